@@ -35,6 +35,7 @@
 #include <sys/time.h>
 #include <time.h>
 #include <stack>
+#include <set>
 
 #include "fallback.h"
 #include "util.h"
@@ -77,6 +78,12 @@
 
 #define READ_MODE_NAME L"fish_read"
 
+/**
+   How many bytes the read builtin asks for at once from a regular file.
+   If a line is longer, the amount is doubled until it is found.
+*/
+#define READ_CHUNK_SIZE 4096
+
 /**
    The send stuff to foreground message
 */
@@ -138,6 +145,42 @@ void builtin_show_error(const wcstring &err)
     stderr_buffer.append(err);
 }
 
+/**
+   Where builtin_stream_stdout writes the current builtin's stdout: a
+   file descriptor, or a buffer if stdout_stream_buffer is not NULL.
+   stdout is only collected if both are unset.
+*/
+static int stdout_stream_fd = -1;
+static io_buffer_t *stdout_stream_buffer = NULL;
+
+void builtin_set_stdout_stream(int fd, io_buffer_t *buffer)
+{
+    ASSERT_IS_MAIN_THREAD();
+    stdout_stream_fd = fd;
+    stdout_stream_buffer = buffer;
+}
+
+void builtin_stream_stdout()
+{
+    ASSERT_IS_MAIN_THREAD();
+    if (stdout_buffer.size() < BUILTIN_STDOUT_CHUNK_SIZE)
+        return;
+
+    if (stdout_stream_buffer != NULL)
+    {
+        const std::string narrow = wcs2string(stdout_buffer);
+        stdout_stream_buffer->out_buffer_append(narrow.data(), narrow.size());
+        stdout_buffer.clear();
+    }
+    else if (stdout_stream_fd >= 0)
+    {
+        /* A failed write, e.g. because the reader of a pipe has exited, drops the output, just like when the output is written after the builtin returns */
+        const std::string narrow = wcs2string(stdout_buffer);
+        write_loop(stdout_stream_fd, narrow.data(), narrow.size());
+        stdout_buffer.clear();
+    }
+}
+
 /**
    Stack containing builtin I/O for recursive builtin calls.
 */
@@ -146,6 +189,8 @@ struct io_stack_elem_t
     int in;
     wcstring out;
     wcstring err;
+    int stream_fd;
+    io_buffer_t *stream_buffer;
 };
 static std::stack<io_stack_elem_t, std::vector<io_stack_elem_t> > io_stack;
 
@@ -394,6 +439,8 @@ static void builtin_missing_argument(parser_t &parser, const wchar_t *cmd, const
 #include "builtin_jobs.cpp"
 #include "builtin_set_color.cpp"
 #include "builtin_printf.cpp"
+#include "builtin_math.cpp"
+#include "builtin_string.cpp"
 
 /* builtin_test lives in builtin_test.cpp */
 int builtin_test(parser_t &parser, wchar_t **argv);
@@ -1134,6 +1181,142 @@ static int builtin_command(parser_t &parser, wchar_t **argv)
     return found ? STATUS_BUILTIN_OK : STATUS_BUILTIN_ERROR;
 }
 
+/**
+   The hash builtin. Inspects and resets the table of commands found in $PATH.
+*/
+static int builtin_hash(parser_t &parser, wchar_t **argv)
+{
+    int argc=builtin_count_args(argv);
+    bool print_path = false;
+    bool delete_commands = false;
+    bool reset = false;
+
+    woptind=0;
+
+    static const struct woption
+            long_options[] =
+    {
+        { L"print", no_argument, 0, 't' },
+        { L"delete", no_argument, 0, 'd' },
+        { L"reset", no_argument, 0, 'r' },
+        { L"help", no_argument, 0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    while (1)
+    {
+        int opt_index = 0;
+
+        int opt = wgetopt_long(argc,
+                               argv,
+                               L"tdrh",
+                               long_options,
+                               &opt_index);
+        if (opt == -1)
+            break;
+
+        switch (opt)
+        {
+            case 0:
+                if (long_options[opt_index].flag != 0)
+                    break;
+                append_format(stderr_buffer,
+                              BUILTIN_ERR_UNKNOWN,
+                              argv[0],
+                              long_options[opt_index].name);
+                builtin_print_help(parser, argv[0], stderr_buffer);
+                return STATUS_BUILTIN_ERROR;
+
+            case 'h':
+                builtin_print_help(parser, argv[0], stdout_buffer);
+                return STATUS_BUILTIN_OK;
+
+            case 't':
+                print_path = true;
+                break;
+
+            case 'd':
+                delete_commands = true;
+                break;
+
+            case 'r':
+                reset = true;
+                break;
+
+            case '?':
+                builtin_unknown_option(parser, argv[0], argv[woptind-1]);
+                return STATUS_BUILTIN_ERROR;
+
+        }
+
+    }
+
+    if (print_path + delete_commands + reset > 1)
+    {
+        append_format(stderr_buffer, BUILTIN_ERR_COMBO, argv[0]);
+        builtin_print_help(parser, argv[0], stderr_buffer);
+        return STATUS_BUILTIN_ERROR;
+    }
+
+    if (reset)
+    {
+        path_reset_command_hash();
+        return STATUS_BUILTIN_OK;
+    }
+
+    if (woptind == argc)
+    {
+        if (print_path || delete_commands)
+        {
+            append_format(stderr_buffer, BUILTIN_ERR_MISSING, argv[0]);
+            return STATUS_BUILTIN_ERROR;
+        }
+
+        /* List the remembered commands, like bash does */
+        const std::vector<path_hashed_command_t> hashed = path_get_hashed_commands();
+        if (! hashed.empty())
+        {
+            stdout_buffer.append(_(L"hits\tcommand\n"));
+        }
+        for (size_t i=0; i < hashed.size(); i++)
+        {
+            append_format(stdout_buffer, L"%4lu\t%ls\n", hashed.at(i).hits, hashed.at(i).path.c_str());
+        }
+        return STATUS_BUILTIN_OK;
+    }
+
+    int res = STATUS_BUILTIN_OK;
+    for (int idx = woptind; argv[idx]; ++idx)
+    {
+        const wchar_t *command_name = argv[idx];
+        if (delete_commands)
+        {
+            if (! path_forget_hashed_command(command_name))
+            {
+                append_format(stderr_buffer, _(L"%ls: %ls: not found\n"), argv[0], command_name);
+                res = STATUS_BUILTIN_ERROR;
+            }
+            continue;
+        }
+
+        /* Looking a command up remembers it */
+        wcstring path;
+        if (path_get_path(command_name, &path))
+        {
+            if (print_path)
+            {
+                append_format(stdout_buffer, L"%ls\n", path.c_str());
+            }
+        }
+        else
+        {
+            append_format(stderr_buffer, _(L"%ls: %ls: not found\n"), argv[0], command_name);
+            res = STATUS_BUILTIN_ERROR;
+        }
+    }
+    return res;
+}
+
 /**
    A generic bultin that only supports showing a help message. This is
    only a placeholder that prints the help message. Useful for
@@ -1504,6 +1687,7 @@ static int builtin_functions(parser_t &parser, wchar_t **argv)
             {
                 stdout_buffer.append(names.at(i).c_str());
                 stdout_buffer.append(L"\n");
+                builtin_stream_stdout();
             }
         }
 
@@ -1765,6 +1949,8 @@ static int builtin_echo(parser_t &parser, wchar_t **argv)
             stdout_buffer.push_back(' ');
         }
 
+        builtin_stream_stdout();
+
         const wchar_t *str = args_to_echo[idx];
         for (size_t j=0; continue_output && str[j]; j++)
         {
@@ -2300,6 +2486,80 @@ static int builtin_random(parser_t &parser, wchar_t **argv)
 }
 
 
+/**
+   Read one line of non-interactive input for the read builtin, and decode
+   it into line. The line ends at a newline, which is consumed but not
+   stored, at a NUL byte, or at the end of input. Returns true if it
+   ended at a NUL byte or at the end of input.
+
+   Regular files are read in chunks, after which the file offset is moved
+   back to just past the line, so that whatever reads the file next
+   starts where a byte at a time read would have stopped. Anything else,
+   like a pipe, has to be read a byte at a time, since bytes read past
+   the newline could not be given back.
+*/
+static bool read_line_for_builtin(int fd, wcstring *line)
+{
+    struct stat buf;
+    const bool seekable = (fstat(fd, &buf) == 0 && S_ISREG(buf.st_mode));
+    size_t chunk_size = seekable ? READ_CHUNK_SIZE : 1;
+    std::vector<char> chunk;
+
+    mbstate_t state;
+    memset(&state, '\0', sizeof(state));
+
+    bool eof = false, finished = false;
+    while (! finished)
+    {
+        chunk.resize(chunk_size);
+        long amt = read_blocked(fd, &chunk.at(0), chunk_size);
+        if (amt <= 0)
+        {
+            eof = true;
+            break;
+        }
+
+        long consumed = 0;
+        while (consumed < amt && ! finished)
+        {
+            wchar_t res = 0;
+            size_t sz = mbrtowc(&res, &chunk.at(consumed++), 1, &state);
+            switch (sz)
+            {
+                case (size_t)(-1):
+                    memset(&state, '\0', sizeof(state));
+                    break;
+
+                case (size_t)(-2):
+                    break;
+
+                case 0:
+                    eof = true;
+                    finished = true;
+                    break;
+
+                default:
+                    if (res == L'\n')
+                        finished = true;
+                    else
+                        line->push_back(res);
+                    break;
+            }
+        }
+
+        if (finished && consumed < amt)
+        {
+            /* Give back what we read past the end of the line */
+            lseek(fd, consumed - amt, SEEK_CUR);
+        }
+        else if (seekable)
+        {
+            chunk_size *= 2;
+        }
+    }
+    return eof;
+}
+
 /**
    The read builtin. Reads from stdin and stores the values in environment variables.
 */
@@ -2544,57 +2804,8 @@ static int builtin_read(parser_t &parser, wchar_t **argv)
     }
     else
     {
-        int eof=0;
-
         wcstring sb;
-
-        while (1)
-        {
-            int finished=0;
-
-            wchar_t res=0;
-            static mbstate_t state;
-            memset(&state, '\0', sizeof(state));
-
-            while (!finished)
-            {
-                char b;
-                if (read_blocked(builtin_stdin, &b, 1) <= 0)
-                {
-                    eof=1;
-                    break;
-                }
-
-                size_t sz = mbrtowc(&res, &b, 1, &state);
-
-                switch (sz)
-                {
-                    case (size_t)(-1):
-                        memset(&state, '\0', sizeof(state));
-                        break;
-
-                    case (size_t)(-2):
-                        break;
-                    case 0:
-                        eof=1;
-                        finished = 1;
-                        break;
-
-                    default:
-                        finished=1;
-                        break;
-
-                }
-            }
-
-            if (eof)
-                break;
-
-            if (res == L'\n')
-                break;
-
-            sb.push_back(res);
-        }
+        bool eof = read_line_for_builtin(builtin_stdin, &sb);
 
         if (sb.size() < 2 && eof)
         {
@@ -2701,7 +2912,8 @@ static int builtin_status(parser_t &parser, wchar_t **argv)
         STACK_TRACE,
         DONE,
         CURRENT_FILENAME,
-        CURRENT_LINE_NUMBER
+        CURRENT_LINE_NUMBER,
+        DIR_CACHE_STATS
     }
     ;
 
@@ -2764,6 +2976,10 @@ static int builtin_status(parser_t &parser, wchar_t **argv)
             L"print-stack-trace", no_argument, 0, 't'
         }
         ,
+        {
+            L"print-dir-cache-stats", no_argument, &mode, DIR_CACHE_STATS
+        }
+        ,
         {
             0, 0, 0, 0
         }
@@ -2906,6 +3122,15 @@ static int builtin_status(parser_t &parser, wchar_t **argv)
                 break;
             }
 
+            case DIR_CACHE_STATS:
+            {
+                const dir_cache_stats_t stats = dir_cache_get_stats();
+                append_format(stdout_buffer, _(L"Directory listings cached: %lu\n"), (unsigned long)stats.directories);
+                append_format(stdout_buffer, _(L"Hits: %lu\n"), stats.hits);
+                append_format(stdout_buffer, _(L"Misses: %lu\n"), stats.misses);
+                break;
+            }
+
             case NORMAL:
             {
                 if (is_login)
@@ -3745,10 +3970,24 @@ static int builtin_history(parser_t &parser, wchar_t **argv)
 
     if (argc == 1)
     {
-        wcstring full_history;
-        history->get_string_representation(&full_history, wcstring(L"\n"));
-        stdout_buffer.append(full_history);
-        stdout_buffer.push_back('\n');
+        /* Print the items newest first, skipping duplicates, as they are loaded */
+        std::set<wcstring> seen;
+        for (size_t idx = 1; ; idx++)
+        {
+            const history_item_t item = history->item_at_index(idx);
+            if (item.empty())
+                break;
+            if (! seen.insert(item.str()).second)
+                continue;
+
+            stdout_buffer.append(item.str());
+            stdout_buffer.push_back('\n');
+            builtin_stream_stdout();
+        }
+
+        /* An empty history prints a single empty line, as it always has */
+        if (seen.empty())
+            stdout_buffer.push_back('\n');
         return STATUS_BUILTIN_OK;
     }
 
@@ -3892,9 +4131,11 @@ static const builtin_data_t builtin_datas[]=
     { 		L"for",  &builtin_generic, N_(L"Perform a set of commands multiple times")   },
     { 		L"function",  &builtin_generic, N_(L"Define a new function")   },
     { 		L"functions",  &builtin_functions, N_(L"List or remove functions")   },
+    { 		L"hash",  &builtin_hash, N_(L"Inspect or reset the table of commands found in PATH")   },
     { 		L"history",  &builtin_history, N_(L"History of commands executed by user")   },
     { 		L"if",  &builtin_generic, N_(L"Evaluate block if condition is true")   },
     { 		L"jobs",  &builtin_jobs, N_(L"Print currently running jobs")   },
+    { 		L"math",  &builtin_math, N_(L"Evaluate math expressions")  },
     { 		L"not",  &builtin_generic, N_(L"Negate exit status of job")  },
     { 		L"or",  &builtin_generic, N_(L"Execute command if previous command failed")  },
     { 		L"printf",  &builtin_printf, N_(L"Prints formatted text")  },
@@ -3906,6 +4147,7 @@ static const builtin_data_t builtin_datas[]=
     { 		L"set_color",  &builtin_set_color, N_(L"Set the terminal color")   },
     { 		L"source",  &builtin_source, N_(L"Evaluate contents of file")   },
     { 		L"status",  &builtin_status, N_(L"Return status information about fish")  },
+    { 		L"string",  &builtin_string, N_(L"Manipulate strings")  },
     { 		L"switch",  &builtin_generic, N_(L"Conditionally execute a block of commands")   },
     { 		L"test",  &builtin_test, N_(L"Test a condition")   },
     { 		L"ulimit",  &builtin_ulimit, N_(L"Set or get the shells resource usage limits")  },
@@ -4030,12 +4272,13 @@ void builtin_push_io(parser_t &parser, int in)
     ASSERT_IS_MAIN_THREAD();
     if (builtin_stdin != -1)
     {
-        struct io_stack_elem_t elem = {builtin_stdin, stdout_buffer, stderr_buffer};
+        struct io_stack_elem_t elem = {builtin_stdin, stdout_buffer, stderr_buffer, stdout_stream_fd, stdout_stream_buffer};
         io_stack.push(elem);
     }
     builtin_stdin = in;
     stdout_buffer.clear();
     stderr_buffer.clear();
+    builtin_set_stdout_stream(-1, NULL);
 }
 
 void builtin_pop_io(parser_t &parser)
@@ -4048,6 +4291,7 @@ void builtin_pop_io(parser_t &parser)
         stderr_buffer = elem.err;
         stdout_buffer = elem.out;
         builtin_stdin = elem.in;
+        builtin_set_stdout_stream(elem.stream_fd, elem.stream_buffer);
         io_stack.pop();
     }
     else
@@ -4055,5 +4299,6 @@ void builtin_pop_io(parser_t &parser)
         stdout_buffer.clear();
         stderr_buffer.clear();
         builtin_stdin = 0;
+        builtin_set_stdout_stream(-1, NULL);
     }
 }
@@ -94,6 +94,12 @@ enum
 
 #define BUILTIN_ERR_NOT_NUMBER _( L"%ls: Argument '%ls' is not a number\n" )
 
+/**
+   How many characters of stdout a builtin collects before
+   builtin_stream_stdout writes them out
+*/
+#define BUILTIN_STDOUT_CHUNK_SIZE 8192
+
 /** Get the string used to represent stdout and stderr */
 const wcstring &get_stdout_buffer();
 const wcstring &get_stderr_buffer();
@@ -101,6 +107,22 @@ const wcstring &get_stderr_buffer();
 /** Output an error */
 void builtin_show_error(const wcstring &err);
 
+/**
+   Makes the current builtin's stdout go to the file descriptor fd, or
+   into buffer if it is not NULL, while the builtin runs, instead of
+   being collected until it returns. Pass -1 and NULL to collect it all,
+   which is the default after builtin_push_io.
+*/
+void builtin_set_stdout_stream(int fd, io_buffer_t *buffer);
+
+/**
+   Writes out the stdout collected so far, if it is being streamed and
+   at least BUILTIN_STDOUT_CHUNK_SIZE characters have accumulated.
+   Builtins that may print a lot call this as they go, so their output
+   reaches its destination early and the buffer stays small.
+*/
+void builtin_stream_stdout();
+
 /**
    Kludge. Tells builtins if output is to screen
 */
@@ -0,0 +1,759 @@
+/** \file builtin_math.cpp
+
+  Implementation of the math builtin.
+
+  math used to be a function which piped its arguments into bc. This
+  costs two process spawns per invocation, which dominates scripts that
+  count or compute in loops. The evaluator below implements the subset of
+  the bc language that is useful from the command line, and tries hard to
+  produce the same output as bc for it:
+
+  - Numbers are decimal, and remember how many fractional digits they
+    have (their scale). Results are truncated, not rounded, to their scale.
+  - The special variable 'scale' determines the scale of division results.
+    It defaults to 0, so 'math 10/3' prints 3.
+  - Operators are + - * / % ^, the relational operators, ! && || and
+    parenthesis, with the same precedence and scale rules as in bc.
+  - Variables may be assigned with 'name = expr'; statements are separated
+    by ';' or newlines.
+  - The functions sqrt, length and scale, and the bc math library
+    functions s, c, a, l and e are supported.
+
+  Numbers are represented as long doubles, so unlike bc the results are
+  only exact to about 18 significant digits.
+*/
+
+#include <math.h>
+#include <float.h>
+#include <map>
+
+/**
+   A number with its bc scale, i.e. the number of decimal digits after the
+   decimal point that are significant.
+*/
+struct math_value_t
+{
+    long double value;
+    int scale;
+
+    math_value_t(long double v = 0, int s = 0) : value(v), scale(s)
+    {
+    }
+};
+
+/**
+   Truncate a value towards zero so that it has at most the given number
+   of fractional digits. Values that are within rounding noise of the next
+   representable decimal are rounded instead, so that e.g. 0.3 does not
+   become 0.2 because it cannot be represented exactly in binary.
+*/
+static long double math_truncate(long double value, int scale)
+{
+    long double mult = powl(10.0L, scale);
+    long double scaled = value * mult;
+    long double rounded = roundl(scaled);
+    if (fabsl(scaled - rounded) <= fabsl(scaled) * 1e-15L)
+    {
+        scaled = rounded;
+    }
+    else
+    {
+        scaled = truncl(scaled);
+    }
+    return scaled / mult;
+}
+
+/**
+   Format a value the way bc does: with exactly its scale of fractional
+   digits, without a leading zero before the decimal point, and zero
+   printed as a bare 0.
+*/
+static wcstring math_format(const math_value_t &val)
+{
+    long double digits = roundl(fabsl(val.value) * powl(10.0L, val.scale));
+    if (digits == 0)
+    {
+        return L"0";
+    }
+
+    /* Print the digits as an integer. printf prints the exact decimal value, and an integer has no locale dependent decimal point. */
+    char buff[LDBL_MAX_10_EXP + 2];
+    snprintf(buff, sizeof buff, "%.0Lf", digits);
+    wcstring all_digits = str2wcstring(buff);
+    if (all_digits.size() < (size_t)val.scale)
+    {
+        all_digits.insert(0, val.scale - all_digits.size(), L'0');
+    }
+
+    wcstring result;
+    if (val.value < 0)
+    {
+        result.push_back(L'-');
+    }
+    size_t int_digits = all_digits.size() - val.scale;
+    result.append(all_digits, 0, int_digits);
+    if (val.scale > 0)
+    {
+        result.push_back(L'.');
+        result.append(all_digits, int_digits, wcstring::npos);
+    }
+    return result;
+}
+
+/**
+   A recursive descent parser and evaluator for bc expressions. Errors are
+   recorded in \c error; once it is set every parse function returns
+   immediately and the result of the evaluation is discarded.
+*/
+class math_evaluator_t
+{
+private:
+    /** The expression being evaluated */
+    const wchar_t *expr;
+
+    /** Current position within expr */
+    const wchar_t *pos;
+
+    /** The value of the special scale variable */
+    int scale;
+
+    /** Values of all other variables. Unset variables are zero, as in bc. */
+    std::map<wcstring, math_value_t> variables;
+
+    /** Set if an error was encountered */
+    wcstring error;
+
+    /** Warnings, which do not stop evaluation */
+    wcstring warnings;
+
+    bool failed() const
+    {
+        return ! error.empty();
+    }
+
+    void fail(const wchar_t *fmt, ...)
+    {
+        if (failed())
+            return;
+        va_list va;
+        va_start(va, fmt);
+        error = vformat_string(fmt, va);
+        va_end(va);
+    }
+
+    void skip_spaces()
+    {
+        while (*pos == L' ' || *pos == L'\t')
+            pos++;
+    }
+
+    /** If the next token is the given operator, consume it and return true */
+    bool accept(const wchar_t *op)
+    {
+        skip_spaces();
+        size_t len = wcslen(op);
+        if (wcsncmp(pos, op, len) != 0)
+            return false;
+
+        /* Don't mistake '==' for '=', '<=' for '<', etc. */
+        if (len == 1 && wcschr(L"=<>!", op[0]) && pos[1] == L'=')
+            return false;
+        if (len == 1 && (op[0] == L'&' || op[0] == L'|') && pos[1] == op[0])
+            return false;
+
+        pos += len;
+        return true;
+    }
+
+    void expect(const wchar_t *op)
+    {
+        if (! accept(op))
+        {
+            unexpected_token();
+        }
+    }
+
+    void unexpected_token()
+    {
+        skip_spaces();
+        if (*pos == L'\0' || *pos == L'\n' || *pos == L';')
+        {
+            fail(_(L"Unexpected end of expression"));
+        }
+        else
+        {
+            fail(_(L"Unexpected token '%lc' at position %lu"), *pos, (unsigned long)(pos - expr + 1));
+        }
+    }
+
+    static bool is_name_char(wchar_t c, bool first)
+    {
+        return (c >= L'a' && c <= L'z') || (! first && ((c >= L'0' && c <= L'9') || c == L'_'));
+    }
+
+    /** Parse an identifier at the current position, or return the empty string */
+    wcstring parse_name()
+    {
+        skip_spaces();
+        const wchar_t *start = pos;
+        if (is_name_char(*pos, true))
+        {
+            while (is_name_char(*pos, false))
+                pos++;
+        }
+        return wcstring(start, pos - start);
+    }
+
+    math_value_t get_variable(const wcstring &name)
+    {
+        if (name == L"scale")
+        {
+            return math_value_t(scale, 0);
+        }
+        if (name == L"ibase" || name == L"obase")
+        {
+            fail(_(L"The bc variable '%ls' is not supported"), name.c_str());
+            return math_value_t();
+        }
+        std::map<wcstring, math_value_t>::const_iterator iter = variables.find(name);
+        return iter == variables.end() ? math_value_t() : iter->second;
+    }
+
+    void set_variable(const wcstring &name, const math_value_t &val)
+    {
+        if (name == L"scale")
+        {
+            if (val.value < 0 || val.value > 100)
+            {
+                fail(_(L"Scale must be between 0 and 100"));
+                return;
+            }
+            scale = (int)val.value;
+        }
+        else if (name == L"ibase" || name == L"obase")
+        {
+            fail(_(L"The bc variable '%ls' is not supported"), name.c_str());
+        }
+        else
+        {
+            variables[name] = val;
+        }
+    }
+
+    /** Make a value with the given scale, checking for overflow */
+    math_value_t make_value(long double value, int result_scale)
+    {
+        if (isnan(value) || isinf(value))
+        {
+            fail(_(L"Result out of range"));
+            return math_value_t();
+        }
+        return math_value_t(math_truncate(value, result_scale), result_scale);
+    }
+
+    math_value_t parse_number()
+    {
+        skip_spaces();
+        const wchar_t *start = pos;
+        long double value = 0;
+        int frac_digits = 0;
+        bool seen_point = false, seen_digit = false;
+        for (;; pos++)
+        {
+            if (*pos >= L'0' && *pos <= L'9')
+            {
+                value = value * 10 + (*pos - L'0');
+                seen_digit = true;
+                if (seen_point)
+                    frac_digits++;
+            }
+            else if (*pos == L'.' && ! seen_point)
+            {
+                seen_point = true;
+            }
+            else
+            {
+                break;
+            }
+        }
+        if (! seen_digit)
+        {
+            pos = start;
+            unexpected_token();
+            return math_value_t();
+        }
+        return math_value_t(value / powl(10.0L, frac_digits), frac_digits);
+    }
+
+    math_value_t call_function(const wcstring &name, const math_value_t &arg)
+    {
+        long double x = arg.value;
+        if (name == L"sqrt")
+        {
+            if (x < 0)
+            {
+                fail(_(L"Square root of a negative number"));
+                return math_value_t();
+            }
+            return make_value(sqrtl(x), std::max(scale, arg.scale));
+        }
+        else if (name == L"length")
+        {
+            /* The number of significant decimal digits */
+            wcstring digits = math_format(arg);
+            size_t count = 0;
+            bool leading = true;
+            for (size_t i=0; i < digits.size(); i++)
+            {
+                if (digits.at(i) == L'0' && leading)
+                    continue;
+                if (digits.at(i) >= L'0' && digits.at(i) <= L'9')
+                {
+                    leading = false;
+                    count++;
+                }
+            }
+            /* bc counts the fractional digits of numbers smaller than one, including leading zeros */
+            if (fabsl(x) < 1)
+                count = std::max(count, (size_t)arg.scale);
+            return math_value_t(std::max(count, (size_t)1), 0);
+        }
+        else if (name == L"scale")
+        {
+            return math_value_t(arg.scale, 0);
+        }
+        else if (name == L"s")
+        {
+            return make_value(sinl(x), scale);
+        }
+        else if (name == L"c")
+        {
+            return make_value(cosl(x), scale);
+        }
+        else if (name == L"a")
+        {
+            return make_value(atanl(x), scale);
+        }
+        else if (name == L"l")
+        {
+            if (x <= 0)
+            {
+                fail(_(L"Logarithm of a non-positive number"));
+                return math_value_t();
+            }
+            return make_value(logl(x), scale);
+        }
+        else if (name == L"e")
+        {
+            return make_value(expl(x), scale);
+        }
+        fail(_(L"Unknown function '%ls'"), name.c_str());
+        return math_value_t();
+    }
+
+    /* primary := number | '(' expr ')' | name '(' expr ')' | name */
+    math_value_t parse_primary()
+    {
+        skip_spaces();
+        if (accept(L"("))
+        {
+            math_value_t result = parse_expression();
+            expect(L")");
+            return result;
+        }
+
+        wcstring name = parse_name();
+        if (name.empty())
+        {
+            return parse_number();
+        }
+        else if (accept(L"("))
+        {
+            math_value_t arg = parse_expression();
+            expect(L")");
+            return failed() ? math_value_t() : call_function(name, arg);
+        }
+        else
+        {
+            return get_variable(name);
+        }
+    }
+
+    /* unary := '-' unary | '+' unary | primary. Note that in bc, unary minus binds tighter than ^ */
+    math_value_t parse_unary()
+    {
+        if (accept(L"-"))
+        {
+            math_value_t val = parse_unary();
+            val.value = -val.value;
+            return val;
+        }
+        if (accept(L"+"))
+        {
+            return parse_unary();
+        }
+        return parse_primary();
+    }
+
+    /* power := unary ('^' power)? */
+    math_value_t parse_power()
+    {
+        math_value_t base = parse_unary();
+        if (failed() || ! accept(L"^"))
+        {
+            return base;
+        }
+
+        math_value_t exponent = parse_power();
+        if (failed())
+            return math_value_t();
+
+        long double exp = truncl(exponent.value);
+        if (exp != exponent.value)
+        {
+            append_format(warnings, _(L"Non-zero scale in exponent\n"));
+        }
+        if (exp < 0)
+        {
+            if (base.value == 0)
+            {
+                fail(_(L"Division by zero"));
+                return math_value_t();
+            }
+            return make_value(powl(base.value, exp), scale);
+        }
+        long double result_scale = std::min((long double)base.scale * exp, (long double)std::max(scale, base.scale));
+        return make_value(powl(base.value, exp), (int)result_scale);
+    }
+
+    /* product := power (('*' | '/' | '%') power)* */
+    math_value_t parse_product()
+    {
+        math_value_t result = parse_power();
+        while (! failed())
+        {
+            wchar_t op;
+            if (accept(L"*"))
+                op = L'*';
+            else if (accept(L"/"))
+                op = L'/';
+            else if (accept(L"%"))
+                op = L'%';
+            else
+                break;
+
+            math_value_t rhs = parse_power();
+            if (failed())
+                break;
+
+            if (op == L'*')
+            {
+                int result_scale = std::min(result.scale + rhs.scale, std::max(scale, std::max(result.scale, rhs.scale)));
+                result = make_value(result.value * rhs.value, result_scale);
+                continue;
+            }
+
+            if (rhs.value == 0)
+            {
+                fail(_(L"Division by zero"));
+                break;
+            }
+            long double quotient = math_truncate(result.value / rhs.value, scale);
+            if (op == L'/')
+            {
+                result = make_value(quotient, scale);
+            }
+            else
+            {
+                int result_scale = std::max(scale + rhs.scale, result.scale);
+                result = make_value(result.value - quotient * rhs.value, result_scale);
+            }
+        }
+        return result;
+    }
+
+    /* sum := product (('+' | '-') product)* */
+    math_value_t parse_sum()
+    {
+        math_value_t result = parse_product();
+        while (! failed())
+        {
+            bool add;
+            if (accept(L"+"))
+                add = true;
+            else if (accept(L"-"))
+                add = false;
+            else
+                break;
+
+            math_value_t rhs = parse_product();
+            long double value = add ? result.value + rhs.value : result.value - rhs.value;
+            result = make_value(value, std::max(result.scale, rhs.scale));
+        }
+        return result;
+    }
+
+    /* relation := sum (relop sum)? */
+    math_value_t parse_relation()
+    {
+        math_value_t lhs = parse_sum();
+        if (failed())
+            return lhs;
+
+        static const wchar_t * const ops[] = {L"==", L"!=", L"<=", L">=", L"<", L">"};
+        for (size_t i=0; i < sizeof ops / sizeof *ops; i++)
+        {
+            if (accept(ops[i]))
+            {
+                long double a = lhs.value, b = parse_sum().value;
+                bool result;
+                switch (i)
+                {
+                    case 0: result = (a == b); break;
+                    case 1: result = (a != b); break;
+                    case 2: result = (a <= b); break;
+                    case 3: result = (a >= b); break;
+                    case 4: result = (a < b); break;
+                    default: result = (a > b); break;
+                }
+                return math_value_t(result, 0);
+            }
+        }
+        return lhs;
+    }
+
+    /* negation := '!' negation | relation */
+    math_value_t parse_negation()
+    {
+        if (accept(L"!"))
+        {
+            return math_value_t(parse_negation().value == 0, 0);
+        }
+        return parse_relation();
+    }
+
+    /* conjunction := negation ('&&' negation)* */
+    math_value_t parse_conjunction()
+    {
+        math_value_t result = parse_negation();
+        while (! failed() && accept(L"&&"))
+        {
+            math_value_t rhs = parse_negation();
+            result = math_value_t(result.value != 0 && rhs.value != 0, 0);
+        }
+        return result;
+    }
+
+    /* expression := conjunction ('||' conjunction)* */
+    math_value_t parse_expression()
+    {
+        math_value_t result = parse_conjunction();
+        while (! failed() && accept(L"||"))
+        {
+            math_value_t rhs = parse_conjunction();
+            result = math_value_t(result.value != 0 || rhs.value != 0, 0);
+        }
+        return result;
+    }
+
+    /** Parse a single statement. Returns true and sets out_value if the statement produces output. */
+    bool parse_statement(math_value_t *out_value)
+    {
+        /* An assignment is a name followed by a single = */
+        const wchar_t *start = pos;
+        wcstring name = parse_name();
+        if (! name.empty() && accept(L"="))
+        {
+            math_value_t val = parse_expression();
+            if (! failed())
+                set_variable(name, val);
+            return false;
+        }
+
+        pos = start;
+        *out_value = parse_expression();
+        return ! failed();
+    }
+
+public:
+    math_evaluator_t(int initial_scale) : expr(NULL), pos(NULL), scale(initial_scale)
+    {
+    }
+
+    /**
+       Evaluate a list of statements, appending the formatted value of each
+       statement that is not an assignment to results. Returns false on error.
+    */
+    bool evaluate(const wcstring &str, wcstring_list_t *results, math_value_t *last_value)
+    {
+        expr = str.c_str();
+        pos = expr;
+        while (! failed())
+        {
+            skip_spaces();
+            if (*pos == L'\0')
+                break;
+            if (*pos == L';' || *pos == L'\n')
+            {
+                pos++;
+                continue;
+            }
+
+            math_value_t val;
+            if (parse_statement(&val))
+            {
+                results->push_back(math_format(val));
+                *last_value = val;
+            }
+
+            skip_spaces();
+            if (! failed() && *pos != L'\0' && *pos != L';' && *pos != L'\n')
+            {
+                unexpected_token();
+            }
+        }
+        return ! failed();
+    }
+
+    const wcstring &get_error() const
+    {
+        return error;
+    }
+
+    const wcstring &get_warnings() const
+    {
+        return warnings;
+    }
+};
+
+/**
+   Test whether str is a nonempty string of decimal digits, and so can
+   be the value of the -s option rather than part of an expression.
+*/
+static bool is_scale_number(const wchar_t *str)
+{
+    if (*str == L'\0')
+        return false;
+
+    for (; *str != L'\0'; str++)
+    {
+        if (! iswdigit(*str))
+            return false;
+    }
+    return true;
+}
+
+/**
+   The math builtin, which evaluates bc-style arithmetic expressions.
+*/
+static int builtin_math(parser_t &parser, wchar_t **argv)
+{
+    int argc = builtin_count_args(argv);
+    int scale = 0;
+
+    /*
+      Options are parsed by hand, since expressions may legitimately start
+      with a dash, as in 'math -1 + 2'.
+    */
+    int argidx = 1;
+    for (; argidx < argc; argidx++)
+    {
+        const wchar_t *arg = argv[argidx];
+        const wchar_t *scale_str = NULL;
+        if (! wcscmp(arg, L"-h") || ! wcscmp(arg, L"--help"))
+        {
+            builtin_print_help(parser, argv[0], stdout_buffer);
+            return STATUS_BUILTIN_OK;
+        }
+        else if (! wcscmp(arg, L"--"))
+        {
+            argidx++;
+            break;
+        }
+        else if (! wcscmp(arg, L"--scale"))
+        {
+            if (argidx + 1 >= argc)
+            {
+                append_format(stderr_buffer, BUILTIN_ERR_MISSING, argv[0]);
+                builtin_print_help(parser, argv[0], stderr_buffer);
+                return STATUS_BUILTIN_ERROR;
+            }
+            scale_str = argv[++argidx];
+        }
+        else if (string_prefixes_string(L"--scale=", arg))
+        {
+            scale_str = arg + wcslen(L"--scale=");
+        }
+        else if (! wcscmp(arg, L"-s") && argidx + 1 < argc && is_scale_number(argv[argidx + 1]))
+        {
+            scale_str = argv[++argidx];
+        }
+        else if (string_prefixes_string(L"-s", arg) && is_scale_number(arg + 2))
+        {
+            /* Anything else, like -sqrt(4) or -s(1), is a negated expression */
+            scale_str = arg + 2;
+        }
+        else
+        {
+            break;
+        }
+
+        wchar_t *end = NULL;
+        errno = 0;
+        long val = wcstol(scale_str, &end, 10);
+        if (errno || *scale_str == L'\0' || *end != L'\0' || val < 0 || val > 100)
+        {
+            append_format(stderr_buffer, _(L"%ls: Invalid scale value '%ls'\n"), argv[0], scale_str);
+            return STATUS_BUILTIN_ERROR;
+        }
+        scale = (int)val;
+    }
+
+    if (argidx >= argc)
+    {
+        /* Like the old bc wrapper, silently fail if there is nothing to compute */
+        return 2;
+    }
+
+    /* The arguments are joined by spaces, as if they were echoed into bc */
+    wcstring expression;
+    for (int i = argidx; i < argc; i++)
+    {
+        if (i > argidx)
+            expression.push_back(L' ');
+        expression.append(argv[i]);
+    }
+
+    math_evaluator_t evaluator(scale);
+    wcstring_list_t results;
+    math_value_t last_value;
+    bool success = evaluator.evaluate(expression, &results, &last_value);
+
+    const wcstring &warnings = evaluator.get_warnings();
+    if (! warnings.empty())
+    {
+        append_format(stderr_buffer, L"%ls: %ls", argv[0], warnings.c_str());
+    }
+
+    if (! success)
+    {
+        append_format(stderr_buffer, L"%ls: %ls\n", argv[0], evaluator.get_error().c_str());
+        return STATUS_BUILTIN_ERROR;
+    }
+
+    if (results.empty())
+    {
+        return STATUS_BUILTIN_ERROR;
+    }
+
+    for (size_t i=0; i < results.size(); i++)
+    {
+        if (i > 0)
+            stdout_buffer.push_back(L' ');
+        stdout_buffer.append(results.at(i));
+    }
+    stdout_buffer.push_back(L'\n');
+
+    /* As with the bc wrapper, a zero result is reported as failure */
+    return math_format(last_value) == L"0" ? STATUS_BUILTIN_ERROR : STATUS_BUILTIN_OK;
+}
@@ -779,6 +779,7 @@ static int builtin_printf(parser_t &parser, wchar_t **argv)
         args_used = state.print_formatted(format, argc, argv);
         argc -= args_used;
         argv += args_used;
+        builtin_stream_stdout();
     }
     while (args_used > 0 && argc > 0 && ! state.early_exit);
     return state.exit_code;
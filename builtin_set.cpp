@@ -53,14 +53,14 @@ static int is_path_variable(const wchar_t *env)
 }
 
 /**
-   Call env_set. If this is a path variable, e.g. PATH, validate the
-   elements. On error, print a description of the problem to stderr.
+   Call env_set_list, or env_append if append is set. If this is a path
+   variable, e.g. PATH, validate the elements. On error, print a
+   description of the problem to stderr.
 */
-static int my_env_set(const wchar_t *key, const wcstring_list_t &val, int scope)
+static int my_env_set(const wchar_t *key, const wcstring_list_t &val, int scope, bool append = false)
 {
     size_t i;
     int retcode = 0;
-    const wchar_t *val_str=NULL;
 
     if (is_path_variable(key))
     {
@@ -69,9 +69,9 @@ static int my_env_set(const wchar_t *key, const wcstring_list_t &val, int scope)
 
         /* Don't bother validating (or complaining about) values that are already present */
         wcstring_list_t existing_values;
-        const env_var_t existing_variable = env_get_string(key, scope);
-        if (! existing_variable.missing_or_empty())
-            tokenize_variable_array(existing_variable, existing_values);
+        const shared_ptr<const wcstring_list_t> existing_variable = env_get_list(key, scope);
+        if (existing_variable)
+            existing_values = *existing_variable;
 
         for (i=0; i< val.size() ; i++)
         {
@@ -134,21 +134,8 @@ static int my_env_set(const wchar_t *key, const wcstring_list_t &val, int scope)
 
     }
 
-    wcstring sb;
-    if (! val.empty())
-    {
-        for (i=0; i< val.size() ; i++)
-        {
-            sb.append(val[i]);
-            if (i<val.size() - 1)
-            {
-                sb.append(ARRAY_SEP_STR);
-            }
-        }
-        val_str = sb.c_str();
-    }
-
-    switch (env_set(key, val_str, scope | ENV_USER))
+    const int result = append ? env_append(key, val, scope | ENV_USER) : env_set_list(key, val, scope | ENV_USER);
+    switch (result)
     {
         case ENV_PERM:
         {
@@ -385,6 +372,7 @@ static void print_variables(int include_values, int esc, bool shorten_ok, int sc
         }
 
         stdout_buffer.append(L"\n");
+        builtin_stream_stdout();
     }
 }
 
@@ -408,11 +396,12 @@ static int builtin_set(parser_t &parser, wchar_t **argv)
         { L"universal", no_argument, 0, 'U' },
         { L"long", no_argument, 0, 'L' },
         { L"query", no_argument, 0, 'q' },
+        { L"append", no_argument, 0, 'a' },
         { L"help", no_argument, 0, 'h' },
         { 0, 0, 0, 0 }
     } ;
 
-    const wchar_t *short_options = L"+xglenuULqh";
+    const wchar_t *short_options = L"+xglenuULqah";
 
     int argc = builtin_count_args(argv);
 
@@ -421,7 +410,7 @@ static int builtin_set(parser_t &parser, wchar_t **argv)
     */
     int local = 0, global = 0, exportv = 0;
     int erase = 0, list = 0, unexport=0;
-    int universal = 0, query=0;
+    int universal = 0, query=0, append=0;
     bool shorten_ok = true;
     bool preserve_incoming_failure_exit_status = true;
     const int incoming_exit_status = proc_get_last_status();
@@ -493,6 +482,10 @@ static int builtin_set(parser_t &parser, wchar_t **argv)
                 preserve_incoming_failure_exit_status = false;
                 break;
 
+            case 'a':
+                append = 1;
+                break;
+
             case 'h':
                 builtin_print_help(parser, argv[0], stdout_buffer);
                 return 0;
@@ -526,6 +519,17 @@ static int builtin_set(parser_t &parser, wchar_t **argv)
     }
 
 
+    /* We can't both list and erase variables, or append to them */
+    if ((erase || list || query) && append)
+    {
+        append_format(stderr_buffer,
+                      BUILTIN_ERR_COMBO,
+                      argv[0]);
+
+        builtin_print_help(parser, argv[0], stderr_buffer);
+        return 1;
+    }
+
     /* We can't both list and erase variables */
     if (erase && list)
     {
@@ -592,14 +596,12 @@ static int builtin_set(parser_t &parser, wchar_t **argv)
             if (slice)
             {
                 std::vector<long> indexes;
-                wcstring_list_t result;
                 size_t j;
 
-                env_var_t dest_str = env_get_string(dest, scope);
-                if (! dest_str.missing())
-                    tokenize_variable_array(dest_str, result);
+                const shared_ptr<const wcstring_list_t> dest_vals = env_get_list(dest, scope);
+                const size_t dest_count = dest_vals ? dest_vals->size() : 0;
 
-                if (!parse_index(indexes, arg, dest, result.size()))
+                if (!parse_index(indexes, arg, dest, dest_count))
                 {
                     builtin_print_help(parser, argv[0], stderr_buffer);
                     retcode = 1;
@@ -608,7 +610,7 @@ static int builtin_set(parser_t &parser, wchar_t **argv)
                 for (j=0; j < indexes.size() ; j++)
                 {
                     long idx = indexes[j];
-                    if (idx < 1 || (size_t)idx > result.size())
+                    if (idx < 1 || (size_t)idx > dest_count)
                     {
                         retcode++;
                     }
@@ -699,10 +701,20 @@ static int builtin_set(parser_t &parser, wchar_t **argv)
         std::vector<long> indexes;
         wcstring_list_t result;
 
-        const env_var_t dest_str = env_get_string(dest, scope);
-        if (! dest_str.missing())
+        if (append)
+        {
+            append_format(stderr_buffer,
+                          _(L"%ls: Array indexes cannot be used with append\n"),
+                          argv[0]);
+            builtin_print_help(parser, argv[0], stderr_buffer);
+            free(dest);
+            return 1;
+        }
+
+        const shared_ptr<const wcstring_list_t> dest_vals = env_get_list(dest, scope);
+        if (dest_vals)
         {
-            tokenize_variable_array(dest_str, result);
+            result = *dest_vals;
         }
         else if (erase)
         {
@@ -803,7 +815,7 @@ static int builtin_set(parser_t &parser, wchar_t **argv)
             wcstring_list_t val;
             for (i=woptind; i<argc; i++)
                 val.push_back(argv[i]);
-            retcode = my_env_set(dest, val, scope);
+            retcode = my_env_set(dest, val, scope, append);
         }
     }
 
@@ -0,0 +1,954 @@
+/** \file builtin_string.cpp
+
+  Implementation of the string builtin, a family of subcommands for
+  manipulating text without forking external tools like sed, tr or cut.
+
+  Every subcommand operates on its string arguments, or, if it was given
+  none and its input is redirected, on the lines read from standard input.
+  Each result is printed on its own line. The exit status is 0 if the
+  subcommand did something (matched, replaced, trimmed, ...), 1 if it did
+  not, and 2 on invalid usage.
+*/
+
+#include <regex.h>
+
+#define BUILTIN_STRING_OK 0
+#define BUILTIN_STRING_NONE 1
+#define BUILTIN_STRING_ERROR 2
+
+/**
+   Produces the strings a subcommand operates on: the remaining arguments,
+   or the lines of standard input if there are no arguments and input is
+   redirected.
+*/
+class string_args_t
+{
+private:
+    wchar_t **argv;
+
+    /** Whether we read lines from builtin_stdin instead of argv */
+    const bool from_stdin;
+
+    /** Bytes read from stdin, and the offset of the first one not yet returned */
+    std::string buffer;
+    size_t buffer_offset;
+    bool eof;
+
+public:
+    string_args_t(wchar_t **args) : argv(args), from_stdin(args[0] == NULL && builtin_stdin != STDIN_FILENO), buffer_offset(0), eof(false)
+    {
+    }
+
+    /** Get the next string, returning false if there are none left */
+    bool next(wcstring *out)
+    {
+        if (! from_stdin)
+        {
+            if (*argv == NULL)
+                return false;
+            out->assign(*argv++);
+            return true;
+        }
+
+        for (;;)
+        {
+            size_t line_end = buffer.find('\n', buffer_offset);
+            if (line_end != std::string::npos)
+            {
+                *out = str2wcstring(buffer.data() + buffer_offset, line_end - buffer_offset);
+                buffer_offset = line_end + 1;
+                return true;
+            }
+
+            if (eof)
+            {
+                /* Return a final unterminated line */
+                if (buffer_offset >= buffer.size())
+                    return false;
+                *out = str2wcstring(buffer.data() + buffer_offset, buffer.size() - buffer_offset);
+                buffer_offset = buffer.size();
+                return true;
+            }
+
+            buffer.erase(0, buffer_offset);
+            buffer_offset = 0;
+
+            char chunk[4096];
+            long amt = read_blocked(builtin_stdin, chunk, sizeof chunk);
+            if (amt <= 0)
+            {
+                eof = true;
+            }
+            else
+            {
+                buffer.append(chunk, amt);
+            }
+        }
+    }
+};
+
+/** Print a result line, unless we are quiet */
+static void string_output(const wcstring &str, bool quiet)
+{
+    if (! quiet)
+    {
+        stdout_buffer.append(str);
+        stdout_buffer.push_back(L'\n');
+        builtin_stream_stdout();
+    }
+}
+
+static void string_unknown_option(parser_t &parser, wchar_t **argv)
+{
+    builtin_unknown_option(parser, L"string", argv[woptind - 1]);
+}
+
+/** Report an error for a subcommand that expects more arguments */
+static int string_missing_argument(parser_t &parser, const wchar_t *subcmd)
+{
+    append_format(stderr_buffer, _(L"string %ls: Expected argument\n"), subcmd);
+    builtin_print_help(parser, L"string", stderr_buffer);
+    return BUILTIN_STRING_ERROR;
+}
+
+/** Parse an integer option value, reporting an error on failure */
+static bool string_parse_long(const wchar_t *subcmd, const wchar_t *str, long *out)
+{
+    wchar_t *end = NULL;
+    errno = 0;
+    *out = wcstol(str, &end, 10);
+    if (errno || *str == L'\0' || *end != L'\0')
+    {
+        append_format(stderr_buffer, _(L"string %ls: Invalid number '%ls'\n"), subcmd, str);
+        return false;
+    }
+    return true;
+}
+
+static wcstring string_lowercase(const wcstring &str)
+{
+    wcstring result = str;
+    for (size_t i=0; i < result.size(); i++)
+    {
+        result[i] = towlower(result[i]);
+    }
+    return result;
+}
+
+/**
+   Turn a glob pattern as written by the user into one with the internal
+   wildcard characters understood by wildcard_match. A backslash makes the
+   following character literal.
+*/
+static wcstring string_glob_to_wildcard(const wcstring &pattern)
+{
+    wcstring result;
+    for (size_t i=0; i < pattern.size(); i++)
+    {
+        wchar_t c = pattern.at(i);
+        if (c == L'\\' && i + 1 < pattern.size())
+        {
+            result.push_back(pattern.at(++i));
+        }
+        else if (c == L'*')
+        {
+            result.push_back(ANY_STRING);
+        }
+        else if (c == L'?')
+        {
+            result.push_back(ANY_CHAR);
+        }
+        else
+        {
+            result.push_back(c);
+        }
+    }
+    return result;
+}
+
+/**
+   A POSIX extended regular expression. Subjects are matched in their
+   narrow (UTF-8) encoding, so offsets are in bytes.
+*/
+class string_regex_t
+{
+private:
+    regex_t regex;
+    bool compiled;
+
+    /* No copying */
+    string_regex_t(const string_regex_t &);
+    string_regex_t &operator=(const string_regex_t &);
+
+public:
+    string_regex_t() : compiled(false)
+    {
+    }
+
+    ~string_regex_t()
+    {
+        if (compiled)
+            regfree(&regex);
+    }
+
+    /** Compile the pattern, printing an error and returning false on failure */
+    bool compile(const wchar_t *subcmd, const wcstring &pattern, bool ignore_case)
+    {
+        const std::string narrow = wcs2string(pattern);
+        int err = regcomp(&regex, narrow.c_str(), REG_EXTENDED | (ignore_case ? REG_ICASE : 0));
+        if (err != 0)
+        {
+            char msg[256];
+            regerror(err, &regex, msg, sizeof msg);
+            append_format(stderr_buffer, _(L"string %ls: Invalid regular expression '%ls': %s\n"), subcmd, pattern.c_str(), msg);
+            return false;
+        }
+        compiled = true;
+        return true;
+    }
+
+    /** Number of parenthesized subexpressions */
+    size_t group_count() const
+    {
+        return regex.re_nsub;
+    }
+
+    /** Find the first match in subject at or after offset. groups must have room for group_count() + 1 entries. */
+    bool match(const std::string &subject, size_t offset, std::vector<regmatch_t> *groups) const
+    {
+        groups->resize(group_count() + 1);
+        int eflags = (offset > 0 ? REG_NOTBOL : 0);
+        if (regexec(&regex, subject.c_str() + offset, groups->size(), &groups->at(0), eflags) != 0)
+            return false;
+
+        for (size_t i=0; i < groups->size(); i++)
+        {
+            regmatch_t &group = groups->at(i);
+            if (group.rm_so >= 0)
+            {
+                group.rm_so += offset;
+                group.rm_eo += offset;
+            }
+        }
+        return true;
+    }
+};
+
+/** Number of bytes in the UTF-8 sequence starting with the given byte, used to step over empty regex matches */
+static size_t string_utf8_length(const std::string &str, size_t offset)
+{
+    unsigned char c = str.at(offset);
+    size_t len = (c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1);
+    return std::min(len, str.size() - offset);
+}
+
+/** string length [-q] [STRING...] */
+static int string_length(parser_t &parser, int argc, wchar_t **argv)
+{
+    bool quiet = false;
+    woptind = 0;
+    for (;;)
+    {
+        static const struct woption long_options[] =
+        {
+            {L"quiet", no_argument, 0, 'q'},
+            {0, 0, 0, 0}
+        };
+        int opt = wgetopt_long(argc, argv, L"+q", long_options, NULL);
+        if (opt == -1)
+            break;
+        switch (opt)
+        {
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                string_unknown_option(parser, argv);
+                return BUILTIN_STRING_ERROR;
+        }
+    }
+
+    int result = BUILTIN_STRING_NONE;
+    string_args_t args(argv + woptind);
+    wcstring arg;
+    while (args.next(&arg))
+    {
+        if (! arg.empty())
+            result = BUILTIN_STRING_OK;
+        string_output(to_string(arg.size()), quiet);
+    }
+    return result;
+}
+
+/** string sub [-s START] [-l LENGTH] [-q] [STRING...] */
+static int string_sub(parser_t &parser, int argc, wchar_t **argv)
+{
+    bool quiet = false;
+    long start = 1, length = -1;
+    woptind = 0;
+    for (;;)
+    {
+        static const struct woption long_options[] =
+        {
+            {L"start", required_argument, 0, 's'},
+            {L"length", required_argument, 0, 'l'},
+            {L"quiet", no_argument, 0, 'q'},
+            {0, 0, 0, 0}
+        };
+        int opt = wgetopt_long(argc, argv, L"+s:l:q", long_options, NULL);
+        if (opt == -1)
+            break;
+        switch (opt)
+        {
+            case 's':
+                if (! string_parse_long(argv[0], woptarg, &start))
+                    return BUILTIN_STRING_ERROR;
+                if (start == 0)
+                {
+                    append_format(stderr_buffer, _(L"string %ls: Start index must not be zero\n"), argv[0]);
+                    return BUILTIN_STRING_ERROR;
+                }
+                break;
+            case 'l':
+                if (! string_parse_long(argv[0], woptarg, &length))
+                    return BUILTIN_STRING_ERROR;
+                if (length < 0)
+                {
+                    append_format(stderr_buffer, _(L"string %ls: Length must not be negative\n"), argv[0]);
+                    return BUILTIN_STRING_ERROR;
+                }
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                string_unknown_option(parser, argv);
+                return BUILTIN_STRING_ERROR;
+        }
+    }
+
+    int result = BUILTIN_STRING_NONE;
+    string_args_t args(argv + woptind);
+    wcstring arg;
+    while (args.next(&arg))
+    {
+        /*
+          Positive starts are 1-based from the beginning; negative starts count from the end.
+          Clamp to the string before doing any arithmetic, since the start may be LONG_MIN.
+        */
+        const long size = (long)arg.size();
+        long begin;
+        if (start > 0)
+        {
+            begin = (start > size ? size : start - 1);
+        }
+        else
+        {
+            begin = (start < -size ? 0 : size + start);
+        }
+        long count = size - begin;
+        if (length >= 0 && length < count)
+        {
+            count = length;
+        }
+        wcstring sub = arg.substr((size_t)begin, (size_t)count);
+        if (! sub.empty())
+            result = BUILTIN_STRING_OK;
+        string_output(sub, quiet);
+    }
+    return result;
+}
+
+/** string split [-m MAX] [-r] [-n] [-q] SEP [STRING...] */
+static int string_split(parser_t &parser, int argc, wchar_t **argv)
+{
+    bool quiet = false, from_right = false, no_empty = false;
+    long max = -1;
+    woptind = 0;
+    for (;;)
+    {
+        static const struct woption long_options[] =
+        {
+            {L"max", required_argument, 0, 'm'},
+            {L"right", no_argument, 0, 'r'},
+            {L"no-empty", no_argument, 0, 'n'},
+            {L"quiet", no_argument, 0, 'q'},
+            {0, 0, 0, 0}
+        };
+        int opt = wgetopt_long(argc, argv, L"+m:rnq", long_options, NULL);
+        if (opt == -1)
+            break;
+        switch (opt)
+        {
+            case 'm':
+                if (! string_parse_long(argv[0], woptarg, &max))
+                    return BUILTIN_STRING_ERROR;
+                break;
+            case 'r':
+                from_right = true;
+                break;
+            case 'n':
+                no_empty = true;
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                string_unknown_option(parser, argv);
+                return BUILTIN_STRING_ERROR;
+        }
+    }
+
+    if (woptind >= argc)
+        return string_missing_argument(parser, argv[0]);
+    const wcstring sep = argv[woptind++];
+
+    int result = BUILTIN_STRING_NONE;
+    string_args_t args(argv + woptind);
+    wcstring arg;
+    while (args.next(&arg))
+    {
+        wcstring_list_t pieces;
+        if (sep.empty())
+        {
+            /* Split into characters, keeping the unsplit remainder in one piece once max is reached */
+            size_t limit = (max < 0 ? arg.size() : std::min((size_t)max, arg.size()));
+            if (from_right)
+            {
+                size_t rest = arg.size() - limit;
+                if (rest > 0)
+                    pieces.push_back(arg.substr(0, rest));
+                for (size_t i = rest; i < arg.size(); i++)
+                    pieces.push_back(wcstring(1, arg.at(i)));
+            }
+            else
+            {
+                for (size_t i=0; i < limit; i++)
+                    pieces.push_back(wcstring(1, arg.at(i)));
+                if (limit < arg.size())
+                    pieces.push_back(arg.substr(limit));
+            }
+        }
+        else if (from_right)
+        {
+            size_t end = arg.size(), splits = 0;
+            while (max < 0 || splits < (size_t)max)
+            {
+                if (end < sep.size())
+                    break;
+                size_t loc = arg.rfind(sep, end - sep.size());
+                if (loc == wcstring::npos)
+                    break;
+                pieces.insert(pieces.begin(), arg.substr(loc + sep.size(), end - loc - sep.size()));
+                end = loc;
+                splits++;
+            }
+            pieces.insert(pieces.begin(), arg.substr(0, end));
+        }
+        else
+        {
+            size_t start = 0, splits = 0;
+            while (max < 0 || splits < (size_t)max)
+            {
+                size_t loc = arg.find(sep, start);
+                if (loc == wcstring::npos)
+                    break;
+                pieces.push_back(arg.substr(start, loc - start));
+                start = loc + sep.size();
+                splits++;
+            }
+            pieces.push_back(arg.substr(start));
+        }
+
+        if (pieces.size() > 1)
+            result = BUILTIN_STRING_OK;
+        for (size_t i=0; i < pieces.size(); i++)
+        {
+            /* With -n, runs of separators count as one, as do separators at either end */
+            if (no_empty && pieces.at(i).empty())
+                continue;
+            string_output(pieces.at(i), quiet);
+        }
+    }
+    return result;
+}
+
+/** string join [-q] SEP [STRING...] */
+static int string_join(parser_t &parser, int argc, wchar_t **argv)
+{
+    bool quiet = false;
+    woptind = 0;
+    for (;;)
+    {
+        static const struct woption long_options[] =
+        {
+            {L"quiet", no_argument, 0, 'q'},
+            {0, 0, 0, 0}
+        };
+        int opt = wgetopt_long(argc, argv, L"+q", long_options, NULL);
+        if (opt == -1)
+            break;
+        switch (opt)
+        {
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                string_unknown_option(parser, argv);
+                return BUILTIN_STRING_ERROR;
+        }
+    }
+
+    if (woptind >= argc)
+        return string_missing_argument(parser, argv[0]);
+    const wcstring sep = argv[woptind++];
+
+    size_t count = 0;
+    wcstring joined;
+    string_args_t args(argv + woptind);
+    wcstring arg;
+    while (args.next(&arg))
+    {
+        if (count++ > 0)
+            joined.append(sep);
+        joined.append(arg);
+    }
+    if (count > 0)
+        string_output(joined, quiet);
+    return count > 1 ? BUILTIN_STRING_OK : BUILTIN_STRING_NONE;
+}
+
+/** string trim [-l] [-r] [-c CHARS] [-q] [STRING...] */
+static int string_trim(parser_t &parser, int argc, wchar_t **argv)
+{
+    bool quiet = false, left = false, right = false;
+    wcstring chars = L" \f\n\r\t";
+    woptind = 0;
+    for (;;)
+    {
+        static const struct woption long_options[] =
+        {
+            {L"left", no_argument, 0, 'l'},
+            {L"right", no_argument, 0, 'r'},
+            {L"chars", required_argument, 0, 'c'},
+            {L"quiet", no_argument, 0, 'q'},
+            {0, 0, 0, 0}
+        };
+        int opt = wgetopt_long(argc, argv, L"+lrc:q", long_options, NULL);
+        if (opt == -1)
+            break;
+        switch (opt)
+        {
+            case 'l':
+                left = true;
+                break;
+            case 'r':
+                right = true;
+                break;
+            case 'c':
+                chars = woptarg;
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                string_unknown_option(parser, argv);
+                return BUILTIN_STRING_ERROR;
+        }
+    }
+
+    /* Trim both ends unless told otherwise */
+    if (! left && ! right)
+        left = right = true;
+
+    int result = BUILTIN_STRING_NONE;
+    string_args_t args(argv + woptind);
+    wcstring arg;
+    while (args.next(&arg))
+    {
+        size_t begin = 0, end = arg.size();
+        if (left)
+        {
+            size_t loc = arg.find_first_not_of(chars);
+            begin = (loc == wcstring::npos ? arg.size() : loc);
+        }
+        if (right)
+        {
+            size_t loc = arg.find_last_not_of(chars);
+            end = (loc == wcstring::npos ? 0 : loc + 1);
+        }
+        end = std::max(begin, end);
+        if (begin > 0 || end < arg.size())
+            result = BUILTIN_STRING_OK;
+        string_output(arg.substr(begin, end - begin), quiet);
+    }
+    return result;
+}
+
+/** string escape [-n] [-q] [STRING...] */
+static int string_escape(parser_t &parser, int argc, wchar_t **argv)
+{
+    bool quiet = false;
+    escape_flags_t flags = ESCAPE_ALL;
+    woptind = 0;
+    for (;;)
+    {
+        static const struct woption long_options[] =
+        {
+            {L"no-quoted", no_argument, 0, 'n'},
+            {L"quiet", no_argument, 0, 'q'},
+            {0, 0, 0, 0}
+        };
+        int opt = wgetopt_long(argc, argv, L"+nq", long_options, NULL);
+        if (opt == -1)
+            break;
+        switch (opt)
+        {
+            case 'n':
+                flags |= ESCAPE_NO_QUOTED;
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                string_unknown_option(parser, argv);
+                return BUILTIN_STRING_ERROR;
+        }
+    }
+
+    int result = BUILTIN_STRING_NONE;
+    string_args_t args(argv + woptind);
+    wcstring arg;
+    while (args.next(&arg))
+    {
+        const wcstring escaped = escape_string(arg, flags);
+        if (escaped != arg)
+            result = BUILTIN_STRING_OK;
+        string_output(escaped, quiet);
+    }
+    return result;
+}
+
+/** string match [-a] [-i] [-r] [-n] [-v] [-q] PATTERN [STRING...] */
+static int string_match(parser_t &parser, int argc, wchar_t **argv)
+{
+    bool quiet = false, all = false, ignore_case = false, regex = false, index = false, invert = false;
+    woptind = 0;
+    for (;;)
+    {
+        static const struct woption long_options[] =
+        {
+            {L"all", no_argument, 0, 'a'},
+            {L"ignore-case", no_argument, 0, 'i'},
+            {L"regex", no_argument, 0, 'r'},
+            {L"index", no_argument, 0, 'n'},
+            {L"invert", no_argument, 0, 'v'},
+            {L"quiet", no_argument, 0, 'q'},
+            {0, 0, 0, 0}
+        };
+        int opt = wgetopt_long(argc, argv, L"+airnvq", long_options, NULL);
+        if (opt == -1)
+            break;
+        switch (opt)
+        {
+            case 'a':
+                all = true;
+                break;
+            case 'i':
+                ignore_case = true;
+                break;
+            case 'r':
+                regex = true;
+                break;
+            case 'n':
+                index = true;
+                break;
+            case 'v':
+                invert = true;
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                string_unknown_option(parser, argv);
+                return BUILTIN_STRING_ERROR;
+        }
+    }
+
+    if (woptind >= argc)
+        return string_missing_argument(parser, argv[0]);
+    const wcstring pattern = argv[woptind++];
+
+    string_regex_t compiled;
+    wcstring wildcard;
+    if (regex)
+    {
+        if (! compiled.compile(argv[0], pattern, ignore_case))
+            return BUILTIN_STRING_ERROR;
+    }
+    else
+    {
+        wildcard = string_glob_to_wildcard(ignore_case ? string_lowercase(pattern) : pattern);
+    }
+
+    int result = BUILTIN_STRING_NONE;
+    string_args_t args(argv + woptind);
+    wcstring arg;
+    std::vector<regmatch_t> groups;
+    while (args.next(&arg))
+    {
+        if (! regex)
+        {
+            bool matched = wildcard_match(ignore_case ? string_lowercase(arg) : arg, wildcard);
+            if (matched != invert)
+            {
+                result = BUILTIN_STRING_OK;
+                string_output(index && ! invert ? format_string(L"1 %lu", (unsigned long)arg.size()) : arg, quiet);
+            }
+            continue;
+        }
+
+        const std::string narrow = wcs2string(arg);
+        bool matched = false;
+        size_t offset = 0;
+        while (offset <= narrow.size() && compiled.match(narrow, offset, &groups))
+        {
+            matched = true;
+            if (invert)
+                break;
+
+            /* Print the whole match followed by each participating group */
+            for (size_t i=0; i < groups.size(); i++)
+            {
+                const regmatch_t &group = groups.at(i);
+                if (group.rm_so < 0)
+                    continue;
+                if (index)
+                {
+                    size_t start = str2wcstring(narrow.substr(0, group.rm_so)).size() + 1;
+                    size_t length = str2wcstring(narrow.substr(group.rm_so, group.rm_eo - group.rm_so)).size();
+                    string_output(format_string(L"%lu %lu", (unsigned long)start, (unsigned long)length), quiet);
+                }
+                else
+                {
+                    string_output(str2wcstring(narrow.substr(group.rm_so, group.rm_eo - group.rm_so)), quiet);
+                }
+            }
+
+            if (! all)
+                break;
+
+            /* Continue after the match, stepping over empty matches */
+            size_t end = groups.at(0).rm_eo;
+            offset = (end > (size_t)groups.at(0).rm_so ? end : end + (end < narrow.size() ? string_utf8_length(narrow, end) : 1));
+        }
+
+        if (matched != invert)
+        {
+            result = BUILTIN_STRING_OK;
+            if (invert)
+                string_output(arg, quiet);
+        }
+    }
+    return result;
+}
+
+/** Append a regex replacement to out, expanding \N group references and \\ */
+static void string_append_replacement(std::string *out, const std::string &subject, const std::string &replacement, const std::vector<regmatch_t> &groups)
+{
+    for (size_t i=0; i < replacement.size(); i++)
+    {
+        char c = replacement.at(i);
+        if (c == '\\' && i + 1 < replacement.size())
+        {
+            char next = replacement.at(i + 1);
+            if (next >= '0' && next <= '9')
+            {
+                size_t group_idx = next - '0';
+                if (group_idx < groups.size() && groups.at(group_idx).rm_so >= 0)
+                {
+                    const regmatch_t &group = groups.at(group_idx);
+                    out->append(subject, group.rm_so, group.rm_eo - group.rm_so);
+                }
+                i++;
+                continue;
+            }
+            else if (next == '\\')
+            {
+                out->push_back('\\');
+                i++;
+                continue;
+            }
+        }
+        out->push_back(c);
+    }
+}
+
+/** string replace [-a] [-i] [-r] [-q] PATTERN REPLACEMENT [STRING...] */
+static int string_replace(parser_t &parser, int argc, wchar_t **argv)
+{
+    bool quiet = false, all = false, ignore_case = false, regex = false;
+    woptind = 0;
+    for (;;)
+    {
+        static const struct woption long_options[] =
+        {
+            {L"all", no_argument, 0, 'a'},
+            {L"ignore-case", no_argument, 0, 'i'},
+            {L"regex", no_argument, 0, 'r'},
+            {L"quiet", no_argument, 0, 'q'},
+            {0, 0, 0, 0}
+        };
+        int opt = wgetopt_long(argc, argv, L"+airq", long_options, NULL);
+        if (opt == -1)
+            break;
+        switch (opt)
+        {
+            case 'a':
+                all = true;
+                break;
+            case 'i':
+                ignore_case = true;
+                break;
+            case 'r':
+                regex = true;
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                string_unknown_option(parser, argv);
+                return BUILTIN_STRING_ERROR;
+        }
+    }
+
+    if (woptind + 1 >= argc)
+        return string_missing_argument(parser, argv[0]);
+    const wcstring pattern = argv[woptind++];
+    const wcstring replacement = argv[woptind++];
+
+    string_regex_t compiled;
+    const std::string narrow_replacement = wcs2string(replacement);
+    if (regex && ! compiled.compile(argv[0], pattern, ignore_case))
+        return BUILTIN_STRING_ERROR;
+    const wcstring folded_pattern = ignore_case ? string_lowercase(pattern) : pattern;
+
+    int result = BUILTIN_STRING_NONE;
+    string_args_t args(argv + woptind);
+    wcstring arg;
+    std::vector<regmatch_t> groups;
+    while (args.next(&arg))
+    {
+        size_t replacements = 0;
+        wcstring replaced;
+        if (regex)
+        {
+            const std::string narrow = wcs2string(arg);
+            std::string out;
+            size_t offset = 0;
+            while (offset <= narrow.size() && (all || replacements == 0) && compiled.match(narrow, offset, &groups))
+            {
+                size_t start = groups.at(0).rm_so, end = groups.at(0).rm_eo;
+                out.append(narrow, offset, start - offset);
+                string_append_replacement(&out, narrow, narrow_replacement, groups);
+                replacements++;
+
+                if (end == start)
+                {
+                    /* Empty match: copy one character so we make progress */
+                    if (end >= narrow.size())
+                    {
+                        offset = narrow.size() + 1;
+                        break;
+                    }
+                    size_t len = string_utf8_length(narrow, end);
+                    out.append(narrow, end, len);
+                    offset = end + len;
+                }
+                else
+                {
+                    offset = end;
+                }
+            }
+            if (offset < narrow.size())
+                out.append(narrow, offset, std::string::npos);
+            replaced = str2wcstring(out);
+        }
+        else if (! pattern.empty())
+        {
+            /* towlower maps characters one to one, so offsets in the folded string are valid in the original */
+            const wcstring haystack = ignore_case ? string_lowercase(arg) : arg;
+            size_t offset = 0;
+            for (;;)
+            {
+                size_t loc = haystack.find(folded_pattern, offset);
+                if (loc == wcstring::npos || (! all && replacements > 0))
+                    break;
+                replaced.append(arg, offset, loc - offset);
+                replaced.append(replacement);
+                offset = loc + pattern.size();
+                replacements++;
+            }
+            replaced.append(arg, offset, wcstring::npos);
+        }
+        else
+        {
+            replaced = arg;
+        }
+
+        if (replacements > 0)
+            result = BUILTIN_STRING_OK;
+        string_output(replaced, quiet);
+    }
+    return result;
+}
+
+/**
+   The string builtin, for manipulating strings.
+*/
+static int builtin_string(parser_t &parser, wchar_t **argv)
+{
+    static const struct
+    {
+        const wchar_t *name;
+        int (*handler)(parser_t &, int argc, wchar_t **argv);
+    }
+    subcommands[] =
+    {
+        { L"escape", &string_escape },
+        { L"join", &string_join },
+        { L"length", &string_length },
+        { L"match", &string_match },
+        { L"replace", &string_replace },
+        { L"split", &string_split },
+        { L"sub", &string_sub },
+        { L"trim", &string_trim },
+    };
+
+    int argc = builtin_count_args(argv);
+    if (argc <= 1)
+    {
+        append_format(stderr_buffer, _(L"%ls: Expected subcommand\n"), argv[0]);
+        builtin_print_help(parser, argv[0], stderr_buffer);
+        return BUILTIN_STRING_ERROR;
+    }
+
+    if (! wcscmp(argv[1], L"-h") || ! wcscmp(argv[1], L"--help"))
+    {
+        builtin_print_help(parser, argv[0], stdout_buffer);
+        return BUILTIN_STRING_OK;
+    }
+
+    for (size_t i=0; i < sizeof subcommands / sizeof *subcommands; i++)
+    {
+        if (! wcscmp(argv[1], subcommands[i].name))
+        {
+            /* Hand the subcommand its arguments, with the subcommand name in place of argv[0] */
+            return subcommands[i].handler(parser, argc - 1, argv + 1);
+        }
+    }
+
+    append_format(stderr_buffer, _(L"%ls: Unknown subcommand '%ls'\n"), argv[0], argv[1]);
+    builtin_print_help(parser, argv[0], stderr_buffer);
+    return BUILTIN_STRING_ERROR;
+}
@@ -169,19 +169,27 @@ int fgetws2(wcstring *s, FILE *f)
    way using the private use area.
 */
 
-static wcstring str2wcs_internal(const char *in, const size_t in_len)
+static void str2wcs_internal(const char *in, const size_t in_len, wcstring *out)
 {
     if (in_len == 0)
-        return wcstring();
+        return;
 
     assert(in != NULL);
 
-    wcstring result;
-    result.reserve(in_len);
+    wcstring &result = *out;
+    result.reserve(result.size() + in_len);
     mbstate_t state = {};
     size_t in_pos = 0;
     while (in_pos < in_len)
     {
+        /* ASCII decodes to itself in every locale we support, so skip mbrtowc for it */
+        if ((unsigned char)in[in_pos] < 0x80 && mbsinit(&state))
+        {
+            result.push_back((unsigned char)in[in_pos]);
+            in_pos++;
+            continue;
+        }
+
         wchar_t wc = 0;
         size_t ret = mbrtowc(&wc, &in[in_pos], in_len-in_pos, &state);
 
@@ -232,23 +240,33 @@ static wcstring str2wcs_internal(const char *in, const size_t in_len)
             in_pos += ret;
         }
     }
-    return result;
 }
 
 wcstring str2wcstring(const char *in, size_t len)
 {
-    return str2wcs_internal(in, len);
+    wcstring result;
+    str2wcs_internal(in, len, &result);
+    return result;
 }
 
 wcstring str2wcstring(const char *in)
 {
-    return str2wcs_internal(in, strlen(in));
+    wcstring result;
+    str2wcs_internal(in, strlen(in), &result);
+    return result;
 }
 
 wcstring str2wcstring(const std::string &in)
 {
     /* Handles embedded nulls! */
-    return str2wcs_internal(in.data(), in.size());
+    wcstring result;
+    str2wcs_internal(in.data(), in.size(), &result);
+    return result;
+}
+
+void str2wcstring_append(wcstring *out, const char *in, size_t len)
+{
+    str2wcs_internal(in, len, out);
 }
 
 char *wcs2str(const wchar_t *in)
@@ -1820,7 +1838,8 @@ string_fuzzy_match_t::string_fuzzy_match_t(enum fuzzy_match_type_t t, size_t dis
 }
 
 
-string_fuzzy_match_t string_fuzzy_match_string(const wcstring &string, const wcstring &match_against, fuzzy_match_type_t limit_type)
+/* Computes a fuzzy match. If the lowercased forms of the strings are given, they are used for the case insensitive comparisons. */
+static string_fuzzy_match_t fuzzy_match_internal(const wcstring &string, const wcstring &match_against, fuzzy_match_type_t limit_type, const wcstring *lowercase_string, const wcstring *lowercase_match_against)
 {
     // Distances are generally the amount of text not matched
     string_fuzzy_match_t result(fuzzy_match_none, 0, 0);
@@ -1835,11 +1854,11 @@ string_fuzzy_match_t string_fuzzy_match_string(const wcstring &string, const wcs
         assert(match_against.size() >= string.size());
         result.match_distance_first = match_against.size() - string.size();
     }
-    else if (limit_type >= fuzzy_match_case_insensitive && wcscasecmp(string.c_str(), match_against.c_str()) == 0)
+    else if (limit_type >= fuzzy_match_case_insensitive && (lowercase_string ? *lowercase_string == *lowercase_match_against : wcscasecmp(string.c_str(), match_against.c_str()) == 0))
     {
         result.type = fuzzy_match_case_insensitive;
     }
-    else if (limit_type >= fuzzy_match_prefix_case_insensitive && string_prefixes_string_case_insensitive(string, match_against))
+    else if (limit_type >= fuzzy_match_prefix_case_insensitive && (lowercase_string ? string_prefixes_string(*lowercase_string, *lowercase_match_against) : string_prefixes_string_case_insensitive(string, match_against)))
     {
         result.type = fuzzy_match_prefix_case_insensitive;
         assert(match_against.size() >= string.size());
@@ -1863,6 +1882,122 @@ string_fuzzy_match_t string_fuzzy_match_string(const wcstring &string, const wcs
     return result;
 }
 
+string_fuzzy_match_t string_fuzzy_match_string(const wcstring &string, const wcstring &match_against, fuzzy_match_type_t limit_type)
+{
+    return fuzzy_match_internal(string, match_against, limit_type, NULL, NULL);
+}
+
+/* Returns the lowercased form of a string, as wcscasecmp compares it */
+static wcstring lowercase_string(const wcstring &str)
+{
+    wcstring result(str);
+    for (size_t i=0; i < result.size(); i++)
+    {
+        result[i] = towlower(result[i]);
+    }
+    return result;
+}
+
+/* Returns a mask with a bit set for each (lowercased) character in the string. Every match requires the mask of the search string to be contained in the mask of the candidate. */
+static unsigned long character_mask(const wcstring &lowercase_str)
+{
+    unsigned long result = 0;
+    for (size_t i=0; i < lowercase_str.size(); i++)
+    {
+        result |= 1UL << ((unsigned long)lowercase_str[i] % 32);
+    }
+    return result;
+}
+
+/* Indicates whether every candidate that matches a search string also matches each of its prefixes, with the given limit. That's not the case if an exact or case insensitive match is allowed, but the corresponding prefix match is not. */
+static bool match_limit_narrows(fuzzy_match_type_t limit_type)
+{
+    return limit_type == fuzzy_match_prefix || limit_type >= fuzzy_match_prefix_case_insensitive;
+}
+
+string_fuzzy_match_index_t::string_fuzzy_match_index_t() : levels_limit(fuzzy_match_none)
+{
+}
+
+size_t string_fuzzy_match_index_t::add(const wcstring &candidate)
+{
+    const wcstring lowercase = lowercase_string(candidate);
+    candidates.push_back(candidate);
+    candidate_masks.push_back(character_mask(lowercase));
+    lowercase_candidates.push_back(lowercase);
+
+    /* The remembered matches don't include the new candidate */
+    levels.clear();
+    return candidates.size() - 1;
+}
+
+void string_fuzzy_match_index_t::clear()
+{
+    candidates.clear();
+    lowercase_candidates.clear();
+    candidate_masks.clear();
+    levels.clear();
+}
+
+const std::vector<size_t> &string_fuzzy_match_index_t::match(const wcstring &needle, fuzzy_match_type_t limit_type)
+{
+    /* Forget the matches for search strings that don't prefix this one */
+    if (limit_type != levels_limit)
+    {
+        levels.clear();
+        levels_limit = limit_type;
+    }
+    while (! levels.empty() && ! string_prefixes_string(levels.back().needle, needle))
+    {
+        levels.pop_back();
+    }
+    if (! levels.empty() && levels.back().needle == needle)
+    {
+        return levels.back().matches;
+    }
+    if (! match_limit_narrows(limit_type))
+    {
+        levels.clear();
+    }
+
+    /* Only the candidates that matched a prefix of the needle can match it */
+    const std::vector<size_t> *previous = levels.empty() ? NULL : &levels.back().matches;
+    const size_t count = previous ? previous->size() : candidates.size();
+
+    level_t level;
+    level.needle = needle;
+    const wcstring lowercase_needle = lowercase_string(needle);
+    const unsigned long needle_mask = character_mask(lowercase_needle);
+    for (size_t i=0; i < count; i++)
+    {
+        const size_t idx = previous ? previous->at(i) : i;
+        if ((needle_mask & ~candidate_masks[idx]) != 0 || needle.size() > candidates[idx].size())
+        {
+            continue;
+        }
+
+        const string_fuzzy_match_t result = fuzzy_match_internal(needle, candidates[idx], limit_type, &lowercase_needle, &lowercase_candidates[idx]);
+        if (result.type != fuzzy_match_none)
+        {
+            level.matches.push_back(idx);
+            level.results.push_back(result);
+        }
+    }
+
+    /* Swap rather than copy, since previous may point into levels */
+    levels.push_back(level_t());
+    levels.back().needle.swap(level.needle);
+    levels.back().matches.swap(level.matches);
+    levels.back().results.swap(level.results);
+    return levels.back().matches;
+}
+
+const std::vector<string_fuzzy_match_t> &string_fuzzy_match_index_t::match_results() const
+{
+    assert(! levels.empty());
+    return levels.back().results;
+}
+
 template<typename T>
 static inline int compare_ints(T a, T b)
 {
@@ -2157,6 +2292,11 @@ void configure_thread_assertions_for_testing(void)
     thread_assertions_configured_for_testing = true;
 }
 
+void enforce_thread_assertions_for_testing(bool enforce)
+{
+    thread_assertions_configured_for_testing = ! enforce;
+}
+
 /* Notice when we've forked */
 static pid_t initial_pid = 0;
 
@@ -22,6 +22,19 @@
 #include <assert.h>
 #include "util.h"
 
+// Note that we have to include something to get any _LIBCPP_VERSION defined so we can detect libc++
+// So it's key that vector go above. If we didn't need vector for other reasons, we might include ciso646, which does nothing
+
+#if defined(_LIBCPP_VERSION) || __cplusplus > 199711L
+// C++11 or libc++ (which is a C++11-only library, but the memory header works OK in C++03)
+#include <memory>
+using std::shared_ptr;
+#else
+// C++03 or libstdc++
+#include <tr1/memory>
+using std::tr1::shared_ptr;
+#endif
+
 /**
    Avoid writing the type name twice in a common "static_cast-initialization".
    Caveat: This doesn't work with type names containing commas!
@@ -265,6 +278,13 @@ wcstring str2wcstring(const char *in);
 wcstring str2wcstring(const char *in, size_t len);
 wcstring str2wcstring(const std::string &in);
 
+/**
+ Like str2wcstring, but appends the converted characters to \c out
+ instead of returning a new string. This lets callers decode directly
+ into a string they already own.
+ */
+void str2wcstring_append(wcstring *out, const char *in, size_t len);
+
 /**
    Returns a newly allocated multibyte character string equivalent of
    the specified wide character string
@@ -358,6 +378,58 @@ struct string_fuzzy_match_t
 /* Compute a fuzzy match for a string. If maximum_match is not fuzzy_match_none, limit the type to matches at or below that type. */
 string_fuzzy_match_t string_fuzzy_match_string(const wcstring &string, const wcstring &match_against, fuzzy_match_type_t limit_type = fuzzy_match_none);
 
+/**
+   An index of candidate strings, for fuzzy matching the same candidates against a search string as it is typed a character at a time.
+
+   Each candidate's lowercased form and a mask of the characters it contains are computed once, when it is added, so most candidates are rejected without looking at their text. The matches for each search string are remembered, so extending the search string only re-examines the candidates that matched before, and deleting characters again reuses the earlier results.
+*/
+class string_fuzzy_match_index_t
+{
+    /* The candidates, their lowercased forms, and the masks of their characters */
+    wcstring_list_t candidates;
+    wcstring_list_t lowercase_candidates;
+    std::vector<unsigned long> candidate_masks;
+
+    /* The matches for a search string: the indexes of the candidates that matched it, and how */
+    struct level_t
+    {
+        wcstring needle;
+        std::vector<size_t> matches;
+        std::vector<string_fuzzy_match_t> results;
+    };
+
+    /* The matches for each search string that prefixes the last one, shortest first, all with the same limit */
+    std::vector<level_t> levels;
+    fuzzy_match_type_t levels_limit;
+
+public:
+    string_fuzzy_match_index_t();
+
+    /* Adds a candidate, returning its index */
+    size_t add(const wcstring &candidate);
+
+    /* Removes all candidates */
+    void clear();
+
+    /* Returns the number of candidates */
+    size_t size() const
+    {
+        return candidates.size();
+    }
+
+    /* Returns the candidate with the given index */
+    const wcstring &at(size_t idx) const
+    {
+        return candidates.at(idx);
+    }
+
+    /* Matches every candidate against needle, as string_fuzzy_match_string would, and returns the indexes of those that match, in increasing order. The result is valid until the next call. */
+    const std::vector<size_t> &match(const wcstring &needle, fuzzy_match_type_t limit_type = fuzzy_match_none);
+
+    /* Returns how the candidates returned by the last call to match matched, in the same order */
+    const std::vector<string_fuzzy_match_t> &match_results() const;
+};
+
 
 /** Test if a list contains a string using a linear search. */
 bool list_contains_string(const wcstring_list_t &list, const wcstring &str);
@@ -897,6 +969,9 @@ bool is_main_thread();
 /** Configures thread assertions for testing */
 void configure_thread_assertions_for_testing();
 
+/** Turns thread assertions back on after configure_thread_assertions_for_testing, or off again, so tests can check code that runs off the main thread */
+void enforce_thread_assertions_for_testing(bool enforce);
+
 /** Set up a guard to complain if we try to do certain things (like take a lock) after calling fork */
 void setup_fork_guards(void);
 
@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <dirent.h>
 #include <errno.h>
 #include <termios.h>
@@ -72,6 +73,19 @@
 */
 #define MAX_CMD_DESC_LOOKUP 10
 
+/**
+   The maximum number of candidates read from a streaming completion
+   generator. Once this many lines have arrived the generator is stopped
+   and the candidates read so far are used.
+*/
+#define STREAMING_COMPLETIONS_MAX 10000
+
+/**
+   How often, in seconds, the completions found so far are reported while
+   a streaming completion generator is running.
+*/
+#define STREAMING_COMPLETIONS_REPORT_INTERVAL 0.1
+
 /**
    Condition cache value returned from hashtable when this condition
    has not yet been tested. This value is NULL, so that when the hash
@@ -349,6 +363,12 @@ class completer_t
     const wcstring initial_cmd;
     std::vector<completion_t> completions;
 
+    /** Receiver of partial results, or NULL */
+    completion_progress_t * const progress;
+
+    /** Set once progress has asked us to stop */
+    bool cancelled;
+
     /** Table of completions conditions that have already been tested and the corresponding test results */
     typedef std::map<wcstring, bool> condition_cache_t;
     condition_cache_t condition_cache;
@@ -382,12 +402,22 @@ class completer_t
 
 
 public:
-    completer_t(const wcstring &c, completion_request_flags_t f) :
+    completer_t(const wcstring &c, completion_request_flags_t f, completion_progress_t *p = NULL) :
         flags(f),
-        initial_cmd(c)
+        initial_cmd(c),
+        progress(p),
+        cancelled(false)
     {
     }
 
+    /** Tells progress about the completions found so far. Returns false if we should stop. */
+    bool report_progress()
+    {
+        if (progress != NULL && ! cancelled && ! progress->completions_found(completions))
+            cancelled = true;
+        return ! cancelled;
+    }
+
     bool empty() const
     {
         return completions.empty();
@@ -1122,6 +1152,171 @@ static wcstring complete_function_desc(const wcstring &fn)
 }
 
 
+/**
+   The most background threads that help complete a command name against the directories in $PATH
+*/
+#define PATH_SCAN_MAX_HELPERS 8
+
+/**
+   Completes a command name against one directory in $PATH, appending to out. base_path must end with a slash.
+*/
+static void complete_cmd_in_dir(const wcstring &base_path, const wcstring &str_cmd, expand_flags_t flags, std::vector<completion_t> &out)
+{
+    wcstring nxt_completion = base_path;
+    nxt_completion.append(str_cmd);
+
+    size_t prev_count = out.size();
+    if (expand_string(nxt_completion, out, flags, NULL) != EXPAND_ERROR)
+    {
+        /* For all new completions, if COMPLETE_NO_CASE is set, then use only the last path component */
+        for (size_t i=prev_count; i < out.size(); i++)
+        {
+            completion_t &c = out.at(i);
+            if (c.flags & COMPLETE_REPLACES_TOKEN)
+            {
+
+                c.completion.erase(0, base_path.size());
+            }
+        }
+    }
+}
+
+/**
+   Completing a command name against the directories in $PATH. The thread doing the completion and up to PATH_SCAN_MAX_HELPERS iothreads each claim directories until there are none left, so a slow directory only holds up the thread scanning it. Each directory's completions are kept separately and merged in $PATH order, so the result does not depend on which thread got there first.
+*/
+class path_scan_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /** The next directory to claim, and how many have been scanned */
+    size_t next_dir, finished_dirs;
+
+    const wcstring_list_t base_paths;
+    const wcstring str_cmd;
+    const expand_flags_t flags;
+
+    /** The completions from each directory */
+    std::vector<std::vector<completion_t> > dir_completions;
+
+public:
+
+    /** Cancels the helpers' expansions, when the completion is no longer wanted */
+    iothread_cancellation_token_t token;
+
+    path_scan_t(const wcstring_list_t &paths, const wcstring &cmd, expand_flags_t f) :
+        next_dir(0), finished_dirs(0), base_paths(paths), str_cmd(cmd), flags(f), dir_completions(paths.size())
+    {
+        VOMIT_ON_FAILURE(pthread_mutex_init(&lock, NULL));
+        VOMIT_ON_FAILURE(pthread_cond_init(&cond, NULL));
+    }
+
+    ~path_scan_t()
+    {
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&lock);
+    }
+
+    /** Scans the next unclaimed directory. Returns false if there were none left. */
+    bool scan_next()
+    {
+        size_t idx;
+        {
+            scoped_lock locker(lock);
+            if (next_dir >= base_paths.size())
+                return false;
+            idx = next_dir++;
+        }
+
+        /* Nobody else touches this directory's list until it is finished */
+        complete_cmd_in_dir(base_paths.at(idx), str_cmd, flags, dir_completions.at(idx));
+
+        scoped_lock locker(lock);
+        finished_dirs++;
+        pthread_cond_broadcast(&cond);
+        return true;
+    }
+
+    /** Returns whether the completion should stop, asking completer's receiver of progress at most every STREAMING_COMPLETIONS_REPORT_INTERVAL seconds */
+    static bool is_stale(completer_t *completer, double *last_report)
+    {
+        if (reader_interrupted())
+            return true;
+        const double now = timef();
+        if (now - *last_report < STREAMING_COMPLETIONS_REPORT_INTERVAL)
+            return false;
+        *last_report = now;
+        return ! completer->report_progress();
+    }
+
+    /**
+       Scans directories until there are none left, waits for the helpers to finish theirs, and appends everything to out. Called by the thread doing the completion, which is the main thread, since only it can start helpers.
+
+       Between directories, and while waiting, the completion is stopped by control-C, or by completer's receiver of progress asking to stop, which the reader does when a key is pressed. It then returns without appending anything. A directory this thread is in the middle of scanning can't be interrupted, nor can the serial scan autosuggestions do.
+    */
+    void scan_and_merge(std::vector<completion_t> &out, completer_t *completer)
+    {
+        double last_report = timef();
+        do
+        {
+            if (is_stale(completer, &last_report))
+            {
+                token.cancel();
+                return;
+            }
+        }
+        while (scan_next());
+
+        scoped_lock locker(lock);
+        while (finished_dirs < base_paths.size())
+        {
+            /* Wake up now and then to notice if the completion went stale while the helpers finish. If so, tell them to stop, and don't wait for them, since one may be stuck in a slow directory. They share ownership of this scan, so they can finish whenever they like. */
+            if (is_stale(completer, &last_report))
+            {
+                token.cancel();
+                return;
+            }
+            struct timespec deadline;
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            deadline.tv_sec = now.tv_sec;
+            deadline.tv_nsec = (now.tv_usec + 10000) * 1000;
+            if (deadline.tv_nsec >= 1000000000)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&cond, &lock, &deadline);
+        }
+
+        for (size_t i=0; i < dir_completions.size(); i++)
+        {
+            out.insert(out.end(), dir_completions.at(i).begin(), dir_completions.at(i).end());
+        }
+    }
+};
+
+/** An iothread helping with a path_scan_t */
+class path_scan_helper_t : public iothread_task_t
+{
+    const shared_ptr<path_scan_t> scan;
+
+public:
+    path_scan_helper_t(const shared_ptr<path_scan_t> &s) : scan(s)
+    {
+        wants_completion = false;
+    }
+
+    int perform()
+    {
+        /* Expansions notice cancellation themselves, through reader_thread_job_is_stale() */
+        while (! is_cancelled() && scan->scan_next())
+        {
+        }
+        return 0;
+    }
+};
+
 /**
    Complete the specified command name. Search for executables in the
    path, executables defined using an absolute path, functions,
@@ -1162,6 +1357,7 @@ void completer_t::complete_cmd(const wcstring &str_cmd, bool use_function, bool
             const env_var_t path = env_get_string(L"PATH");
             if (!path.missing())
             {
+                wcstring_list_t base_paths;
                 wcstring base_path;
                 wcstokenizer tokenizer(path, ARRAY_SEP_STR);
                 while (tokenizer.next(base_path))
@@ -1173,26 +1369,34 @@ void completer_t::complete_cmd(const wcstring &str_cmd, bool use_function, bool
                     if (base_path.at(base_path.size() - 1) != L'/')
                         base_path.push_back(L'/');
 
-                    wcstring nxt_completion = base_path;
-                    nxt_completion.append(str_cmd);
+                    base_paths.push_back(base_path);
+                }
 
-                    size_t prev_count =  this->completions.size();
-                    if (expand_string(nxt_completion,
-                                      this->completions,
-                                      ACCEPT_INCOMPLETE | EXECUTABLES_ONLY | this->expand_flags(), NULL) != EXPAND_ERROR)
-                    {
-                        /* For all new completions, if COMPLETE_NO_CASE is set, then use only the last path component */
-                        for (size_t i=prev_count; i< this->completions.size(); i++)
-                        {
-                            completion_t &c =  this->completions.at(i);
-                            if (c.flags & COMPLETE_REPLACES_TOKEN)
-                            {
+                const expand_flags_t flags = ACCEPT_INCOMPLETE | EXECUTABLES_ONLY | this->expand_flags();
 
-                                c.completion.erase(0, base_path.size());
-                            }
-                        }
+                /*
+                  Scan the directories concurrently, unless expanding the name might need the main thread, which the helpers can't use.
+                  Helpers can only be started from the main thread, so autosuggestions scan the directories one by one, and a slow directory still holds them up.
+                */
+                const bool may_need_main_thread = ! (flags & EXPAND_SKIP_CMDSUBST) && str_cmd.find(L'(') != wcstring::npos;
+                if (base_paths.size() > 1 && ! may_need_main_thread && is_main_thread())
+                {
+                    const shared_ptr<path_scan_t> scan(new path_scan_t(base_paths, str_cmd, flags));
+                    const size_t helper_count = std::min(base_paths.size() - 1, (size_t)PATH_SCAN_MAX_HELPERS);
+                    for (size_t i=0; i < helper_count; i++)
+                    {
+                        iothread_perform_task(new path_scan_helper_t(scan), IOTHREAD_PRIORITY_AUTOSUGGEST, &scan->token);
                     }
+                    scan->scan_and_merge(this->completions, this);
                 }
+                else
+                {
+                    for (size_t i=0; i < base_paths.size(); i++)
+                    {
+                        complete_cmd_in_dir(base_paths.at(i), str_cmd, flags, this->completions);
+                    }
+                }
+
                 if (this->wants_descriptions())
                     this->complete_cmd_desc(str_cmd);
             }
@@ -1222,6 +1426,60 @@ void completer_t::complete_cmd(const wcstring &str_cmd, bool use_function, bool
 }
 
 
+/**
+   Turns the lines printed by a completion generator into completions,
+   reporting them to the completer's progress as they arrive.
+*/
+class completion_stream_t : public subshell_line_handler_t
+{
+    completer_t * const completer;
+    const wcstring wc_escaped;
+    const wcstring desc;
+    const complete_flags_t flags;
+
+    /** Lines not yet matched against the token being completed */
+    std::vector<completion_t> pending;
+    size_t line_count;
+    double last_report;
+
+public:
+    completion_stream_t(completer_t *c, const wcstring &w, const wcstring &d, complete_flags_t f) :
+        completer(c),
+        wc_escaped(w),
+        desc(d),
+        flags(f),
+        line_count(0),
+        last_report(timef())
+    {
+    }
+
+    /** Matches the pending lines and adds them to the completer */
+    void flush()
+    {
+        if (! pending.empty())
+        {
+            completer->complete_strings(wc_escaped, desc.c_str(), 0, pending, flags);
+            pending.clear();
+        }
+    }
+
+    bool handle_line(const wcstring &line)
+    {
+        pending.push_back(completion_t(line));
+        return ++line_count < STREAMING_COMPLETIONS_MAX;
+    }
+
+    bool keep_going()
+    {
+        double now = timef();
+        if (now - last_report < STREAMING_COMPLETIONS_REPORT_INTERVAL)
+            return true;
+        last_report = now;
+        flush();
+        return completer->report_progress();
+    }
+};
+
 /**
    Evaluate the argument list (as supplied by complete -a) and insert
    any return matching completions. Matching is done using \c
@@ -1239,10 +1497,26 @@ void completer_t::complete_from_args(const wcstring &str,
                                      const wcstring &desc,
                                      complete_flags_t flags)
 {
+    if (this->cancelled)
+        return;
 
     std::vector<completion_t> possible_comp;
 
     bool is_autosuggest = (this->type() == COMPLETE_AUTOSUGGEST);
+
+    /* An argument list that is just one command substitution is read line by line, so that progress sees the candidates as they arrive. Without IFS the output is a single candidate, so there is nothing to stream. */
+    wchar_t *cmdsub_begin = NULL, *cmdsub_end = NULL;
+    if (! is_autosuggest && this->progress != NULL && ! env_get_string(L"IFS").missing_or_empty() &&
+            parse_util_locate_cmdsubst(args.c_str(), &cmdsub_begin, &cmdsub_end, false) > 0 &&
+            cmdsub_begin == args.c_str() && cmdsub_end + 1 == args.c_str() + args.size())
+    {
+        completion_stream_t stream(this, escape_string(str, ESCAPE_ALL), desc, flags);
+        proc_push_interactive(0);
+        exec_subshell_streaming(wcstring(cmdsub_begin + 1, cmdsub_end), &stream, true);
+        proc_pop_interactive();
+        stream.flush();
+        return;
+    }
     parser_t parser(is_autosuggest ? PARSER_TYPE_COMPLETIONS_ONLY : PARSER_TYPE_GENERAL, false /* don't show errors */);
 
     /* If type is COMPLETE_AUTOSUGGEST, it means we're on a background thread, so don't call proc_push_interactive */
@@ -1842,7 +2116,7 @@ bool completer_t::try_complete_user(const wcstring &str)
     return res;
 }
 
-void complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> &comps, completion_request_flags_t flags)
+void complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> &comps, completion_request_flags_t flags, completion_progress_t *progress)
 {
     /* Determine the innermost subcommand */
     const wchar_t *cmdsubst_begin, *cmdsubst_end;
@@ -1851,7 +2125,7 @@ void complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> &comps
     const wcstring cmd = wcstring(cmdsubst_begin, cmdsubst_end - cmdsubst_begin);
 
     /* Make our completer */
-    completer_t completer(cmd, flags);
+    completer_t completer(cmd, flags, progress);
 
     wcstring current_command;
     const size_t pos = cmd.size();
@@ -210,11 +210,35 @@ void complete_remove(const wchar_t *cmd,
                      const wchar_t *long_opt);
 
 
+/**
+   Receives the completions found so far while a completion is still
+   being computed. This is used when candidates come from a command
+   substitution like <tt>complete -a '(generator)'</tt>, whose output is
+   read incrementally, and while waiting for slow directories in $PATH
+   when completing a command name.
+*/
+class completion_progress_t
+{
+public:
+    virtual ~completion_progress_t() {}
+
+    /**
+       Called periodically with all completions found so far, in no
+       particular order. Return false to stop computing completions; the
+       running generator is then cancelled as if by control-C, and the
+       scan of $PATH is abandoned.
+    */
+    virtual bool completions_found(const std::vector<completion_t> &completions) = 0;
+};
+
 /** Find all completions of the command cmd, insert them into out.
+    If progress is not NULL, it is told about partial results while slow
+    completion generators are still running.
  */
 void complete(const wcstring &cmd,
               std::vector<completion_t> &comp,
-              completion_request_flags_t flags);
+              completion_request_flags_t flags,
+              completion_progress_t *progress = NULL);
 
 /**
    Print a list of all current completions into the string.
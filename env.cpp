@@ -57,6 +57,14 @@
 #include "complete.h"
 #include "fish_version.h"
 
+#if defined(_LIBCPP_VERSION) || __cplusplus > 199711L
+#include <unordered_map>
+using std::unordered_map;
+#else
+#include <tr1/unordered_map>
+using std::tr1::unordered_map;
+#endif
+
 /** Value denoting a null string */
 #define ENV_NULL L"\x1d"
 
@@ -79,6 +87,30 @@ extern char **__environ;
 bool g_log_forks = false;
 bool g_use_posix_spawn = false; //will usually be set to true
 
+/**
+   Hash function for variable names. The standard hash of a wide string
+   goes through it a byte at a time, which makes a lookup several times
+   slower than the string comparisons of a std::map.
+*/
+struct var_name_hash_t
+{
+    size_t operator()(const wcstring &name) const
+    {
+        size_t result = 0;
+        for (size_t i=0; i < name.size(); i++)
+        {
+            result = result * 31 + name[i];
+        }
+        return result;
+    }
+};
+
+/**
+   The variables of one scope, hashed by name. Unlike the universal
+   variable table, scopes are never listed in order, so they don't need
+   to be sorted.
+*/
+typedef unordered_map<wcstring, var_entry_t, var_name_hash_t> scope_table_t;
 
 /**
    Struct representing one level in the function variable stack
@@ -88,7 +120,7 @@ struct env_node_t
     /**
       Variable table
     */
-    var_table_t env;
+    scope_table_t env;
     /**
       Does this node imply a new variable scope? If yes, all
       non-global variables below this one in the stack are
@@ -123,6 +155,64 @@ class variable_entry_t
 
 static pthread_mutex_t env_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/**
+   Cache of the variables visible from the top scope. It maps each key
+   that has been searched for in all scopes to the innermost scope that
+   has it and its entry there, or to NULL if no local or global scope
+   does. Entries are not moved when their table grows, so a key only
+   has to be dropped when it is set or erased, or when the scope that
+   has it is popped. Pushing or popping a function scope changes which
+   local variables are visible, and drops every key.
+
+   Keys are dropped by marking them stale rather than removing them, so
+   that the next lookup of the same key after a function call does not
+   allocate. A cached value is only used if its generation is
+   visible_vars_generation. Protected by env_lock.
+*/
+struct visible_var_t
+{
+    /** The innermost visible scope that has the key, or NULL */
+    env_node_t *node;
+    /** The entry for the key in node, or NULL */
+    const var_entry_t *entry;
+    unsigned int generation;
+
+    visible_var_t() : node(NULL), entry(NULL), generation(0) { }
+};
+static unordered_map<wcstring, visible_var_t, var_name_hash_t> visible_vars;
+static unsigned int visible_vars_generation = 1;
+
+/**
+   The number of keys at which the cache of visible variables is emptied
+   instead of just being marked stale
+*/
+#define VISIBLE_VARS_MAX 4096
+
+/**
+   Mark the cached lookup of key as stale. The caller must hold env_lock.
+*/
+static void forget_visible_var(const wcstring &key)
+{
+    unordered_map<wcstring, visible_var_t, var_name_hash_t>::iterator where = visible_vars.find(key);
+    if (where != visible_vars.end())
+    {
+        where->second.generation = 0;
+    }
+}
+
+/**
+   Mark all cached lookups as stale. The caller must hold env_lock.
+*/
+static void forget_visible_vars()
+{
+    visible_vars_generation++;
+    if (visible_vars_generation == 0 || visible_vars.size() > VISIBLE_VARS_MAX)
+    {
+        visible_vars.clear();
+        visible_vars_generation = 1;
+    }
+}
+
 /** Top node on the function stack */
 static env_node_t *top = NULL;
 
@@ -140,7 +230,7 @@ static env_universal_t *uvars() {
 /**
    Table for global variables
 */
-static var_table_t *global;
+static scope_table_t *global;
 
 /* Helper class for storing constant strings, without needing to wrap them in a wcstring */
 
@@ -207,7 +297,12 @@ static const wchar_t * const locale_variable[] =
 const var_entry_t *env_node_t::find_entry(const wcstring &key)
 {
     const var_entry_t *result = NULL;
-    var_table_t::const_iterator where = env.find(key);
+    if (env.empty())
+    {
+        /* Most block scopes have no variables; don't bother hashing the key */
+        return result;
+    }
+    scope_table_t::const_iterator where = env.find(key);
     if (where != env.end())
     {
         result = &where->second;
@@ -220,6 +315,103 @@ env_node_t *env_node_t::next_scope_to_search(void)
     return this->new_scope ? global_env : this->next;
 }
 
+/**
+   Join the elements of a variable with ARRAY_SEP. Zero element arrays
+   are represented by ENV_NULL.
+*/
+static wcstring join_variable_array(const wcstring_list_t &vals)
+{
+    if (vals.empty())
+    {
+        return ENV_NULL;
+    }
+
+    size_t len = vals.size() - 1;
+    for (size_t i=0; i < vals.size(); i++)
+    {
+        len += vals.at(i).size();
+    }
+
+    wcstring result;
+    result.reserve(len);
+    for (size_t i=0; i < vals.size(); i++)
+    {
+        if (i > 0)
+        {
+            result.push_back(ARRAY_SEP);
+        }
+        result.append(vals.at(i));
+    }
+    return result;
+}
+
+bool var_entry_t::empty() const
+{
+    return ! vals || vals->empty();
+}
+
+wcstring var_entry_t::as_string() const
+{
+    return vals ? join_variable_array(*vals) : ENV_NULL;
+}
+
+void var_entry_t::set_string(const wcstring &val)
+{
+    wcstring_list_t list;
+    if (val != ENV_NULL)
+    {
+        tokenize_variable_array(val, list);
+    }
+    set_list(list);
+}
+
+shared_ptr<const wcstring_list_t> var_entry_t::as_list() const
+{
+    if (this->empty())
+    {
+        return shared_ptr<const wcstring_list_t>();
+    }
+    return vals;
+}
+
+void var_entry_t::set_list(const wcstring_list_t &list)
+{
+    /* Never modify the old list in place, since a reader may hold it */
+    if (list.empty())
+    {
+        vals.reset();
+    }
+    else
+    {
+        vals.reset(new wcstring_list_t(list));
+    }
+}
+
+void var_entry_t::append(const wcstring_list_t &list)
+{
+    if (list.empty())
+    {
+        return;
+    }
+
+    if (vals && vals.unique())
+    {
+        vals->insert(vals->end(), list.begin(), list.end());
+    }
+    else
+    {
+        /* Someone else may be looking at the elements; copy them first */
+        shared_ptr<wcstring_list_t> new_vals(new wcstring_list_t());
+        if (vals)
+        {
+            new_vals->reserve(vals->size() + list.size());
+            new_vals->insert(new_vals->end(), vals->begin(), vals->end());
+        }
+        new_vals->insert(new_vals->end(), list.begin(), list.end());
+        vals.swap(new_vals);
+    }
+}
+
 /**
    Return the current umask value.
 */
@@ -316,9 +508,30 @@ static void handle_locale()
 }
 
 
+/**
+   Bumped whenever a variable that affects highlighting changes, see env_vars_snapshot_t::get_generation
+*/
+static volatile unsigned int s_highlighting_generation = 0;
+
+/** Returns whether the given variable affects which commands and paths are valid */
+static bool var_affects_highlighting(const wcstring &key)
+{
+    for (size_t i=0; env_vars_snapshot_t::highlighting_keys[i]; i++)
+    {
+        if (key == env_vars_snapshot_t::highlighting_keys[i])
+            return true;
+    }
+    return key == L"fish_user_abbreviations";
+}
+
 /** React to modifying hte given variable */
 static void react_to_variable_change(const wcstring &key)
 {
+    if (var_affects_highlighting(key))
+    {
+        s_highlighting_generation++;
+    }
+
     if (var_is_locale(key))
     {
         handle_locale();
@@ -332,6 +545,10 @@ static void react_to_variable_change(const wcstring &key)
     {
         reader_react_to_color_change();
     }
+    else if (key == L"PATH")
+    {
+        path_reset_command_hash();
+    }
 }
 
 /**
@@ -589,25 +806,74 @@ void env_init(const struct config_paths_t *paths /* or NULL */)
 }
 
 /**
-   Search all visible scopes in order for the specified key. Return
-   the first scope in which it was found.
+   Search all visible scopes in order for the specified key, and
+   remember the result in the cache of visible variables. The caller
+   must hold env_lock.
 */
-static env_node_t *env_get_node(const wcstring &key)
+static const visible_var_t &find_visible_var(const wcstring &key)
 {
-    env_node_t *env = top;
-    while (env != NULL)
+    ASSERT_IS_LOCKED(env_lock);
+
+    unordered_map<wcstring, visible_var_t, var_name_hash_t>::iterator cached = visible_vars.find(key);
+    if (cached != visible_vars.end() && cached->second.generation == visible_vars_generation)
     {
-        if (env->find_entry(key) != NULL)
+        return cached->second;
+    }
+
+    /* Reuse a stale cache entry for the key rather than looking it up again */
+    visible_var_t &visible = (cached != visible_vars.end() ? cached->second : visible_vars[key]);
+    visible.node = top;
+    visible.entry = NULL;
+    while (visible.node != NULL)
+    {
+        visible.entry = visible.node->find_entry(key);
+        if (visible.entry != NULL)
         {
             break;
         }
 
-        env = env->next_scope_to_search();
+        visible.node = visible.node->next_scope_to_search();
     }
-    return env;
+    visible.generation = visible_vars_generation;
+    return visible;
 }
 
-int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
+/**
+   Search all visible scopes in order for the specified key. Return
+   the first scope in which it was found.
+*/
+static env_node_t *env_get_node(const wcstring &key)
+{
+    scoped_lock locker(env_lock);
+    return find_visible_var(key).node;
+}
+
+/**
+   Return the value a universal variable gets when it is set to vals,
+   or when vals is appended to it.
+*/
+static wcstring universal_value(const wcstring &key, const wcstring_list_t &vals, bool append)
+{
+    if (! append)
+    {
+        return join_variable_array(vals);
+    }
+
+    wcstring_list_t result;
+    const env_var_t old_val = uvars()->get(key);
+    if (! old_val.missing() && old_val != ENV_NULL)
+    {
+        tokenize_variable_array(old_val, result);
+    }
+    result.insert(result.end(), vals.begin(), vals.end());
+    return join_variable_array(result);
+}
+
+/**
+   Set or append to a variable. This does the work of env_set(),
+   env_set_list() and env_append().
+*/
+static int set_variable(const wcstring &key, const wcstring_list_t &vals, bool append, env_mode_flags_t var_mode)
 {
     ASSERT_IS_MAIN_THREAD();
     bool has_changed_old = has_changed_exported;
@@ -616,9 +882,10 @@ int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
 
     int is_universal = 0;
 
-    if (val && contains(key, L"PWD", L"HOME"))
+    if (! vals.empty() && ! append && contains(key, L"PWD", L"HOME"))
     {
         /* Canoncalize our path; if it changes, recurse and try again. */
+        const wcstring val = join_variable_array(vals);
         wcstring val_canonical = val;
         path_make_canonical(val_canonical);
         if (val != val_canonical)
@@ -648,10 +915,11 @@ int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
         /*
          Set the new umask
          */
-        if (val && wcslen(val))
+        const wcstring val = join_variable_array(vals);
+        if (! vals.empty() && ! val.empty())
         {
             errno=0;
-            long mask = wcstol(val, &end, 8);
+            long mask = wcstol(val.c_str(), &end, 8);
 
             if (!errno && (!*end) && (mask <= 0777) && (mask >= 0))
             {
@@ -664,15 +932,6 @@ int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
         return ENV_INVALID;
     }
 
-    /*
-     Zero element arrays are internaly not coded as null but as this
-     placeholder string
-     */
-    if (!val)
-    {
-        val = ENV_NULL;
-    }
-
     if (var_mode & ENV_UNIVERSAL)
     {
         const bool old_export = uvars() && uvars()->get_export(key);
@@ -694,7 +953,7 @@ int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
         }
         if (uvars())
         {
-            uvars()->set(key, val, new_export);
+            uvars()->set(key, universal_value(key, vals, append), new_export);
             env_universal_barrier();
             if (old_export || new_export)
             {
@@ -712,7 +971,7 @@ int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
         bool preexisting_entry_exportv = false;
         if (preexisting_node != NULL)
         {
-            var_table_t::const_iterator result = preexisting_node->env.find(key);
+            scope_table_t::const_iterator result = preexisting_node->env.find(key);
             assert(result != preexisting_node->env.end());
             const var_entry_t &entry = result->second;
             if (entry.exportv)
@@ -765,7 +1024,7 @@ int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
                     exportv = uvars()->get_export(key);
                 }
 
-                uvars()->set(key, val, exportv);
+                uvars()->set(key, universal_value(key, vals, append), exportv);
                 env_universal_barrier();
                 is_universal = 1;
 
@@ -790,7 +1049,22 @@ int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
 
         if (!done)
         {
-            // Set the entry in the node
+            /*
+             Appending to a variable that is not set in this scope
+             starts from the value that is currently visible
+             */
+            shared_ptr<const wcstring_list_t> inherited_vals;
+            if (append && node->find_entry(key) == NULL)
+            {
+                inherited_vals = env_get_list(key);
+            }
+
+            // Set the entry in the node. Other threads may read it, so lock.
+            scoped_lock locker(env_lock);
+
+            // The entry may now shadow the one that was visible before
+            forget_visible_var(key);
+
             // Note that operator[] accesses the existing entry, or creates a new one
             var_entry_t &entry = node->env[key];
             if (entry.exportv)
@@ -798,7 +1072,18 @@ int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
                 // this variable already existed, and was exported
                 has_changed_new = true;
             }
-            entry.val = val;
+            if (! append)
+            {
+                entry.set_list(vals);
+            }
+            else
+            {
+                if (inherited_vals)
+                {
+                    entry.append(*inherited_vals);
+                }
+                entry.append(vals);
+            }
             if (var_mode & ENV_EXPORT)
             {
                 // the new variable is exported
@@ -835,6 +1120,28 @@ int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
 }
 
 
+int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
+{
+    /* A null value, or the placeholder string, means zero elements */
+    wcstring_list_t vals;
+    if (val && wcscmp(val, ENV_NULL) != 0)
+    {
+        tokenize_variable_array(val, vals);
+    }
+    return set_variable(key, vals, false, var_mode);
+}
+
+int env_set_list(const wcstring &key, const wcstring_list_t &vals, env_mode_flags_t var_mode)
+{
+    return set_variable(key, vals, false, var_mode);
+}
+
+int env_append(const wcstring &key, const wcstring_list_t &vals, env_mode_flags_t var_mode)
+{
+    return set_variable(key, vals, true, var_mode);
+}
+
+
 /**
    Attempt to remove/free the specified key/value pair from the
    specified map.
@@ -848,13 +1155,15 @@ static bool try_remove(env_node_t *n, const wchar_t *key, int var_mode)
         return false;
     }
 
-    var_table_t::iterator result = n->env.find(key);
+    scope_table_t::iterator result = n->env.find(key);
     if (result != n->env.end())
     {
         if (result->second.exportv)
         {
             mark_changed_exported();
         }
+        scoped_lock locker(env_lock);
+        forget_visible_var(key);
         n->env.erase(result);
         return true;
     }
@@ -931,6 +1240,50 @@ const wchar_t *env_var_t::c_str(void) const
     return wcstring::c_str();
 }
 
+/**
+   Search the local and global scopes selected by mode for the
+   specified key, and return its entry if it matches the export flags
+   of mode. The caller must hold env_lock while using the entry.
+*/
+static const var_entry_t *find_scoped_entry(const wcstring &key, env_mode_flags_t mode)
+{
+    ASSERT_IS_LOCKED(env_lock);
+
+    const bool has_scope = mode & (ENV_LOCAL | ENV_GLOBAL | ENV_UNIVERSAL);
+    const bool search_local = !has_scope || (mode & ENV_LOCAL);
+    const bool search_global = !has_scope || (mode & ENV_GLOBAL);
+
+    const bool search_exported = (mode & ENV_EXPORT) || !(mode & ENV_UNEXPORT);
+    const bool search_unexported = (mode & ENV_UNEXPORT) || !(mode & ENV_EXPORT);
+
+    /* Searches of all scopes are answered from the cache of visible variables */
+    if (!has_scope && search_exported && search_unexported)
+    {
+        return find_visible_var(key).entry;
+    }
+
+    env_node_t *env = search_local ? top : global_env;
+    while (env != NULL)
+    {
+        const var_entry_t *entry = env->find_entry(key);
+        if (entry != NULL && (entry->exportv ? search_exported : search_unexported))
+        {
+            return entry;
+        }
+
+        if (has_scope)
+        {
+            if (!search_global || env == global_env) break;
+            env = global_env;
+        }
+        else
+        {
+            env = env->next_scope_to_search();
+        }
+    }
+    return NULL;
+}
+
 env_var_t env_get_string(const wcstring &key, env_mode_flags_t mode)
 {
     const bool has_scope = mode & (ENV_LOCAL | ENV_GLOBAL | ENV_UNIVERSAL);
@@ -982,32 +1335,16 @@ env_var_t env_get_string(const wcstring &key, env_mode_flags_t mode)
         /* Lock around a local region */
         scoped_lock lock(env_lock);
 
-        env_node_t *env = search_local ? top : global_env;
-        wcstring result;
-
-        while (env != NULL)
+        const var_entry_t *entry = find_scoped_entry(key, mode);
+        if (entry != NULL)
         {
-            const var_entry_t *entry = env->find_entry(key);
-            if (entry != NULL && (entry->exportv ? search_exported : search_unexported))
+            if (entry->empty())
             {
-                if (entry->val == ENV_NULL)
-                {
-                    return env_var_t::missing_var();
-                }
-                else
-                {
-                    return entry->val;
-                }
-            }
-
-            if (has_scope)
-            {
-                if (!search_global || env == global_env) break;
-                env = global_env;
+                return env_var_t::missing_var();
             }
             else
             {
-                env = env->next_scope_to_search();
+                return entry->as_string();
             }
         }
     }
@@ -1034,6 +1371,33 @@ env_var_t env_get_string(const wcstring &key, env_mode_flags_t mode)
     return env_var_t::missing_var();
 }
 
+shared_ptr<const wcstring_list_t> env_get_list(const wcstring &key, env_mode_flags_t mode)
+{
+    const bool has_scope = mode & (ENV_LOCAL | ENV_GLOBAL | ENV_UNIVERSAL);
+    const bool search_local = !has_scope || (mode & ENV_LOCAL);
+    const bool search_global = !has_scope || (mode & ENV_GLOBAL);
+
+    if ((search_local || search_global) && ! is_electric(key))
+    {
+        scoped_lock lock(env_lock);
+        const var_entry_t *entry = find_scoped_entry(key, mode);
+        if (entry != NULL)
+        {
+            return entry->as_list();
+        }
+    }
+
+    /* Electric and universal variables are only stored as strings */
+    shared_ptr<wcstring_list_t> result;
+    const env_var_t val = env_get_string(key, mode);
+    if (! val.missing())
+    {
+        result.reset(new wcstring_list_t());
+        tokenize_variable_array(val, *result);
+    }
+    return result;
+}
+
 bool env_exist(const wchar_t *key, env_mode_flags_t mode)
 {
     env_node_t *env;
@@ -1067,7 +1431,7 @@ bool env_exist(const wchar_t *key, env_mode_flags_t mode)
 
         while (env)
         {
-            var_table_t::iterator result = env->env.find(key);
+            scope_table_t::iterator result = env->env.find(key);
 
             if (result != env->env.end())
             {
@@ -1133,8 +1497,16 @@ void env_push(bool new_scope)
         if (local_scope_exports(top))
             mark_changed_exported();
     }
+
+    scoped_lock locker(env_lock);
     top = node;
 
+    /* A new function scope hides the local variables of its caller */
+    if (new_scope)
+    {
+        forget_visible_vars();
+    }
+
 }
 
 
@@ -1147,9 +1519,19 @@ void env_pop()
 
         env_node_t *killme = top;
 
-        for (i=0; locale_variable[i]; i++)
+        /* Local variables going out of scope may uncover other values */
+        for (scope_table_t::const_iterator iter = killme->env.begin(); iter != killme->env.end(); ++iter)
+        {
+            if (var_affects_highlighting(iter->first))
+            {
+                s_highlighting_generation++;
+                break;
+            }
+        }
+
+        for (i=0; locale_variable[i] && ! killme->env.empty(); i++)
         {
-            var_table_t::iterator result =  killme->env.find(locale_variable[i]);
+            scope_table_t::iterator result =  killme->env.find(locale_variable[i]);
             if (result != killme->env.end())
             {
                 locale_changed = 1;
@@ -1163,9 +1545,7 @@ void env_pop()
                 mark_changed_exported();
         }
 
-        top = top->next;
-
-        var_table_t::iterator iter;
+        scope_table_t::iterator iter;
         for (iter = killme->env.begin(); iter != killme->env.end(); ++iter)
         {
             const var_entry_t &entry = iter->second;
@@ -1176,7 +1556,24 @@ void env_pop()
             }
         }
 
-        delete killme;
+        {
+            scoped_lock locker(env_lock);
+            top = top->next;
+
+            /* Popping a function scope uncovers the local variables of its caller */
+            if (killme->new_scope)
+            {
+                forget_visible_vars();
+            }
+            else
+            {
+                for (iter = killme->env.begin(); iter != killme->env.end(); ++iter)
+                {
+                    forget_visible_var(iter->first);
+                }
+            }
+            delete killme;
+        }
 
         if (locale_changed)
             handle_locale();
@@ -1193,9 +1590,9 @@ void env_pop()
 /**
    Function used with to insert keys of one table into a set::set<wcstring>
 */
-static void add_key_to_string_set(const var_table_t &envs, std::set<wcstring> *str_set, bool show_exported, bool show_unexported)
+static void add_key_to_string_set(const scope_table_t &envs, std::set<wcstring> *str_set, bool show_exported, bool show_unexported)
 {
-    var_table_t::const_iterator iter;
+    scope_table_t::const_iterator iter;
     for (iter = envs.begin(); iter != envs.end(); ++iter)
     {
         const var_entry_t &e = iter->second;
@@ -1278,15 +1675,15 @@ static void get_exported(const env_node_t *n, std::map<wcstring, wcstring> &h)
     else
         get_exported(n->next, h);
 
-    var_table_t::const_iterator iter;
+    scope_table_t::const_iterator iter;
     for (iter = n->env.begin(); iter != n->env.end(); ++iter)
     {
         const wcstring &key = iter->first;
         const var_entry_t &val_entry = iter->second;
-        if (val_entry.exportv && (val_entry.val != ENV_NULL))
+        if (val_entry.exportv && ! val_entry.empty())
         {
             // Don't use std::map::insert here, since we need to overwrite existing values from previous scopes
-            h[key] = val_entry.val;
+            h[key] = val_entry.as_string();
         }
     }
 }
@@ -1368,7 +1765,7 @@ const char * const *env_export_arr(bool recalc)
     return export_array.get();
 }
 
-env_vars_snapshot_t::env_vars_snapshot_t(const wchar_t * const *keys)
+env_vars_snapshot_t::env_vars_snapshot_t(const wchar_t * const *keys) : generation(s_highlighting_generation)
 {
     ASSERT_IS_MAIN_THREAD();
     wcstring key;
@@ -1405,7 +1802,7 @@ void env_universal_barrier()
     }
 }
 
-env_vars_snapshot_t::env_vars_snapshot_t() { }
+env_vars_snapshot_t::env_vars_snapshot_t() : generation(0) { }
 
 /* The "current" variables are not a snapshot at all, but instead trampoline to env_get_string, etc. We identify the current snapshot based on pointer values. */
 static const env_vars_snapshot_t sCurrentSnapshot;
@@ -1433,4 +1830,10 @@ env_var_t env_vars_snapshot_t::get(const wcstring &key) const
     }
 }
 
+unsigned int env_vars_snapshot_t::get_generation() const
+{
+    /* The current snapshot is always up to date */
+    return this->is_current() ? s_highlighting_generation : this->generation;
+}
+
 const wchar_t * const env_vars_snapshot_t::highlighting_keys[] = {L"PATH", L"CDPATH", L"fish_function_path", NULL};
@@ -85,6 +85,22 @@ void env_init(const struct config_paths_t *paths = NULL);
 
 int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t mode);
 
+/**
+   Set the variable whose name matches key to the elements in vals. An
+   empty list sets the variable to zero elements. The scope and error
+   codes are the same as for env_set().
+*/
+int env_set_list(const wcstring &key, const wcstring_list_t &vals, env_mode_flags_t mode);
+
+/**
+   Append the elements in vals to the variable whose name matches
+   key. The elements already in the variable are not copied, unless
+   someone else holds a reference to them through env_get_list(). If
+   the variable is not yet set in the scope selected by mode, it is
+   set to its current value followed by vals. The scope and error
+   codes are the same as for env_set().
+*/
+int env_append(const wcstring &key, const wcstring_list_t &vals, env_mode_flags_t mode);
 
 /**
   Return the value of the variable with the specified name.  Returns 0
@@ -173,6 +189,18 @@ public:
 */
 env_var_t env_get_string(const wcstring &key, env_mode_flags_t mode = ENV_DEFAULT);
 
+/**
+   Gets the elements of the variable with the specified name, without
+   joining and splitting them. Returns NULL if the variable does not
+   exist or has zero elements. The returned list is shared with the
+   variable and must not be modified; it stays valid after the
+   variable changes.
+
+   \param key The name of the variable to get
+   \param mode An optional scope to search in. All scopes are searched if unset
+*/
+shared_ptr<const wcstring_list_t> env_get_list(const wcstring &key, env_mode_flags_t mode = ENV_DEFAULT);
+
 /**
    Returns true if the specified key exists. This can't be reliably done
    using env_get, since env_get returns null for 0-element arrays
@@ -222,6 +250,7 @@ wcstring env_get_pwd_slash();
 class env_vars_snapshot_t
 {
     std::map<wcstring, wcstring> vars;
+    unsigned int generation;
     bool is_current() const;
 
 public:
@@ -230,6 +259,9 @@ public:
 
     env_var_t get(const wcstring &key) const;
 
+    // Returns a number that changes whenever one of the highlighting_keys (or the abbreviations) changes, as of when the snapshot was taken
+    unsigned int get_generation() const;
+
     // Returns the fake snapshot representing the live variables array
     static const env_vars_snapshot_t &current();
 
@@ -243,15 +275,40 @@ extern int g_fork_count;
 extern bool g_use_posix_spawn;
 
 /**
- A variable entry. Stores the value of a variable and whether it
- should be exported.
+ A variable entry. Stores the elements of a variable and whether it
+ should be exported. The elements are kept as a list, so that
+ indexing and appending do not need to split the value; the joined
+ form is only built when it is asked for, e.g. for exporting. The list
+ is shared with the readers returned by as_list(), and is copied
+ before modification only if such a reader still holds it.
  */
-struct var_entry_t
+class var_entry_t
 {
-    wcstring val; /**< The value of the variable */
+    /** The elements of the variable, or NULL if it has none */
+    shared_ptr<wcstring_list_t> vals;
+
+public:
     bool exportv; /**< Whether the variable should be exported */
     
     var_entry_t() : exportv(false) { }
+
+    /** Returns whether the variable has zero elements */
+    bool empty() const;
+
+    /** Returns the elements joined with ARRAY_SEP, or ENV_NULL if there are none */
+    wcstring as_string() const;
+
+    /** Sets the elements by splitting val on ARRAY_SEP. ENV_NULL means zero elements. */
+    void set_string(const wcstring &val);
+
+    /** Returns the elements, or NULL if there are none */
+    shared_ptr<const wcstring_list_t> as_list() const;
+
+    /** Replaces the elements with a copy of list */
+    void set_list(const wcstring_list_t &list);
+
+    /** Appends the elements in list */
+    void append(const wcstring_list_t &list);
 };
 
 typedef std::map<wcstring, var_entry_t> var_table_t;
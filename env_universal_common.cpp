@@ -285,7 +285,7 @@ env_var_t env_universal_t::get(const wcstring &name) const
     var_table_t::const_iterator where = vars.find(name);
     if (where != vars.end())
     {
-        result = where->second.val;
+        result = where->second.as_string();
     }
     return result;
 }
@@ -312,9 +312,9 @@ void env_universal_t::set_internal(const wcstring &key, const wcstring &val, boo
     }
     
     var_entry_t *entry = &vars[key];
-    if (entry->exportv != exportv || entry->val != val)
+    if (entry->exportv != exportv || entry->as_string() != val)
     {
-        entry->val = val;
+        entry->set_string(val);
         entry->exportv = exportv;
         
         /* If we are overwriting, then this is now modified */
@@ -402,10 +402,10 @@ void env_universal_t::generate_callbacks(const var_table_t &new_vars, callback_d
         /* See if the value has changed */
         const var_entry_t &new_entry = iter->second;
         var_table_t::const_iterator existing = this->vars.find(key);
-        if (existing == this->vars.end() || existing->second.exportv != new_entry.exportv || existing->second.val != new_entry.val)
+        if (existing == this->vars.end() || existing->second.exportv != new_entry.exportv || existing->second.as_string() != new_entry.as_string())
         {
             /* Value has changed */
-            callbacks->push_back(callback_data_t(new_entry.exportv ? SET_EXPORT : SET, key, new_entry.val));
+            callbacks->push_back(callback_data_t(new_entry.exportv ? SET_EXPORT : SET, key, new_entry.as_string()));
         }
     }
 }
@@ -425,11 +425,8 @@ void env_universal_t::acquire_variables(var_table_t *vars_to_acquire)
         }
         else
         {
-            /* The value has been modified. Copy it over. Note we can destructively modify the source entry in vars since we are about to get rid of this->vars entirely. */
-            var_entry_t &src = src_iter->second;
-            var_entry_t &dst = (*vars_to_acquire)[key];
-            dst.val.swap(src.val);
-            dst.exportv = src.exportv;
+            /* The value has been modified. Copy it over. Entries share their elements, so this does not copy the value itself. */
+            (*vars_to_acquire)[key] = src_iter->second;
         }
     }
     
@@ -510,7 +507,7 @@ bool env_universal_t::write_to_fd(int fd, const wcstring &path)
         // Append the entry. Note that append_file_entry may fail, but that only affects one variable; soldier on.
         const wcstring &key = iter->first;
         const var_entry_t &entry = iter->second;
-        append_file_entry(entry.exportv ? SET_EXPORT : SET, key, entry.val, &contents, &storage);
+        append_file_entry(entry.exportv ? SET_EXPORT : SET, key, entry.as_string(), &contents, &storage);
         
         // Go to next
         ++iter;
@@ -938,7 +935,7 @@ void env_universal_t::parse_message_internal(const wcstring &msgstr, var_table_t
             {
                 var_entry_t &entry = (*vars)[key];
                 entry.exportv = exportv;
-                entry.val.swap(val); //acquire the value
+                entry.set_string(val);
             }
         }
         else
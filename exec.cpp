@@ -498,6 +498,7 @@ static bool io_transmogrify(const io_chain_t &in_chain, io_chain_t *out_chain, s
    passing to eval, call eval, and clean up morphed redirections.
 
    \param def the code to evaluate, or the empty string if none
+   \param parsed_def the already parsed code to evaluate, or an empty reference if none. If set, this is used instead of def.
    \param node_offset the offset of the node to evalute, or NODE_OFFSET_INVALID
    \param block_type the type of block to push on evaluation
    \param io the io redirections to be performed on this block
@@ -505,6 +506,7 @@ static bool io_transmogrify(const io_chain_t &in_chain, io_chain_t *out_chain, s
 
 static void internal_exec_helper(parser_t &parser,
                                  const wcstring &def,
+                                 const parsed_source_ref_t &parsed_def,
                                  node_offset_t node_offset,
                                  enum block_type_t block_type,
                                  const io_chain_t &ios)
@@ -530,7 +532,11 @@ static void internal_exec_helper(parser_t &parser,
 
     signal_unblock();
 
-    if (node_offset == NODE_OFFSET_INVALID)
+    if (parsed_def.get() != NULL)
+    {
+        parser.eval(parsed_def, morphed_chain, block_type);
+    }
+    else if (node_offset == NODE_OFFSET_INVALID)
     {
         parser.eval(def, morphed_chain, block_type);
     }
@@ -547,6 +553,153 @@ static void internal_exec_helper(parser_t &parser,
     is_block=is_block_old;
 }
 
+/**
+   Run a function or block process inside this shell, with the given IO
+   chain. Signals must be blocked.
+*/
+static void exec_block_or_function_process(parser_t &parser, process_t *p, const io_chain_t &io_chain)
+{
+    switch (p->type)
+    {
+        case INTERNAL_FUNCTION:
+        {
+            /*
+              Calls to function_get_definition might need to
+              source a file as a part of autoloading, hence there
+              must be no blocks.
+            */
+
+            signal_unblock();
+            wcstring def;
+            parsed_source_ref_t parsed_def;
+            bool function_exists = function_get_definition(p->argv0(), &def) && function_get_parsed_definition(p->argv0(), &parsed_def);
+
+            wcstring_list_t named_arguments = function_get_named_arguments(p->argv0());
+            bool shadows = function_get_shadows(p->argv0());
+
+            signal_block();
+
+            if (! function_exists)
+            {
+                debug(0, _(L"Unknown function '%ls'"), p->argv0());
+                break;
+            }
+            function_block_t *newv = new function_block_t(p, p->argv0(), shadows);
+            parser.push_block(newv);
+
+            /*
+              set_argv might trigger an event
+              handler, hence we need to unblock
+              signals.
+            */
+            signal_unblock();
+            parse_util_set_argv(p->get_argv()+1, named_arguments);
+            signal_block();
+
+            parser.forbid_function(p->argv0());
+
+            internal_exec_helper(parser, def, parsed_def, NODE_OFFSET_INVALID, TOP, io_chain);
+
+            parser.allow_function();
+            parser.pop_block();
+            break;
+        }
+
+        case INTERNAL_BLOCK:
+        {
+            /* The block contents (as in, fish code) are stored in argv0 (ugh) */
+            assert(p->argv0() != NULL);
+            internal_exec_helper(parser, p->argv0(), parsed_source_ref_t(), NODE_OFFSET_INVALID, TOP, io_chain);
+            break;
+        }
+
+        case INTERNAL_BLOCK_NODE:
+        {
+            internal_exec_helper(parser, wcstring(), parsed_source_ref_t(), p->internal_block_node, TOP, io_chain);
+            break;
+        }
+
+        default:
+        {
+            assert(0 && "Not a function or block process");
+            break;
+        }
+    }
+}
+
+/**
+   Returns the function or block process in the job that may write
+   straight into the pipe to the next process, or NULL if there is none.
+
+   Normally the output of a function or block in a pipeline is buffered
+   in full, and only written once it has finished, because the processes
+   after it have not been started yet. If every process after it is
+   external, they can be started first instead, so that they consume its
+   output while it runs. This can only be done for one process per job:
+   the last one that is not external.
+
+   It is not done if the job writes into a buffer, e.g. in a command
+   substitution, since we drain those buffers only while waiting for the
+   job, and the streamed process runs before that.
+
+   Nor is it done if the job is given the terminal. The jobs inside the
+   streamed process would take the terminal from the processes after it,
+   and give it back to fish rather than to them, so they would stop as
+   soon as they used it.
+*/
+static process_t *get_streamed_process(const job_t *j, const io_chain_t &all_ios)
+{
+    if (job_get_flag(j, JOB_TERMINAL) && job_get_flag(j, JOB_FOREGROUND))
+        return NULL;
+
+    for (size_t idx = 0; idx < all_ios.size(); idx++)
+    {
+        if (all_ios.at(idx)->io_mode == IO_BUFFER)
+            return NULL;
+    }
+
+    process_t *result = NULL;
+    for (process_t *p = j->first_process; p; p = p->next)
+    {
+        if (p->type == EXTERNAL)
+            continue;
+
+        bool is_block_or_function = (p->type == INTERNAL_FUNCTION || p->type == INTERNAL_BLOCK || p->type == INTERNAL_BLOCK_NODE);
+        result = (is_block_or_function && p->next != NULL) ? p : NULL;
+    }
+    return result;
+}
+
+/**
+   Lets a builtin write its stdout while it runs, if its output would be
+   written by this process once it returns: when it is the last process
+   in the job and stdout is not a file we must open. Otherwise a forked
+   process writes the output, and it is collected as usual.
+*/
+static void set_builtin_stdout_stream(const process_t *p, io_chain_t &io_chain)
+{
+    const shared_ptr<io_data_t> stdout_io = io_chain.get_io_for_fd(STDOUT_FILENO);
+    const shared_ptr<io_data_t> stderr_io = io_chain.get_io_for_fd(STDERR_FILENO);
+    if (p->next != NULL || redirection_is_to_real_file(stdout_io.get()) || redirection_is_to_real_file(stderr_io.get()))
+        return;
+
+    if (stdout_io.get() == NULL)
+    {
+        builtin_set_stdout_stream(STDOUT_FILENO, NULL);
+    }
+    else if (stdout_io->io_mode == IO_BUFFER)
+    {
+        CAST_INIT(io_buffer_t *, io_buffer, stdout_io.get());
+        builtin_set_stdout_stream(-1, io_buffer);
+    }
+    else if (stdout_io->io_mode == IO_PIPE)
+    {
+        /* Only a streamed function or block gives its builtins a pipe as stdout, and the process reading it is already running */
+        CAST_INIT(io_pipe_t *, io_pipe, stdout_io.get());
+        builtin_set_stdout_stream(io_pipe->pipe_fd[1], NULL);
+    }
+}
+
 /* Returns whether we can use posix spawn for a given process in a given job.
  Per https://github.com/fish-shell/fish-shell/issues/364 , error handling for file redirections is too difficult with posix_spawn,
  so in that case we use fork/exec.
@@ -741,6 +894,12 @@ void exec_job(parser_t &parser, job_t *j)
     */
 
     int pipe_current_read = -1, pipe_current_write = -1, pipe_next_read = -1;
+
+    /* The process whose output streams into the rest of the pipeline, which is run after the loop, along with the IO chain and pipe ends it gets */
+    process_t * const streamed_process = get_streamed_process(j, all_ios);
+    io_chain_t streamed_io_chain;
+    int streamed_read = -1, streamed_write = -1;
+
     for (process_t *p=j->first_process; p; p = p->next)
     {
         /* The IO chain for this process. It starts with the block IO, then pipes, and then gets any from the process */
@@ -847,105 +1006,45 @@ void exec_job(parser_t &parser, job_t *j)
         //fprintf(stderr, "before IO: ");
         //io_print(j->io);
 
+        if (p == streamed_process)
+        {
+            /* Hold on to the pipe ends until the process has run; the read end of its output pipe belongs to the next process */
+            pipe_write->pipe_fd[0] = -1;
+            streamed_io_chain = process_net_io_chain;
+            streamed_read = pipe_current_read;
+            streamed_write = pipe_current_write;
+            pipe_current_read = -1;
+            pipe_current_write = -1;
+            continue;
+        }
+
         // This is the IO buffer we use for storing the output of a block or function when it is in a pipeline
         shared_ptr<io_buffer_t> block_output_io_buffer;
         switch (p->type)
         {
             case INTERNAL_FUNCTION:
-            {
-                /*
-                  Calls to function_get_definition might need to
-                  source a file as a part of autoloading, hence there
-                  must be no blocks.
-                */
-
-                signal_unblock();
-                wcstring def;
-                bool function_exists = function_get_definition(p->argv0(), &def);
-
-                wcstring_list_t named_arguments = function_get_named_arguments(p->argv0());
-                bool shadows = function_get_shadows(p->argv0());
-
-                signal_block();
-
-                if (! function_exists)
-                {
-                    debug(0, _(L"Unknown function '%ls'"), p->argv0());
-                    break;
-                }
-                function_block_t *newv = new function_block_t(p, p->argv0(), shadows);
-                parser.push_block(newv);
-
-                /*
-                  set_argv might trigger an event
-                  handler, hence we need to unblock
-                  signals.
-                */
-                signal_unblock();
-                parse_util_set_argv(p->get_argv()+1, named_arguments);
-                signal_block();
-
-                parser.forbid_function(p->argv0());
-
-                if (p->next)
-                {
-                    // Be careful to handle failure, e.g. too many open fds
-                    block_output_io_buffer.reset(io_buffer_t::create(STDOUT_FILENO));
-                    if (block_output_io_buffer.get() == NULL)
-                    {
-                        exec_error = true;
-                        job_mark_process_as_failed(j, p);
-                    }
-                    else
-                    {
-                        /* This looks sketchy, because we're adding this io buffer locally - they aren't in the process or job redirection list. Therefore select_try won't be able to read them. However we call block_output_io_buffer->read() below, which reads until EOF. So there's no need to select on this. */
-                        process_net_io_chain.push_back(block_output_io_buffer);
-                    }
-                }
-
-                if (! exec_error)
-                {
-                    internal_exec_helper(parser, def, NODE_OFFSET_INVALID, TOP, process_net_io_chain);
-                }
-
-                parser.allow_function();
-                parser.pop_block();
-
-                break;
-            }
-
             case INTERNAL_BLOCK:
             case INTERNAL_BLOCK_NODE:
             {
                 if (p->next)
                 {
+                    // Be careful to handle failure, e.g. too many open fds
                     block_output_io_buffer.reset(io_buffer_t::create(STDOUT_FILENO));
                     if (block_output_io_buffer.get() == NULL)
                     {
-                        /* We failed (e.g. no more fds could be created). */
                         exec_error = true;
                         job_mark_process_as_failed(j, p);
                     }
                     else
                     {
-                        /* See the comment above about it's OK to add an IO redirection to this local buffer, even though it won't be handled in select_try */
+                        /* This looks sketchy, because we're adding this io buffer locally - they aren't in the process or job redirection list. Therefore select_try won't be able to read them. However we call block_output_io_buffer->read() below, which reads until EOF. So there's no need to select on this. */
                         process_net_io_chain.push_back(block_output_io_buffer);
                     }
                 }
 
                 if (! exec_error)
                 {
-                    if (p->type == INTERNAL_BLOCK)
-                    {
-                        /* The block contents (as in, fish code) are stored in argv0 (ugh) */
-                        assert(p->argv0() != NULL);
-                        internal_exec_helper(parser, p->argv0(), NODE_OFFSET_INVALID, TOP, process_net_io_chain);
-                    }
-                    else
-                    {
-                        assert(p->type == INTERNAL_BLOCK_NODE);
-                        internal_exec_helper(parser, wcstring(), p->internal_block_node, TOP, process_net_io_chain);
-                    }
+                    exec_block_or_function_process(parser, p, process_net_io_chain);
                 }
                 break;
             }
@@ -1064,6 +1163,8 @@ void exec_job(parser_t &parser, job_t *j)
                     builtin_out_redirect = has_fd(process_net_io_chain, STDOUT_FILENO);
                     builtin_err_redirect = has_fd(process_net_io_chain, STDERR_FILENO);
 
+                    set_builtin_stdout_stream(p, process_net_io_chain);
+
                     const int fg = job_get_flag(j, JOB_FOREGROUND);
                     job_set_flag(j, JOB_FOREGROUND, 0);
 
@@ -1286,6 +1387,19 @@ void exec_job(parser_t &parser, job_t *j)
                             io_buffer->out_buffer_append(res.data(), res.size());
                             fork_was_skipped = true;
                         }
+                        else if (no_stderr_output && stdout_io && stdout_io->io_mode == IO_PIPE)
+                        {
+                            /* The builtin is inside a streamed function or block (see get_streamed_process), so its stdout is a pipe to a process that is already running. Write to it directly; this blocks until that process catches up, and fails harmlessly if it has exited. */
+                            if (g_log_forks)
+                            {
+                                printf("fork #-: Skipping fork due to piped output for internal builtin for '%ls'\n", p->argv0());
+                            }
+
+                            CAST_INIT(io_pipe_t *, io_pipe, stdout_io.get());
+                            const std::string res = wcs2string(get_stdout_buffer());
+                            write_loop(io_pipe->pipe_fd[1], res.data(), res.size());
+                            fork_was_skipped = true;
+                        }
                         else if (stdout_io.get() == NULL && stderr_io.get() == NULL)
                         {
                             /* We are writing to normal stdout and stderr. Just do it - no need to fork. */
@@ -1497,6 +1611,21 @@ void exec_job(parser_t &parser, job_t *j)
         }
     }
 
+    /* Now that the processes after it are running, run the streamed process. Closing its pipe ends afterwards lets the next process see the end of its output. */
+    if (streamed_process != NULL)
+    {
+        if (! exec_error)
+        {
+            exec_block_or_function_process(parser, streamed_process, streamed_io_chain);
+            streamed_process->completed = 1;
+        }
+        streamed_io_chain.clear();
+        if (streamed_read >= 0)
+            exec_close(streamed_read);
+        if (streamed_write >= 0)
+            exec_close(streamed_write);
+    }
+
     /* Clean up any file descriptors we left open */
     if (pipe_current_read >= 0)
         exec_close(pipe_current_read);
@@ -1535,7 +1664,73 @@ void exec_job(parser_t &parser, job_t *j)
 }
 
 
-static int exec_subshell_internal(const wcstring &cmd, wcstring_list_t *lst, bool apply_exit_status)
+/**
+   Splits the output of a command substitution into lines as it arrives, for exec_subshell_streaming
+*/
+class subshell_line_splitter_t : public io_buffer_listener_t
+{
+    subshell_line_handler_t * const handler;
+    bool stopped;
+
+    /* How many blocks the parser had before the command started. Only the blocks above these belong to the command; the ones below may be a script that is completing, e.g. in read -s. */
+    const size_t block_depth;
+
+    /* Stop the command, if the handler wants no more */
+    bool stop_if(bool stop)
+    {
+        if (stop && ! stopped)
+        {
+            stopped = true;
+            parser_t &parser = parser_t::principal_parser();
+            for (size_t i=0; i + block_depth < parser.block_count(); i++)
+            {
+                parser.block_at_index(i)->skip = true;
+            }
+        }
+        return ! stopped;
+    }
+
+public:
+    subshell_line_splitter_t(subshell_line_handler_t *h, size_t depth) : handler(h), stopped(false), block_depth(depth)
+    {
+    }
+
+    /* Hand each complete line in the buffer to the handler, and drop it from the buffer */
+    virtual bool output_available(io_buffer_t *buffer)
+    {
+        const char *begin = buffer->out_buffer_ptr();
+        const char *end = begin + buffer->out_buffer_size();
+        const char *cursor = begin;
+        wcstring line;
+        while (! stopped && cursor < end)
+        {
+            const char *stop = (const char *)memchr(cursor, '\n', end - cursor);
+            if (stop == NULL)
+                break;
+
+            line.clear();
+            str2wcstring_append(&line, cursor, stop - cursor);
+            cursor = stop + 1;
+            stop_if(! handler->handle_line(line));
+        }
+        buffer->out_buffer_consume(cursor - begin);
+        return stop_if(! handler->keep_going());
+    }
+
+    /* Hand over the last line, which may lack a newline, once the command has finished */
+    void finish(io_buffer_t *buffer)
+    {
+        this->output_available(buffer);
+        if (! stopped && buffer->out_buffer_size() > 0)
+        {
+            wcstring line;
+            str2wcstring_append(&line, buffer->out_buffer_ptr(), buffer->out_buffer_size());
+            handler->handle_line(line);
+        }
+    }
+};
+
+static int exec_subshell_internal(const wcstring &cmd, wcstring_list_t *lst, bool apply_exit_status, subshell_line_handler_t *handler = NULL)
 {
     ASSERT_IS_MAIN_THREAD();
     int prev_subshell = is_subshell;
@@ -1561,12 +1756,24 @@ static int exec_subshell_internal(const wcstring &cmd, wcstring_list_t *lst, boo
     if (io_buffer.get() != NULL)
     {
         parser_t &parser = parser_t::principal_parser();
+        subshell_line_splitter_t splitter(handler, parser.block_count());
+        if (handler != NULL)
+        {
+            io_buffer->set_listener(&splitter);
+        }
+
         if (parser.eval(cmd, io_chain_t(io_buffer), SUBST) == 0)
         {
             subcommand_status = proc_get_last_status();
         }
 
         io_buffer->read();
+
+        if (handler != NULL)
+        {
+            splitter.finish(io_buffer.get());
+            io_buffer->set_listener(NULL);
+        }
     }
 
     // If the caller asked us to preserve the exit status, restore the old status
@@ -1582,6 +1789,15 @@ static int exec_subshell_internal(const wcstring &cmd, wcstring_list_t *lst, boo
         const char *end = begin + io_buffer->out_buffer_size();
         if (split_output)
         {
+            // Count the lines first, so the list is allocated once and never copies its strings as it grows
+            size_t line_count = 0;
+            for (const char *cursor = begin; cursor < end; line_count++)
+            {
+                const char *stop = (const char *)memchr(cursor, '\n', end - cursor);
+                cursor = (stop ? stop + 1 : end);
+            }
+            lst->reserve(lst->size() + line_count);
+
             const char *cursor = begin;
             while (cursor < end)
             {
@@ -1594,8 +1810,9 @@ static int exec_subshell_internal(const wcstring &cmd, wcstring_list_t *lst, boo
                     stop = end;
                 }
                 // Stop now points at the first character we do not want to copy
-                const wcstring wc = str2wcstring(cursor, stop - cursor);
-                lst->push_back(wc);
+                // Decode it straight into its slot in the list, rather than into a temporary
+                lst->push_back(wcstring());
+                str2wcstring_append(&lst->back(), cursor, stop - cursor);
 
                 // If we hit a separator, skip over it; otherwise we're at the end
                 cursor = stop + (hit_separator ? 1 : 0);
@@ -1608,8 +1825,8 @@ static int exec_subshell_internal(const wcstring &cmd, wcstring_list_t *lst, boo
             {
                 --end;
             }
-            const wcstring wc = str2wcstring(begin, end - begin);
-            lst->push_back(wc);
+            lst->push_back(wcstring());
+            str2wcstring_append(&lst->back(), begin, end - begin);
         }
     }
 
@@ -1627,3 +1844,10 @@ int exec_subshell(const wcstring &cmd, bool apply_exit_status)
     ASSERT_IS_MAIN_THREAD();
     return exec_subshell_internal(cmd, NULL, apply_exit_status);
 }
+
+int exec_subshell_streaming(const wcstring &cmd, subshell_line_handler_t *handler, bool apply_exit_status)
+{
+    ASSERT_IS_MAIN_THREAD();
+    assert(handler != NULL);
+    return exec_subshell_internal(cmd, NULL, apply_exit_status, handler);
+}
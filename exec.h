@@ -57,6 +57,38 @@ void exec_job(parser_t &parser, job_t *j);
 int exec_subshell(const wcstring &cmd, std::vector<wcstring> &outputs, bool preserve_exit_status);
 int exec_subshell(const wcstring &cmd, bool preserve_exit_status);
 
+/**
+  Receives the lines of output of exec_subshell_streaming as they are produced
+*/
+class subshell_line_handler_t
+{
+public:
+    virtual ~subshell_line_handler_t() {}
+
+    /** Called with each line of output, without its newline. Returns false if no more lines are wanted. */
+    virtual bool handle_line(const wcstring &line) = 0;
+
+    /** Called every so often while the command runs, even if it produces no output. Returns false to stop it. */
+    virtual bool keep_going()
+    {
+        return true;
+    }
+};
+
+/**
+  Evaluate the expression cmd in a subshell like exec_subshell, but pass
+  each line of output to handler as soon as it is written, instead of
+  collecting them. The output is always split into lines.
+
+  If the handler wants no more lines, the rest of the output is discarded,
+  and the command is cancelled: its external commands get SIGPIPE, and the
+  blocks it pushed are skipped. Blocks that were already running, such as
+  a script calling read -s, carry on.
+
+  \return the status of the last job to exit, or -1 if en error was encountered.
+*/
+int exec_subshell_streaming(const wcstring &cmd, subshell_line_handler_t *handler, bool preserve_exit_status);
+
 
 /**
    Loops over close until the syscall was run without being
@@ -172,13 +172,14 @@ static void append_cmdsub_error(parse_error_list_t *errors, size_t source_start,
 
 
 /**
-   Return the environment variable value for the string starting at \c in.
+   Return the elements of the environment variable named by the string
+   starting at \c in, or NULL if it is missing or has no elements.
 */
-static env_var_t expand_var(const wchar_t *in)
+static shared_ptr<const wcstring_list_t> expand_var(const wchar_t *in)
 {
     if (!in)
-        return env_var_t::missing_var();
-    return env_get_string(in);
+        return shared_ptr<const wcstring_list_t>();
+    return env_get_list(in);
 }
 
 /**
@@ -1122,25 +1123,22 @@ static int expand_variables(parser_t &parser, const wcstring &instr, std::vector
             }
 
             var_tmp.append(instr, start_pos, var_len);
-            env_var_t var_val;
-            if (var_len == 1 && var_tmp[0] == VARIABLE_EXPAND_EMPTY)
+            shared_ptr<const wcstring_list_t> var_vals;
+            if (!(var_len == 1 && var_tmp[0] == VARIABLE_EXPAND_EMPTY))
             {
-                var_val = env_var_t::missing_var();
-            }
-            else
-            {
-                var_val = expand_var(var_tmp.c_str());
+                var_vals = expand_var(var_tmp.c_str());
             }
 
-            if (! var_val.missing())
+            if (var_vals)
             {
                 int all_vars=1;
+
+                /* The elements to expand to. This is the variable itself, unless a slice selects some of them into var_item_list. */
+                const wcstring_list_t *items = var_vals.get();
                 wcstring_list_t var_item_list;
 
                 if (is_ok)
                 {
-                    tokenize_variable_array(var_val, var_item_list);
-
                     const size_t slice_start = stop_pos;
                     if (slice_start < insize && instr.at(slice_start) == L'[')
                     {
@@ -1148,7 +1146,7 @@ static int expand_variables(parser_t &parser, const wcstring &instr, std::vector
                         size_t bad_pos;
                         all_vars=0;
                         const wchar_t *in = instr.c_str();
-                        bad_pos = parse_slice(in + slice_start, &slice_end, var_idx_list, var_pos_list, var_item_list.size());
+                        bad_pos = parse_slice(in + slice_start, &slice_end, var_idx_list, var_pos_list, var_vals->size());
                         if (bad_pos != 0)
                         {
                             append_syntax_error(errors,
@@ -1167,7 +1165,7 @@ static int expand_variables(parser_t &parser, const wcstring &instr, std::vector
                         {
                             long tmp = var_idx_list.at(j);
                             /* Check that we are within array bounds. If not, truncate the list to exit. */
-                            if (tmp < 1 || (size_t)tmp > var_item_list.size())
+                            if (tmp < 1 || (size_t)tmp > var_vals->size())
                             {
                                 size_t var_src_pos = var_pos_list.at(j);
                                 /* The slice was parsed starting at stop_pos, so we have to add that to the error position */
@@ -1182,12 +1180,13 @@ static int expand_variables(parser_t &parser, const wcstring &instr, std::vector
                             {
                                 /* Replace each index in var_idx_list inplace with the string value at the specified index */
                                 //al_set( var_idx_list, j, wcsdup((const wchar_t *)al_get( &var_item_list, tmp-1 ) ) );
-                                string_values.at(j) = var_item_list.at(tmp-1);
+                                string_values.at(j) = var_vals->at(tmp-1);
                             }
                         }
 
                         // string_values is the new var_item_list
                         var_item_list.swap(string_values);
+                        items = &var_item_list;
                     }
                 }
 
@@ -1202,16 +1201,16 @@ static int expand_variables(parser_t &parser, const wcstring &instr, std::vector
                             {
                                 res.push_back(INTERNAL_SEPARATOR);
                             }
-                            else if (var_item_list.empty() || var_item_list.front().empty())
+                            else if (items->empty() || items->front().empty())
                             {
                                 // first expansion is empty, but we need to recursively expand
                                 res.push_back(VARIABLE_EXPAND_EMPTY);
                             }
                         }
 
-                        for (size_t j=0; j<var_item_list.size(); j++)
+                        for (size_t j=0; j<items->size(); j++)
                         {
-                            const wcstring &next = var_item_list.at(j);
+                            const wcstring &next = items->at(j);
                             if (is_ok)
                             {
                                 if (j != 0)
@@ -1225,9 +1224,9 @@ static int expand_variables(parser_t &parser, const wcstring &instr, std::vector
                     }
                     else
                     {
-                        for (size_t j=0; j<var_item_list.size(); j++)
+                        for (size_t j=0; j<items->size(); j++)
                         {
-                            const wcstring &next = var_item_list.at(j);
+                            const wcstring &next = items->at(j);
                             if (is_ok && (i == 0) && stop_pos == insize)
                             {
                                 append_completion(out, next);
@@ -1537,7 +1536,7 @@ static int expand_cmdsubst(parser_t &parser, const wcstring &input, std::vector<
                 //        debug( 0, L"Pushing item '%ls' with index %d onto sliced result", al_get( sub_res, idx ), idx );
                 //sub_res[idx] = 0; // ??
             }
-            sub_res = sub_res2;
+            sub_res.swap(sub_res2);
         }
     }
 
@@ -16,6 +16,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <libgen.h>
@@ -54,6 +55,7 @@
 #include "exec.h"
 #include "event.h"
 #include "path.h"
+#include "wildcard.h"
 #include "history.h"
 #include "highlight.h"
 #include "iothread.h"
@@ -544,6 +546,298 @@ static void test_iothread(void)
     delete int_ptr;
 }
 
+/* A task that notes the time it takes to get from the main thread, to a worker, and back */
+class iothread_round_trip_task_t : public iothread_task_t
+{
+    const double start;
+    double *total_latency;
+    size_t *completed_count;
+
+public:
+    iothread_round_trip_task_t(double *latency, size_t *count) : start(timef()), total_latency(latency), completed_count(count)
+    {
+    }
+
+    int perform()
+    {
+        return 0;
+    }
+
+    void completed(int result)
+    {
+        *total_latency += timef() - start;
+        *completed_count += 1;
+    }
+};
+
+/* Services completions until the given number of tasks have completed. Returns the number of wakeups it took. */
+static size_t iothread_service_until(const size_t *completed_count, size_t target)
+{
+    size_t wakeups = 0;
+    const int fd = iothread_port();
+    while (*completed_count < target)
+    {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        if (select(fd + 1, &fds, NULL, NULL, NULL) > 0)
+        {
+            iothread_service_completion();
+            wakeups++;
+        }
+    }
+    return wakeups;
+}
+
+static void test_iothread_round_trip(void)
+{
+    say(L"Testing iothread round trips");
+    const size_t task_count = 10000;
+
+    /* One task at a time, which measures the latency of an idle pool */
+    double serial_latency = 0;
+    size_t serial_count = 0;
+    for (size_t i=0; i < task_count; i++)
+    {
+        iothread_perform_task(new iothread_round_trip_task_t(&serial_latency, &serial_count), IOTHREAD_PRIORITY_DEFAULT);
+        iothread_service_until(&serial_count, i + 1);
+    }
+
+    /* All at once, where completions should share wakeups */
+    double burst_latency = 0;
+    size_t burst_count = 0;
+    double start = timef();
+    for (size_t i=0; i < task_count; i++)
+    {
+        iothread_perform_task(new iothread_round_trip_task_t(&burst_latency, &burst_count), IOTHREAD_PRIORITY_DEFAULT);
+    }
+    size_t burst_wakeups = iothread_service_until(&burst_count, task_count);
+    double end = timef();
+    iothread_drain_all();
+
+    if (serial_count != task_count || burst_count != task_count)
+    {
+        err(L"Expected %lu round trips, but got %lu and %lu", (unsigned long)task_count, (unsigned long)serial_count, (unsigned long)burst_count);
+    }
+    if (burst_wakeups > task_count)
+    {
+        err(L"Needed %lu wakeups for %lu tasks", (unsigned long)burst_wakeups, (unsigned long)task_count);
+    }
+
+    say(L"    (%lu tasks: %.02f usec per round trip one at a time; %.02f msec in a burst, with %lu wakeups)",
+        (unsigned long)task_count,
+        serial_latency * 1E6 / task_count,
+        (end - start) * 1000.0,
+        (unsigned long)burst_wakeups);
+}
+
+/* Shared state for the iothread priority and cancellation tests. Everything is protected by the lock. */
+struct iothread_test_state_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t condition;
+
+    /* How many blocking tasks have started, and how many more may finish */
+    size_t blockers_started;
+    size_t blocker_releases;
+
+    /* The names of the recording tasks, in the order they were performed */
+    wcstring performed;
+    size_t completed_count;
+    size_t destroyed_count;
+
+    iothread_test_state_t() : blockers_started(0), blocker_releases(0), completed_count(0), destroyed_count(0)
+    {
+        VOMIT_ON_FAILURE(pthread_mutex_init(&lock, NULL));
+        VOMIT_ON_FAILURE(pthread_cond_init(&condition, NULL));
+    }
+
+    ~iothread_test_state_t()
+    {
+        VOMIT_ON_FAILURE(pthread_cond_destroy(&condition));
+        VOMIT_ON_FAILURE(pthread_mutex_destroy(&lock));
+    }
+
+    /* Waits until the value at the given address is at least the given value */
+    void wait_for(const size_t *value, size_t target)
+    {
+        scoped_lock locker(lock);
+        while (*value < target)
+        {
+            VOMIT_ON_FAILURE(pthread_cond_wait(&condition, &lock));
+        }
+    }
+
+    void release_blockers(size_t count)
+    {
+        scoped_lock locker(lock);
+        blocker_releases += count;
+        VOMIT_ON_FAILURE(pthread_cond_broadcast(&condition));
+    }
+};
+
+/* A task that occupies a worker until it is released */
+class iothread_blocking_task_t : public iothread_task_t
+{
+    iothread_test_state_t *state;
+
+public:
+    iothread_blocking_task_t(iothread_test_state_t *s) : state(s)
+    {
+    }
+
+    int perform()
+    {
+        scoped_lock locker(state->lock);
+        state->blockers_started++;
+        VOMIT_ON_FAILURE(pthread_cond_broadcast(&state->condition));
+        while (state->blocker_releases == 0)
+        {
+            VOMIT_ON_FAILURE(pthread_cond_wait(&state->condition, &state->lock));
+        }
+        state->blocker_releases--;
+        return 0;
+    }
+};
+
+/* A task that records when it is performed, completed and destroyed */
+class iothread_recording_task_t : public iothread_task_t
+{
+    iothread_test_state_t *state;
+    wchar_t name;
+
+public:
+    iothread_recording_task_t(iothread_test_state_t *s, wchar_t n) : state(s), name(n)
+    {
+    }
+
+    ~iothread_recording_task_t()
+    {
+        scoped_lock locker(state->lock);
+        state->destroyed_count++;
+    }
+
+    int perform()
+    {
+        scoped_lock locker(state->lock);
+        state->performed.push_back(name);
+        VOMIT_ON_FAILURE(pthread_cond_broadcast(&state->condition));
+        return name;
+    }
+
+    void completed(int result)
+    {
+        if (result != name)
+        {
+            err(L"Task %lc completed with result %d", name, result);
+        }
+        scoped_lock locker(state->lock);
+        state->completed_count++;
+    }
+};
+
+/* A task that runs until it is cancelled */
+class iothread_cancellable_task_t : public iothread_task_t
+{
+    iothread_test_state_t *state;
+
+public:
+    bool *saw_cancellation;
+
+    iothread_cancellable_task_t(iothread_test_state_t *s, bool *saw) : state(s), saw_cancellation(saw)
+    {
+    }
+
+    int perform()
+    {
+        {
+            scoped_lock locker(state->lock);
+            state->blockers_started++;
+            VOMIT_ON_FAILURE(pthread_cond_broadcast(&state->condition));
+        }
+
+        /* Give up after ten seconds, so a failure doesn't hang the tests */
+        double deadline = timef() + 10;
+        while (! this->is_cancelled() && timef() < deadline)
+        {
+            usleep(1000);
+        }
+        *saw_cancellation = this->is_cancelled() && iothread_current_task_is_cancelled();
+        return 0;
+    }
+};
+
+static void test_iothread_priorities(void)
+{
+    say(L"Testing iothread priorities and cancellation");
+    iothread_test_state_t state;
+
+    /* Occupy every worker. Since there may be fewer workers than blockers, let the extra blockers run until each worker is stuck in one. */
+    const size_t blocker_count = 64;
+    int thread_count = 0;
+    for (size_t i=0; i < blocker_count; i++)
+    {
+        thread_count = iothread_perform_task(new iothread_blocking_task_t(&state), IOTHREAD_PRIORITY_DEFAULT);
+    }
+    if (thread_count <= 0 || (size_t)thread_count > blocker_count)
+    {
+        err(L"Unexpected iothread count %d", thread_count);
+        state.release_blockers(blocker_count);
+        iothread_drain_all();
+        return;
+    }
+    state.release_blockers(blocker_count - thread_count);
+    state.wait_for(&state.blockers_started, blocker_count);
+
+    /* Now queue up work of every priority, plus some that gets cancelled before it can start */
+    iothread_cancellation_token_t token;
+    iothread_perform_task(new iothread_recording_task_t(&state, L'd'), IOTHREAD_PRIORITY_DEFAULT);
+    iothread_perform_task(new iothread_recording_task_t(&state, L'a'), IOTHREAD_PRIORITY_AUTOSUGGEST);
+    iothread_perform_task(new iothread_recording_task_t(&state, L'x'), IOTHREAD_PRIORITY_HIGHLIGHT, &token);
+    iothread_perform_task(new iothread_recording_task_t(&state, L'h'), IOTHREAD_PRIORITY_HIGHLIGHT);
+    iothread_perform_task(new iothread_recording_task_t(&state, L'D'), IOTHREAD_PRIORITY_DEFAULT);
+    iothread_perform_task(new iothread_recording_task_t(&state, L'y'), IOTHREAD_PRIORITY_AUTOSUGGEST, &token);
+    iothread_perform_task(new iothread_recording_task_t(&state, L'H'), IOTHREAD_PRIORITY_HIGHLIGHT);
+    token.cancel();
+
+    /* Free up a single worker, which then performs the queued work in priority order */
+    state.release_blockers(1);
+    {
+        scoped_lock locker(state.lock);
+        while (state.performed.size() < 5)
+        {
+            VOMIT_ON_FAILURE(pthread_cond_wait(&state.condition, &state.lock));
+        }
+    }
+    state.release_blockers(thread_count - 1);
+    iothread_drain_all();
+
+    if (state.performed != L"hHadD")
+    {
+        err(L"Tasks were performed in the wrong order: '%ls'", state.performed.c_str());
+    }
+    if (state.completed_count != 5)
+    {
+        err(L"Expected 5 completed tasks, but %lu were completed", (unsigned long)state.completed_count);
+    }
+    if (state.destroyed_count != 7)
+    {
+        err(L"Expected 7 destroyed tasks, but %lu were destroyed", (unsigned long)state.destroyed_count);
+    }
+
+    /* A running task notices when it is cancelled */
+    bool saw_cancellation = false;
+    size_t started = state.blockers_started;
+    iothread_perform_task(new iothread_cancellable_task_t(&state, &saw_cancellation), IOTHREAD_PRIORITY_DEFAULT, &token);
+    state.wait_for(&state.blockers_started, started + 1);
+    token.cancel();
+    iothread_drain_all();
+    if (! saw_cancellation)
+    {
+        err(L"Running task did not notice its cancellation");
+    }
+}
+
 static parser_test_error_bits_t detect_argument_errors(const wcstring &src)
 {
     parse_node_tree_t tree;
@@ -794,6 +1088,377 @@ static void test_cancellation()
     reader_reset_interrupted();
 }
 
+/* Test that functions are executed from their cached parse tree, and report how fast that is compared to reparsing the body on each call */
+static void test_function_calls()
+{
+    say(L"Testing cached function definitions");
+    parser_t &parser = parser_t::principal_parser();
+
+    parser.eval(L"function __fish_test_cached ; set -g __fish_test_cached_result first $argv ; end", io_chain_t(), TOP);
+    parsed_source_ref_t parsed;
+    if (! function_get_parsed_definition(L"__fish_test_cached", &parsed) || parsed.get() == NULL)
+    {
+        err(L"Function definition was not parsed when the function was added");
+    }
+    parser.eval(L"__fish_test_cached arg", io_chain_t(), TOP);
+    do_test(env_get_string(L"__fish_test_cached_result") == wcstring(L"first") + ARRAY_SEP_STR + L"arg");
+
+    /* Redefining the function must not execute the old tree */
+    parser.eval(L"function __fish_test_cached ; set -g __fish_test_cached_result second ; end ; __fish_test_cached", io_chain_t(), TOP);
+    do_test(env_get_string(L"__fish_test_cached_result") == L"second");
+
+    /* Copies share the definition, and must survive the original going away */
+    do_test(function_copy(L"__fish_test_cached", L"__fish_test_cached_copy"));
+    function_remove(L"__fish_test_cached");
+    parser.eval(L"set -g __fish_test_cached_result none ; __fish_test_cached_copy", io_chain_t(), TOP);
+    do_test(env_get_string(L"__fish_test_cached_result") == L"second");
+    function_remove(L"__fish_test_cached_copy");
+    env_remove(L"__fish_test_cached_result", ENV_GLOBAL);
+
+    /* Benchmark a function whose body is mostly parsed rather than executed, like a typical prompt helper */
+    wcstring body;
+    for (int i=0; i < 20; i++)
+    {
+        append_format(body, L"switch \"$argv[1]\"\n case 'never%d*' '*%d.never'\n echo (basename $argv[1])\n set -l x $x[1]\n end\n", i, i);
+    }
+    parser.eval(L"function __fish_test_call_speed\n" + body + L"end", io_chain_t(), TOP);
+    const int iterations = 2000;
+
+    double start = timef();
+    for (int i=0; i < iterations; i++)
+    {
+        parser.eval(body, io_chain_t(), TOP);
+    }
+    double reparse_time = timef() - start;
+
+    do_test(function_get_parsed_definition(L"__fish_test_call_speed", &parsed) && parsed.get() != NULL);
+    start = timef();
+    for (int i=0; i < iterations && parsed.get() != NULL; i++)
+    {
+        parser.eval(parsed, io_chain_t(), TOP);
+    }
+    double cached_time = timef() - start;
+    function_remove(L"__fish_test_call_speed");
+
+    say(L"    (reparsing: %.0f calls/sec, cached: %.0f calls/sec)", iterations / reparse_time, iterations / cached_time);
+}
+
+/* Test capturing the output of command substitutions, and report how long tiny ones take */
+static void test_command_substitution()
+{
+    say(L"Testing command substitution");
+
+    /* External commands are only reaped when the SIGCHLD handler is installed */
+    signal_set_handlers();
+    env_push(true);
+    env_set(L"IFS", L"\n", ENV_LOCAL);
+
+    /* Large output is captured completely, across many reads */
+    wcstring_list_t lines;
+    exec_subshell(L"command seq 30000", lines, false);
+    do_test(lines.size() == 30000);
+    do_test(! lines.empty() && lines.front() == L"1" && lines.back() == L"30000");
+
+    /* Splitting a large output, and how much the peak memory grows while doing so */
+    struct rusage usage_before = {}, usage_after = {};
+    getrusage(RUSAGE_SELF, &usage_before);
+    lines.clear();
+    double split_start = timef();
+    exec_subshell(L"command seq 1000000", lines, false);
+    double split_time = timef() - split_start;
+    getrusage(RUSAGE_SELF, &usage_after);
+    do_test(lines.size() == 1000000);
+    do_test(! lines.empty() && lines.at(499999) == L"500000");
+    say(L"    (1000000 lines in %.02f msec, peak memory grew by %ld KB)", split_time * 1E3, usage_after.ru_maxrss - usage_before.ru_maxrss);
+    lines = wcstring_list_t();
+
+    /* Non-ASCII output is decoded correctly next to ASCII */
+    exec_subshell(L"command printf 'a\\xc3\\xa9b\\n\\xff\\n'", lines, false);
+    do_test(lines.size() == 2 && lines.at(0) == str2wcstring("a\xc3\xa9" "b") && lines.at(1) == str2wcstring("\xff"));
+    lines.clear();
+
+    /* Output from a process that outlives its writes */
+    lines.clear();
+    exec_subshell(L"command sh -c 'echo a; sleep 0.1; echo b'", lines, false);
+    do_test(lines.size() == 2 && lines.at(0) == L"a" && lines.at(1) == L"b");
+
+    /* Benchmark tiny substitutions, with a builtin and with an external command */
+    const size_t builtin_count = 1000, external_count = 1000;
+    double start = timef();
+    for (size_t i=0; i < builtin_count; i++)
+    {
+        lines.clear();
+        exec_subshell(L"echo x", lines, false);
+        if (lines.size() != 1 || lines.at(0) != L"x")
+        {
+            err(L"Unexpected output from (echo x)");
+            break;
+        }
+    }
+    double builtin_time = timef() - start;
+
+    start = timef();
+    for (size_t i=0; i < external_count; i++)
+    {
+        lines.clear();
+        exec_subshell(L"command echo x", lines, false);
+        if (lines.size() != 1 || lines.at(0) != L"x")
+        {
+            err(L"Unexpected output from (command echo x)");
+            break;
+        }
+    }
+    double external_time = timef() - start;
+
+    env_pop();
+    signal_reset_handlers();
+    say(L"    (echo x: %.02f usec each; command echo x: %.02f usec each)", builtin_time * 1E6 / builtin_count, external_time * 1E6 / external_count);
+}
+
+/* Test that functions and blocks stream their output into external pipeline stages, and report how long a huge stream takes to cut short */
+static void test_pipeline_streaming()
+{
+    say(L"Testing streaming functions in pipelines");
+
+    /* External commands are only reaped when the SIGCHLD handler is installed */
+    signal_set_handlers();
+    parser_t &parser = parser_t::principal_parser();
+    const wchar_t * const path = L"/tmp/fish_pipeline_streaming_test";
+
+    /* Output of builtins and external commands keeps its order, and the function still runs in this shell */
+    parser.eval(L"function __fish_test_streamer; echo a; command echo b; echo c; set -g __fish_test_streamed 1; end", io_chain_t(), TOP);
+    parser.eval(format_string(L"__fish_test_streamer | command cat > %ls", path), io_chain_t(), TOP);
+    wcstring_list_t lines;
+    exec_subshell(format_string(L"command cat %ls", path), lines, false);
+    do_test(lines.size() == 1 && lines.at(0) == L"a\nb\nc");
+    do_test(! env_get_string(L"__fish_test_streamed").missing());
+
+    /* Blocks stream too, and their stdin still works */
+    parser.eval(format_string(L"echo x | begin; read v; echo got $v; end | command cat > %ls", path), io_chain_t(), TOP);
+    lines.clear();
+    exec_subshell(format_string(L"command cat %ls", path), lines, false);
+    do_test(lines.size() == 1 && lines.at(0) == L"got x");
+
+    /* A function producing 1 GB piped into head. This only finishes quickly, in bounded memory, if head reads while the function runs. */
+    parser.eval(L"function __fish_test_gigabyte; command head -c 1073741824 /dev/zero; end", io_chain_t(), TOP);
+    struct rusage usage_before = {}, usage_after = {};
+    getrusage(RUSAGE_SELF, &usage_before);
+    double start = timef();
+    parser.eval(format_string(L"__fish_test_gigabyte | command head -c 3 | command wc -c > %ls", path), io_chain_t(), TOP);
+    double elapsed = timef() - start;
+    getrusage(RUSAGE_SELF, &usage_after);
+    lines.clear();
+    exec_subshell(format_string(L"command cat %ls", path), lines, false);
+    do_test(lines.size() == 1 && lines.at(0).find(L'3') != wcstring::npos);
+    do_test(usage_after.ru_maxrss - usage_before.ru_maxrss < 64 * 1024);
+    do_test(elapsed < 10);
+
+    parser.eval(L"functions -e __fish_test_streamer __fish_test_gigabyte; set -e __fish_test_streamed", io_chain_t(), TOP);
+    unlink(wcs2string(path).c_str());
+    signal_reset_handlers();
+    say(L"    (1 GB function piped into head: %.02f msec, peak memory grew by %ld KB)", elapsed * 1E3, usage_after.ru_maxrss - usage_before.ru_maxrss);
+}
+
+/* Runs a function piped into a command that uses the terminal, with job control, in a child that has a pseudo terminal as its controlling terminal. Exits with 0 if the job finished without stopping. */
+static void run_terminal_pipeline_in_child(const char *tty_name)
+{
+    setup_fork_guards();
+    setsid();
+    int tty = open(tty_name, O_RDWR);
+    if (tty < 0)
+        exit_without_destructors(2);
+    dup2(tty, STDIN_FILENO);
+    dup2(tty, STDOUT_FILENO);
+    dup2(tty, STDERR_FILENO);
+    close(tty);
+
+    job_control_mode = JOB_CONTROL_ALL;
+    proc_push_interactive(1);
+    signal_set_handlers();
+
+    parser_t &parser = parser_t::principal_parser();
+    parser.eval(L"function __fish_test_tty_streamer; command echo hi; command sleep 0.3; end", io_chain_t(), TOP);
+    parser.eval(L"__fish_test_tty_streamer | command sh -c 'cat >/dev/null; stty -echo </dev/tty; stty echo </dev/tty'", io_chain_t(), TOP);
+
+    int result = proc_get_last_status() == 0 ? 0 : 1;
+    job_iterator_t jobs;
+    while (job_t *j = jobs.next())
+    {
+        if (job_is_stopped(j))
+        {
+            killpg(j->pgid, SIGKILL);
+            result = 1;
+        }
+    }
+    exit_without_destructors(result);
+}
+
+/* Test that a function piped into a command using the terminal does not stop the job. The inner jobs of a streamed function take the terminal and give it back to fish, not to the other processes of the job, so functions in foreground jobs that own the terminal must not stream. */
+static void test_pipeline_streaming_terminal()
+{
+    say(L"Testing functions piped into commands using the terminal");
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) || unlockpt(master) || ptsname(master) == NULL)
+    {
+        err(L"Unable to open a pseudo terminal");
+        if (master >= 0)
+            close(master);
+        return;
+    }
+    const std::string tty_name = ptsname(master);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        run_terminal_pipeline_in_child(tty_name.c_str());
+    }
+
+    /* Drain the terminal while waiting, in case something writes to it. A stopped job hangs the child, so give up eventually. */
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    int stat = 0;
+    bool exited = false;
+    for (size_t i=0; i < 1000 && ! exited; i++)
+    {
+        char buff[256];
+        while (read(master, buff, sizeof buff) > 0)
+        {
+        }
+        exited = waitpid(pid, &stat, WNOHANG) == pid;
+        if (! exited)
+            usleep(10000);
+    }
+    if (! exited)
+    {
+        err(L"Function piped into a command using the terminal did not finish");
+        kill(pid, SIGKILL);
+        waitpid(pid, &stat, 0);
+    }
+    else if (! WIFEXITED(stat) || WEXITSTATUS(stat) != 0)
+    {
+        err(L"Function piped into a command using the terminal stopped or failed");
+    }
+    close(master);
+}
+
+/* Test that builtins stream their stdout in chunks, rather than collecting all of it */
+static void test_builtin_output_streaming()
+{
+    say(L"Testing streaming builtin output");
+
+    parser_t &parser = parser_t::principal_parser();
+    extern wcstring stdout_buffer;
+
+    /* Streamed into a buffer, the collected output never grows much past a chunk */
+    const shared_ptr<io_buffer_t> buffer(io_buffer_t::create(STDOUT_FILENO));
+    builtin_push_io(parser, 0);
+    builtin_set_stdout_stream(-1, buffer.get());
+    const wcstring line = L"streamed line \u00e9\n";
+    size_t largest = 0;
+    for (size_t i=0; i < 100000; i++)
+    {
+        stdout_buffer.append(line);
+        builtin_stream_stdout();
+        largest = maxi(largest, stdout_buffer.size());
+    }
+    do_test(largest < BUILTIN_STDOUT_CHUNK_SIZE + line.size());
+    const std::string expected_tail = wcs2string(stdout_buffer);
+    do_test(buffer->out_buffer_size() > 0);
+
+    /* A nested builtin collects its own output, and the outer one streams again afterwards */
+    builtin_push_io(parser, 0);
+    stdout_buffer.append(BUILTIN_STDOUT_CHUNK_SIZE * 2, L'x');
+    builtin_stream_stdout();
+    do_test(stdout_buffer.size() == BUILTIN_STDOUT_CHUNK_SIZE * 2);
+    builtin_pop_io(parser);
+    do_test(wcs2string(stdout_buffer) == expected_tail);
+    builtin_pop_io(parser);
+
+    /* Everything that was streamed arrived intact */
+    const std::string narrow_line = wcs2string(line);
+    const size_t streamed_lines = buffer->out_buffer_size() / narrow_line.size();
+    do_test(buffer->out_buffer_size() + expected_tail.size() == narrow_line.size() * 100000);
+    do_test(std::string(buffer->out_buffer_ptr(), narrow_line.size()) == narrow_line);
+    do_test(std::string(buffer->out_buffer_ptr() + (streamed_lines - 1) * narrow_line.size(), narrow_line.size()) == narrow_line);
+
+    /* Whole builtins produce the same output, whether they stream or not */
+    signal_set_handlers();
+    env_push(true);
+    env_set(L"IFS", L"\n", ENV_LOCAL);
+    wcstring_list_t lines;
+    exec_subshell(L"printf '%s\\n' (seq 100000)", lines, false);
+    do_test(lines.size() == 100000 && lines.at(0) == L"1" && lines.back() == L"100000");
+    lines.clear();
+    exec_subshell(L"string split , (string join , (seq 50000))", lines, false);
+    do_test(lines.size() == 50000 && lines.at(49998) == L"49999");
+    env_pop();
+    signal_reset_handlers();
+}
+
+/* Test that read gives back what it reads past a line in a regular file, and report its throughput */
+static void test_read_buffering()
+{
+    say(L"Testing buffered reads");
+
+    /* External commands are only reaped when the SIGCHLD handler is installed */
+    signal_set_handlers();
+    parser_t &parser = parser_t::principal_parser();
+    const char * const path = "/tmp/fish_read_buffering_test";
+    const char * const rest_path = "/tmp/fish_read_buffering_rest";
+
+    /* A line longer than a chunk, then lines followed by data that a command reads */
+    std::string long_line(3 * 4096 + 17, 'L');
+    FILE *f = fopen(path, "w");
+    if (! f)
+    {
+        err(L"Unable to create %s", path);
+        return;
+    }
+    fprintf(f, "first\n%s\nthird\nrest of\nthe file", long_line.c_str());
+    fclose(f);
+
+    parser.eval(format_string(L"begin; read -g __fish_test_read1; read -g __fish_test_read2; read -g __fish_test_read3; command cat > %s; end < %s", rest_path, path), io_chain_t(), TOP);
+    do_test(env_get_string(L"__fish_test_read1") == L"first");
+    do_test(env_get_string(L"__fish_test_read2") == str2wcstring(long_line));
+    do_test(env_get_string(L"__fish_test_read3") == L"third");
+    wcstring_list_t lines;
+    exec_subshell(format_string(L"command cat %s", rest_path), lines, false);
+    do_test(lines.size() == 1 && lines.at(0) == L"rest of\nthe file");
+
+    /* The same through a pipe, which is read a byte at a time */
+    parser.eval(format_string(L"command cat %s | begin; read -g __fish_test_read1; read -g __fish_test_read2; command cat > %s; end", path, rest_path), io_chain_t(), TOP);
+    do_test(env_get_string(L"__fish_test_read1") == L"first");
+    lines.clear();
+    exec_subshell(format_string(L"command cat %s", rest_path), lines, false);
+    do_test(lines.size() == 1 && lines.at(0) == L"third\nrest of\nthe file");
+
+    /* Throughput of a read loop over a 100 MB file, and over 1 MB from a pipe */
+    const size_t line_length = 1000, file_lines = 100 * 1000, pipe_lines = 1000;
+    std::string line(line_length - 1, 'x');
+    line.push_back('\n');
+    f = fopen(path, "w");
+    for (size_t i=0; f && i < file_lines; i++)
+    {
+        fwrite(line.data(), 1, line.size(), f);
+    }
+    if (f)
+        fclose(f);
+
+    double start = timef();
+    parser.eval(format_string(L"while read -l line; end < %s", path), io_chain_t(), TOP);
+    double file_time = timef() - start;
+
+    start = timef();
+    parser.eval(format_string(L"command head -n %lu %s | while read -l line; end", (unsigned long)pipe_lines, path), io_chain_t(), TOP);
+    double pipe_time = timef() - start;
+
+    parser.eval(L"set -e __fish_test_read1; set -e __fish_test_read2; set -e __fish_test_read3", io_chain_t(), TOP);
+    unlink(path);
+    unlink(rest_path);
+    signal_reset_handlers();
+    say(L"    (file: %.1f MB/s; pipe: %.1f MB/s)", file_lines * line_length / file_time / 1E6, pipe_lines * line_length / pipe_time / 1E6);
+}
+
 static void test_indents()
 {
     say(L"Testing indents");
@@ -1395,6 +2060,199 @@ static void test_expand()
     if (system("rm -Rf /tmp/fish_expand_test")) err(L"rm failed");
 }
 
+/**
+   Test that list variables are stored as lists, and that appending to
+   them, indexing them and iterating over them does not scale with the
+   length of the list.
+*/
+static void test_list_variables()
+{
+    say(L"Testing list variables");
+
+    parser_t &parser = parser_t::principal_parser();
+
+    /* Empty elements and zero element lists survive a round trip */
+    wcstring_list_t vals;
+    vals.push_back(L"a");
+    vals.push_back(L"");
+    vals.push_back(L"c");
+    env_set_list(L"__fish_test_list", vals, ENV_GLOBAL);
+    shared_ptr<const wcstring_list_t> list = env_get_list(L"__fish_test_list");
+    do_test(list && *list == vals);
+    do_test(env_get_string(L"__fish_test_list") == wcstring(L"a") + ARRAY_SEP_STR + ARRAY_SEP_STR + L"c");
+
+    env_set_list(L"__fish_test_list", wcstring_list_t(), ENV_GLOBAL);
+    do_test(! env_get_list(L"__fish_test_list"));
+    do_test(env_get_string(L"__fish_test_list").missing());
+    do_test(env_exist(L"__fish_test_list", ENV_GLOBAL));
+
+    env_set(L"__fish_test_list", L"", ENV_GLOBAL);
+    list = env_get_list(L"__fish_test_list");
+    do_test(list && list->size() == 1 && list->at(0).empty());
+
+    /* Appending copies the elements only if someone is looking at them */
+    env_set_list(L"__fish_test_list", vals, ENV_GLOBAL);
+    list = env_get_list(L"__fish_test_list");
+    env_append(L"__fish_test_list", vals, ENV_GLOBAL);
+    do_test(list->size() == 3);
+    list = env_get_list(L"__fish_test_list");
+    do_test(list && list->size() == 6 && list->at(5) == L"c");
+
+    /* Appending in a function scope starts from the global value */
+    parser.eval(L"function __fish_test_append; set -a __fish_test_list d; end; __fish_test_append; functions -e __fish_test_append", io_chain_t(), TOP);
+    list = env_get_list(L"__fish_test_list");
+    do_test(list && list->size() == 7 && list->at(6) == L"d");
+
+    /* Exported lists are joined with colons, universal lists can be appended to */
+    env_set_list(L"__fish_test_list", vals, ENV_GLOBAL | ENV_EXPORT);
+    bool exported = false;
+    for (const char * const *env = env_export_arr(true); *env; env++)
+    {
+        exported = exported || ! strcmp(*env, "__fish_test_list=a::c");
+    }
+    do_test(exported);
+    env_remove(L"__fish_test_list", ENV_GLOBAL);
+
+    env_set_list(L"__fish_test_list", vals, ENV_UNIVERSAL);
+    env_append(L"__fish_test_list", vals, ENV_UNIVERSAL);
+    list = env_get_list(L"__fish_test_list");
+    do_test(list && list->size() == 6 && list->at(3) == L"a");
+    env_remove(L"__fish_test_list", ENV_UNIVERSAL);
+
+    /* Append to, index and iterate over a long list */
+    const size_t count = 100 * 1000;
+    wcstring_list_t numbers;
+    for (size_t i=1; i <= count; i++)
+    {
+        numbers.push_back(to_string(i));
+    }
+    env_set_list(L"__fish_test_numbers", numbers, ENV_GLOBAL);
+
+    double start = timef();
+    parser.eval(L"set -g __fish_test_list; for i in $__fish_test_numbers; set -a __fish_test_list $i; end", io_chain_t(), TOP);
+    double append_time = timef() - start;
+    list = env_get_list(L"__fish_test_list");
+    do_test(list && *list == numbers);
+
+    start = timef();
+    parser.eval(L"for i in $__fish_test_numbers; set -g __fish_test_item $__fish_test_list[$i]; end", io_chain_t(), TOP);
+    double index_time = timef() - start;
+    do_test(env_get_string(L"__fish_test_item") == to_string(count));
+
+    start = timef();
+    parser.eval(L"set -g __fish_test_item 0; for i in $__fish_test_list; set -g __fish_test_item $i; end", io_chain_t(), TOP);
+    double iterate_time = timef() - start;
+    do_test(env_get_string(L"__fish_test_item") == to_string(count));
+
+    env_remove(L"__fish_test_list", ENV_GLOBAL);
+    env_remove(L"__fish_test_numbers", ENV_GLOBAL);
+    env_remove(L"__fish_test_item", ENV_GLOBAL);
+    say(L"    (%lu elements: append %.2f usec, index %.2f usec, iterate %.2f usec per element)", (unsigned long)count, append_time * 1E6 / count, index_time * 1E6 / count, iterate_time * 1E6 / count);
+}
+
+/**
+   Time a loop over the count elements of __fish_test_numbers that looks
+   up variables and sets one, run inside depth nested function calls
+   that each add depth block scopes.
+   Returns the time per iteration in microseconds.
+*/
+static double time_nested_lookups(parser_t &parser, size_t depth, size_t count)
+{
+    wcstring blocks, ends;
+    for (size_t i=0; i < depth; i++)
+    {
+        blocks.append(L"begin; set -l __fish_test_shadowed $argv; ");
+        ends.append(L"end; ");
+    }
+
+    parser.eval(L"function __fish_test_nested; if test $argv[1] -gt 0; " + blocks + L"__fish_test_nested (math $argv[1] - 1); " + ends + L"else; for i in $__fish_test_numbers; set -l x $__fish_test_global $__fish_test_shadowed; end; end; end", io_chain_t(), TOP);
+
+    double start = timef();
+    parser.eval(L"__fish_test_nested " + to_string(depth), io_chain_t(), TOP);
+    double result = (timef() - start) * 1E6 / count;
+
+    parser.eval(L"functions -e __fish_test_nested", io_chain_t(), TOP);
+    return result;
+}
+
+/**
+   Test that variable lookups see the innermost visible scope through
+   the cache of visible variables, and that they do not get slower in
+   deeply nested scopes
+*/
+static void test_variable_scopes()
+{
+    say(L"Testing variable scopes");
+
+    /* Local variables shadow global ones until their scope is popped */
+    env_set(L"__fish_test_scoped", L"global", ENV_GLOBAL);
+    do_test(env_get_string(L"__fish_test_scoped") == L"global");
+    env_push(false);
+    env_set(L"__fish_test_scoped", L"local", ENV_LOCAL);
+    do_test(env_get_string(L"__fish_test_scoped") == L"local");
+
+    /* Function scopes hide the local variables of their caller */
+    env_push(true);
+    do_test(env_get_string(L"__fish_test_scoped") == L"global");
+    env_set(L"__fish_test_scoped", L"function", ENV_LOCAL);
+    do_test(env_get_string(L"__fish_test_scoped") == L"function");
+    env_pop();
+    do_test(env_get_string(L"__fish_test_scoped") == L"local");
+    env_pop();
+    do_test(env_get_string(L"__fish_test_scoped") == L"global");
+
+    /* Variables that were not found can be set later, and erased ones are gone */
+    do_test(env_get_string(L"__fish_test_unset").missing());
+    env_set(L"__fish_test_unset", L"set", ENV_GLOBAL);
+    do_test(env_get_string(L"__fish_test_unset") == L"set");
+    env_remove(L"__fish_test_unset", ENV_GLOBAL);
+    env_remove(L"__fish_test_scoped", ENV_GLOBAL);
+    do_test(env_get_string(L"__fish_test_unset").missing());
+    do_test(env_get_string(L"__fish_test_scoped").missing());
+
+    /* Setting a variable without a scope modifies the innermost visible one */
+    env_set(L"__fish_test_scoped", L"global", ENV_GLOBAL);
+    env_push(false);
+    env_set(L"__fish_test_scoped", L"local", ENV_LOCAL);
+    env_push(false);
+    env_set(L"__fish_test_scoped", L"changed", 0);
+    env_pop();
+    do_test(env_get_string(L"__fish_test_scoped") == L"changed");
+    env_pop();
+    do_test(env_get_string(L"__fish_test_scoped") == L"global");
+    env_remove(L"__fish_test_scoped", ENV_GLOBAL);
+
+    /* Lookups from deep inside nested functions and blocks */
+    parser_t &parser = parser_t::principal_parser();
+    const size_t count = 20000;
+    env_set_list(L"__fish_test_numbers", wcstring_list_t(count, L"1"), ENV_GLOBAL);
+    env_set(L"__fish_test_global", L"1", ENV_GLOBAL);
+    double shallow = time_nested_lookups(parser, 1, count);
+    double deep = time_nested_lookups(parser, 40, count);
+    env_remove(L"__fish_test_numbers", ENV_GLOBAL);
+
+    /* The lookups alone, below a thousand scopes that each have a variable */
+    const size_t scopes = 1000, lookups = 100 * 1000;
+    for (size_t i=0; i < scopes; i++)
+    {
+        env_push(false);
+        env_set(L"__fish_test_shadowed", L"1", ENV_LOCAL);
+    }
+    double start = timef();
+    for (size_t i=0; i < lookups; i++)
+    {
+        env_get_string(L"__fish_test_global");
+    }
+    double lookup_time = (timef() - start) * 1E9 / lookups;
+    for (size_t i=0; i < scopes; i++)
+    {
+        env_pop();
+    }
+    env_remove(L"__fish_test_global", ENV_GLOBAL);
+
+    say(L"    (%.2f usec per loop 1 level deep, %.2f usec 40 levels deep; %.0f nsec per lookup below %lu scopes)", shallow, deep, lookup_time, (unsigned long)scopes);
+}
+
 static void test_fuzzy_match(void)
 {
     say(L"Testing fuzzy string matching");
@@ -1409,6 +2267,92 @@ static void test_fuzzy_match(void)
     if (string_fuzzy_match_string(L"BB", L"ALPHA!").type != fuzzy_match_none) err(L"test_fuzzy_match failed on line %ld", __LINE__);
 }
 
+/* Test that the fuzzy match index agrees with string_fuzzy_match_string as the search string is typed and deleted, and report how much faster it is */
+static void test_fuzzy_match_index(void)
+{
+    say(L"Testing fuzzy matching index");
+
+    string_fuzzy_match_index_t index;
+    wcstring_list_t candidates;
+    const wchar_t * const words[] = {L"lib", L"Python", L"perl", L"GTK", L"gnome", L"kde", L"x11", L"font", L"devel", L"doc"};
+    const size_t word_count = sizeof words / sizeof *words;
+    for (size_t i=0; i < 20000; i++)
+    {
+        candidates.push_back(format_string(L"%ls-%ls%lu-%ls", words[i % word_count], words[i / 7 % word_count], (unsigned long)(i * 7919 % 20011), i % 3 ? L"bin" : L"Devel"));
+        do_test(index.add(candidates.back()) == i);
+    }
+    candidates.push_back(L"");
+    index.add(L"");
+    candidates.push_back(L"package");
+    index.add(L"package");
+    do_test(index.size() == candidates.size());
+
+    /* Type and then delete each search string, with each limit */
+    const wchar_t * const needles[] = {L"perl-python12-bin", L"PeRl-", L"p1-l", L"99", L"xyz"};
+    const fuzzy_match_type_t limits[] = {fuzzy_match_exact, fuzzy_match_prefix, fuzzy_match_case_insensitive, fuzzy_match_prefix_case_insensitive, fuzzy_match_substring, fuzzy_match_none};
+    for (size_t l=0; l < sizeof limits / sizeof *limits; l++)
+    {
+        for (size_t n=0; n < sizeof needles / sizeof *needles; n++)
+        {
+            const wcstring full = needles[n];
+            for (size_t step = 0; step <= 2 * full.size(); step++)
+            {
+                const wcstring needle(full, 0, step <= full.size() ? step : 2 * full.size() - step);
+                const std::vector<size_t> &matches = index.match(needle, limits[l]);
+                const std::vector<string_fuzzy_match_t> &results = index.match_results();
+                do_test(matches.size() == results.size());
+
+                size_t m = 0;
+                bool agrees = true;
+                for (size_t i=0; agrees && i < candidates.size(); i++)
+                {
+                    string_fuzzy_match_t expected = string_fuzzy_match_string(needle, candidates.at(i), limits[l]);
+                    if (expected.type == fuzzy_match_none)
+                        continue;
+                    agrees = m < matches.size() && matches.at(m) == i && results.at(m).compare(expected) == 0;
+                    m++;
+                }
+                if (! agrees || m != matches.size())
+                {
+                    err(L"Fuzzy match index disagrees with string_fuzzy_match_string for '%ls' with limit %d", needle.c_str(), (int)limits[l]);
+                    break;
+                }
+            }
+        }
+    }
+
+    /* Adding a candidate is noticed */
+    do_test(index.match(L"zebra").empty());
+    index.add(L"zebra");
+    do_test(index.match(L"zebra").size() == 1);
+
+    /* Benchmark filtering as the search string is typed */
+    const wcstring typed = L"gtk-python1";
+    double times[2];
+    size_t total[2] = {0, 0};
+    for (int indexed = 0; indexed < 2; indexed++)
+    {
+        double start = timef();
+        for (size_t i=1; i <= typed.size(); i++)
+        {
+            const wcstring needle(typed, 0, i);
+            if (indexed)
+            {
+                total[indexed] += index.match(needle, fuzzy_match_substring).size();
+                continue;
+            }
+            for (size_t j=0; j < candidates.size(); j++)
+            {
+                if (string_fuzzy_match_string(needle, candidates.at(j), fuzzy_match_substring).type != fuzzy_match_none)
+                    total[indexed]++;
+            }
+        }
+        times[indexed] = (timef() - start) * 1E3 / typed.size();
+    }
+    do_test(total[0] == total[1]);
+    say(L"    (%lu candidates: %.02f msec per keystroke unindexed, %.02f msec indexed)", (unsigned long)candidates.size(), times[0], times[1]);
+}
+
 static void test_abbreviations(void)
 {
     say(L"Testing abbreviations");
@@ -1470,32 +2414,411 @@ static void test_abbreviations(void)
     if (expanded) err(L"gc incorrectly expanded on line %ld", (long)__LINE__);
 
 
-    env_pop();
+    env_pop();
+}
+
+/** Test path functions */
+static void test_path()
+{
+    say(L"Testing path functions");
+
+    wcstring path = L"//foo//////bar/";
+    path_make_canonical(path);
+    if (path != L"/foo/bar")
+    {
+        err(L"Bug in canonical PATH code");
+    }
+
+    path = L"/";
+    path_make_canonical(path);
+    if (path != L"/")
+    {
+        err(L"Bug in canonical PATH code");
+    }
+
+    if (paths_are_equivalent(L"/foo/bar/baz", L"foo/bar/baz")) err(L"Bug in canonical PATH code on line %ld", (long)__LINE__);
+    if (! paths_are_equivalent(L"///foo///bar/baz", L"/foo/bar////baz//")) err(L"Bug in canonical PATH code on line %ld", (long)__LINE__);
+    if (! paths_are_equivalent(L"/foo/bar/baz", L"/foo/bar/baz")) err(L"Bug in canonical PATH code on line %ld", (long)__LINE__);
+    if (! paths_are_equivalent(L"/", L"/")) err(L"Bug in canonical PATH code on line %ld", (long)__LINE__);
+}
+
+/* Runs the given function with stdout redirected to a pipe, and returns what it wrote */
+static std::string capture_stdout(void (*func)(void))
+{
+    fflush(stdout);
+    int pipes[2];
+    if (pipe(pipes) != 0)
+    {
+        err(L"pipe failed");
+        return std::string();
+    }
+    int saved_stdout = dup(STDOUT_FILENO);
+    dup2(pipes[1], STDOUT_FILENO);
+    close(pipes[1]);
+
+    func();
+
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    std::string result;
+    char buff[256];
+    ssize_t amt;
+    while ((amt = read(pipes[0], buff, sizeof buff)) > 0)
+    {
+        result.append(buff, amt);
+    }
+    close(pipes[0]);
+    return result;
+}
+
+static void write_frame(void)
+{
+    output_frame_t frame;
+    writestr(L"hello");
+    writech(L' ');
+    output_write_bytes("there", 5);
+    writestr_ellipsis(L"world", 10);
+}
+
+static void write_without_frame(void)
+{
+    writestr(L"abc");
+    writech(L'd');
+}
+
+static void test_output_frames()
+{
+    say(L"Testing output frames");
+
+    /* A frame goes out in one write */
+    output_frame_stats_t before = output_get_frame_stats();
+    std::string written = capture_stdout(write_frame);
+    output_frame_stats_t after = output_get_frame_stats();
+    do_test(written == "hello thereworld");
+    do_test(after.frames == before.frames + 1);
+    do_test(after.writes == before.writes + 1);
+    do_test(after.bytes == before.bytes + written.size());
+
+    /* Without a frame, each call is its own frame */
+    before = after;
+    written = capture_stdout(write_without_frame);
+    after = output_get_frame_stats();
+    do_test(written == "abcd");
+    do_test(after.frames == before.frames + 2);
+    do_test(after.writes == before.writes + 2);
+}
+
+static void test_command_hash()
+{
+    say(L"Testing the command hash");
+    if (system("rm -Rf /tmp/fish_command_hash_test/")) err(L"Failed to remove /tmp/fish_command_hash_test/");
+    if (system("mkdir -p /tmp/fish_command_hash_test/first/ /tmp/fish_command_hash_test/second/")) err(L"mkdir failed");
+
+    env_push(true);
+    env_set(L"PATH", L"/tmp/fish_command_hash_test/first" ARRAY_SEP_STR L"/tmp/fish_command_hash_test/second", ENV_LOCAL | ENV_EXPORT);
+
+    wcstring path;
+    do_test(! path_get_path(L"hash_test_cmd", &path));
+
+    /* New commands are noticed right away */
+    if (system("touch /tmp/fish_command_hash_test/second/hash_test_cmd && chmod +x /tmp/fish_command_hash_test/second/hash_test_cmd")) err(L"touch failed");
+    do_test(path_get_path(L"hash_test_cmd", &path) && path == L"/tmp/fish_command_hash_test/second/hash_test_cmd");
+
+    /* As are commands that shadow them, and their removal */
+    if (system("touch /tmp/fish_command_hash_test/first/hash_test_cmd && chmod +x /tmp/fish_command_hash_test/first/hash_test_cmd")) err(L"touch failed");
+    do_test(path_get_path(L"hash_test_cmd", &path) && path == L"/tmp/fish_command_hash_test/first/hash_test_cmd");
+    if (system("rm /tmp/fish_command_hash_test/first/hash_test_cmd")) err(L"rm failed");
+    do_test(path_get_path(L"hash_test_cmd", &path) && path == L"/tmp/fish_command_hash_test/second/hash_test_cmd");
+    do_test(path_get_path(L"hash_test_cmd", NULL));
+
+    /* Names that aren't executable files don't count */
+    if (system("touch /tmp/fish_command_hash_test/first/hash_test_file")) err(L"touch failed");
+    if (system("mkdir /tmp/fish_command_hash_test/first/hash_test_dir")) err(L"mkdir failed");
+    do_test(! path_get_path(L"hash_test_file", &path));
+    do_test(! path_get_path(L"hash_test_dir", &path));
+
+    /* A name whose case differs from the command on disk finds it only where the filesystem ignores case, as on OS X */
+    struct stat buf;
+    const bool ignores_case = stat("/tmp/fish_command_hash_test/second/HASH_TEST_CMD", &buf) == 0;
+    const dir_listing_ref_t listing = dir_cache_get_listing(L"/tmp/fish_command_hash_test/second");
+    do_test(listing && listing->case_sensitive == ! ignores_case);
+    do_test(path_get_path(L"HASH_TEST_CMD", &path) == ignores_case);
+
+    dir_listing_t folded;
+    folded.entries.push_back(dir_entry_t(L"ls", DT_REG));
+    do_test(! folded.may_contain(L"LS"));
+    folded.case_sensitive = false;
+    do_test(folded.may_contain(L"LS") && folded.may_contain(L"ls") && ! folded.may_contain(L"make"));
+
+    /* Successful lookups are remembered where they were last found */
+    const std::vector<path_hashed_command_t> hashed = path_get_hashed_commands();
+    bool found = false;
+    for (size_t i=0; i < hashed.size(); i++)
+    {
+        if (hashed.at(i).name == L"hash_test_cmd")
+        {
+            found = true;
+            do_test(hashed.at(i).path == L"/tmp/fish_command_hash_test/second/hash_test_cmd");
+            do_test(hashed.at(i).hits == 2);
+        }
+        do_test(hashed.at(i).name != L"hash_test_file");
+    }
+    do_test(found);
+    do_test(path_forget_hashed_command(L"hash_test_cmd"));
+    do_test(! path_forget_hashed_command(L"hash_test_cmd"));
+
+    env_pop();
+    if (system("rm -Rf /tmp/fish_command_hash_test/")) err(L"Failed to remove /tmp/fish_command_hash_test/");
+}
+
+static void test_dir_cache()
+{
+    say(L"Testing the directory listing cache");
+    if (system("rm -Rf /tmp/fish_dir_cache_test/")) err(L"Failed to remove /tmp/fish_dir_cache_test/");
+    if (system("mkdir -p /tmp/fish_dir_cache_test/sub/ && touch /tmp/fish_dir_cache_test/beta /tmp/fish_dir_cache_test/alpha")) err(L"mkdir failed");
+
+    const wcstring dir = L"/tmp/fish_dir_cache_test";
+    dir_cache_stats_t before = dir_cache_get_stats();
+
+    /* The first lookup reads the directory; entries are sorted, and carry their type when the filesystem reports it */
+    dir_listing_ref_t listing = dir_cache_get_listing(dir);
+    do_test(listing);
+    do_test(listing && listing->find(L"alpha") && listing->find(L"beta") && listing->find(L"sub") && ! listing->find(L"gamma"));
+    do_test(listing && listing->entries.size() == 5 && listing->entries.at(2).name == L"alpha" && listing->entries.at(3).name == L"beta");
+    do_test(listing && listing->find(L"sub") && dir_entry_is_dir(dir, *listing->find(L"sub")));
+    do_test(listing && listing->find(L"alpha") && ! dir_entry_is_dir(dir, *listing->find(L"alpha")));
+
+    /* A listing made in the same second its directory changed can't be trusted, so wait for that second to pass */
+    usleep(1100000);
+    listing = dir_cache_get_listing(dir);
+    dir_listing_ref_t again = dir_cache_get_listing(dir);
+    do_test(listing && again.get() == listing.get());
+
+    dir_cache_stats_t after = dir_cache_get_stats();
+    do_test(after.hits == before.hits + 1);
+    do_test(after.misses == before.misses + 2);
+
+    /* Adding or removing an entry is noticed right away */
+    if (system("touch /tmp/fish_dir_cache_test/gamma")) err(L"touch failed");
+    listing = dir_cache_get_listing(dir);
+    do_test(listing && listing->find(L"gamma"));
+    if (system("rm /tmp/fish_dir_cache_test/alpha")) err(L"rm failed");
+    listing = dir_cache_get_listing(dir);
+    do_test(listing && ! listing->find(L"alpha"));
+
+    /* Wildcards are expanded from the listing */
+    std::vector<completion_t> expanded;
+    do_test(wildcard_expand_string(wcstring(1, ANY_STRING), L"/tmp/fish_dir_cache_test/", 0, expanded) == 1);
+    std::sort(expanded.begin(), expanded.end(), completion_t::is_alphabetically_less_than);
+    do_test(expanded.size() == 3);
+    do_test(expanded.size() == 3 && expanded.at(0).completion == L"/tmp/fish_dir_cache_test/beta" && expanded.at(2).completion == L"/tmp/fish_dir_cache_test/sub");
+
+    /* Directories that can't be listed give no listing, and forgetting everything empties the cache */
+    do_test(! dir_cache_get_listing(L"/tmp/fish_dir_cache_test/beta"));
+    do_test(! dir_cache_get_listing(L"/tmp/fish_dir_cache_test/nonexistent"));
+    dir_cache_reset();
+    do_test(dir_cache_get_stats().directories == 0);
+
+    if (system("rm -Rf /tmp/fish_dir_cache_test/")) err(L"Failed to remove /tmp/fish_dir_cache_test/");
+}
+
+struct path_scan_thread_result_t
+{
+    std::vector<completion_t> completions;
+    volatile bool done;
+    path_scan_thread_result_t() : done(false)
+    {
+    }
+};
+
+static void *path_completion_thread(void *arg)
+{
+    path_scan_thread_result_t *result = static_cast<path_scan_thread_result_t *>(arg);
+    complete(L"fish_scan_", result->completions, COMPLETION_REQUEST_AUTOSUGGESTION);
+    result->done = true;
+    return NULL;
+}
+
+static void test_path_completion()
+{
+    say(L"Testing command completion from PATH");
+    if (system("rm -Rf /tmp/fish_path_scan_test/")) err(L"Failed to remove /tmp/fish_path_scan_test/");
+    if (system("mkdir -p /tmp/fish_path_scan_test/1 /tmp/fish_path_scan_test/2 /tmp/fish_path_scan_test/3 /tmp/fish_path_scan_test/4")) err(L"mkdir failed");
+    if (system("cd /tmp/fish_path_scan_test/ && touch 1/fish_scan_b 2/fish_scan_a 2/fish_scan_c 3/fish_scan_plain 4/fish_scan_a && chmod +x 1/* 2/* 4/*")) err(L"touch failed");
+
+    env_push(true);
+    env_set(L"PATH", L"/tmp/fish_path_scan_test/1" ARRAY_SEP_STR L"/tmp/fish_path_scan_test/2" ARRAY_SEP_STR L"/tmp/fish_path_scan_test/3" ARRAY_SEP_STR L"/tmp/fish_path_scan_test/4", ENV_LOCAL | ENV_EXPORT);
+
+    /* The directories are scanned concurrently, but the completions always come out in PATH order */
+    const wchar_t * const expected[] = {L"b", L"a", L"c", L"a"};
+    const size_t expected_count = sizeof expected / sizeof *expected;
+    for (size_t iter = 0; iter < 20; iter++)
+    {
+        std::vector<completion_t> completions;
+        complete(L"fish_scan_", completions, COMPLETION_REQUEST_DEFAULT);
+        bool matches = completions.size() == expected_count;
+        for (size_t i=0; matches && i < expected_count; i++)
+        {
+            matches = completions.at(i).completion == expected[i];
+        }
+        if (! matches)
+        {
+            err(L"Unexpected completions of fish_scan_ from PATH");
+            for (size_t i=0; i < completions.size(); i++)
+            {
+                fprintf(stderr, "\t%ls\n", completions.at(i).completion.c_str());
+            }
+            break;
+        }
+    }
+
+    /* Autosuggestions complete off the main thread, where the scan must not start helpers, so check that with thread assertions on. A failed assertion hangs the thread, so wait for it with a timeout. */
+    path_scan_thread_result_t result;
+    pthread_t thread;
+    enforce_thread_assertions_for_testing(true);
+    if (pthread_create(&thread, NULL, path_completion_thread, &result))
+    {
+        err(L"Failed to start the thread completing from PATH");
+    }
+    else
+    {
+        for (size_t i=0; i < 500 && ! result.done; i++)
+        {
+            usleep(10000);
+        }
+        if (! result.done)
+        {
+            err(L"Completing from PATH off the main thread did not finish");
+            pthread_detach(thread);
+        }
+        else
+        {
+            pthread_join(thread, NULL);
+            if (result.completions.size() != expected_count)
+            {
+                err(L"Unexpected completions of fish_scan_ from PATH off the main thread");
+            }
+        }
+    }
+    enforce_thread_assertions_for_testing(false);
+
+    env_pop();
+    if (system("rm -Rf /tmp/fish_path_scan_test/")) err(L"Failed to remove /tmp/fish_path_scan_test/");
+}
+
+/* Test that the pager filters its completions by the search field */
+static void test_pager_filtering()
+{
+    say(L"Testing pager filtering");
+
+    completion_list_t completions;
+    append_completion(completions, L"alpha", L"First letter");
+    append_completion(completions, L"beta", L"Second letter");
+    append_completion(completions, L"gamma", L"Third letter");
+    append_completion(completions, L"delta", L"Fourth letter");
+
+    pager_t pager;
+    pager.set_prefix(L"x");
+    pager.set_completions(completions);
+    pager.set_term_size(80, 24);
+    pager.set_search_field_shown(true);
+
+    /* Expects the completions that pass the current filter, in order */
+    const struct
+    {
+        const wchar_t *search;
+        const wchar_t *expected;
+    }
+    tests[] =
+    {
+        {L"", L"alpha beta gamma delta"},
+        {L"t", L"alpha beta gamma delta"},
+        {L"ta", L"beta delta"},
+        {L"t", L"alpha beta gamma delta"},
+        {L"th", L"gamma delta"},
+        {L"thi", L"gamma"},
+        {L"x", L"alpha beta gamma delta"},
+        {L"xd", L"delta"},
+        {L"Four", L"delta"},
+        {L"four", L"delta"},
+        {L"ourth L", L""},
+        {L"a", L"alpha beta gamma delta"}
+    };
+    for (size_t i=0; i < sizeof tests / sizeof *tests; i++)
+    {
+        pager.search_field_line.text = tests[i].search;
+        pager.refilter_completions();
+
+        /* Walk the filtered completions by selecting each in turn, until the selection wraps around */
+        page_rendering_t render = pager.render();
+        pager.select_next_completion_in_direction(direction_deselect, render);
+        pager.update_rendering(&render);
+        wcstring got, first;
+        while (pager.select_next_completion_in_direction(direction_next, render))
+        {
+            pager.update_rendering(&render);
+            const completion_t *comp = pager.selected_completion(render);
+            if (comp == NULL || comp->completion == first)
+                break;
+            if (first.empty())
+                first = comp->completion;
+            else
+                got.push_back(L' ');
+            got.append(comp->completion);
+        }
+        if (got != tests[i].expected)
+        {
+            err(L"Filtering by '%ls' gave '%ls', expected '%ls'", tests[i].search, got.c_str(), tests[i].expected);
+        }
+    }
+
+    /* A new prefix changes what the completions match */
+    pager.set_prefix(L"y");
+    pager.search_field_line.text = L"xd";
+    pager.refilter_completions();
+    page_rendering_t render = pager.render();
+    do_test(! pager.select_next_completion_in_direction(direction_next, render));
 }
 
-/** Test path functions */
-static void test_path()
+/* Test that the pager only lays out the completions it shows, so huge lists render quickly */
+static void test_pager_lazy_layout()
 {
-    say(L"Testing path functions");
-
-    wcstring path = L"//foo//////bar/";
-    path_make_canonical(path);
-    if (path != L"/foo/bar")
-    {
-        err(L"Bug in canonical PATH code");
-    }
+    say(L"Testing pager layout of huge lists");
 
-    path = L"/";
-    path_make_canonical(path);
-    if (path != L"/")
+    const size_t count = 100000;
+    completion_list_t completions;
+    completions.reserve(count);
+    for (size_t i=0; i < count; i++)
     {
-        err(L"Bug in canonical PATH code");
+        append_completion(completions, format_string(L"file%06lu.txt", (unsigned long)i), i % 2 ? L"Some  file" : L"");
     }
 
-    if (paths_are_equivalent(L"/foo/bar/baz", L"foo/bar/baz")) err(L"Bug in canonical PATH code on line %ld", (long)__LINE__);
-    if (! paths_are_equivalent(L"///foo///bar/baz", L"/foo/bar////baz//")) err(L"Bug in canonical PATH code on line %ld", (long)__LINE__);
-    if (! paths_are_equivalent(L"/foo/bar/baz", L"/foo/bar/baz")) err(L"Bug in canonical PATH code on line %ld", (long)__LINE__);
-    if (! paths_are_equivalent(L"/", L"/")) err(L"Bug in canonical PATH code on line %ld", (long)__LINE__);
+    double start = timef();
+    pager_t pager;
+    pager.set_term_size(80, 24);
+    pager.set_completions(completions);
+    page_rendering_t render = pager.render();
+    const double msec = (timef() - start) * 1E3;
+
+    /* The list is partially disclosed, in fewer columns than fit "fileNNNNNN.txt" without descriptions */
+    do_test(render.remaining_to_disclose > 0);
+    do_test(render.cols > 0 && render.cols < 5);
+    do_test(render.rows == (count + render.cols - 1) / render.cols);
+
+    /* Moving back from the first completion to the last discloses the list; moving again scrolls to the end, laying it out */
+    do_test(pager.select_next_completion_in_direction(direction_next, render));
+    pager.update_rendering(&render);
+    do_test(pager.select_next_completion_in_direction(direction_prev, render));
+    pager.update_rendering(&render);
+    const completion_t *selected = pager.selected_completion(render);
+    do_test(selected != NULL && selected->completion == completions.back().completion);
+    do_test(pager.select_next_completion_in_direction(direction_prev, render));
+    pager.update_rendering(&render);
+    const size_t selected_row = pager.get_selected_row(render);
+    do_test(selected_row >= render.row_start && selected_row < render.row_end);
+
+    say(L"    (%lu completions rendered in %.02f msec)", (unsigned long)count, msec);
 }
 
 static void test_pager_navigation()
@@ -2004,6 +3327,94 @@ static void test_complete(void)
     do_test(comma_join(complete_get_wrap_chain(L"wrapper2")) == L"wrapper2,wrapper3,wrapper1");
 }
 
+/* Records the partial results reported while completing, and optionally asks to stop */
+class test_completion_progress_t : public completion_progress_t
+{
+public:
+    bool stop;
+    std::vector<size_t> counts;
+
+    test_completion_progress_t(bool s) : stop(s)
+    {
+    }
+
+    bool completions_found(const std::vector<completion_t> &completions)
+    {
+        counts.push_back(completions.size());
+        return ! stop;
+    }
+};
+
+static void test_streaming_completions()
+{
+    say(L"Testing streaming completions");
+
+    /* External commands are only reaped when the SIGCHLD handler is installed */
+    signal_set_handlers();
+    env_push(true);
+    env_set(L"IFS", L"\n", ENV_LOCAL);
+
+    /* Candidates printed before a pause are reported while the generator is still running */
+    complete_add(L"streamtest1", false, 0, NULL, 0, NO_FILES, NULL, L"(command sh -c 'echo alpha; echo beta; sleep 0.5; echo gamma')", NULL, 0);
+    std::vector<completion_t> completions;
+    test_completion_progress_t progress(false);
+    complete(L"streamtest1 ", completions, COMPLETION_REQUEST_DEFAULT, &progress);
+    do_test(completions.size() == 3);
+    do_test(std::find(progress.counts.begin(), progress.counts.end(), 2) != progress.counts.end());
+
+    /* Only candidates matching the token are kept */
+    completions.clear();
+    complete(L"streamtest1 g", completions, COMPLETION_REQUEST_DEFAULT, &progress);
+    do_test(completions.size() == 1 && completions.at(0).completion == L"amma");
+
+    /* Without a receiver of progress, the generator is expanded as usual */
+    completions.clear();
+    complete(L"streamtest1 ", completions, COMPLETION_REQUEST_DEFAULT);
+    do_test(completions.size() == 3);
+
+    /* An endless generator is stopped at the cap (STREAMING_COMPLETIONS_MAX) */
+    complete_add(L"streamtest2", false, 0, NULL, 0, NO_FILES, NULL, L"(command sh -c 'i=0; while true; do i=$((i+1)); echo $i; done')", NULL, 0);
+    completions.clear();
+    test_completion_progress_t capped(false);
+    double start = timef();
+    complete(L"streamtest2 ", completions, COMPLETION_REQUEST_DEFAULT, &capped);
+    do_test(completions.size() == 10000);
+    do_test(timef() - start < 5);
+
+    /* Asking to stop cancels a slow endless generator promptly */
+    complete_add(L"streamtest3", false, 0, NULL, 0, NO_FILES, NULL, L"(command sh -c 'while true; do echo x; sleep 0.01; done')", NULL, 0);
+    completions.clear();
+    test_completion_progress_t stopping(true);
+    start = timef();
+    complete(L"streamtest3 ", completions, COMPLETION_REQUEST_DEFAULT, &stopping);
+    do_test(stopping.counts.size() == 1);
+    do_test(timef() - start < 2);
+
+    /* The parser is usable again afterwards */
+    wcstring_list_t lines;
+    exec_subshell(L"echo ok", lines, false);
+    do_test(lines.size() == 1 && lines.at(0) == L"ok");
+
+    /* Stopping a generator while a script is running, as when completing in read -s, leaves the script's blocks alone */
+    parser_t &parser = parser_t::principal_parser();
+    parser.push_block(new scope_block_t(TOP));
+    completions.clear();
+    test_completion_progress_t stopping_in_script(true);
+    complete(L"streamtest3 ", completions, COMPLETION_REQUEST_DEFAULT, &stopping_in_script);
+    do_test(stopping_in_script.counts.size() == 1);
+    do_test(! parser.current_block()->skip);
+    lines.clear();
+    exec_subshell(L"echo ok", lines, false);
+    do_test(lines.size() == 1 && lines.at(0) == L"ok");
+    parser.pop_block();
+
+    complete_remove(L"streamtest1", false, 0, NULL);
+    complete_remove(L"streamtest2", false, 0, NULL);
+    complete_remove(L"streamtest3", false, 0, NULL);
+    env_pop();
+    signal_reset_handlers();
+}
+
 static void test_1_completion(wcstring line, const wcstring &completion, complete_flags_t flags, bool append_only, wcstring expected, long source_line)
 {
     // str is given with a caret, which we use to represent the cursor position
@@ -2579,6 +3990,10 @@ class history_tests_t
 public:
     static void test_history(void);
     static void test_history_merge(void);
+    static void test_history_index(void);
+    static void test_history_item_cache(void);
+    static void test_history_binary_format(void);
+    static void test_history_lazy_loading(void);
     static void test_history_formats(void);
     static void test_history_speed(void);
 
@@ -2890,6 +4305,332 @@ void history_tests_t::test_history_merge(void)
     delete everything; //not as scary as it looks
 }
 
+/* Count the matches for a term by searching, which consults the history index */
+static size_t count_history_search_matches(history_t &hist, const wcstring &term, enum history_search_type_t type)
+{
+    history_search_t search(hist, term, type);
+    size_t result = 0;
+    while (search.go_backwards())
+        result++;
+    return result;
+}
+
+/* Count the matches for a term by decoding every item. This assumes all items are distinct. */
+static size_t count_history_matches_slowly(history_t &hist, const wcstring &term, enum history_search_type_t type)
+{
+    size_t result = 0;
+    for (size_t i=1; ; i++)
+    {
+        history_item_t item = hist.item_at_index(i);
+        if (item.empty())
+            break;
+        if (item.matches_search(term, type))
+            result++;
+    }
+    return result;
+}
+
+/* Check that searches in the given history find exactly what a brute force search finds */
+static void test_history_index_searches(history_t &hist, size_t expected_count)
+{
+    do_test(count_history_matches_slowly(hist, L"", HISTORY_SEARCH_TYPE_PREFIX) == expected_count);
+
+    const wchar_t * const terms[] = {L"index", L"item 1", L"alpha", L"ha 4", L"tem 24", L"\\n", L"zzz", L"x"};
+    for (size_t i=0; i < sizeof terms / sizeof *terms; i++)
+    {
+        for (int type = HISTORY_SEARCH_TYPE_CONTAINS; type <= HISTORY_SEARCH_TYPE_PREFIX; type++)
+        {
+            history_search_type_t search_type = (history_search_type_t)type;
+            size_t expected = count_history_matches_slowly(hist, terms[i], search_type);
+            size_t actual = count_history_search_matches(hist, terms[i], search_type);
+            if (expected != actual)
+            {
+                err(L"History search for '%ls' found %lu items, expected %lu", terms[i], actual, expected);
+            }
+        }
+    }
+}
+
+void history_tests_t::test_history_index(void)
+{
+    say(L"Testing history index");
+    const wcstring name = L"index_test";
+    wcstring index_path;
+    if (! path_get_config(index_path))
+    {
+        err(L"No config directory for the history index");
+        return;
+    }
+    index_path.append(L"/index_test_history.index");
+
+    history_t *hist = new history_t(name);
+    hist->clear();
+    time_barrier();
+
+    /* The first save creates the file, by rewriting it, which writes a fresh index */
+    for (size_t i=0; i < 200; i++)
+    {
+        hist->add(format_string(L"index item %lu", i));
+    }
+    hist->save();
+
+    /* The second save appends, which extends the index */
+    for (size_t i=0; i < 50; i++)
+    {
+        hist->add(format_string(L"alpha %lu%ls", i, i % 5 ? L"" : L"\\n\n"));
+    }
+    hist->save();
+    delete hist;
+
+    /* A new history should find all of the items via the index */
+    time_barrier();
+    hist = new history_t(name);
+    {
+        scoped_lock locker(hist->lock);
+        hist->load_all_old();
+    }
+    do_test(hist->old_item_offsets.size() == 250);
+    do_test(hist->old_item_signatures.size() == 250);
+    test_history_index_searches(*hist, 250);
+    delete hist;
+
+    /* The index stays open until all of its items are loaded, and is closed with the history */
+    hist = new history_t(name);
+    int index_fd;
+    {
+        scoped_lock locker(hist->lock);
+        hist->load_old_if_needed();
+        index_fd = hist->old_index_fd;
+    }
+    do_test(index_fd >= 0);
+    delete hist;
+    do_test(index_fd < 0 || (fcntl(index_fd, F_GETFD) == -1 && errno == EBADF));
+
+    struct stat buf = {};
+    do_test(wstat(index_path, &buf) == 0 && buf.st_size > 0);
+    const off_t full_index_size = buf.st_size;
+
+    /* A corrupt index must not affect the results, and should get rebuilt */
+    FILE *f = wfopen(index_path, "w");
+    do_test(f != NULL);
+    if (f != NULL)
+    {
+        fputs("garbage", f);
+        fclose(f);
+    }
+    hist = new history_t(name);
+    test_history_index_searches(*hist, 250);
+    do_test(wstat(index_path, &buf) == 0 && buf.st_size == full_index_size);
+    delete hist;
+
+    /* A missing index likewise */
+    wunlink(index_path);
+    hist = new history_t(name);
+    test_history_index_searches(*hist, 250);
+    do_test(wstat(index_path, &buf) == 0 && buf.st_size == full_index_size);
+
+    /* Vacuuming rewrites the index */
+    time_barrier();
+    hist->add(L"index item after vacuum");
+    hist->save_and_vacuum();
+    delete hist;
+    time_barrier();
+    hist = new history_t(name);
+    test_history_index_searches(*hist, 251);
+    do_test(count_history_search_matches(*hist, L"after vacuum", HISTORY_SEARCH_TYPE_CONTAINS) == 1);
+
+    hist->clear();
+    do_test(wstat(index_path, &buf) != 0);
+    delete hist;
+}
+
+void history_tests_t::test_history_item_cache(void)
+{
+    say(L"Testing history item cache");
+    const wcstring name = L"item_cache_test";
+    history_t *hist = new history_t(name);
+    hist->clear();
+    time_barrier();
+    for (size_t i=0; i < 20; i++)
+    {
+        hist->add(format_string(L"cached item %lu", i));
+    }
+    hist->save();
+    delete hist;
+
+    time_barrier();
+    hist = new history_t(name);
+    size_t hits = 0, misses = 0;
+
+    /* The first pass decodes every item, the second finds them all in the cache */
+    for (size_t pass = 0; pass < 2; pass++)
+    {
+        for (size_t i=1; i <= 20; i++)
+        {
+            do_test(hist->item_at_index(i).str() == format_string(L"cached item %lu", 20 - i));
+        }
+    }
+    hist->get_item_cache_stats(&hits, &misses);
+    do_test(hits == 20);
+    do_test(misses == 20);
+
+    /* Remapping the file forgets the cached items */
+    time_barrier();
+    hist->incorporate_external_changes();
+    do_test(hist->item_at_index(1).str() == L"cached item 19");
+    hist->get_item_cache_stats(&hits, &misses);
+    do_test(hits == 20);
+    do_test(misses == 21);
+
+    say(L"    (%lu hits, %lu misses)", hits, misses);
+    hist->clear();
+    delete hist;
+}
+
+void history_tests_t::test_history_lazy_loading(void)
+{
+    say(L"Testing lazy loading of history");
+    const wcstring name = L"lazy_test";
+    const size_t count = 5000;
+    history_t *hist = new history_t(name);
+    hist->clear();
+    time_barrier();
+    hist->disable_automatic_saving();
+    for (size_t i=0; i < count; i++)
+    {
+        hist->add(format_string(L"lazy item %lu", i));
+    }
+    hist->enable_automatic_saving();
+    hist->save();
+    delete hist;
+
+    /* Looking at the most recent item should only load the end of the file */
+    time_barrier();
+    hist = new history_t(name);
+    do_test(hist->item_at_index(1).str() == format_string(L"lazy item %lu", count - 1));
+    do_test(! hist->old_item_offsets.empty() && hist->old_item_offsets.size() < count);
+
+    /* Searching and indexing further back loads the rest */
+    do_test(count_history_search_matches(*hist, L"lazy item 0", HISTORY_SEARCH_TYPE_PREFIX) == 1);
+    do_test(hist->old_item_offsets.size() == count);
+    do_test(hist->item_at_index(count).str() == L"lazy item 0");
+    do_test(hist->item_at_index(count + 1).empty());
+    delete hist;
+
+    /* Damage a record early in the index; we should notice when we get there, and scan instead */
+    wcstring index_path;
+    if (path_get_config(index_path))
+    {
+        index_path.append(L"/lazy_test_history.index");
+        int fd = wopen_cloexec(index_path, O_WRONLY);
+        do_test(fd >= 0);
+        if (fd >= 0)
+        {
+            const char zeros[64] = {};
+            do_test(pwrite(fd, zeros, sizeof zeros, 1024) == (ssize_t)sizeof zeros);
+            close(fd);
+        }
+    }
+    hist = new history_t(name);
+    for (size_t i=1; i <= count; i++)
+    {
+        if (hist->item_at_index(i).str() != format_string(L"lazy item %lu", count - i))
+        {
+            err(L"Wrong lazily loaded history item at index %lu", i);
+            break;
+        }
+    }
+    do_test(hist->item_at_index(count + 1).empty());
+
+    hist->clear();
+    delete hist;
+}
+
+/* Returns the format of the history file with the given name, judging by its first byte */
+static history_file_type_t history_file_type_on_disk(const wcstring &name)
+{
+    history_file_type_t result = history_type_unknown;
+    wcstring path;
+    if (path_get_config(path))
+    {
+        FILE *f = wfopen(path + L"/" + name + L"_history", "r");
+        if (f != NULL)
+        {
+            int c = fgetc(f);
+            if (c == '\0')
+                result = history_type_fish_binary;
+            else if (c == '-')
+                result = history_type_fish_2_0;
+            fclose(f);
+        }
+    }
+    return result;
+}
+
+void history_tests_t::test_history_binary_format(void)
+{
+    say(L"Testing binary history format");
+    const wcstring name = L"binary_test";
+    history_t *hist = new history_t(name);
+    hist->clear();
+    time_barrier();
+
+    /* Write some awkward items in the binary format, first by rewriting the file, then by appending */
+    env_set(L"fish_history_format", L"binary", ENV_GLOBAL);
+    history_item_list_t before;
+    for (size_t i=0; i < 40; i++)
+    {
+        wcstring value = format_string(L"binary item %lu", i);
+        if (i % 4 == 0)
+            value.append(L"\nwith a newline and a \\ backslash");
+        history_item_t item(value, time(NULL));
+        for (size_t j=0; j < i % 3; j++)
+            item.required_paths.push_back(format_string(L"/some path/%lu/%lu", i, j));
+        before.push_back(item);
+        hist->add(item);
+        if (i == 19)
+            hist->save();
+    }
+    hist->save();
+    delete hist;
+    do_test(history_file_type_on_disk(name) == history_type_fish_binary);
+
+    /* Read them back */
+    time_barrier();
+    hist = new history_t(name);
+    for (size_t i=0; i < before.size(); i++)
+    {
+        const history_item_t &bef = before.at(i);
+        const history_item_t aft = hist->item_at_index(before.size() - i);
+        do_test(bef.contents == aft.contents);
+        do_test(bef.creation_timestamp == aft.creation_timestamp);
+        do_test(bef.required_paths == aft.required_paths);
+    }
+    do_test(hist->item_at_index(before.size() + 1).empty());
+    do_test(count_history_search_matches(*hist, L"item 1", HISTORY_SEARCH_TYPE_CONTAINS) == 11);
+    do_test(count_history_search_matches(*hist, L"backslash", HISTORY_SEARCH_TYPE_CONTAINS) == 10);
+
+    /* Switching back to text migrates the file on the next save, keeping everything */
+    env_remove(L"fish_history_format", ENV_GLOBAL);
+    hist->add(L"text item");
+    hist->save();
+    delete hist;
+    do_test(history_file_type_on_disk(name) == history_type_fish_2_0);
+
+    time_barrier();
+    hist = new history_t(name);
+    do_test(hist->item_at_index(1).str() == L"text item");
+    for (size_t i=0; i < before.size(); i++)
+    {
+        const history_item_t aft = hist->item_at_index(before.size() - i + 1);
+        do_test(before.at(i).contents == aft.contents);
+        do_test(before.at(i).required_paths == aft.required_paths);
+    }
+
+    hist->clear();
+    delete hist;
+}
+
 static bool install_sample_history(const wchar_t *name)
 {
     char command[512];
@@ -3629,9 +5370,184 @@ static void test_highlighting(void)
     }
 }
 
+/* Highlights text from scratch */
+static std::vector<highlight_spec_t> full_highlight(const wcstring &text, size_t pos)
+{
+    std::vector<highlight_spec_t> colors;
+    highlight_shell_reset();
+    highlight_shell(text, colors, pos, NULL, env_vars_snapshot_t());
+    return colors;
+}
+
+/* Test that incremental highlighting gives the same colors as highlighting from scratch, and report how much faster it is */
+static void test_incremental_highlighting(void)
+{
+    say(L"Testing incremental highlighting");
+    const wcstring script =
+        L"echo hello; ls /tmp\n"
+        L"for i in (seq 3)\n"
+        L"    echo $i | cat >/dev/null\n"
+        L"end\n"
+        L"fish_no_such_command arg\n"
+        L"if true; echo 'quoted ; text'\n"
+        L"else; cd /\n"
+        L"end\n"
+        L"echo (echo nested; fish_no_such_command)\n"
+        L"# a comment; with a semicolon\n"
+        L"begin; echo )\n"
+        L"end; echo done\n";
+
+    /* Type the script a character at a time, with the cursor at the end */
+    std::vector<highlight_spec_t> colors;
+    highlight_shell_reset();
+    for (size_t len = 0; len <= script.size(); len++)
+    {
+        const wcstring text(script, 0, len);
+        highlight_shell(text, colors, len, NULL, env_vars_snapshot_t());
+        if (colors != full_highlight(text, len))
+        {
+            err(L"Incremental highlighting differs from full highlighting after typing:\n%ls", text.c_str());
+            break;
+        }
+    }
+
+    /* Delete each character in turn, and then put it back, with the cursor at the edit */
+    for (size_t i = 0; i < script.size(); i++)
+    {
+        wcstring text = script;
+        highlight_shell(text, colors, i, NULL, env_vars_snapshot_t());
+        text.erase(i, 1);
+        highlight_shell(text, colors, i, NULL, env_vars_snapshot_t());
+        if (colors != full_highlight(text, i))
+        {
+            err(L"Incremental highlighting differs from full highlighting after deleting at %lu:\n%ls", i, text.c_str());
+            break;
+        }
+    }
+
+    /* Moving the cursor moves the valid path underline */
+    const wcstring paths = L"ls /tmp; ls /usr";
+    highlight_shell(paths, colors, 6, NULL, env_vars_snapshot_t());
+    highlight_shell(paths, colors, paths.size(), NULL, env_vars_snapshot_t());
+    do_test(colors == full_highlight(paths, paths.size()));
+    highlight_shell(paths, colors, 6, NULL, env_vars_snapshot_t());
+    do_test(colors == full_highlight(paths, 6));
+
+    /* Benchmark typing at the end of a long script */
+    wcstring long_script;
+    for (size_t i = 0; i < 300; i++)
+    {
+        append_format(long_script, L"echo line %lu | cat >/dev/null; ls /tmp\n", (unsigned long)i);
+    }
+    const wcstring typed = L"echo the end";
+    double times[2];
+    for (int incremental = 0; incremental < 2; incremental++)
+    {
+        highlight_shell_reset();
+        double start = timef();
+        for (size_t i = 0; i <= typed.size(); i++)
+        {
+            const wcstring text = long_script + typed.substr(0, i);
+            if (! incremental)
+                highlight_shell_reset();
+            highlight_shell(text, colors, text.size(), NULL, env_vars_snapshot_t());
+        }
+        times[incremental] = (timef() - start) * 1E3 / (typed.size() + 1);
+    }
+    say(L"    (%.02f msec per keystroke from scratch, %.02f msec incrementally)", times[0], times[1]);
+    highlight_shell_reset();
+}
+
+/* Test that checks for valid commands and paths are remembered between highlights, and forgotten when they may have changed */
+static void test_highlight_validity_cache(void)
+{
+    say(L"Testing the highlighting validity cache");
+    if (system("mkdir -p /tmp/fish_validity_test/ && touch /tmp/fish_validity_test/somefile"))
+    {
+        err(L"mkdir failed");
+    }
+
+    const env_vars_snapshot_t &vars = env_vars_snapshot_t::current();
+    const wcstring text = L"ls /tmp/fish_validity_test/some; cd /tmp; fish_no_such_command";
+    const size_t path_start = text.find(L"/tmp/fish_validity_test");
+    const size_t cursor = path_start + 5; /* paths are underlined under the cursor */
+    std::vector<highlight_spec_t> colors;
+    unsigned long hits, misses, hits_after, misses_after;
+
+    /* Highlighting a line makes some checks */
+    highlight_shell_reset();
+    highlight_get_validity_stats(&hits, &misses);
+    highlight_shell(text, colors, cursor, NULL, vars);
+    highlight_get_validity_stats(&hits_after, &misses_after);
+    do_test(misses_after > misses);
+    do_test(colors.at(path_start) & highlight_modifier_valid_path);
+
+    /* Highlighting it again (from the start, as after clearing the line) makes none */
+    highlight_shell(L"", colors, 0, NULL, vars);
+    highlight_get_validity_stats(&hits, &misses);
+    highlight_shell(text, colors, cursor, NULL, vars);
+    highlight_get_validity_stats(&hits_after, &misses_after);
+    do_test(misses_after == misses);
+    do_test(hits_after > hits);
+
+    /* Running a command forgets the checks, so a removed file is noticed */
+    if (system("rm -f /tmp/fish_validity_test/somefile"))
+    {
+        err(L"rm failed");
+    }
+    highlight_forget_validity();
+    highlight_shell(L"", colors, 0, NULL, vars);
+    highlight_shell(text, colors, cursor, NULL, vars);
+    do_test(!(colors.at(path_start) & highlight_modifier_valid_path));
+
+    /* That includes the colors kept for unchanged statements, so the same text highlights differently once the command it starts with is defined */
+    const wcstring command_text = L"fish_validity_test_function arg; echo done";
+    highlight_shell(command_text, colors, command_text.size(), NULL, vars);
+    do_test(highlight_get_primary(colors.at(0)) == highlight_spec_error);
+    parser_t::principal_parser().eval(L"function fish_validity_test_function; end", io_chain_t(), TOP);
+    highlight_forget_validity();
+    highlight_shell(command_text, colors, command_text.size(), NULL, vars);
+    do_test(highlight_get_primary(colors.at(0)) == highlight_spec_command);
+    parser_t::principal_parser().eval(L"functions -e fish_validity_test_function", io_chain_t(), TOP);
+    highlight_forget_validity();
+    highlight_shell(command_text, colors, command_text.size(), NULL, vars);
+    do_test(highlight_get_primary(colors.at(0)) == highlight_spec_error);
+
+    /* Changing a variable that affects lookups forgets them too */
+    unsigned int generation = vars.get_generation();
+    env_push(true);
+    env_set(L"CDPATH", L"/", ENV_LOCAL);
+    do_test(vars.get_generation() != generation);
+    highlight_shell(L"", colors, 0, NULL, vars);
+    highlight_get_validity_stats(&hits, &misses);
+    highlight_shell(text, colors, cursor, NULL, vars);
+    highlight_get_validity_stats(&hits_after, &misses_after);
+    do_test(misses_after > misses);
+
+    /* As does the variable going out of scope */
+    generation = vars.get_generation();
+    env_pop();
+    do_test(vars.get_generation() != generation);
+
+    /* Snapshots keep the generation they were taken at */
+    const env_vars_snapshot_t snapshot(env_vars_snapshot_t::highlighting_keys);
+    generation = snapshot.get_generation();
+    env_set(L"CDPATH", L"/", ENV_GLOBAL);
+    env_remove(L"CDPATH", ENV_GLOBAL);
+    do_test(snapshot.get_generation() == generation);
+    do_test(vars.get_generation() != generation);
+
+    highlight_shell_reset();
+    if (system("rm -Rf /tmp/fish_validity_test"))
+    {
+        err(L"rm failed");
+    }
+}
+
 /**
    Main test
 */
+
 int main(int argc, char **argv)
 {
     // Look for the file tests/test.fish. We expect to run in a directory containing that file.
@@ -3672,6 +5588,8 @@ int main(int argc, char **argv)
     signal_reset_handlers();
 
     if (should_test_function("highlighting")) test_highlighting();
+    if (should_test_function("incremental_highlighting")) test_incremental_highlighting();
+    if (should_test_function("highlight_validity_cache")) test_highlight_validity_cache();
     if (should_test_function("new_parser_ll2")) test_new_parser_ll2();
     if (should_test_function("new_parser_fuzzing")) test_new_parser_fuzzing(); //fuzzing is expensive
     if (should_test_function("new_parser_correctness")) test_new_parser_correctness();
@@ -3684,23 +5602,41 @@ int main(int argc, char **argv)
     if (should_test_function("convert_nulls")) test_convert_nulls();
     if (should_test_function("tok")) test_tok();
     if (should_test_function("iothread")) test_iothread();
+    if (should_test_function("iothread_priorities")) test_iothread_priorities();
+    if (should_test_function("iothread_round_trip")) test_iothread_round_trip();
     if (should_test_function("parser")) test_parser();
     if (should_test_function("cancellation")) test_cancellation();
+    if (should_test_function("command_substitution")) test_command_substitution();
+    if (should_test_function("pipeline_streaming")) test_pipeline_streaming();
+    if (should_test_function("pipeline_streaming_terminal")) test_pipeline_streaming_terminal();
+    if (should_test_function("builtin_output_streaming")) test_builtin_output_streaming();
+    if (should_test_function("read_buffering")) test_read_buffering();
+    if (should_test_function("function_calls")) test_function_calls();
     if (should_test_function("indents")) test_indents();
     if (should_test_function("utils")) test_utils();
     if (should_test_function("utf8")) test_utf8();
     if (should_test_function("escape_sequences")) test_escape_sequences();
     if (should_test_function("lru")) test_lru();
     if (should_test_function("expand")) test_expand();
+    if (should_test_function("list_variables")) test_list_variables();
+    if (should_test_function("variable_scopes")) test_variable_scopes();
     if (should_test_function("fuzzy_match")) test_fuzzy_match();
+    if (should_test_function("fuzzy_match_index")) test_fuzzy_match_index();
     if (should_test_function("abbreviations")) test_abbreviations();
     if (should_test_function("test")) test_test();
     if (should_test_function("path")) test_path();
+    if (should_test_function("command_hash")) test_command_hash();
+    if (should_test_function("dir_cache")) test_dir_cache();
+    if (should_test_function("path_completion")) test_path_completion();
+    if (should_test_function("output_frames")) test_output_frames();
+    if (should_test_function("pager_filtering")) test_pager_filtering();
     if (should_test_function("pager_navigation")) test_pager_navigation();
+    if (should_test_function("pager_lazy_layout")) test_pager_lazy_layout();
     if (should_test_function("word_motion")) test_word_motion();
     if (should_test_function("is_potential_path")) test_is_potential_path();
     if (should_test_function("colors")) test_colors();
     if (should_test_function("complete")) test_complete();
+    if (should_test_function("streaming_completions")) test_streaming_completions();
     if (should_test_function("input")) test_input();
     if (should_test_function("universal")) test_universal();
     if (should_test_function("universal")) test_universal_callbacks();
@@ -3711,6 +5647,10 @@ int main(int argc, char **argv)
     if (should_test_function("autosuggest_suggest_special")) test_autosuggest_suggest_special();
     if (should_test_function("history")) history_tests_t::test_history();
     if (should_test_function("history_merge")) history_tests_t::test_history_merge();
+    if (should_test_function("history_index")) history_tests_t::test_history_index();
+    if (should_test_function("history_item_cache")) history_tests_t::test_history_item_cache();
+    if (should_test_function("history_binary_format")) history_tests_t::test_history_binary_format();
+    if (should_test_function("history_lazy_loading")) history_tests_t::test_history_lazy_loading();
     if (should_test_function("history_races")) history_tests_t::test_history_races();
     if (should_test_function("history_formats")) history_tests_t::test_history_formats();
     //history_tests_t::test_history_speed();
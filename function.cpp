@@ -152,6 +152,7 @@ void function_init()
 
 function_info_t::function_info_t(const function_data_t &data, const wchar_t *filename, int def_offset, bool autoload) :
     definition(data.definition),
+    parsed_definition(parse_source(definition, parse_flag_none, NULL)),
     description(data.description),
     definition_file(intern(filename)),
     definition_offset(def_offset),
@@ -163,6 +164,7 @@ function_info_t::function_info_t(const function_data_t &data, const wchar_t *fil
 
 function_info_t::function_info_t(const function_info_t &data, const wchar_t *filename, int def_offset, bool autoload) :
     definition(data.definition),
+    parsed_definition(data.parsed_definition),
     description(data.description),
     definition_file(intern(filename)),
     definition_offset(def_offset),
@@ -261,6 +263,17 @@ bool function_get_definition(const wcstring &name, wcstring *out_definition)
     return func != NULL;
 }
 
+bool function_get_parsed_definition(const wcstring &name, parsed_source_ref_t *out_parsed)
+{
+    scoped_lock lock(functions_lock);
+    const function_info_t *func = function_get(name);
+    if (func && out_parsed)
+    {
+        *out_parsed = func->parsed_definition;
+    }
+    return func != NULL;
+}
+
 wcstring_list_t function_get_named_arguments(const wcstring &name)
 {
     scoped_lock lock(functions_lock);
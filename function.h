@@ -15,6 +15,7 @@
 #include "util.h"
 #include "common.h"
 #include "event.h"
+#include "parse_tree.h"
 
 class parser_t;
 class env_vars_snapshot_t;
@@ -67,6 +68,9 @@ public:
     /** Function definition */
     const wcstring definition;
 
+    /** The definition, parsed once when the function is created so that calls need not reparse it. May be empty if parsing failed, in which case callers fall back to evaluating the definition string. Copies of the function share this tree, since it depends only on the definition. */
+    const parsed_source_ref_t parsed_definition;
+
     /** Function description. Only the description may be changed after the function is created. */
     wcstring description;
 
@@ -109,6 +113,13 @@ void function_remove(const wcstring &name);
 */
 bool function_get_definition(const wcstring &name, wcstring *out_definition);
 
+/**
+   Returns by reference the parsed definition of the function with the name \c name.
+   Returns true if successful, false if no function with the given name exists.
+   The returned reference may be empty if the definition could not be parsed.
+*/
+bool function_get_parsed_definition(const wcstring &name, parsed_source_ref_t *out_parsed);
+
 /**
    Returns by reference the description of the function with the name \c name.
    Returns true if the function exists and has a nonempty description, false if it does not.
@@ -116,9 +116,120 @@ static wcstring apply_working_directory(const wcstring &path, const wcstring &wo
     }
 }
 
-/* Determine if the filesystem containing the given fd is case insensitive. */
+/**
+   How long, in seconds, the validity cache trusts a check
+*/
+#define VALIDITY_CACHE_MAX_AGE 5.0
+
+/**
+   The kinds of checks in the validity cache. Command checks are made for each decoration, so validity_command must be last.
+*/
+enum validity_kind_t
+{
+    /* Whether an argument to cd is a directory we could cd to */
+    validity_cd_path,
+
+    /* Whether a token is the prefix of an existing path, for underlining */
+    validity_potential_path,
+
+    /* Whether the command of a history item exists, for autosuggestions */
+    validity_history_command,
+
+    /* Whether the argument of a cd in a history item is a different directory we could cd to */
+    validity_history_cd,
+
+    /* Whether a path required by a history item exists */
+    validity_history_path,
+
+    /* Whether a command exists, plus the decoration of the statement */
+    validity_command
+};
+
+/**
+   The validity cache remembers the results of the checks the highlighter and autosuggestions make on tokens, which need builtin, function and file system lookups, so that typing on the same line repeats none of them.
+
+   Results are keyed by kind and token. They are forgotten when the working directory or a variable affecting lookups changes (see env_vars_snapshot_t::get_generation), when a command is run, and after VALIDITY_CACHE_MAX_AGE seconds.
+*/
+struct validity_entry_t
+{
+    bool valid;
+    double when;
+};
+
+static pthread_mutex_t s_validity_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::pair<int, wcstring>, validity_entry_t> s_validity_cache;
+static wcstring s_validity_cache_working_directory;
+static unsigned int s_validity_cache_generation = 0;
+static unsigned long s_validity_cache_hits = 0, s_validity_cache_misses = 0;
+
+/* Counts calls to highlight_forget_validity, so that incremental highlighting notices them without the caller taking its locks */
+static unsigned int s_validity_forget_count = 0;
+
+/* Forget everything if it was checked in another directory or with other variables. Call with the lock held. */
+static void validity_cache_check_context(const wcstring &working_directory, const env_vars_snapshot_t &vars)
+{
+    ASSERT_IS_LOCKED(s_validity_cache_lock);
+    const unsigned int generation = vars.get_generation();
+    if (working_directory != s_validity_cache_working_directory || generation != s_validity_cache_generation)
+    {
+        s_validity_cache.clear();
+        s_validity_cache_working_directory = working_directory;
+        s_validity_cache_generation = generation;
+    }
+}
+
+/* Looks up a remembered check. Returns false if there is none. */
+static bool validity_cache_lookup(int kind, const wcstring &token, const wcstring &working_directory, const env_vars_snapshot_t &vars, bool *out_valid)
+{
+    scoped_lock locker(s_validity_cache_lock);
+    validity_cache_check_context(working_directory, vars);
+
+    std::map<std::pair<int, wcstring>, validity_entry_t>::const_iterator iter = s_validity_cache.find(std::make_pair(kind, token));
+    if (iter == s_validity_cache.end() || timef() - iter->second.when >= VALIDITY_CACHE_MAX_AGE)
+    {
+        s_validity_cache_misses++;
+        return false;
+    }
+    s_validity_cache_hits++;
+    *out_valid = iter->second.valid;
+    return true;
+}
+
+/* Remembers a check */
+static void validity_cache_store(int kind, const wcstring &token, const wcstring &working_directory, const env_vars_snapshot_t &vars, bool valid)
+{
+    scoped_lock locker(s_validity_cache_lock);
+    validity_cache_check_context(working_directory, vars);
+
+    validity_entry_t &entry = s_validity_cache[std::make_pair(kind, token)];
+    entry.valid = valid;
+    entry.when = timef();
+}
+
+void highlight_forget_validity(void)
+{
+    scoped_lock locker(s_validity_cache_lock);
+    s_validity_cache.clear();
+    s_validity_forget_count++;
+}
+
+/* Returns how often highlight_forget_validity has been called */
+static unsigned int validity_forget_count(void)
+{
+    scoped_lock locker(s_validity_cache_lock);
+    return s_validity_forget_count;
+}
+
+void highlight_get_validity_stats(unsigned long *hits, unsigned long *misses)
+{
+    scoped_lock locker(s_validity_cache_lock);
+    *hits = s_validity_cache_hits;
+    *misses = s_validity_cache_misses;
+}
+
+/* Determine if the filesystem containing the given directory is case insensitive. */
 typedef std::map<wcstring, bool> case_sensitivity_cache_t;
-bool fs_is_case_insensitive(const wcstring &path, int fd, case_sensitivity_cache_t &case_sensitivity_cache)
+bool fs_is_case_insensitive(const wcstring &path, case_sensitivity_cache_t &case_sensitivity_cache)
 {
     /* If _PC_CASE_SENSITIVE is not defined, assume case sensitive */
     bool result = false;
@@ -133,7 +244,7 @@ bool fs_is_case_insensitive(const wcstring &path, int fd, case_sensitivity_cache
     else
     {
         /* Ask the system. A -1 value means error (so assume case sensitive), a 1 value means case sensitive, and a 0 value means case insensitive */
-        long ret = fpathconf(fd, _PC_CASE_SENSITIVE);
+        long ret = pathconf(wcs2string(path).c_str(), _PC_CASE_SENSITIVE);
         result = (ret == 0);
         case_sensitivity_cache[path] = result;
     }
@@ -228,7 +339,7 @@ bool is_potential_path(const wcstring &const_path, const wcstring_list_t &direct
             }
             else
             {
-                DIR *dir = NULL;
+                dir_listing_ref_t listing;
 
                 /* We do not end with a slash; it does not have to be a directory */
                 const wcstring dir_name = wdirname(abs_path);
@@ -239,18 +350,19 @@ bool is_potential_path(const wcstring &const_path, const wcstring_list_t &direct
                     if (out_path)
                         *out_path = clean_path;
                 }
-                else if ((dir = wopendir(dir_name)))
+                else if ((listing = dir_cache_get_listing(dir_name)))
                 {
-                    // We opened the dir_name; look for a string where the base name prefixes it
-                    wcstring ent;
+                    // We listed the dir_name; look for a string where the base name prefixes it
 
                     // Check if we're case insensitive
-                    bool case_insensitive = fs_is_case_insensitive(dir_name, dirfd(dir), case_sensitivity_cache);
+                    bool case_insensitive = fs_is_case_insensitive(dir_name, case_sensitivity_cache);
 
                     // Don't ask for the is_dir value unless we care, because it can cause extra filesystem acces */
                     bool is_dir = false;
-                    while (wreaddir_resolving(dir, dir_name, ent, require_dir ? &is_dir : NULL))
+                    for (size_t ent_idx = 0; ent_idx < listing->entries.size(); ent_idx++)
                     {
+                        const dir_entry_t &entry = listing->entries.at(ent_idx);
+                        const wcstring &ent = entry.name;
 
                         /* Determine which function to call to check for prefixes */
                         bool (*prefix_func)(const wcstring &, const wcstring &);
@@ -263,7 +375,7 @@ bool is_potential_path(const wcstring &const_path, const wcstring_list_t &direct
                             prefix_func = string_prefixes_string;
                         }
 
-                        if (prefix_func(base_name, ent) && (! require_dir || is_dir))
+                        if (prefix_func(base_name, ent) && (! require_dir || (is_dir = dir_entry_is_dir(dir_name, entry))))
                         {
                             result = true;
                             if (out_path)
@@ -288,7 +400,6 @@ bool is_potential_path(const wcstring &const_path, const wcstring_list_t &direct
                             break;
                         }
                     }
-                    closedir(dir);
                 }
             }
         }
@@ -335,6 +446,18 @@ static bool is_potential_cd_path(const wcstring &path, const wcstring &working_d
     return result;
 }
 
+/* Determine if an argument to cd is valid, consulting the validity cache */
+static bool cd_path_is_valid_cached(const wcstring &param, const wcstring &working_directory, const env_vars_snapshot_t &vars)
+{
+    bool result = false;
+    if (! validity_cache_lookup(validity_cd_path, param, working_directory, vars, &result))
+    {
+        result = is_potential_cd_path(param, working_directory, PATH_EXPAND_TILDE, NULL);
+        validity_cache_store(validity_cd_path, param, working_directory, vars, result);
+    }
+    return result;
+}
+
 /* Given a plain statement node in a parse tree, get the command and return it, expanded appropriately for commands. If we succeed, return true. */
 bool plain_statement_get_expanded_command(const wcstring &src, const parse_node_tree_t &tree, const parse_node_t &plain_statement, wcstring *out_cmd)
 {
@@ -531,7 +654,7 @@ bool autosuggest_validate_from_history(const history_item_t &item, file_detectio
             {
                 suggestionOK = false;
             }
-            else
+            else if (! validity_cache_lookup(validity_history_cd, dir, working_directory, vars, &suggestionOK))
             {
                 wcstring path;
                 bool can_cd = path_get_cdpath(dir, &path, working_directory.c_str(), vars);
@@ -548,6 +671,7 @@ bool autosuggest_validate_from_history(const history_item_t &item, file_detectio
                 {
                     suggestionOK = true;
                 }
+                validity_cache_store(validity_history_cd, dir, working_directory, vars, suggestionOK);
             }
         }
     }
@@ -556,27 +680,32 @@ bool autosuggest_validate_from_history(const history_item_t &item, file_detectio
     if (! handled)
     {
         bool cmd_ok = false;
-
-        if (path_get_path(parsed_command, NULL))
-        {
-            cmd_ok = true;
-        }
-        else if (builtin_exists(parsed_command) || function_exists_no_autoload(parsed_command, vars))
+        if (! validity_cache_lookup(validity_history_command, parsed_command, working_directory, vars, &cmd_ok))
         {
-            cmd_ok = true;
+            if (path_get_path(parsed_command, NULL))
+            {
+                cmd_ok = true;
+            }
+            else if (builtin_exists(parsed_command) || function_exists_no_autoload(parsed_command, vars))
+            {
+                cmd_ok = true;
+            }
+            validity_cache_store(validity_history_command, parsed_command, working_directory, vars, cmd_ok);
         }
 
         if (cmd_ok)
         {
             const path_list_t &paths = item.get_required_paths();
-            if (paths.empty())
-            {
-                suggestionOK= true;
-            }
-            else
+
+            /* Check the paths one at a time, so that the ones checked for earlier items need not be checked again */
+            suggestionOK = true;
+            for (path_list_t::const_iterator iter = paths.begin(); suggestionOK && iter != paths.end(); ++iter)
             {
-                detector.potential_paths = paths;
-                suggestionOK = detector.paths_are_valid(paths);
+                if (! validity_cache_lookup(validity_history_path, *iter, working_directory, vars, &suggestionOK))
+                {
+                    suggestionOK = detector.paths_are_valid(path_list_t(1, *iter));
+                    validity_cache_store(validity_history_path, *iter, working_directory, vars, suggestionOK);
+                }
             }
         }
     }
@@ -973,6 +1102,9 @@ public:
 
     /* Perform highlighting, returning an array of colors */
     const color_array_t &highlight();
+
+    /* Returns the offsets just past the terminators of top-level statements, in order. Highlighting the text from one of these offsets on gives the same colors as highlighting all of it. Offsets after a parse error are left out, since error recovery may have joined statements. */
+    std::vector<size_t> statement_boundaries() const;
 };
 
 void highlighter_t::color_node(const parse_node_t &node, highlight_spec_t color)
@@ -1041,7 +1173,7 @@ void highlighter_t::color_argument(const parse_node_t &node)
 }
 
 // Indicates whether the source range of the given node forms a valid path in the given working_directory
-static bool node_is_potential_path(const wcstring &src, const parse_node_t &node, const wcstring &working_directory)
+static bool node_is_potential_path(const wcstring &src, const parse_node_t &node, const wcstring &working_directory, const env_vars_snapshot_t &vars)
 {
     if (! node.has_source())
         return false;
@@ -1056,8 +1188,12 @@ static bool node_is_potential_path(const wcstring &src, const parse_node_t &node
         if (! token.empty() && token.at(0) == HOME_DIRECTORY)
             token.at(0) = L'~';
 
-        const wcstring_list_t working_directory_list(1, working_directory);
-        result = is_potential_path(token, working_directory_list, PATH_EXPAND_TILDE);
+        if (! validity_cache_lookup(validity_potential_path, token, working_directory, vars, &result))
+        {
+            const wcstring_list_t working_directory_list(1, working_directory);
+            result = is_potential_path(token, working_directory_list, PATH_EXPAND_TILDE);
+            validity_cache_store(validity_potential_path, token, working_directory, vars, result);
+        }
     }
     return result;
 }
@@ -1096,7 +1232,7 @@ void highlighter_t::color_arguments(const parse_node_t &list_node)
             if (expand_one(param, EXPAND_SKIP_CMDSUBST))
             {
                 bool is_help = string_prefixes_string(param, L"--help") || string_prefixes_string(param, L"-h");
-                if (! is_help && this->io_ok && ! is_potential_cd_path(param, working_directory, PATH_EXPAND_TILDE, NULL))
+                if (! is_help && this->io_ok && ! cd_path_is_valid_cached(param, working_directory, vars))
                 {
                     this->color_node(*child, highlight_spec_error);
                 }
@@ -1309,6 +1445,55 @@ static bool command_is_valid(const wcstring &cmd, enum parse_statement_decoratio
     return is_valid;
 }
 
+/* Determine if a command is valid, consulting the validity cache */
+static bool command_is_valid_cached(const wcstring &cmd, enum parse_statement_decoration_t decoration, const wcstring &working_directory, const env_vars_snapshot_t &vars)
+{
+    const int kind = validity_command + decoration;
+    bool result = false;
+    if (! validity_cache_lookup(kind, cmd, working_directory, vars, &result))
+    {
+        result = command_is_valid(cmd, decoration, working_directory, vars);
+        validity_cache_store(kind, cmd, working_directory, vars, result);
+    }
+    return result;
+}
+
+std::vector<size_t> highlighter_t::statement_boundaries() const
+{
+    /* Find where the first error is */
+    size_t first_error = this->buff.size();
+    for (parse_node_tree_t::const_iterator iter = parse_tree.begin(); iter != parse_tree.end(); ++iter)
+    {
+        if (iter->type == parse_special_type_parse_error || iter->type == parse_special_type_tokenizer_error)
+        {
+            first_error = std::min(first_error, iter->has_source() ? (size_t)iter->source_start : 0);
+        }
+    }
+
+    /* Top-level statements are terminated by end tokens in the chain of job lists starting at the root */
+    std::vector<size_t> result;
+    for (parse_node_tree_t::const_iterator iter = parse_tree.begin(); iter != parse_tree.end(); ++iter)
+    {
+        const parse_node_t &node = *iter;
+        if (node.type != parse_token_type_end || ! node.has_source())
+            continue;
+
+        size_t boundary = node.source_start + node.source_length;
+        if (boundary > first_error)
+            continue;
+
+        bool top_level = true;
+        for (const parse_node_t *ancestor = parse_tree.get_parent(node); ancestor != NULL && top_level; ancestor = parse_tree.get_parent(*ancestor))
+        {
+            top_level = (ancestor->type == symbol_job_list);
+        }
+        if (top_level)
+            result.push_back(boundary);
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
 const highlighter_t::color_array_t & highlighter_t::highlight()
 {
     // If we are doing I/O, we must be in a background thread
@@ -1409,7 +1594,7 @@ const highlighter_t::color_array_t & highlighter_t::highlight()
                         bool expanded = expand_one(cmd, EXPAND_SKIP_CMDSUBST | EXPAND_SKIP_VARIABLES | EXPAND_SKIP_JOBS);
                         if (expanded && ! has_expand_reserved(cmd))
                         {
-                            is_valid_cmd = command_is_valid(cmd, decoration, working_directory, vars);
+                            is_valid_cmd = command_is_valid_cached(cmd, decoration, working_directory, vars);
                         }
                     }
                     this->color_node(*cmd_node, is_valid_cmd ? highlight_spec_command : highlight_spec_error);
@@ -1463,7 +1648,7 @@ const highlighter_t::color_array_t & highlighter_t::highlight()
             if (this->cursor_pos >= node.source_start && this->cursor_pos - node.source_start <= node.source_length)
             {
                 /* See if this is a valid path */
-                if (node_is_potential_path(buff, node, working_directory))
+                if (node_is_potential_path(buff, node, working_directory, vars))
                 {
                     /* It is, underline it. */
                     for (size_t i=node.source_start; i < node.source_start + node.source_length; i++)
@@ -1482,24 +1667,98 @@ const highlighter_t::color_array_t & highlighter_t::highlight()
     return color_array;
 }
 
-void highlight_shell(const wcstring &buff, std::vector<highlight_spec_t> &color, size_t pos, wcstring_list_t *error, const env_vars_snapshot_t &vars)
+/* What highlight_shell and highlight_shell_no_io remember about the last text they highlighted, so that the next keystroke only rehighlights from the statement it changed */
+struct incremental_highlight_state_t
+{
+    wcstring text;
+    size_t cursor;
+    wcstring working_directory;
+    std::vector<highlight_spec_t> colors;
+
+    /* The statement boundaries of text, see highlighter_t::statement_boundaries */
+    std::vector<size_t> boundaries;
+
+    /* The value of validity_forget_count when the colors were computed. The colors of valid commands and paths are stale once it moves. */
+    unsigned int forget_count;
+
+    incremental_highlight_state_t() : cursor(CURSOR_POSITION_INVALID), forget_count(0)
+    {
+    }
+};
+
+/* The state for highlighting without and with I/O. They have separate locks so that the main thread never waits for a background highlight. */
+static pthread_mutex_t s_incremental_highlight_locks[2] = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER};
+static incremental_highlight_state_t s_incremental_highlight_states[2];
+
+static void highlight_shell_incremental(const wcstring &buff, std::vector<highlight_spec_t> &color, size_t pos, const env_vars_snapshot_t &vars, bool io_ok)
 {
     /* Do something sucky and get the current working directory on this background thread. This should really be passed in. */
     const wcstring working_directory = env_get_pwd_slash();
+    const unsigned int forget_count = validity_forget_count();
+
+    scoped_lock locker(s_incremental_highlight_locks[io_ok]);
+    incremental_highlight_state_t &state = s_incremental_highlight_states[io_ok];
+
+    const size_t common = std::mismatch(state.text.begin(), state.text.begin() + std::min(state.text.size(), buff.size()), buff.begin()).first - state.text.begin();
+
+    /* A new directory starts from scratch, as does a command having run, since it may have created or removed commands and files */
+    if (state.working_directory != working_directory || state.forget_count != forget_count)
+    {
+        state.boundaries.clear();
+    }
+
+    /* Restart from the last statement boundary that is followed by at least one unchanged character (so the terminator before it tokenizes the same), and that neither the old nor the new cursor is past, since the colors depend on where the cursor is */
+    size_t restart = 0, kept_boundaries = 0;
+    while (kept_boundaries < state.boundaries.size())
+    {
+        const size_t boundary = state.boundaries.at(kept_boundaries);
+        if (boundary >= common || boundary > pos || boundary > state.cursor)
+            break;
+        restart = boundary;
+        kept_boundaries++;
+    }
+
+    const wcstring suffix(buff, restart, wcstring::npos);
+    const size_t suffix_pos = (pos == CURSOR_POSITION_INVALID) ? CURSOR_POSITION_INVALID : pos - restart;
+    highlighter_t highlighter(suffix, suffix_pos, vars, working_directory, io_ok);
+    const std::vector<highlight_spec_t> &suffix_colors = highlighter.highlight();
+
+    color.resize(buff.size());
+    std::copy(state.colors.begin(), state.colors.begin() + restart, color.begin());
+    std::copy(suffix_colors.begin(), suffix_colors.end(), color.begin() + restart);
+
+    /* Remember what we did for next time */
+    const std::vector<size_t> suffix_boundaries = highlighter.statement_boundaries();
+    state.boundaries.resize(kept_boundaries);
+    for (size_t i=0; i < suffix_boundaries.size(); i++)
+    {
+        state.boundaries.push_back(restart + suffix_boundaries.at(i));
+    }
+    state.text = buff;
+    state.cursor = pos;
+    state.working_directory = working_directory;
+    state.forget_count = forget_count;
+    state.colors = color;
+}
 
-    /* Highlight it! */
-    highlighter_t highlighter(buff, pos, vars, working_directory, true /* can do IO */);
-    color = highlighter.highlight();
+void highlight_shell(const wcstring &buff, std::vector<highlight_spec_t> &color, size_t pos, wcstring_list_t *error, const env_vars_snapshot_t &vars)
+{
+    highlight_shell_incremental(buff, color, pos, vars, true /* can do IO */);
 }
 
 void highlight_shell_no_io(const wcstring &buff, std::vector<highlight_spec_t> &color, size_t pos, wcstring_list_t *error, const env_vars_snapshot_t &vars)
 {
-    /* Do something sucky and get the current working directory on this background thread. This should really be passed in. */
-    const wcstring working_directory = env_get_pwd_slash();
+    highlight_shell_incremental(buff, color, pos, vars, false /* no IO allowed */);
+}
 
-    /* Highlight it! */
-    highlighter_t highlighter(buff, pos, vars, working_directory, false /* no IO allowed */);
-    color = highlighter.highlight();
+void highlight_shell_reset(void)
+{
+    for (size_t i=0; i < 2; i++)
+    {
+        scoped_lock locker(s_incremental_highlight_locks[i]);
+        s_incremental_highlight_states[i] = incremental_highlight_state_t();
+    }
+    highlight_forget_validity();
 }
 
 /**
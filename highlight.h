@@ -69,6 +69,11 @@ struct file_detection_context_t;
    stored in the color array as a color_code from the HIGHLIGHT_ enum
    for each character in buff.
 
+   Highlighting is incremental: the text before the last top-level
+   statement that is unchanged since the previous call keeps its
+   colors, and only the rest is parsed and checked again. Commands
+   checked since the command line was started are not looked up again.
+
    \param buff The buffer on which to perform syntax highlighting
    \param color The array in wchich to store the color codes. The first 8 bits are used for fg color, the next 8 bits for bg color.
    \param pos the cursor position. Used for quote matching, etc.
@@ -81,6 +86,21 @@ void highlight_shell(const wcstring &buffstr, std::vector<highlight_spec_t> &col
 */
 void highlight_shell_no_io(const wcstring &buffstr, std::vector<highlight_spec_t> &color, size_t pos, wcstring_list_t *error, const env_vars_snapshot_t &vars);
 
+/**
+   Forgets what highlight_shell and highlight_shell_no_io remember from previous calls, so the next call highlights everything from scratch.
+*/
+void highlight_shell_reset(void);
+
+/**
+   Forgets which commands and paths highlight_shell and autosuggest_validate_from_history found to be valid, and the colors highlight_shell and highlight_shell_no_io would reuse, so the next call highlights everything from scratch. Call this when running a command may have changed that.
+*/
+void highlight_forget_validity(void);
+
+/**
+   Reports how often the validity checks were answered from what highlight_shell and autosuggest_validate_from_history remember. For testing.
+*/
+void highlight_get_validity_stats(unsigned long *hits, unsigned long *misses);
+
 /**
    Perform syntax highlighting for the text in buff. Matching quotes and paranthesis are highlighted. The result is
    stored in the color array as a color_code from the HIGHLIGHT_ enum
@@ -46,6 +46,15 @@ Our history format is intended to be valid YAML. Here it is:
       - /path/to/something_else
 
   Newlines are replaced by \n. Backslashes are replaced by \\.
+
+If the fish_history_format variable is set to "binary", history files are instead written in a binary format, which can be used without any parsing. The file starts with the 8 bytes of HISTORY_BINARY_MAGIC, followed by one record per item. All integers are little-endian. A record is:
+
+  uint32 length of the entire record, including this field
+  int64  timestamp
+  uint32 length of the command, followed by the command in UTF-8
+  uint32 number of paths, followed by each path as a uint32 length and UTF-8
+
+Readers recognize the format of a file from its contents, so switching the variable migrates the file the next time it is saved.
 */
 
 /** When we rewrite the history, the number of items we keep */
@@ -109,6 +118,21 @@ public:
         assert(buffer.at(buffer.size() - 1) == '\0');
     }
 
+    /* Append bytes that may contain nulls */
+    void append_bytes(const char *bytes, size_t len)
+    {
+        size_t required_size = offset + len + 1;
+        if (required_size > buffer.size())
+        {
+            buffer.resize(required_size, '\0');
+        }
+        if (len > 0)
+        {
+            memmove(&buffer.at(offset), bytes, len);
+            offset += len;
+        }
+    }
+
     /* Output to a given fd, resetting our buffer. Returns true on success, false on error */
     bool flush_to_fd(int fd)
     {
@@ -208,6 +232,44 @@ public:
     }
 };
 
+/** The number of index records we read at a time when loading old items */
+#define HISTORY_LOAD_CHUNK_SIZE 1024
+
+/** The number of decoded old items we keep around */
+#define HISTORY_ITEM_CACHE_SIZE 1024
+
+/* Our item cache remembers decoded old items, since the same items are typically visited over and over by autosuggestion and history navigation. The key is the item's offset in the mmap'd file. */
+class history_item_cache_node_t : public lru_node_t
+{
+public:
+    const history_item_t item;
+    history_item_cache_node_t(size_t offset, const history_item_t &pitem) :
+        lru_node_t(to_string(static_cast<long>(offset))),
+        item(pitem)
+    {}
+};
+
+class history_item_cache_t : public lru_cache_t<history_item_cache_node_t>
+{
+protected:
+
+    /* Override to delete evicted nodes */
+    virtual void node_was_evicted(history_item_cache_node_t *node)
+    {
+        delete node;
+    }
+
+public:
+    history_item_cache_t(size_t max) : lru_cache_t<history_item_cache_node_t>(max) { }
+
+    /* Returns the item at the given offset, or NULL if it's not cached */
+    const history_item_t *get_item(size_t offset)
+    {
+        const history_item_cache_node_t *node = this->get_node(to_string(static_cast<long>(offset)));
+        return node ? &node->item : NULL;
+    }
+};
+
 static pthread_mutex_t hist_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static std::map<wcstring, history_t *> histories;
@@ -291,6 +353,76 @@ static void append_yaml_to_buffer(const wcstring &wcmd, time_t timestamp, const
     }
 }
 
+/* The binary history format starts with these bytes. The leading null keeps it from being mistaken for either text format. The trailing digit is the version of the format. */
+static const char HISTORY_BINARY_MAGIC[8] = {'\0', 'f', 'i', 's', 'h', 'h', 's', '1'};
+
+/* The size of a binary record with an empty command and no paths: the record length, timestamp, command length and path count */
+#define HISTORY_BINARY_RECORD_MIN_SIZE (4 + 8 + 4 + 4)
+
+static void append_uint32_le(uint32_t val, history_output_buffer_t *buffer)
+{
+    char bytes[4];
+    for (size_t i=0; i < sizeof bytes; i++)
+    {
+        bytes[i] = (char)((val >> (8 * i)) & 0xFF);
+    }
+    buffer->append_bytes(bytes, sizeof bytes);
+}
+
+static void append_uint64_le(uint64_t val, history_output_buffer_t *buffer)
+{
+    append_uint32_le((uint32_t)(val & 0xFFFFFFFF), buffer);
+    append_uint32_le((uint32_t)(val >> 32), buffer);
+}
+
+static uint32_t read_uint32_le(const char *bytes)
+{
+    const unsigned char *ubytes = (const unsigned char *)bytes;
+    return (uint32_t)ubytes[0] | ((uint32_t)ubytes[1] << 8) | ((uint32_t)ubytes[2] << 16) | ((uint32_t)ubytes[3] << 24);
+}
+
+static uint64_t read_uint64_le(const char *bytes)
+{
+    return (uint64_t)read_uint32_le(bytes) | ((uint64_t)read_uint32_le(bytes + 4) << 32);
+}
+
+/* Append a record in the binary history format to the provided buffer */
+static void append_binary_to_buffer(const wcstring &wcmd, time_t timestamp, const path_list_t &required_paths, history_output_buffer_t *buffer)
+{
+    const std::string cmd = wcs2string(wcmd);
+    std::vector<std::string> paths;
+    size_t record_length = HISTORY_BINARY_RECORD_MIN_SIZE + cmd.size();
+    for (path_list_t::const_iterator iter = required_paths.begin(); iter != required_paths.end(); ++iter)
+    {
+        paths.push_back(wcs2string(*iter));
+        record_length += 4 + paths.back().size();
+    }
+
+    append_uint32_le((uint32_t)record_length, buffer);
+    append_uint64_le((uint64_t)(int64_t)timestamp, buffer);
+    append_uint32_le((uint32_t)cmd.size(), buffer);
+    buffer->append_bytes(cmd.data(), cmd.size());
+    append_uint32_le((uint32_t)paths.size(), buffer);
+    for (size_t i=0; i < paths.size(); i++)
+    {
+        append_uint32_le((uint32_t)paths.at(i).size(), buffer);
+        buffer->append_bytes(paths.at(i).data(), paths.at(i).size());
+    }
+}
+
+/* Append an item to the provided buffer in the given format */
+static void append_item_to_buffer(history_file_type_t type, const wcstring &wcmd, time_t timestamp, const path_list_t &required_paths, history_output_buffer_t *buffer)
+{
+    if (type == history_type_fish_binary)
+    {
+        append_binary_to_buffer(wcmd, timestamp, required_paths, buffer);
+    }
+    else
+    {
+        append_yaml_to_buffer(wcmd, timestamp, required_paths, buffer);
+    }
+}
+
 // Parse a timestamp line that looks like this: spaces, "when:", spaces, timestamp, newline
 // The string is NOT null terminated; however we do know it contains a newline, so stop when we reach it
 static bool parse_timestamp(const char *str, time_t *out_when)
@@ -502,6 +634,34 @@ static size_t offset_of_next_item_fish_1_x(const char *begin, size_t mmap_length
     return result;
 }
 
+// Same as offset_of_next_item_fish_2_0, but for the binary format. Records are length-prefixed, so we can hop from one to the next without looking at their contents.
+static size_t offset_of_next_item_binary(const char *begin, size_t mmap_length, size_t *inout_cursor, time_t cutoff_timestamp)
+{
+    size_t cursor = std::max(*inout_cursor, sizeof HISTORY_BINARY_MAGIC);
+    size_t result = (size_t)(-1);
+    while (cursor < mmap_length && mmap_length - cursor >= HISTORY_BINARY_RECORD_MIN_SIZE)
+    {
+        const char *record = begin + cursor;
+        size_t record_length = read_uint32_le(record);
+
+        /* A record that is too short or runs off the end is corrupt or still being written. Either way we can't find the next one. */
+        if (record_length < HISTORY_BINARY_RECORD_MIN_SIZE || record_length > mmap_length - cursor)
+            break;
+
+        size_t offset = cursor;
+        cursor += record_length;
+
+        /* Skip items created after our cutoff */
+        if (cutoff_timestamp != 0 && (int64_t)read_uint64_le(record + 4) > (int64_t)cutoff_timestamp)
+            continue;
+
+        result = offset;
+        break;
+    }
+    *inout_cursor = cursor;
+    return result;
+}
+
 // Returns the offset of the next item based on the given history type, or -1
 static size_t offset_of_next_item(const char *begin, size_t mmap_length, history_file_type_t mmap_type, size_t *inout_cursor, time_t cutoff_timestamp)
 {
@@ -516,6 +676,10 @@ static size_t offset_of_next_item(const char *begin, size_t mmap_length, history
             result = offset_of_next_item_fish_1_x(begin, mmap_length, inout_cursor, cutoff_timestamp);
             break;
 
+        case history_type_fish_binary:
+            result = offset_of_next_item_binary(begin, mmap_length, inout_cursor, cutoff_timestamp);
+            break;
+
         default:
         case history_type_unknown:
             // Oh well
@@ -545,6 +709,12 @@ history_t::history_t(const wcstring &pname) :
     boundary_timestamp(time(NULL)),
     countdown_to_vacuum(-1),
     loaded_old(false),
+    old_index_fd(-1),
+    old_index_unloaded_count(0),
+    old_index_limit(0),
+    item_cache(new history_item_cache_t(HISTORY_ITEM_CACHE_SIZE)),
+    item_cache_hits(0),
+    item_cache_misses(0),
     chaos_mode(false)
 {
     pthread_mutex_init(&lock, NULL);
@@ -552,6 +722,12 @@ history_t::history_t(const wcstring &pname) :
 
 history_t::~history_t()
 {
+    if (old_index_fd >= 0)
+    {
+        close(old_index_fd);
+    }
+    item_cache->evict_all_nodes();
+    delete item_cache;
     pthread_mutex_destroy(&lock);
 }
 
@@ -689,7 +865,7 @@ void history_t::get_string_representation(wcstring *result, const wcstring &sepa
     }
 
     /* Append old items */
-    load_old_if_needed();
+    load_all_old();
     for (std::deque<size_t>::reverse_iterator iter = old_item_offsets.rbegin(); iter != old_item_offsets.rend(); ++iter)
     {
         size_t offset = *iter;
@@ -724,18 +900,72 @@ history_item_t history_t::item_at_index(size_t idx)
     /* Now look in our old items */
     idx -= new_item_count;
     load_old_if_needed();
+    while (idx >= old_item_offsets.size() && load_old_chunk())
+        ;
     size_t old_item_count = old_item_offsets.size();
     if (idx < old_item_count)
     {
         /* idx=0 corresponds to last item in old_item_offsets */
         size_t offset = old_item_offsets.at(old_item_count - idx - 1);
-        return history_t::decode_item(mmap_start + offset, mmap_length - offset, mmap_type);
+        return this->decode_old_item(offset);
     }
 
     /* Index past the valid range, so return an empty history item */
     return history_item_t(wcstring(), 0);
 }
 
+history_item_t history_t::decode_old_item(size_t offset)
+{
+    ASSERT_IS_LOCKED(lock);
+    const history_item_t *cached = item_cache->get_item(offset);
+    if (cached != NULL)
+    {
+        item_cache_hits++;
+        return *cached;
+    }
+
+    item_cache_misses++;
+    const history_item_t item = history_t::decode_item(mmap_start + offset, mmap_length - offset, mmap_type);
+    item_cache->add_node(new history_item_cache_node_t(offset, item));
+    return item;
+}
+
+void history_t::get_item_cache_stats(size_t *hits, size_t *misses)
+{
+    scoped_lock locker(lock);
+    *hits = item_cache_hits;
+    *misses = item_cache_misses;
+}
+
+size_t history_t::next_possible_match(size_t idx, history_signature_t term_signature)
+{
+    scoped_lock locker(lock);
+
+    /* New items are not indexed */
+    assert(idx > 0);
+    size_t new_item_count = new_items.size();
+    if (idx <= new_item_count)
+    {
+        return idx;
+    }
+
+    /* Walk backwards through the signatures of the old items, looking for one with all the bits of the term */
+    load_old_if_needed();
+    size_t old_idx = idx - new_item_count - 1;
+    for (;;)
+    {
+        /* Loading a chunk pushes onto the front, so indexes counted from the end stay valid */
+        size_t old_item_count = old_item_signatures.size();
+        while (old_idx < old_item_count && (old_item_signatures.at(old_item_count - old_idx - 1) & term_signature) != term_signature)
+        {
+            old_idx++;
+        }
+        if (old_idx < old_item_count || ! load_old_chunk())
+            break;
+    }
+    return old_idx + new_item_count + 1;
+}
+
 /* Read one line, stripping off any newline, and updating cursor. Note that our input string is NOT null terminated; it's just a memory mapped file. */
 static size_t read_line(const char *base, size_t cursor, size_t len, std::string &result)
 {
@@ -872,11 +1102,52 @@ history_item_t history_t::decode_item(const char *base, size_t len, history_file
             return history_t::decode_item_fish_1_x(base, len);
         case history_type_fish_2_0:
             return history_t::decode_item_fish_2_0(base, len);
+        case history_type_fish_binary:
+            return history_t::decode_item_binary(base, len);
         default:
             return history_item_t(L"");
     }
 }
 
+/* Decode an item via the binary format. Everything is bounds-checked against the record length, which is itself checked against the available data. */
+history_item_t history_t::decode_item_binary(const char *base, size_t len)
+{
+    wcstring cmd;
+    time_t when = 0;
+    path_list_t paths;
+
+    size_t record_length = (len >= HISTORY_BINARY_RECORD_MIN_SIZE ? read_uint32_le(base) : 0);
+    if (record_length >= HISTORY_BINARY_RECORD_MIN_SIZE && record_length <= len)
+    {
+        when = (time_t)(int64_t)read_uint64_le(base + 4);
+        size_t cursor = 12;
+        size_t cmd_length = read_uint32_le(base + cursor);
+        cursor += 4;
+
+        /* The command must leave room for the path count */
+        if (cmd_length <= record_length - cursor - 4)
+        {
+            cmd = str2wcstring(base + cursor, cmd_length);
+            cursor += cmd_length;
+            size_t path_count = read_uint32_le(base + cursor);
+            cursor += 4;
+            while (path_count-- > 0 && record_length - cursor >= 4)
+            {
+                size_t path_length = read_uint32_le(base + cursor);
+                cursor += 4;
+                if (path_length > record_length - cursor)
+                    break;
+                paths.push_back(str2wcstring(base + cursor, path_length));
+                cursor += path_length;
+            }
+        }
+    }
+
+    history_item_t result(cmd, when);
+    result.required_paths.swap(paths);
+    return result;
+}
+
 /**
    Remove backslashes from all newlines. This makes a string from the
    history file better formated for on screen display.
@@ -996,7 +1267,11 @@ history_item_t history_t::decode_item_fish_1_x(const char *begin, size_t length)
 static history_file_type_t infer_file_type(const char *data, size_t len)
 {
     history_file_type_t result = history_type_unknown;
-    if (len > 0)
+    if (len >= sizeof HISTORY_BINARY_MAGIC && ! memcmp(data, HISTORY_BINARY_MAGIC, sizeof HISTORY_BINARY_MAGIC))
+    {
+        result = history_type_fish_binary;
+    }
+    else if (len > 0)
     {
         /* Old fish started with a # */
         if (data[0] == '#')
@@ -1012,9 +1287,428 @@ static history_file_type_t infer_file_type(const char *data, size_t len)
     return result;
 }
 
+/*
+
+The history index is a binary file stored next to the history file, with the suffix ".index". It consists of a header identifying the history file it describes, followed by one record for each item in the history file, in file order. Its purpose is to let us find old items without scanning the history file, and to let searches rule out items without decoding them.
+
+Since a history file is only appended to until it is vacuumed (which replaces it via rename()), the device and inode are enough to identify it. The index is in native byte order; an index written by a different machine simply fails to validate and is rebuilt.
+
+Only fish 2.0 and binary history files are indexed.
+*/
+
+/** Magic bytes at the start of a history index. The trailing digit is the version of the format. */
+static const char HISTORY_INDEX_MAGIC[8] = {'f', 'i', 's', 'h', 'i', 'd', 'x', '1'};
+
+/** The signature that matches every term, used for items that have not been indexed */
+#define HISTORY_SIGNATURE_ANY (~(history_signature_t)0)
+
+struct history_index_header_t
+{
+    char magic[sizeof HISTORY_INDEX_MAGIC];
+    uint64_t device;
+    uint64_t inode;
+};
+
+struct history_index_record_t
+{
+    /* Offset of the item in the history file */
+    uint64_t offset;
+
+    /* Offset just past the item. Appended items are expected to start here. */
+    uint64_t end;
+
+    /* Timestamp of the item, or 0 if it has none */
+    int64_t timestamp;
+
+    /* Signature of the item's command */
+    uint64_t signature;
+};
+
+typedef std::vector<history_index_record_t> history_index_t;
+
+/* Compute the signature of the given bytes. Each trigram sets one of the 64 bits, so any string contained in these bytes has a signature whose bits are a subset of the result. */
+static history_signature_t history_signature_for_bytes(const char *str, size_t len)
+{
+    history_signature_t result = 0;
+    for (size_t i=0; i + 3 <= len; i++)
+    {
+        uint32_t trigram = ((uint32_t)(unsigned char)str[i] << 16) | ((uint32_t)(unsigned char)str[i + 1] << 8) | (unsigned char)str[i + 2];
+        /* Fibonacci hashing; the top six bits select the bit */
+        uint32_t hash = trigram * 2654435761u;
+        result |= (history_signature_t)1 << (hash >> 26);
+    }
+    return result;
+}
+
+/* Compute the signature of a string, as it appears in a decoded history item */
+static history_signature_t history_signature_for_string(const wcstring &str)
+{
+    const std::string narrow = wcs2string(str);
+    return history_signature_for_bytes(narrow.data(), narrow.size());
+}
+
+/* Compute the signature of the fish 2.0 item at the given location. We unescape the command, but do not bother decoding it into a wide string: str2wcstring and wcs2string map characters to bytes one by one, so the result is the same as history_signature_for_string of the decoded command. */
+static history_signature_t signature_of_item_fish_2_0(const char *base, size_t len)
+{
+    std::string line;
+    read_line(base, 0, len, line);
+    trim_leading_spaces(line);
+
+    /* Find the command after "- cmd:", the same way decode_item_fish_2_0 does. If it's missing, the item decodes as empty, which never matches anything. */
+    size_t where = line.find(':');
+    if (where == std::string::npos)
+        return 0;
+    size_t val_start = where + 1;
+    if (val_start < line.size() && line.at(val_start) == ' ')
+        val_start++;
+    line.erase(0, val_start);
+    unescape_yaml(&line);
+    return history_signature_for_bytes(line.data(), line.size());
+}
+
+/* Find the timestamp of the fish 2.0 item at the given location, or 0 if it has none */
+static time_t timestamp_of_item_fish_2_0(const char *base, size_t len)
+{
+    time_t timestamp = 0;
+    for (const char *interior_line = next_line(base, len);
+            interior_line != NULL && interior_line[0] == ' ';
+            interior_line = next_line(interior_line, base + len - interior_line))
+    {
+        if (parse_timestamp(interior_line, &timestamp))
+            break;
+    }
+    return timestamp;
+}
+
+/* Scan a history file starting at the given cursor, appending a record for each item found */
+static void index_items(const char *base, size_t len, history_file_type_t type, size_t cursor, history_index_t *index)
+{
+    const size_t first_new_record = index->size();
+    for (;;)
+    {
+        size_t offset = offset_of_next_item(base, len, type, &cursor, 0);
+        if (offset == (size_t)(-1))
+            break;
+
+        history_index_record_t record;
+        record.offset = offset;
+        if (type == history_type_fish_binary)
+        {
+            /* Binary records know their extent, and keep their timestamp and command in the open */
+            const char *item = base + offset;
+            size_t record_length = read_uint32_le(item);
+            size_t cmd_length = std::min((size_t)read_uint32_le(item + 12), record_length - HISTORY_BINARY_RECORD_MIN_SIZE);
+            record.end = offset + record_length;
+            record.timestamp = (int64_t)read_uint64_le(item + 4);
+            record.signature = history_signature_for_bytes(item + 16, cmd_length);
+        }
+        else
+        {
+            /* The previous item ends where this one begins */
+            if (index->size() > first_new_record)
+                index->back().end = offset;
+
+            record.end = len;
+            record.timestamp = timestamp_of_item_fish_2_0(base + offset, len - offset);
+            record.signature = signature_of_item_fish_2_0(base + offset, len - offset);
+        }
+        index->push_back(record);
+    }
+}
+
+/* Check that an item of the given type appears to start at the given offset */
+static bool history_item_starts_at(const char *base, size_t len, history_file_type_t type, const history_index_record_t &record)
+{
+    if (type == history_type_fish_binary)
+    {
+        return len - record.offset >= 4 && read_uint32_le(base + record.offset) == record.end - record.offset;
+    }
+    else
+    {
+        const char *cmd = "- cmd:";
+        const size_t cmd_len = strlen(cmd);
+        return len - record.offset >= cmd_len && ! memcmp(base + record.offset, cmd, cmd_len);
+    }
+}
+
+static bool history_index_header_matches(const history_index_header_t &header, const file_id_t &history_file_id)
+{
+    return ! memcmp(header.magic, HISTORY_INDEX_MAGIC, sizeof header.magic) &&
+           header.device == (uint64_t)history_file_id.device &&
+           header.inode == (uint64_t)history_file_id.inode;
+}
+
+/* Read count records from an open index, starting with the record at index first. Returns true on success. */
+static bool read_history_index_records(int fd, size_t first, size_t count, history_index_t *records)
+{
+    const size_t record_size = sizeof(history_index_record_t);
+    records->resize(count);
+    if (count == 0)
+        return true;
+    off_t where = (off_t)(sizeof(history_index_header_t) + first * record_size);
+    return pread(fd, &records->at(0), count * record_size, where) == (ssize_t)(count * record_size);
+}
+
+/* Open the index at the given path, if it describes the given mapped history file. Returns the file descriptor, or -1 if there is no usable index. Returns by reference the number of records that describe items in the mapped file (records for items appended after we mapped the file are ignored), and the offset at which the last of them ends. Only the last record is checked here; the others are checked as they are read. */
+static int open_history_index(const wcstring &path, const file_id_t &history_file_id, const char *base, size_t len, history_file_type_t type, size_t *out_count, size_t *out_end)
+{
+    if (history_file_id == kInvalidFileID)
+        return -1;
+
+    int fd = wopen_cloexec(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    bool ok = false;
+    size_t count = 0;
+    history_index_record_t last = {};
+    history_index_header_t header;
+    struct stat buf = {};
+    if (fstat(fd, &buf) == 0 && buf.st_size >= (off_t)sizeof header &&
+            pread(fd, &header, sizeof header, 0) == (ssize_t)sizeof header &&
+            history_index_header_matches(header, history_file_id))
+    {
+        /* Ignore any partially written record at the end */
+        count = ((size_t)buf.st_size - sizeof header) / sizeof(history_index_record_t);
+        ok = true;
+
+        /* Skip records for items appended after we mapped the file */
+        history_index_t records;
+        while (ok && count > 0)
+        {
+            ok = read_history_index_records(fd, count - 1, 1, &records);
+            if (ok)
+            {
+                last = records.at(0);
+                if (last.end <= len)
+                    break;
+                count--;
+            }
+        }
+
+        /* Check that the last record really points at an item */
+        if (ok && count > 0)
+        {
+            ok = (last.offset < last.end && history_item_starts_at(base, len, type, last));
+        }
+    }
+
+    if (! ok)
+    {
+        close(fd);
+        return -1;
+    }
+    *out_count = count;
+    *out_end = (count > 0 ? (size_t)last.end : 0);
+    return fd;
+}
+
+/* Create a temporary file from the given template (which must end in XXXXXX), opened for writing. Returns the file descriptor, or -1 on failure. */
+static int create_temporary_file(const wcstring &name_template, wcstring *out_path)
+{
+    /* Try to create a temporary file, up to 10 times. We don't use mkstemps because we want to open it CLO_EXEC. This should almost always succeed on the first try. */
+    int out_fd = -1;
+    for (size_t attempt = 0; attempt < 10 && out_fd == -1; attempt++)
+    {
+        char *narrow_str = wcs2str(name_template.c_str());
+#if HAVE_MKOSTEMP
+        out_fd = mkostemp(narrow_str, O_WRONLY | O_CREAT | O_EXCL | O_TRUNC | O_CLOEXEC);
+        if (out_fd >= 0)
+        {
+            *out_path = str2wcstring(narrow_str);
+        }
+#else
+        if (narrow_str && mktemp(narrow_str))
+        {
+            /* It was successfully templated; try opening it atomically */
+            *out_path = str2wcstring(narrow_str);
+            out_fd = wopen_cloexec(*out_path, O_WRONLY | O_CREAT | O_EXCL | O_TRUNC, 0644);
+        }
+#endif
+        free(narrow_str);
+    }
+    return out_fd;
+}
+
+/* Write out a complete index for the given history file, atomically replacing any existing index */
+static bool write_history_index(const wcstring &path, const file_id_t &history_file_id, const history_index_t &index)
+{
+    wcstring tmp_path;
+    int fd = create_temporary_file(path + L".XXXXXX", &tmp_path);
+    if (fd < 0)
+        return false;
+
+    history_index_header_t header = {};
+    memcpy(header.magic, HISTORY_INDEX_MAGIC, sizeof header.magic);
+    header.device = (uint64_t)history_file_id.device;
+    header.inode = (uint64_t)history_file_id.inode;
+
+    bool ok = write_loop(fd, (const char *)&header, sizeof header) >= 0;
+    if (ok && ! index.empty())
+    {
+        ok = write_loop(fd, (const char *)&index.at(0), index.size() * sizeof(history_index_record_t)) >= 0;
+    }
+    close(fd);
+
+    if (ok)
+    {
+        ok = (wrename(tmp_path, path) == 0);
+    }
+    if (! ok)
+    {
+        wunlink(tmp_path);
+    }
+    return ok;
+}
+
+/* Append records for newly appended history items to the index. This must be called while holding the write lock on the history file. The records are only appended if the index describes the history file and covers everything up to the first new item; otherwise we leave the index alone, and the uncovered items are scanned when the history file is next loaded. */
+static void append_to_history_index(const wcstring &path, const file_id_t &history_file_id, const history_index_t &new_records)
+{
+    if (new_records.empty())
+        return;
+
+    int fd = wopen_cloexec(path, O_RDWR | O_APPEND);
+    if (fd < 0)
+        return;
+
+    history_index_header_t header;
+    struct stat buf = {};
+    if (fstat(fd, &buf) == 0 &&
+            pread(fd, &header, sizeof header, 0) == (ssize_t)sizeof header &&
+            history_index_header_matches(header, history_file_id))
+    {
+        /* Find where the existing records say the next item begins */
+        const size_t record_size = sizeof(history_index_record_t);
+        size_t count = ((size_t)buf.st_size - sizeof header) / record_size;
+        bool contiguous = false;
+        if ((size_t)buf.st_size != sizeof header + count * record_size)
+        {
+            /* A partially written record; don't touch it */
+        }
+        else if (count == 0)
+        {
+            contiguous = (new_records.front().offset == 0);
+        }
+        else
+        {
+            history_index_record_t last;
+            off_t last_offset = (off_t)(sizeof header + (count - 1) * record_size);
+            contiguous = (pread(fd, &last, record_size, last_offset) == (ssize_t)record_size &&
+                          last.end == new_records.front().offset);
+        }
+
+        if (contiguous)
+        {
+            write_loop(fd, (const char *)&new_records.at(0), new_records.size() * record_size);
+        }
+    }
+    close(fd);
+}
+
+void history_t::populate_from_index(void)
+{
+    const wcstring index_path = history_filename(name, L".index");
+    history_index_t records;
+    size_t record_count = 0, indexed_end = 0;
+    int fd = open_history_index(index_path, mmap_file_id, mmap_start, mmap_length, mmap_type, &record_count, &indexed_end);
+    if (fd >= 0)
+    {
+        /* Scan whatever the index doesn't cover, which is normally nothing. The indexed items are loaded later, as they are needed, by load_old_chunk(). */
+        index_items(mmap_start, mmap_length, mmap_type, indexed_end, &records);
+        if (old_index_fd >= 0)
+        {
+            close(old_index_fd);
+        }
+        old_index_fd = fd;
+        old_index_unloaded_count = record_count;
+        old_index_limit = indexed_end;
+    }
+    else
+    {
+        /* No usable index, so scan the whole file. Don't write out an index for a file we don't have an identity for, e.g. one that has been deleted. */
+        index_items(mmap_start, mmap_length, mmap_type, 0, &records);
+        if (mmap_file_id != kInvalidFileID)
+        {
+            write_history_index(index_path, mmap_file_id, records);
+        }
+    }
+
+    /* Skip items created after our boundary timestamp, just like offset_of_next_item does */
+    for (size_t i=0; i < records.size(); i++)
+    {
+        const history_index_record_t &record = records.at(i);
+        if (record.timestamp > (int64_t)boundary_timestamp)
+            continue;
+        old_item_offsets.push_back((size_t)record.offset);
+        old_item_signatures.push_back(record.signature);
+    }
+}
+
+bool history_t::load_old_chunk(void)
+{
+    ASSERT_IS_LOCKED(lock);
+    if (old_index_fd < 0)
+        return false;
+
+    /* Read the chunk of records just before the ones we've loaded. Each must end before the next begins. */
+    size_t count = std::min(old_index_unloaded_count, (size_t)HISTORY_LOAD_CHUNK_SIZE);
+    size_t first = old_index_unloaded_count - count;
+    history_index_t records;
+    bool ok = read_history_index_records(old_index_fd, first, count, &records);
+    uint64_t limit = old_index_limit;
+    for (size_t i = count; ok && i--;)
+    {
+        const history_index_record_t &record = records.at(i);
+        ok = (record.offset < record.end && record.end <= limit);
+        limit = record.offset;
+    }
+
+    if (! ok)
+    {
+        /* The index has been damaged. Scan the part of the file we haven't loaded; no item there extends past old_index_limit, since an item starts there. */
+        records.clear();
+        index_items(mmap_start, old_index_limit, mmap_type, 0, &records);
+        first = 0;
+        limit = 0;
+    }
+
+    /* Push onto the front, newest first, skipping items created after our boundary timestamp */
+    for (size_t i = records.size(); i--;)
+    {
+        const history_index_record_t &record = records.at(i);
+        if (record.timestamp > (int64_t)boundary_timestamp)
+            continue;
+        old_item_offsets.push_front((size_t)record.offset);
+        old_item_signatures.push_front(record.signature);
+    }
+
+    old_index_unloaded_count = first;
+    old_index_limit = (size_t)limit;
+    if (old_index_unloaded_count == 0)
+    {
+        close(old_index_fd);
+        old_index_fd = -1;
+    }
+    return true;
+}
+
+void history_t::load_all_old(void)
+{
+    ASSERT_IS_LOCKED(lock);
+    load_old_if_needed();
+    while (load_old_chunk())
+        ;
+}
+
 void history_t::populate_from_mmap(void)
 {
     mmap_type = infer_file_type(mmap_start, mmap_length);
+    if (mmap_type == history_type_fish_2_0 || mmap_type == history_type_fish_binary)
+    {
+        this->populate_from_index();
+        return;
+    }
+
     size_t cursor = 0;
     for (;;)
     {
@@ -1025,6 +1719,7 @@ void history_t::populate_from_mmap(void)
 
         // Remember this item
         old_item_offsets.push_back(offset);
+        old_item_signatures.push_back(HISTORY_SIGNATURE_ANY);
     }
 }
 
@@ -1129,6 +1824,9 @@ bool history_search_t::go_backwards()
 
     const bool main_thread = is_main_thread();
 
+    /* Both prefix and substring matches imply that the term's trigrams are among the item's */
+    const history_signature_t term_signature = history_signature_for_string(term);
+
     while (++idx < max_idx)
     {
         if (main_thread ? reader_interrupted() : reader_thread_job_is_stale())
@@ -1136,6 +1834,9 @@ bool history_search_t::go_backwards()
             return false;
         }
 
+        /* Skip items that the index tells us cannot match, without decoding them */
+        idx = history->next_possible_match(idx, term_signature);
+
         const history_item_t item = history->item_at_index(idx);
         /* We're done if it's empty or we cancelled */
         if (item.empty())
@@ -1279,6 +1980,17 @@ void history_t::clear_file_state()
     mmap_length = 0;
     loaded_old = false;
     old_item_offsets.clear();
+    old_item_signatures.clear();
+    if (old_index_fd >= 0)
+    {
+        close(old_index_fd);
+        old_index_fd = -1;
+    }
+    old_index_unloaded_count = 0;
+    old_index_limit = 0;
+
+    /* Offsets into the old file mean nothing for the new one */
+    item_cache->evict_all_nodes();
 }
 
 void history_t::compact_new_items()
@@ -1303,6 +2015,13 @@ void history_t::compact_new_items()
     }
 }
 
+/* The format in which we write history files, as chosen by the fish_history_format variable */
+static history_file_type_t preferred_history_file_type()
+{
+    const env_var_t format = env_get_string(L"fish_history_format");
+    return format == L"binary" ? history_type_fish_binary : history_type_fish_2_0;
+}
+
 bool history_t::save_internal_via_rewrite()
 {
     /* This must be called while locked */
@@ -1369,42 +2088,40 @@ bool history_t::save_internal_via_rewrite()
 
         signal_block();
 
-        /* Try to create a temporary file, up to 10 times. We don't use mkstemps because we want to open it CLO_EXEC. This should almost always succeed on the first try. */
-        int out_fd = -1;
         wcstring tmp_name;
-        for (size_t attempt = 0; attempt < 10 && out_fd == -1; attempt++)
-        {
-            char *narrow_str = wcs2str(tmp_name_template.c_str());
-#if HAVE_MKOSTEMP
-            out_fd = mkostemp(narrow_str, O_WRONLY | O_CREAT | O_EXCL | O_TRUNC | O_CLOEXEC);
-            if (out_fd >= 0)
-            {
-                tmp_name = str2wcstring(narrow_str);
-            }
-#else
-            if (narrow_str && mktemp(narrow_str))
-            {
-                /* It was successfully templated; try opening it atomically */
-                tmp_name = str2wcstring(narrow_str);
-                out_fd = wopen_cloexec(tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_TRUNC, 0644);
-            }
-#endif
-            free(narrow_str);
-        }
+        int out_fd = create_temporary_file(tmp_name_template, &tmp_name);
 
         if (out_fd >= 0)
         {
-            /* Write them out */
+            /* Write them out, building a new index as we go */
+            const history_file_type_t save_type = preferred_history_file_type();
             bool errored = false;
             history_output_buffer_t buffer;
+            history_index_t index;
+            size_t flushed = 0;
+            if (save_type == history_type_fish_binary)
+            {
+                buffer.append_bytes(HISTORY_BINARY_MAGIC, sizeof HISTORY_BINARY_MAGIC);
+            }
             for (history_lru_cache_t::iterator iter = lru.begin(); iter != lru.end(); ++iter)
             {
                 const history_lru_node_t *node = *iter;
-                append_yaml_to_buffer(node->key, node->timestamp, node->required_paths, &buffer);
-                if (buffer.output_size() >= HISTORY_OUTPUT_BUFFER_SIZE && ! buffer.flush_to_fd(out_fd))
+                history_index_record_t record;
+                record.offset = flushed + buffer.output_size();
+                append_item_to_buffer(save_type, node->key, node->timestamp, node->required_paths, &buffer);
+                record.end = flushed + buffer.output_size();
+                record.timestamp = node->timestamp;
+                record.signature = history_signature_for_string(node->key);
+                index.push_back(record);
+
+                if (buffer.output_size() >= HISTORY_OUTPUT_BUFFER_SIZE)
                 {
-                    errored = true;
-                    break;
+                    flushed += buffer.output_size();
+                    if (! buffer.flush_to_fd(out_fd))
+                    {
+                        errored = true;
+                        break;
+                    }
                 }
             }
 
@@ -1424,7 +2141,10 @@ bool history_t::save_internal_via_rewrite()
             else
             {
                 wcstring new_name = history_filename(name, wcstring());
-                wrename(tmp_name, new_name);
+                if (wrename(tmp_name, new_name) == 0)
+                {
+                    write_history_index(history_filename(name, L".index"), file_id_for_fd(out_fd), index);
+                }
             }
             close(out_fd);
         }
@@ -1469,12 +2189,13 @@ bool history_t::save_internal_via_appending()
 
     signal_block();
 
-    /* Open the file */
-    int out_fd = wopen_cloexec(history_path, O_WRONLY | O_APPEND);
+    /* Open the file. We open it for reading too, to check its format. */
+    int out_fd = wopen_cloexec(history_path, O_RDWR | O_APPEND);
     if (out_fd >= 0)
     {
         /* Check to see if the file changed */
-        if (file_id_for_fd(out_fd) != mmap_file_id)
+        const file_id_t file_id = file_id_for_fd(out_fd);
+        if (file_id != mmap_file_id)
             file_changed = true;
 
         /* Exclusive lock on the entire file. This is released when we close the file (below). This may fail on (e.g.) lockless NFS. If so, proceed as if it did not fail; the risk is that we may get interleaved history items, which is considered better than no history, or forcing everything through the slow copy-move mode. We try to minimize this possibility by writing with O_APPEND.
@@ -1495,27 +2216,54 @@ bool history_t::save_internal_via_appending()
            Periodically we "clean up" the file by rewriting it, so that most of the time it doesn't have duplicates, although we don't yet sort by timestamp (the timestamp isn't really used for much anyways).
         */
 
-        /* So far so good. Write all items at or after first_unwritten_new_item_index */
-
-        bool errored = false;
-        history_output_buffer_t buffer;
-        while (first_unwritten_new_item_index < new_items.size())
+        /* We can only append in the format the file already has. If the file is in another format, we fail, so that the file is rewritten in the preferred format instead. An empty file can be appended to in the text format, but the binary format needs its header. */
+        const history_file_type_t save_type = preferred_history_file_type();
+        char header[sizeof HISTORY_BINARY_MAGIC];
+        ssize_t header_len = pread(out_fd, header, sizeof header, 0);
+        const history_file_type_t file_type = infer_file_type(header, header_len > 0 ? (size_t)header_len : 0);
+        if (file_type == save_type || (file_type == history_type_unknown && save_type == history_type_fish_2_0))
         {
-            const history_item_t &item = new_items.at(first_unwritten_new_item_index);
-            append_yaml_to_buffer(item.str(), item.timestamp(), item.get_required_paths(), &buffer);
-            if (buffer.output_size() >= HISTORY_OUTPUT_BUFFER_SIZE)
+            /* So far so good. Write all items at or after first_unwritten_new_item_index */
+
+            /* Since we hold the lock, we know where our items will land, so we can index them too */
+            off_t file_end = lseek(out_fd, 0, SEEK_END);
+            size_t flushed = (file_end == (off_t)-1 ? 0 : (size_t)file_end);
+            history_index_t new_records;
+
+            bool errored = false;
+            history_output_buffer_t buffer;
+            while (first_unwritten_new_item_index < new_items.size())
             {
-                errored = ! buffer.flush_to_fd(out_fd);
-                if (errored) break;
+                const history_item_t &item = new_items.at(first_unwritten_new_item_index);
+                history_index_record_t record;
+                record.offset = flushed + buffer.output_size();
+                append_item_to_buffer(save_type, item.str(), item.timestamp(), item.get_required_paths(), &buffer);
+                record.end = flushed + buffer.output_size();
+                record.timestamp = item.timestamp();
+                record.signature = history_signature_for_string(item.str());
+                new_records.push_back(record);
+
+                if (buffer.output_size() >= HISTORY_OUTPUT_BUFFER_SIZE)
+                {
+                    flushed += buffer.output_size();
+                    errored = ! buffer.flush_to_fd(out_fd);
+                    if (errored) break;
+                }
+
+                /* We wrote this item, hooray */
+                first_unwritten_new_item_index++;
             }
 
-            /* We wrote this item, hooray */
-            first_unwritten_new_item_index++;
-        }
+            if (! errored && buffer.flush_to_fd(out_fd))
+            {
+                ok = true;
+            }
 
-        if (! errored && buffer.flush_to_fd(out_fd))
-        {
-            ok = true;
+            /* Only extend the index if we know exactly where our items went */
+            if (ok && file_end != (off_t)-1 && ! chaos_mode)
+            {
+                append_to_history_index(history_filename(name, L".index"), file_id, new_records);
+            }
         }
 
         close(out_fd);
@@ -1594,9 +2342,13 @@ void history_t::clear(void)
     deleted_items.clear();
     first_unwritten_new_item_index = 0;
     old_item_offsets.clear();
+    old_item_signatures.clear();
     wcstring filename = history_filename(name, L"");
     if (! filename.empty())
+    {
         wunlink(filename);
+        wunlink(history_filename(name, L".index"));
+    }
     this->clear_file_state();
 
 }
@@ -1612,7 +2364,9 @@ bool history_t::is_empty(void)
     bool empty = false;
     if (loaded_old)
     {
-        /* If we've loaded old items, see if we have any offsets */
+        /* If we've loaded old items, see if we have any offsets, loading more if necessary */
+        while (old_item_offsets.empty() && load_old_chunk())
+            ;
         empty = old_item_offsets.empty();
     }
     else
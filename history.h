@@ -22,6 +22,8 @@
 3. History files are mapped in via mmap(). Before the file is mapped, the file takes a fcntl read lock. The purpose of this lock is to avoid seeing a transient state where partial data has been written to the file.
 4. History is appended to under a fcntl write lock.
 5. The chaos_mode boolean can be set to true to do things like lower buffer sizes which can trigger race conditions. This is useful for testing.
+6. A history file may be in the text format or the optional binary format, selected by the fish_history_format variable. Appending is only done in the format the file already has; a file in the other format is rewritten (migrated) instead.
+7. Next to each history file is an index file, which records the offset, timestamp and signature of every item. It is appended to (under the history file's write lock) when the history file is appended to, and rewritten when the history file is vacuumed. The index is only a cache: if it is missing, stale, or does not describe the history file, the history file is scanned instead.
 */
 
 typedef std::vector<wcstring> path_list_t;
@@ -37,10 +39,14 @@ enum history_search_type_t
 
 typedef uint32_t history_identifier_t;
 
+/** A small bloom filter of the trigrams of a history item's command. If an item's signature does not contain all the bits of a search term's signature, the item cannot match the term. */
+typedef uint64_t history_signature_t;
+
 class history_item_t
 {
     friend class history_t;
     friend class history_lru_node_t;
+    friend class history_item_cache_node_t;
     friend class history_tests_t;
 
 private:
@@ -96,12 +102,18 @@ public:
 
 typedef std::deque<history_item_t> history_item_list_t;
 
+/* A cache of decoded old items, defined in history.cpp */
+class history_item_cache_t;
+
 /* The type of file that we mmap'd */
 enum history_file_type_t
 {
     history_type_unknown,
     history_type_fish_2_0,
-    history_type_fish_1_x
+    history_type_fish_1_x,
+
+    /* Length-prefixed binary records, written when fish_history_format is "binary" */
+    history_type_fish_binary
 };
 
 class history_t
@@ -166,9 +178,39 @@ private:
     /** List of old items, as offsets into out mmap data */
     std::deque<size_t> old_item_offsets;
 
+    /** Signatures of the old items, parallel to old_item_offsets */
+    std::deque<history_signature_t> old_item_signatures;
+
+    /** Populates old_item_offsets with the items our index file does not cover, arranging for the rest to be loaded lazily by load_old_chunk(). If the index file is missing or stale, populates everything by scanning, and rewrites the index file. */
+    void populate_from_index(void);
+
     /** Whether we've loaded old items */
     bool loaded_old;
 
+    /** The index file we are loading old items from, or -1 if all old items are loaded */
+    int old_index_fd;
+
+    /** The number of records at the start of the index file that we have not loaded yet */
+    size_t old_index_unloaded_count;
+
+    /** Items that we have not loaded from the index end at or before this offset */
+    size_t old_index_limit;
+
+    /** Loads the chunk of old items just before those already loaded, working backwards from the end of the file, and pushes them onto the front of old_item_offsets. Returns false if there was nothing left to load. */
+    bool load_old_chunk(void);
+
+    /** Loads all old items */
+    void load_all_old(void);
+
+    /** Recently decoded old items, keyed by their offset. Cleared whenever we unmap the file. */
+    history_item_cache_t *item_cache;
+
+    /** How often we found (or did not find) an old item in item_cache */
+    size_t item_cache_hits, item_cache_misses;
+
+    /** Returns the old item at the given offset in our mmap'd data, decoding it if it is not in item_cache */
+    history_item_t decode_old_item(size_t offset);
+
     /** Loads old if necessary */
     bool load_old_if_needed(void);
 
@@ -199,6 +241,7 @@ private:
     /* Versioned decoding */
     static history_item_t decode_item_fish_2_0(const char *base, size_t len);
     static history_item_t decode_item_fish_1_x(const char *base, size_t len);
+    static history_item_t decode_item_binary(const char *base, size_t len);
     static history_item_t decode_item(const char *base, size_t len, history_file_type_t type);
 
 public:
@@ -244,6 +287,12 @@ public:
 
     /** Return the specified history at the specified index. 0 is the index of the current commandline. (So the most recent item is at index 1.) */
     history_item_t item_at_index(size_t idx);
+
+    /** Returns the first index at or after idx whose item may match a search term with the given signature. Items that are skipped are known not to match. The result may be past the end of the history. */
+    size_t next_possible_match(size_t idx, history_signature_t term_signature);
+
+    /** Reports how often item_at_index() found an old item already decoded, and how often it had to decode it */
+    void get_item_cache_stats(size_t *hits, size_t *misses);
 };
 
 class history_search_t
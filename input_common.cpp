@@ -209,6 +209,18 @@ static wint_t readb()
     return arr[0];
 }
 
+bool input_common_has_pending_input()
+{
+    if (has_lookahead())
+        return true;
+
+    fd_set fds;
+    struct timeval tm = {0, 0};
+    FD_ZERO(&fds);
+    FD_SET(0, &fds);
+    return select(1, &fds, 0, 0, &tm) > 0;
+}
+
 wchar_t input_common_readch(int timed)
 {
     if (! has_lookahead())
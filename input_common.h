@@ -46,6 +46,12 @@ void input_common_destroy();
 */
 wchar_t input_common_readch(int timed);
 
+/**
+   Returns true if a character is waiting to be read, either pushed back
+   with \c input_common_unreadch or available on fd 0. Never blocks.
+*/
+bool input_common_has_pending_input();
+
 /**
    Push a character or a readline function onto the stack of unread
    characters that input_readch will return before actually reading from fd
@@ -74,54 +74,88 @@ void io_buffer_t::print() const
             is_input ? "yes" : "no", (unsigned long) out_buffer_size());
 }
 
-void io_buffer_t::read()
-{
-    exec_close(pipe_fd[1]);
+/**
+   The most to read from a buffer's pipe at once. Reads go directly into
+   the buffer, which grows geometrically, so this only bounds how much of
+   it is zeroed ahead of each read.
+*/
+#define IO_BUFFER_READ_SIZE 65536
 
-    if (io_mode == IO_BUFFER)
+bool io_buffer_t::read_available()
+{
+    while (1)
     {
-        /*    if( fcntl( pipe_fd[0], F_SETFL, 0 ) )
-            {
-              wperror( L"fcntl" );
-              return;
-              }  */
-        debug(4, L"io_buffer_t::read: blocking read on fd %d", pipe_fd[0]);
-        while (1)
+        /* Make room at the end of the buffer, doubling its capacity when it is full */
+        const size_t old_size = out_buffer.size();
+        if (out_buffer.capacity() - old_size < 4096)
         {
-            char b[4096];
-            long l;
-            l=read_blocked(pipe_fd[0], b, 4096);
-            if (l==0)
-            {
-                break;
-            }
-            else if (l<0)
-            {
-                /*
-                  exec_read_io_buffer is only called on jobs that have
-                  exited, and will therefore never block. But a broken
-                  pipe seems to cause some flags to reset, causing the
-                  EOF flag to not be set. Therefore, EAGAIN is ignored
-                  and we exit anyway.
-                */
-                if (errno != EAGAIN)
-                {
-                    debug(1,
-                          _(L"An error occured while reading output from code block on file descriptor %d"),
-                          pipe_fd[0]);
-                    wperror(L"io_buffer_t::read");
-                }
-
-                break;
-            }
-            else
+            out_buffer.reserve(std::max((size_t)4096, 2 * out_buffer.capacity()));
+        }
+        const size_t amt = std::min((size_t)IO_BUFFER_READ_SIZE, out_buffer.capacity() - old_size);
+        out_buffer.resize(old_size + amt);
+
+        long l = read_blocked(pipe_fd[0], &out_buffer.at(old_size), amt);
+        out_buffer.resize(old_size + (l > 0 ? l : 0));
+        if (l > 0)
+        {
+            notify_listener();
+        }
+
+        if (l == 0)
+        {
+            return true;
+        }
+        else if (l < 0)
+        {
+            if (errno == EAGAIN)
             {
-                out_buffer_append(b, l);
+                return false;
             }
+
+            /*
+              A broken pipe seems to cause some flags to reset, causing the
+              EOF flag to not be set, so only complain about other errors.
+            */
+            debug(1,
+                  _(L"An error occured while reading output from code block on file descriptor %d"),
+                  pipe_fd[0]);
+            wperror(L"io_buffer_t::read");
+            return true;
         }
     }
 }
 
+bool io_buffer_t::notify_listener()
+{
+    if (listener != NULL && ! discarding && ! listener->output_available(this))
+    {
+        discarding = true;
+    }
+
+    /* Output nobody wants is dropped as it arrives, so the pipe never fills while its writers are stopped */
+    if (discarding)
+    {
+        out_buffer.clear();
+    }
+    return ! discarding;
+}
+
+void io_buffer_t::read()
+{
+    exec_close(pipe_fd[1]);
+
+    if (io_mode == IO_BUFFER)
+    {
+        /*
+          exec_read_io_buffer is only called on jobs that have exited, and
+          will therefore never block. If the pipe is still open somewhere
+          and returns EAGAIN, we exit anyway.
+        */
+        debug(4, L"io_buffer_t::read: reading fd %d", pipe_fd[0]);
+        read_available();
+    }
+}
+
 
 io_buffer_t *io_buffer_t::create(int fd)
 {
@@ -3,18 +3,7 @@
 
 #include <vector>
 
-// Note that we have to include something to get any _LIBCPP_VERSION defined so we can detect libc++
-// So it's key that vector go above. If we didn't need vector for other reasons, we might include ciso646, which does nothing
-
-#if defined(_LIBCPP_VERSION) || __cplusplus > 199711L
-// C++11 or libc++ (which is a C++11-only library, but the memory header works OK in C++03)
-#include <memory>
-using std::shared_ptr;
-#else
-// C++03 or libstdc++
-#include <tr1/memory>
-using std::tr1::shared_ptr;
-#endif
+#include "common.h"
 
 /**
    Describes what type of IO operation an io_data_t represents
@@ -122,15 +111,48 @@ public:
     }
 };
 
+class io_buffer_t;
+
+/**
+   How often, in microseconds, the listener of a buffer is told that a command writing to the buffer is still running
+*/
+#define IO_BUFFER_LISTENER_POLL_USEC 100000
+
+/**
+   Receives the output written to an io_buffer_t as it arrives, rather than once the command has finished
+*/
+class io_buffer_listener_t
+{
+public:
+    virtual ~io_buffer_listener_t() {}
+
+    /**
+       Called after output is appended to the buffer, and every
+       IO_BUFFER_LISTENER_POLL_USEC while an external command writing
+       to it runs. The listener may consume the output. Returns false if
+       no more output is wanted; the buffer then discards any further
+       output, and the commands writing to it are stopped.
+    */
+    virtual bool output_available(io_buffer_t *buffer) = 0;
+};
+
 class io_buffer_t : public io_pipe_t
 {
 private:
     /** buffer to save output in */
     std::vector<char> out_buffer;
 
+    /** The listener, or NULL */
+    io_buffer_listener_t *listener;
+
+    /** Whether the listener wants no more output */
+    bool discarding;
+
     io_buffer_t(int f):
         io_pipe_t(IO_BUFFER, f, false /* not input */),
-        out_buffer()
+        out_buffer(),
+        listener(NULL),
+        discarding(false)
     {
     }
 
@@ -142,7 +164,17 @@ public:
     /** Function to append to the buffer */
     void out_buffer_append(const char *ptr, size_t count)
     {
-        out_buffer.insert(out_buffer.end(), ptr, ptr + count);
+        if (! discarding)
+        {
+            out_buffer.insert(out_buffer.end(), ptr, ptr + count);
+            notify_listener();
+        }
+    }
+
+    /** Remove the given number of bytes from the start of the buffer, once they have been handled */
+    void out_buffer_consume(size_t count)
+    {
+        out_buffer.erase(out_buffer.begin(), out_buffer.begin() + count);
     }
 
     /** Function to get a pointer to the buffer */
@@ -167,6 +199,34 @@ public:
     */
     void read();
 
+    /**
+       Read from the input pipe until it would block, directly into the
+       end of the buffer. Returns true if the pipe reached end of file, or
+       could not be read.
+    */
+    bool read_available();
+
+    /** Set the listener to notify when output arrives, or NULL */
+    void set_listener(io_buffer_listener_t *l)
+    {
+        listener = l;
+    }
+
+    /** Whether there is a listener to poll while commands write to the buffer */
+    bool has_listener() const
+    {
+        return listener != NULL;
+    }
+
+    /** Tell the listener about the output in the buffer. Returns false if the listener wants no more output. */
+    bool notify_listener();
+
+    /** Whether the listener wants no more output, so the commands writing to the buffer should be stopped */
+    bool output_is_discarded() const
+    {
+        return discarding;
+    }
+
     /**
        Create a IO_BUFFER type io redirection, complete with a pipe and a
        vector<char> for output. The default file descriptor used is STDOUT_FILENO
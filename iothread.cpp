@@ -22,46 +22,116 @@
 #define IO_MAX_THREADS 64
 #endif
 
-/* Values for the wakeup bytes sent to the ioport */
-#define IO_SERVICE_MAIN_THREAD_REQUEST_QUEUE 99
-#define IO_SERVICE_RESULT_QUEUE 100
+/* Value for the wakeup byte sent to the ioport */
+#define IO_SERVICE_WAKEUP 100
 
 #define IOTHREAD_LOG if (0)
 
 static void iothread_service_main_thread_requests(void);
 static void iothread_service_result_queue();
 
-struct SpawnRequest_t
-{
-    int (*handler)(void *);
-    void (*completionCallback)(void *, int);
-    void *context;
-    int handlerResult;
-};
-
 struct MainThreadRequest_t
 {
     int (*handler)(void *);
     void *context;
     volatile int handlerResult;
     volatile bool done;
+    MainThreadRequest_t *next;
+};
+
+/* A lock-free queue with many producers and a single consumer, of objects linked through their 'next' member. Producers push onto a stack with compare-and-swap. The consumer takes the entire stack at once and reverses it, so that items come out in the order they were pushed. Since the consumer never removes individual items, there is no ABA problem. */
+template<typename T>
+class mpsc_queue_t
+{
+    T * volatile head;
+
+public:
+    mpsc_queue_t() : head(NULL)
+    {
+    }
+
+    /* Pushes an item. Returns true if the queue was empty, in which case the caller is responsible for waking the consumer. */
+    bool push(T *item)
+    {
+        T *old_head;
+        do
+        {
+            old_head = head;
+            item->next = old_head;
+        }
+        while (! __sync_bool_compare_and_swap(&head, old_head, item));
+        return old_head == NULL;
+    }
+
+    /* Removes every item, and returns them as a list linked through 'next', oldest first */
+    T *pop_all()
+    {
+        T *items;
+        do
+        {
+            items = head;
+        }
+        while (items != NULL && ! __sync_bool_compare_and_swap(&head, items, (T *)NULL));
+
+        T *result = NULL;
+        while (items != NULL)
+        {
+            T *next = items->next;
+            items->next = result;
+            result = items;
+            items = next;
+        }
+        return result;
+    }
+};
+
+/* Adapts the function pointer interface to a task */
+class iothread_function_task_t : public iothread_task_t
+{
+    int (* const handler)(void *);
+    void (* const completion_callback)(void *, int);
+    void * const context;
+
+public:
+    iothread_function_task_t(int (*h)(void *), void (*c)(void *, int), void *ctx) : handler(h), completion_callback(c), context(ctx)
+    {
+        /* Without a completion callback, there's no need to bother the main thread */
+        this->wants_completion = (c != NULL);
+    }
+
+    int perform()
+    {
+        return handler(context);
+    }
+
+    void completed(int result)
+    {
+        completion_callback(context, result);
+    }
 };
 
-/* Spawn support. Requests are allocated and come in on request_queue. They go out on result_queue, at which point they can be deallocated. s_active_thread_count is also protected by the lock. */
+/* Worker pool support. Tasks come in on one request queue per priority, and go out on the lock-free result queue, at which point they can be deallocated. Workers are spawned on demand, up to IO_MAX_THREADS, and then persist, sleeping on s_spawn_queue_condition while there is no work. The queues and the counts below are protected by s_spawn_queue_lock. */
 static pthread_mutex_t s_spawn_queue_lock;
-static std::queue<SpawnRequest_t *> s_request_queue;
-static volatile int s_active_thread_count;
+static pthread_cond_t s_spawn_queue_condition;
+static std::queue<iothread_task_t *> s_request_queues[IOTHREAD_PRIORITY_COUNT];
+static size_t s_queued_request_count;
+static int s_thread_count;
+static int s_idle_thread_count;
+
+/* The number of tasks that have been handed to us but not yet deleted, whether queued, running, or awaiting completion. Also protected by s_spawn_queue_lock. */
+static size_t s_pending_request_count;
+
+static mpsc_queue_t<iothread_task_t> s_result_queue;
 
-static pthread_mutex_t s_result_queue_lock;
-static std::queue<SpawnRequest_t *> s_result_queue;
+/* The task running on each worker thread, for iothread_current_task_is_cancelled */
+static pthread_key_t s_current_task_key;
 
 /* "Do on main thread" support */
 static pthread_mutex_t s_main_thread_performer_lock; // protects the main thread requests
 static pthread_cond_t s_main_thread_performer_condition; //protects the main thread requests
-static pthread_mutex_t s_main_thread_request_queue_lock; // protects the queue
-static std::queue<MainThreadRequest_t *> s_main_thread_request_queue;
+static mpsc_queue_t<MainThreadRequest_t> s_main_thread_request_queue;
 
-/* Notifying pipes */
+/* Notifying pipes. Both queues share one pipe, and a wakeup byte is only written when a queue goes from empty to non-empty, so a burst of completions costs a single wakeup. */
 static int s_read_pipe, s_write_pipe;
 
 static void iothread_init(void)
@@ -73,10 +143,10 @@ static void iothread_init(void)
 
         /* Initialize some locks */
         VOMIT_ON_FAILURE(pthread_mutex_init(&s_spawn_queue_lock, NULL));
-        VOMIT_ON_FAILURE(pthread_mutex_init(&s_result_queue_lock, NULL));
-        VOMIT_ON_FAILURE(pthread_mutex_init(&s_main_thread_request_queue_lock, NULL));
+        VOMIT_ON_FAILURE(pthread_cond_init(&s_spawn_queue_condition, NULL));
         VOMIT_ON_FAILURE(pthread_mutex_init(&s_main_thread_performer_lock, NULL));
         VOMIT_ON_FAILURE(pthread_cond_init(&s_main_thread_performer_condition, NULL));
+        VOMIT_ON_FAILURE(pthread_key_create(&s_current_task_key, NULL));
 
         /* Initialize the completion pipes */
         int pipes[2] = {0, 0};
@@ -90,28 +160,87 @@ static void iothread_init(void)
     }
 }
 
-static void add_to_queue(struct SpawnRequest_t *req)
+/* Gives the worker pool access to the private parts of tasks */
+class iothread_task_runner_t
+{
+public:
+    /* Performs the task on the current worker thread, unless it has been cancelled already */
+    static void perform(iothread_task_t *task)
+    {
+        if (! task->is_cancelled())
+        {
+            VOMIT_ON_FAILURE(pthread_setspecific(s_current_task_key, task));
+            task->result = task->perform();
+            task->performed = true;
+            VOMIT_ON_FAILURE(pthread_setspecific(s_current_task_key, NULL));
+        }
+    }
+
+    static bool wants_completion(const iothread_task_t *task)
+    {
+        return task->wants_completion;
+    }
+
+    /* Runs the task's completion on the main thread, if the task was performed */
+    static void complete(iothread_task_t *task)
+    {
+        ASSERT_IS_MAIN_THREAD();
+        if (task->performed)
+        {
+            task->completed(task->result);
+        }
+    }
+
+    static iothread_task_t *next(const iothread_task_t *task)
+    {
+        return task->next;
+    }
+
+    static void set_token(iothread_task_t *task, const iothread_cancellation_token_t *token)
+    {
+        task->token = token;
+        task->token_generation = token ? token->get_generation() : 0;
+    }
+};
+
+static void add_to_queue(iothread_task_t *task, iothread_priority_t priority)
 {
     ASSERT_IS_LOCKED(s_spawn_queue_lock);
-    s_request_queue.push(req);
+    s_request_queues[priority].push(task);
+    s_queued_request_count++;
 }
 
-static SpawnRequest_t *dequeue_spawn_request(void)
+/* Returns the oldest request of the most urgent priority, or NULL if there are none */
+static iothread_task_t *dequeue_spawn_request(void)
 {
     ASSERT_IS_LOCKED(s_spawn_queue_lock);
-    SpawnRequest_t *result = NULL;
-    if (! s_request_queue.empty())
+    for (size_t i=0; i < IOTHREAD_PRIORITY_COUNT; i++)
     {
-        result = s_request_queue.front();
-        s_request_queue.pop();
+        std::queue<iothread_task_t *> &queue = s_request_queues[i];
+        if (! queue.empty())
+        {
+            iothread_task_t *result = queue.front();
+            queue.pop();
+            s_queued_request_count--;
+            return result;
+        }
     }
-    return result;
+    return NULL;
+}
+
+/* Wakes the main thread, to service the queues */
+static void iothread_wakeup_main_thread(void)
+{
+    const char wakeup_byte = IO_SERVICE_WAKEUP;
+    VOMIT_ON_FAILURE(! write_loop(s_write_pipe, &wakeup_byte, sizeof wakeup_byte));
 }
 
-static void enqueue_thread_result(SpawnRequest_t *req)
+static void enqueue_thread_result(iothread_task_t *task)
 {
-    scoped_lock lock(s_result_queue_lock);
-    s_result_queue.push(req);
+    if (s_result_queue.push(task))
+    {
+        iothread_wakeup_main_thread();
+    }
 }
 
 static void *this_thread()
@@ -119,105 +248,126 @@ static void *this_thread()
     return (void *)(intptr_t)pthread_self();
 }
 
-/* The function that does thread work. */
+/* The function that does thread work. Workers never exit; they wait for more requests instead. */
 static void *iothread_worker(void *unused)
 {
     scoped_lock locker(s_spawn_queue_lock);
-    struct SpawnRequest_t *req;
-    while ((req = dequeue_spawn_request()) != NULL)
+    for (;;)
     {
-        IOTHREAD_LOG fprintf(stderr, "pthread %p dequeued %p\n", this_thread(), req);
+        iothread_task_t *task = dequeue_spawn_request();
+        if (task == NULL)
+        {
+            /* Nothing to do. Note that pthread_cond_wait reacquires the lock before returning, so the locker remains valid. */
+            s_idle_thread_count++;
+            VOMIT_ON_FAILURE(pthread_cond_wait(&s_spawn_queue_condition, &s_spawn_queue_lock));
+            s_idle_thread_count--;
+            continue;
+        }
+
+        IOTHREAD_LOG fprintf(stderr, "pthread %p dequeued %p\n", this_thread(), task);
         /* Unlock the queue while we execute the request */
         locker.unlock();
-        
-        /* Perfor the work */
-        req->handlerResult = req->handler(req->context);
-        
-        /* If there's a completion handler, we have to enqueue it on the result queue. Otherwise, we can just delete the request! */
-        if (req->completionCallback == NULL)
+
+        /* Perform the work */
+        iothread_task_runner_t::perform(task);
+
+        /* If the task wants a completion, we have to enqueue it on the result queue. Otherwise, we can just delete it! */
+        if (iothread_task_runner_t::wants_completion(task))
         {
-            delete req;
+            /* Enqueue the result, telling the main thread about it if necessary */
+            enqueue_thread_result(task);
+            locker.lock();
         }
         else
         {
-            /* Enqueue the result, and tell the main thread about it */
-            enqueue_thread_result(req);
-            const char wakeup_byte = IO_SERVICE_RESULT_QUEUE;
-            VOMIT_ON_FAILURE(! write_loop(s_write_pipe, &wakeup_byte, sizeof wakeup_byte));
+            delete task;
+            locker.lock();
+            assert(s_pending_request_count > 0);
+            s_pending_request_count--;
         }
-        
-        /* Lock us up again */
-        locker.lock();
     }
-    
-    /* We believe we have exhausted the thread request queue. We want to decrement s_active_thread_count and exit. But it's possible that a request just came in. Furthermore, it's possible that the main thread saw that s_active_thread_count is full, and decided to not spawn a new thread, trusting in one of the existing threads to handle it. But we've already committed to not handling anything else. Therefore, we have to decrement s_active_thread_count under the lock, which we still hold. Likewise, the main thread must check the value under the lock. */
-    ASSERT_IS_LOCKED(s_spawn_queue_lock);
-    assert(s_active_thread_count > 0);
-    s_active_thread_count -= 1;
-    
-    IOTHREAD_LOG fprintf(stderr, "pthread %p exiting\n", this_thread());
 
-    /* We're done */
+    /* Not reached */
     return NULL;
 }
 
-/* Spawn another thread. No lock is held when this is called. */
-static void iothread_spawn()
+/* Spawn another thread. No lock is held when this is called. Returns false if the thread could not be created. */
+static bool iothread_spawn()
 {
     /* The spawned thread inherits our signal mask. We don't want the thread to ever receive signals on the spawned thread, so temporarily block all signals, spawn the thread, and then restore it. */
     sigset_t new_set, saved_set;
     sigfillset(&new_set);
     VOMIT_ON_FAILURE(pthread_sigmask(SIG_BLOCK, &new_set, &saved_set));
 
-    /* Spawn a thread. If this fails, it means there's already a bunch of threads; it is very unlikely that they are all on the verge of exiting, so one is likely to be ready to handle extant requests. So we can ignore failure with some confidence. */
     pthread_t thread = 0;
-    pthread_create(&thread, NULL, iothread_worker, NULL);
-    
-    /* We will never join this thread */
-    VOMIT_ON_FAILURE(pthread_detach(thread));
-    
-    IOTHREAD_LOG fprintf(stderr, "pthread %p spawned\n", (void *)(intptr_t)thread);
-    
+    bool spawned = (0 == pthread_create(&thread, NULL, iothread_worker, NULL));
+    if (spawned)
+    {
+        /* We will never join this thread */
+        VOMIT_ON_FAILURE(pthread_detach(thread));
+        IOTHREAD_LOG fprintf(stderr, "pthread %p spawned\n", (void *)(intptr_t)thread);
+    }
+
     /* Restore our sigmask */
     VOMIT_ON_FAILURE(pthread_sigmask(SIG_SETMASK, &saved_set, NULL));
+    return spawned;
 }
 
-int iothread_perform_base(int (*handler)(void *), void (*completionCallback)(void *, int), void *context)
+int iothread_perform_task(iothread_task_t *task, iothread_priority_t priority, const iothread_cancellation_token_t *token)
 {
     ASSERT_IS_MAIN_THREAD();
     ASSERT_IS_NOT_FORKED_CHILD();
+    assert(task != NULL);
+    assert(priority >= 0 && priority < IOTHREAD_PRIORITY_COUNT);
     iothread_init();
 
-    /* Create and initialize a request. */
-    struct SpawnRequest_t *req = new SpawnRequest_t();
-    req->handler = handler;
-    req->completionCallback = completionCallback;
-    req->context = context;
+    iothread_task_runner_t::set_token(task, token);
 
     int local_thread_count = -1;
     bool spawn_new_thread = false;
     {
-        /* Lock around a local region. Note that we can only access s_active_thread_count under the lock. */
         scoped_lock lock(s_spawn_queue_lock);
-        add_to_queue(req);
-        if (s_active_thread_count < IO_MAX_THREADS)
+        add_to_queue(task, priority);
+        s_pending_request_count++;
+
+        /* Wake an idle worker, if there is one. If there are more queued requests than idle workers to take them, spawn another worker, as long as we are under the limit. */
+        VOMIT_ON_FAILURE(pthread_cond_signal(&s_spawn_queue_condition));
+        if (s_queued_request_count > (size_t)s_idle_thread_count && s_thread_count < IO_MAX_THREADS)
         {
-            s_active_thread_count++;
+            s_thread_count++;
             spawn_new_thread = true;
         }
-        local_thread_count = s_active_thread_count;
+        local_thread_count = s_thread_count;
     }
-    
-    /* Kick off the thread if we decided to do so */
-    if (spawn_new_thread)
+
+    /* Kick off the thread if we decided to do so. If that fails, it means there's already a bunch of threads, which will get to the request eventually. But if there are none at all, nobody will, so complain loudly. */
+    if (spawn_new_thread && ! iothread_spawn())
     {
-        iothread_spawn();
+        scoped_lock lock(s_spawn_queue_lock);
+        s_thread_count--;
+        local_thread_count = s_thread_count;
+        if (s_thread_count == 0)
+        {
+            perror("pthread_create");
+        }
     }
-    
-    /* We return the active thread count for informational purposes only */
+
+    /* We return the thread count for informational purposes only */
     return local_thread_count;
 }
 
+int iothread_perform_base(int (*handler)(void *), void (*completionCallback)(void *, int), void *context)
+{
+    return iothread_perform_task(new iothread_function_task_t(handler, completionCallback, context), IOTHREAD_PRIORITY_DEFAULT);
+}
+
+bool iothread_current_task_is_cancelled(void)
+{
+    iothread_init();
+    const iothread_task_t *task = static_cast<const iothread_task_t *>(pthread_getspecific(s_current_task_key));
+    return task != NULL && task->is_cancelled();
+}
+
 int iothread_port(void)
 {
     iothread_init();
@@ -227,20 +377,15 @@ int iothread_port(void)
 void iothread_service_completion(void)
 {
     ASSERT_IS_MAIN_THREAD();
+    /* Consume the wakeup before emptying the queues. Anything pushed after we empty them will find them empty, and write another byte. */
     char wakeup_byte = 0;
     VOMIT_ON_FAILURE(1 != read_loop(iothread_port(), &wakeup_byte, sizeof wakeup_byte));
-    switch (wakeup_byte)
+    if (wakeup_byte != IO_SERVICE_WAKEUP)
     {
-        case IO_SERVICE_MAIN_THREAD_REQUEST_QUEUE:
-            iothread_service_main_thread_requests();
-            break;
-        case IO_SERVICE_RESULT_QUEUE:
-            iothread_service_result_queue();
-            break;
-        default:
-            fprintf(stderr, "Unknown wakeup byte %02x in %s\n", wakeup_byte, __FUNCTION__);
-            break;
+        fprintf(stderr, "Unknown wakeup byte %02x in %s\n", wakeup_byte, __FUNCTION__);
     }
+    iothread_service_main_thread_requests();
+    iothread_service_result_queue();
 }
 
 static bool iothread_wait_for_pending_completions(long timeout_usec)
@@ -258,27 +403,27 @@ static bool iothread_wait_for_pending_completions(long timeout_usec)
     return ret > 0;
 }
 
-/* Note that this function is quite sketchy. In particular, it drains threads, not requests, meaning that it may leave requests on the queue. This is the desired behavior (it may be called before fork, and we don't want to bother servicing requests before we fork), but in the test suite we depend on it draining all requests. In practice, this works, because a thread in practice won't exit while there is outstanding requests.
- 
-  At the moment, this function is only used in the test suite and in a drain-all-threads-before-fork compatibility mode that no architecture requires, so it's OK that it's terrible.
-*/
+static size_t iothread_pending_request_count(void)
+{
+    scoped_lock lock(s_spawn_queue_lock);
+    return s_pending_request_count;
+}
+
+/* Waits until every request has been performed and its completion has run. It may be called before fork, in a drain-all-threads-before-fork compatibility mode that no architecture requires, and in the test suite, which depends on it draining all requests. The worker threads themselves persist, idle. */
 void iothread_drain_all(void)
 {
     ASSERT_IS_MAIN_THREAD();
     ASSERT_IS_NOT_FORKED_CHILD();
-    
-    /* Hackish. Since we are the only thread that can increment s_active_thread_count, we can check for a zero value without locking; the true value may be smaller than we read, but never bigger. */
-    if (s_active_thread_count == 0)
-        return;
-    
+    iothread_init();
+
 #define TIME_DRAIN 0
 #if TIME_DRAIN
-    int thread_count = s_active_thread_count;
+    size_t request_count = iothread_pending_request_count();
     double now = timef();
 #endif
-    
+
     /* Nasty polling via select(). */
-    while (s_active_thread_count > 0)
+    while (iothread_pending_request_count() > 0)
     {
         if (iothread_wait_for_pending_completions(1000))
         {
@@ -287,7 +432,7 @@ void iothread_drain_all(void)
     }
 #if TIME_DRAIN
     double after = timef();
-    printf("(Waited %.02f msec for %d thread(s) to drain)\n", 1000 * (after - now), thread_count);
+    printf("(Waited %.02f msec for %lu request(s) to drain)\n", 1000 * (after - now), (unsigned long)request_count);
 #endif
 }
 
@@ -296,23 +441,20 @@ static void iothread_service_main_thread_requests(void)
 {
     ASSERT_IS_MAIN_THREAD();
 
-    // Move the queue to a local variable
-    std::queue<MainThreadRequest_t *> request_queue;
-    {
-        scoped_lock queue_lock(s_main_thread_request_queue_lock);
-        std::swap(request_queue, s_main_thread_request_queue);
-    }
+    // Take the whole queue
+    MainThreadRequest_t *req = s_main_thread_request_queue.pop_all();
 
-    if (! request_queue.empty())
+    if (req != NULL)
     {
         // Perform each of the functions
         // Note we are NOT responsible for deleting these. They are stack allocated in their respective threads!
-        while (! request_queue.empty())
+        while (req != NULL)
         {
-            MainThreadRequest_t *req = request_queue.front();
-            request_queue.pop();
+            // Grab the next request before we mark this one done, at which point its thread may destroy it
+            MainThreadRequest_t *next = req->next;
             req->handlerResult = req->handler(req->context);
             req->done = true;
+            req = next;
         }
 
         /* Ok, we've handled everybody. Announce the good news, and allow ourselves to be unlocked. Note we must do this while holding the lock. Otherwise we race with the waiting threads:
@@ -329,24 +471,26 @@ static void iothread_service_main_thread_requests(void)
 /* Service the queue of results */
 static void iothread_service_result_queue()
 {
-    // Move the queue to a local variable
-    std::queue<SpawnRequest_t *> result_queue;
-    {
-        scoped_lock queue_lock(s_main_thread_request_queue_lock);
-        std::swap(result_queue, s_result_queue);
-    }
-    
+    // Take the whole queue
+    iothread_task_t *task = s_result_queue.pop_all();
+
     // Perform each completion in order
     // We are responsibile for cleaning them up
-    while (! result_queue.empty())
+    size_t completed_count = 0;
+    while (task != NULL)
     {
-        SpawnRequest_t *req = result_queue.front();
-        result_queue.pop();
-        if (req->completionCallback)
-        {
-            req->completionCallback(req->context, req->handlerResult);
-        }
-        delete req;
+        iothread_task_t *next = iothread_task_runner_t::next(task);
+        iothread_task_runner_t::complete(task);
+        delete task;
+        completed_count++;
+        task = next;
+    }
+
+    if (completed_count > 0)
+    {
+        scoped_lock lock(s_spawn_queue_lock);
+        assert(s_pending_request_count >= completed_count);
+        s_pending_request_count -= completed_count;
     }
 }
 
@@ -364,17 +508,14 @@ int iothread_perform_on_main_base(int (*handler)(void *), void *context)
     req.context = context;
     req.handlerResult = 0;
     req.done = false;
+    req.next = NULL;
 
-    // Append it
+    // Append it, and tell the pipe if the main thread doesn't know about the queue yet
+    if (s_main_thread_request_queue.push(&req))
     {
-        scoped_lock queue_lock(s_main_thread_request_queue_lock);
-        s_main_thread_request_queue.push(&req);
+        iothread_wakeup_main_thread();
     }
 
-    // Tell the pipe
-    const char wakeup_byte = IO_SERVICE_MAIN_THREAD_REQUEST_QUEUE;
-    VOMIT_ON_FAILURE(! write_loop(s_write_pipe, &wakeup_byte, sizeof wakeup_byte));
-
     // Wait on the condition, until we're done
     scoped_lock perform_lock(s_main_thread_performer_lock);
     while (! req.done)
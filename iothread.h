@@ -5,13 +5,128 @@
 #ifndef FISH_IOTHREAD_H
 #define FISH_IOTHREAD_H
 
+#include <stddef.h>
+
+/**
+ Priority classes for background requests. Idle workers always take the oldest request of the most urgent class, so that work the user is waiting to see is not stuck behind slower bookkeeping.
+*/
+enum iothread_priority_t
+{
+    /** Syntax highlighting of the command line */
+    IOTHREAD_PRIORITY_HIGHLIGHT,
+
+    /** Computing autosuggestions */
+    IOTHREAD_PRIORITY_AUTOSUGGEST,
+
+    /** Everything else, such as file detection for history items */
+    IOTHREAD_PRIORITY_DEFAULT,
+
+    IOTHREAD_PRIORITY_COUNT
+};
+
+/**
+ A cancellation token. Requests made with a token remember the token's generation at the time they are made; calling cancel() cancels all of them at once. Requests that are cancelled before they start are never performed, and requests that are already running may notice the cancellation via iothread_task_t::is_cancelled() or iothread_current_task_is_cancelled().
+
+ Tokens may be cancelled from any thread, and must outlive the requests made with them.
+*/
+class iothread_cancellation_token_t
+{
+    volatile unsigned int generation;
+
+public:
+    iothread_cancellation_token_t() : generation(0)
+    {
+    }
+
+    /** Cancels every request made with this token so far */
+    void cancel()
+    {
+        __sync_add_and_fetch(&generation, 1);
+    }
+
+    /** Returns the current generation of the token */
+    unsigned int get_generation() const
+    {
+        return generation;
+    }
+};
+
+template<typename T> class mpsc_queue_t;
+
+/**
+ A typed background task. Subclasses implement perform(), which runs on a background thread, and optionally completed(), which runs on the main thread with the value returned by perform(). A task that wants a completion (the default) is deleted on the main thread once it is complete, or once it has been cancelled without running. A task that clears wants_completion is deleted on the background thread instead, so its destructor must not touch anything that belongs to the main thread.
+*/
+class iothread_task_t
+{
+    friend int iothread_perform_task(iothread_task_t *, iothread_priority_t, const iothread_cancellation_token_t *);
+    friend class iothread_task_runner_t;
+    friend class mpsc_queue_t<iothread_task_t>;
+
+    /** The token the task was made with, or NULL */
+    const iothread_cancellation_token_t *token;
+
+    /** The generation of the token when the task was made */
+    unsigned int token_generation;
+
+    /** The value returned by perform() */
+    int result;
+
+    /** Whether perform() was called */
+    bool performed;
+
+    /** The next task in the completion queue */
+    iothread_task_t *next;
+
+protected:
+    /** Whether completed() should run on the main thread. If false, the task is deleted on the background thread as soon as perform() returns. */
+    bool wants_completion;
+
+public:
+    iothread_task_t() : token(NULL), token_generation(0), result(0), performed(false), next(NULL), wants_completion(true)
+    {
+    }
+
+    virtual ~iothread_task_t()
+    {
+    }
+
+    /** Does the work of the task. Called on a background thread. */
+    virtual int perform() = 0;
+
+    /** Called on the main thread with the result of perform(). Not called for tasks that were cancelled before they started. */
+    virtual void completed(int result)
+    {
+    }
+
+    /** Returns whether the task's cancellation token has been cancelled since the task was made. Long running tasks should check this periodically and give up early. */
+    bool is_cancelled() const
+    {
+        return token != NULL && token->get_generation() != token_generation;
+    }
+};
+
+/**
+ Runs a task on a background thread.
+
+ \param task The task to perform. Ownership passes to the iothread machinery, which deletes it when it is done.
+ \param priority The priority class of the task
+ \param token A cancellation token, or NULL if the task may not be cancelled
+ \return The number of worker threads, for informational purposes only
+*/
+int iothread_perform_task(iothread_task_t *task, iothread_priority_t priority, const iothread_cancellation_token_t *token = NULL);
+
+/**
+ Returns whether the task running on the current background thread has been cancelled. This lets code far removed from the task, such as history searches, give up early. Returns false when called on a thread that is not running a task.
+*/
+bool iothread_current_task_is_cancelled(void);
+
 /**
- Runs a command on a thread.
+ Runs a command on a thread, at the default priority.
 
  \param handler The function to execute on a background thread. Accepts an arbitrary context pointer, and returns an int, which is passed to the completionCallback.
  \param completionCallback The function to execute on the main thread once the background thread is complete. Accepts an int (the return value of handler) and the context.
  \param context A arbitary context pointer to pass to the handler and completion callback.
- \return A sequence number, currently not very useful.
+ \return The number of worker threads, for informational purposes only.
 */
 int iothread_perform_base(int (*handler)(void *), void (*completionCallback)(void *, int), void *context);
 
@@ -25,7 +140,7 @@ int iothread_port(void);
 /** Services one iothread competion callback. */
 void iothread_service_completion(void);
 
-/** Waits for all iothreads to terminate. */
+/** Waits until every request has been performed and its completion has run. */
 void iothread_drain_all(void);
 
 /** Performs a function on the main thread, blocking until it completes */
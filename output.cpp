@@ -37,6 +37,8 @@
 #include <dirent.h>
 #include <time.h>
 #include <wchar.h>
+#include <assert.h>
+#include <string>
 
 
 #include "fallback.h"
@@ -102,6 +104,21 @@ static const int col_idx[]=
 
 static int (*out)(char c) = &writeb_internal;
 
+/**
+ Output made with the default writer, waiting to be written to stdout
+ */
+static std::string s_frame_buffer;
+
+/**
+ How many output_frame_t objects currently exist
+ */
+static int s_frame_depth = 0;
+
+/**
+ Counts of frames and write calls
+ */
+static output_frame_stats_t s_frame_stats;
+
 /**
  Name of terminal
  */
@@ -122,6 +139,64 @@ int (*output_get_writer())(char)
     return out;
 }
 
+output_frame_t::output_frame_t()
+{
+    s_frame_depth++;
+}
+
+output_frame_t::~output_frame_t()
+{
+    assert(s_frame_depth > 0);
+    if (--s_frame_depth == 0)
+    {
+        output_flush();
+    }
+}
+
+void output_flush()
+{
+    if (s_frame_buffer.empty())
+        return;
+
+    /* This is write_loop, except that it counts the calls */
+    const char *buff = s_frame_buffer.data();
+    size_t remaining = s_frame_buffer.size();
+    s_frame_stats.frames++;
+    s_frame_stats.bytes += remaining;
+    while (remaining > 0)
+    {
+        ssize_t amt = write(STDOUT_FILENO, buff, remaining);
+        s_frame_stats.writes++;
+        if (amt < 0)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+            {
+                break;
+            }
+        }
+        else
+        {
+            buff += amt;
+            remaining -= (size_t)amt;
+        }
+    }
+    s_frame_buffer.clear();
+}
+
+void output_write_bytes(const char *bytes, size_t len)
+{
+    s_frame_buffer.append(bytes, len);
+    if (s_frame_depth == 0)
+    {
+        output_flush();
+    }
+}
+
+output_frame_stats_t output_get_frame_stats()
+{
+    return s_frame_stats;
+}
+
 static bool term256_support_is_native(void)
 {
     /* Return YES if we think the term256 support is "native" as opposed to forced. */
@@ -219,6 +294,7 @@ bool write_background_color(unsigned char idx)
 
 void set_color(rgb_color_t c, rgb_color_t c2)
 {
+    output_frame_t frame;
 
 #if 0
     wcstring tmp = c.description();
@@ -404,11 +480,11 @@ void set_color(rgb_color_t c, rgb_color_t c2)
 }
 
 /**
- Default output method, simply calls write() on stdout
+ Default output method. Adds to the current frame, which is written to stdout when it ends.
  */
 static int writeb_internal(char c)
 {
-    write_loop(1, &c, 1);
+    output_write_bytes(&c, 1);
     return 0;
 }
 
@@ -420,6 +496,7 @@ int writeb(tputs_arg_t b)
 
 int writech(wint_t ch)
 {
+    output_frame_t frame;
     mbstate_t state;
     size_t i;
     char buff[MB_LEN_MAX+1];
@@ -454,6 +531,7 @@ int writech(wint_t ch)
 
 void writestr(const wchar_t *str)
 {
+    output_frame_t frame;
     char *pos;
 
     CHECK(str,);
@@ -502,6 +580,7 @@ void writestr(const wchar_t *str)
 
 void writestr_ellipsis(const wchar_t *str, int max_width)
 {
+    output_frame_t frame;
     int written=0;
     int tot;
 
@@ -538,6 +617,7 @@ void writestr_ellipsis(const wchar_t *str, int max_width)
 
 int write_escaped_str(const wchar_t *str, int max_len)
 {
+    output_frame_t frame;
 
     wchar_t *out;
     int i;
@@ -721,6 +801,7 @@ const wchar_t *output_get_term()
 
 void writembs_check(char *mbs, const char *mbs_name, const char *file, long line)
 {
+    output_frame_t frame;
     if (mbs != NULL)
     {
         tputs(mbs, 1, &writeb);
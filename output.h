@@ -118,8 +118,8 @@ int writeb(tputs_arg_t b);
 /**
    Set the function used for writing in move_cursor, writespace and
    set_color and all other output functions in this library. By
-   default, the write call is used to give completely unbuffered
-   output to stdout.
+   default, output is collected into the current frame and written
+   to stdout when the frame ends.
 */
 void output_set_writer(int (*writer)(char));
 
@@ -128,6 +128,56 @@ void output_set_writer(int (*writer)(char));
  */
 int (*output_get_writer())(char) ;
 
+/**
+   Output to the terminal is collected into frames. While an
+   output_frame_t exists, everything written with the default writer
+   is buffered, and when the outermost one is destroyed the buffer is
+   written to stdout with a single write call. Each output function
+   in this library is its own frame, and a repaint is one frame
+   overall. Anything that writes to stdout by other means must not
+   do so while a frame is open, or must call output_flush() first.
+*/
+class output_frame_t
+{
+public:
+    output_frame_t();
+    ~output_frame_t();
+};
+
+/**
+   Writes any buffered output to stdout now, even if a frame is open.
+*/
+void output_flush();
+
+/**
+   Writes raw bytes to stdout, as part of the current frame if there
+   is one.
+*/
+void output_write_bytes(const char *bytes, size_t len);
+
+/**
+   Counts of the output written to the terminal, for measuring how
+   many system calls a repaint takes.
+*/
+struct output_frame_stats_t
+{
+    /** The number of times buffered output was written out */
+    unsigned long frames;
+
+    /** The number of write calls that took */
+    unsigned long writes;
+
+    /** The number of bytes written */
+    unsigned long bytes;
+
+    output_frame_stats_t() : frames(0), writes(0), bytes(0)
+    {
+    }
+};
+
+/** Returns the counts of output written to the terminal so far */
+output_frame_stats_t output_get_frame_stats();
+
 /** Set the terminal name */
 void output_set_term(const wcstring &term);
 
@@ -34,21 +34,14 @@ static size_t divide_round_up(size_t numer, size_t denom)
 }
 
 /**
-   This function calculates the minimum width for each completion
-   entry in the specified array_list. This width depends on the
-   terminal size, so this function should be called when the terminal
-   changes size.
+   Returns the minimum width for the specified completion entry, which
+   must have been measured. This width depends on the terminal size.
 */
-void pager_t::recalc_min_widths(comp_info_list_t * lst) const
+int pager_t::min_width(const comp_t &c) const
 {
-    for (size_t i=0; i<lst->size(); i++)
-    {
-        comp_t *c = &lst->at(i);
-
-        c->min_width = mini(c->desc_width, maxi(0, available_term_width/3 - 2)) +
-                       mini(c->desc_width, maxi(0, available_term_width/5 - 4)) +4;
-    }
-
+    assert(c.measured);
+    return mini(c.desc_width, maxi(0, available_term_width/3 - 2)) +
+           mini(c.desc_width, maxi(0, available_term_width/5 - 4)) +4;
 }
 
 /**
@@ -258,6 +251,22 @@ static void mangle_1_completion_description(wcstring *str)
     str->resize(trailing);
 }
 
+/** Fill in the completion string and description of a comp_t from its representative completion, unless that has been done already */
+static void prepare_completion_info(comp_t *comp_info)
+{
+    if (! comp_info->comp.empty())
+        return;
+
+    const completion_t &comp = comp_info->representative;
+
+    // Append the single completion string. We may later merge these into multiple.
+    comp_info->comp.push_back(escape_string(comp.completion, ESCAPE_ALL | ESCAPE_NO_QUOTED));
+
+    // Append the mangled description
+    comp_info->desc = comp.description;
+    mangle_1_completion_description(&comp_info->desc);
+}
+
 static void join_completions(comp_info_list_t *comps)
 {
     // A map from description to index in the completion list of the element with that description
@@ -267,6 +276,7 @@ static void join_completions(comp_info_list_t *comps)
     // note that we mutate the completion list as we go, so the size changes
     for (size_t i=0; i < comps->size(); i++)
     {
+        prepare_completion_info(&comps->at(i));
         const comp_t &new_comp = comps->at(i);
         const wcstring &desc = new_comp.desc;
         if (desc.empty())
@@ -292,7 +302,7 @@ static void join_completions(comp_info_list_t *comps)
     }
 }
 
-/** Generate a list of comp_t structures from a list of completions */
+/** Generate a list of comp_t structures from a list of completions. Their completion strings and descriptions are filled in by prepare_completion_info. */
 static comp_info_list_t process_completions_into_infos(const completion_list_t &lst, const wcstring &prefix)
 {
     const size_t lst_size = lst.size();
@@ -301,91 +311,96 @@ static comp_info_list_t process_completions_into_infos(const completion_list_t &
     comp_info_list_t result(lst_size);
     for (size_t i=0; i<lst_size; i++)
     {
-        const completion_t &comp = lst.at(i);
-        comp_t *comp_info = &result.at(i);
-
-        // Append the single completion string. We may later merge these into multiple.
-        comp_info->comp.push_back(escape_string(comp.completion, ESCAPE_ALL | ESCAPE_NO_QUOTED));
-
-        // Append the mangled description
-        comp_info->desc = comp.description;
-        mangle_1_completion_description(&comp_info->desc);
-
         // Set the representative completion
-        comp_info->representative = comp;
+        result.at(i).representative = lst.at(i);
     }
     return result;
 }
 
-void pager_t::measure_completion_infos(comp_info_list_t *infos, const wcstring &prefix) const
+/** Compute the widths of a completion entry, unless they are known already */
+void pager_t::measure_completion_info(comp_t *comp) const
 {
+    if (comp->measured)
+        return;
+
+    prepare_completion_info(comp);
+
+    // Compute comp_width
     size_t prefix_len = my_wcswidth(prefix.c_str());
-    for (size_t i=0; i < infos->size(); i++)
+    const wcstring_list_t &comp_strings = comp->comp;
+    comp->comp_width = 0;
+    for (size_t j=0; j < comp_strings.size(); j++)
     {
-        comp_t *comp = &infos->at(i);
+        // If there's more than one, append the length of ', '
+        if (j >= 1)
+            comp->comp_width += 2;
 
-        // Compute comp_width
-        const wcstring_list_t &comp_strings = comp->comp;
-        for (size_t j=0; j < comp_strings.size(); j++)
-        {
-            // If there's more than one, append the length of ', '
-            if (j >= 1)
-                comp->comp_width += 2;
-
-            comp->comp_width += prefix_len + my_wcswidth(comp_strings.at(j).c_str());
-        }
+        comp->comp_width += prefix_len + my_wcswidth(comp_strings.at(j).c_str());
+    }
 
-        // Compute desc_width
-        comp->desc_width = my_wcswidth(comp->desc.c_str());
+    // Compute desc_width
+    comp->desc_width = my_wcswidth(comp->desc.c_str());
 
-        // Compute preferred width
-        comp->pref_width = comp->comp_width + comp->desc_width + (comp->desc_width?4:0);
-    }
+    // Compute preferred width
+    comp->pref_width = comp->comp_width + comp->desc_width + (comp->desc_width?4:0);
 
-    recalc_min_widths(infos);
+    comp->measured = true;
 }
 
-/* Indicates if the given completion info passes any filtering we have */
-bool pager_t::completion_info_passes_filter(const comp_t &info) const
+/* Build the index the filter matches against, from unfiltered_completion_infos and the prefix */
+void pager_t::index_completion_infos()
 {
-    /* If we have no filter, everything passes */
-    if (! search_field_shown || this->search_field_line.empty())
-        return true;
-
-    const wcstring &needle = this->search_field_line.text;
-
-    /* We do substring matching */
-    const fuzzy_match_type_t limit = fuzzy_match_substring;
-
-    /* Match against the description */
-    if (string_fuzzy_match_string(needle, info.desc, limit).type != fuzzy_match_none)
+    this->filter_index.clear();
+    this->filter_index_infos.clear();
+    for (size_t i=0; i < this->unfiltered_completion_infos.size(); i++)
     {
-        return true;
-    }
+        comp_t &info = this->unfiltered_completion_infos.at(i);
+        prepare_completion_info(&info);
 
-    /* Match against the completion strings */
-    for (size_t i=0; i < info.comp.size(); i++)
-    {
-        if (string_fuzzy_match_string(needle, prefix + info.comp.at(i), limit).type != fuzzy_match_none)
+        /* Match against the description */
+        this->filter_index.add(info.desc);
+        this->filter_index_infos.push_back(i);
+
+        /* Match against the completion strings */
+        for (size_t j=0; j < info.comp.size(); j++)
         {
-            return true;
+            this->filter_index.add(prefix + info.comp.at(j));
+            this->filter_index_infos.push_back(i);
         }
     }
-
-    /* No match */
-    return false;
+    this->filter_index_valid = true;
 }
 
 /* Update completion_infos from unfiltered_completion_infos, to reflect the filter */
 void pager_t::refilter_completions()
 {
+    this->layout_row_count = 0;
+
+    /* If we have no filter, everything passes */
+    if (! search_field_shown || this->search_field_line.empty())
+    {
+        this->completion_infos = this->unfiltered_completion_infos;
+        return;
+    }
+
+    if (! this->filter_index_valid)
+    {
+        this->index_completion_infos();
+    }
+
+    /* We do substring matching. The index remembers the previous matches, so typing more of the filter only checks those again. */
+    const std::vector<size_t> &matches = this->filter_index.match(this->search_field_line.text, fuzzy_match_substring);
+
+    /* An info passes if any of its strings match. The matches are in order, so the strings of an info are adjacent. */
     this->completion_infos.clear();
-    for (size_t i=0; i < this->unfiltered_completion_infos.size(); i++)
+    size_t last_info = (size_t)(-1);
+    for (size_t i=0; i < matches.size(); i++)
     {
-        const comp_t &info = this->unfiltered_completion_infos.at(i);
-        if (this->completion_info_passes_filter(info))
+        const size_t info_idx = this->filter_index_infos.at(matches.at(i));
+        if (info_idx != last_info)
         {
-            this->completion_infos.push_back(info);
+            this->completion_infos.push_back(this->unfiltered_completion_infos.at(info_idx));
+            last_info = info_idx;
         }
     }
 }
@@ -399,8 +414,8 @@ void pager_t::set_completions(const completion_list_t &raw_completions)
     if (prefix == L"-")
         join_completions(&unfiltered_completion_infos);
 
-    // Compute their various widths
-    measure_completion_infos(&unfiltered_completion_infos, prefix);
+    // They are indexed for filtering when the filter is used, and measured as they are laid out
+    this->filter_index_valid = false;
 
     // Refilter them
     this->refilter_completions();
@@ -408,7 +423,21 @@ void pager_t::set_completions(const completion_list_t &raw_completions)
 
 void pager_t::set_prefix(const wcstring &pref)
 {
-    prefix = pref;
+    if (prefix != pref)
+    {
+        prefix = pref;
+
+        /* The completions are matched and measured with the prefix */
+        this->filter_index_valid = false;
+        for (size_t i=0; i < this->unfiltered_completion_infos.size(); i++)
+        {
+            this->unfiltered_completion_infos.at(i).measured = false;
+        }
+        for (size_t i=0; i < this->completion_infos.size(); i++)
+        {
+            this->completion_infos.at(i).measured = false;
+        }
+    }
 }
 
 void pager_t::set_term_size(int w, int h)
@@ -417,7 +446,6 @@ void pager_t::set_term_size(int w, int h)
     assert(h > 0);
     available_term_width = w;
     available_term_height = h;
-    recalc_min_widths(&completion_infos);
 }
 
 /**
@@ -427,7 +455,7 @@ void pager_t::set_term_size(int w, int h)
    columns. Always succeeds if cols is 1.
 */
 
-bool pager_t::completion_try_print(size_t cols, const wcstring &prefix, const comp_info_list_t &lst, page_rendering_t *rendering, size_t suggested_start_row) const
+bool pager_t::completion_try_print(size_t cols, const wcstring &prefix, comp_info_list_t &lst, page_rendering_t *rendering, size_t suggested_start_row)
 {
     /*
       The calculated preferred width of each column
@@ -479,19 +507,41 @@ bool pager_t::completion_try_print(size_t cols, const wcstring &prefix, const co
     if (term_width < PAGER_MIN_WIDTH)
         return true;
 
+    /* Determine the starting and stop row */
+    size_t start_row = 0, stop_row = 0;
+    if (row_count <= term_height)
+    {
+        /* Easy, we can show everything */
+        start_row = 0;
+        stop_row = row_count;
+    }
+    else
+    {
+        /* We can only show part of the full list. Determine which part based on the suggested_start_row */
+        assert(row_count > term_height);
+        size_t last_starting_row = row_count - term_height;
+        start_row = mini(suggested_start_row, last_starting_row);
+        stop_row = start_row + term_height;
+        assert(start_row >= 0 && start_row <= last_starting_row);
+    }
+
+    /* The widths are computed from the rows up to a bounded distance past the last visible one (or the furthest one shown so far) */
+    const size_t measured_row_count = mini(row_count, maxi(this->layout_row_count, stop_row + PAGER_LOOKAHEAD_ROWS));
+
     /* Calculate how wide the list would be */
     for (long col = 0; col < cols; col++)
     {
-        for (long row = 0; row<row_count; row++)
+        for (long row = 0; row<measured_row_count; row++)
         {
             int pref,min;
-            const comp_t *c;
+            comp_t *c;
             if (lst.size() <= col*row_count + row)
                 continue;
 
             c = &lst.at(col*row_count + row);
+            measure_completion_info(c);
             pref = c->pref_width;
-            min = c->min_width;
+            min = this->min_width(*c);
 
             if (col != cols-1)
             {
@@ -575,23 +625,7 @@ bool pager_t::completion_try_print(size_t cols, const wcstring &prefix, const co
 
     if (print)
     {
-        /* Determine the starting and stop row */
-        size_t start_row = 0, stop_row = 0;
-        if (row_count <= term_height)
-        {
-            /* Easy, we can show everything */
-            start_row = 0;
-            stop_row = row_count;
-        }
-        else
-        {
-            /* We can only show part of the full list. Determine which part based on the suggested_start_row */
-            assert(row_count > term_height);
-            size_t last_starting_row = row_count - term_height;
-            start_row = mini(suggested_start_row, last_starting_row);
-            stop_row = start_row + term_height;
-            assert(start_row >= 0 && start_row <= last_starting_row);
-        }
+        this->layout_row_count = maxi(this->layout_row_count, measured_row_count);
 
         assert(stop_row >= start_row);
         assert(stop_row <= row_count);
@@ -650,7 +684,7 @@ bool pager_t::completion_try_print(size_t cols, const wcstring &prefix, const co
 }
 
 
-page_rendering_t pager_t::render() const
+page_rendering_t pager_t::render()
 {
 
     /**
@@ -693,7 +727,7 @@ page_rendering_t pager_t::render() const
     return rendering;
 }
 
-void pager_t::update_rendering(page_rendering_t *rendering) const
+void pager_t::update_rendering(page_rendering_t *rendering)
 {
     if (rendering->term_width != this->available_term_width ||
             rendering->term_height != this->available_term_height ||
@@ -707,7 +741,7 @@ void pager_t::update_rendering(page_rendering_t *rendering) const
     }
 }
 
-pager_t::pager_t() : available_term_width(0), available_term_height(0), selected_completion_idx(PAGER_SELECTION_NONE), suggested_row_start(0), fully_disclosed(false), search_field_shown(false)
+pager_t::pager_t() : available_term_width(0), available_term_height(0), selected_completion_idx(PAGER_SELECTION_NONE), suggested_row_start(0), fully_disclosed(false), search_field_shown(false), layout_row_count(0), filter_index_valid(false)
 {
 }
 
@@ -981,6 +1015,10 @@ void pager_t::clear()
 {
     unfiltered_completion_infos.clear();
     completion_infos.clear();
+    filter_index.clear();
+    filter_index_infos.clear();
+    filter_index_valid = false;
+    layout_row_count = 0;
     prefix.clear();
     selected_completion_idx = PAGER_SELECTION_NONE;
     fully_disclosed = false;
@@ -37,6 +37,9 @@ public:
 /* How many rows we will show in the "initial" pager */
 #define PAGER_UNDISCLOSED_MAX_ROWS 4
 
+/* How many rows past the last visible one are measured when laying out the completions. Rows further down are only measured once they are scrolled towards, so huge lists render quickly. */
+#define PAGER_LOOKAHEAD_ROWS 64
+
 typedef std::vector<completion_t> completion_list_t;
 page_rendering_t render_completions(const completion_list_t &raw_completions, const wcstring &prefix);
 
@@ -54,6 +57,9 @@ class pager_t
     /* Whether we show the search field */
     bool search_field_shown;
 
+    /* How many rows the layout of the completions is computed from. This grows as the list is scrolled, so the columns don't narrow again when scrolling back. */
+    size_t layout_row_count;
+
     /* Returns the index of the completion that should draw selected, using the given number of columns */
     size_t visual_selected_completion_index(size_t rows, size_t cols) const;
 
@@ -61,7 +67,7 @@ class pager_t
 public:
     struct comp_t
     {
-        /** The list of all completin strings this entry applies to */
+        /** The list of all completin strings this entry applies to. This and the description are filled in from the representative completion when first needed, while it is empty. */
         wcstring_list_t comp;
 
         /** The description */
@@ -79,10 +85,10 @@ public:
         /** Preferred total width */
         int pref_width;
 
-        /** Minimum acceptable width */
-        int min_width;
+        /** Whether the widths have been computed. They are computed when the completion is first laid out. */
+        bool measured;
 
-        comp_t() : comp(), desc(), representative(L""), comp_width(0), desc_width(0), pref_width(0), min_width(0)
+        comp_t() : comp(), desc(), representative(L""), comp_width(0), desc_width(0), pref_width(0), measured(false)
         {
         }
     };
@@ -96,16 +102,21 @@ private:
     /* The unfiltered list. Note there's a lot of duplication here. */
     comp_info_list_t unfiltered_completion_infos;
 
+    /* The strings the filter matches against (the descriptions, and the completions with the prefix), and the index in unfiltered_completion_infos of the info each belongs to. Built when the filter is first used. */
+    string_fuzzy_match_index_t filter_index;
+    std::vector<size_t> filter_index_infos;
+    bool filter_index_valid;
+
     wcstring prefix;
 
     void note_selection_changed();
 
-    bool completion_try_print(size_t cols, const wcstring &prefix, const comp_info_list_t &lst, page_rendering_t *rendering, size_t suggested_start_row) const;
+    bool completion_try_print(size_t cols, const wcstring &prefix, comp_info_list_t &lst, page_rendering_t *rendering, size_t suggested_start_row);
 
-    void recalc_min_widths(comp_info_list_t * lst) const;
-    void measure_completion_infos(std::vector<comp_t> *infos, const wcstring &prefix) const;
+    int min_width(const comp_t &c) const;
+    void measure_completion_info(comp_t *comp) const;
 
-    bool completion_info_passes_filter(const comp_t &info) const;
+    void index_completion_infos();
 
     void completion_print(size_t cols, int *width_per_column, size_t row_start, size_t row_stop, const wcstring &prefix, const comp_info_list_t &lst, page_rendering_t *rendering) const;
     line_t completion_print_item(const wcstring &prefix, const comp_t *c, size_t row, size_t column, int width, bool secondary, bool selected, page_rendering_t *rendering) const;
@@ -135,11 +146,11 @@ public:
     size_t get_selected_row(const page_rendering_t &rendering) const;
     size_t get_selected_column(const page_rendering_t &rendering) const;
 
-    /* Produces a rendering of the completions, at the given term size */
-    page_rendering_t render() const;
+    /* Produces a rendering of the completions, at the given term size. Measures the completions it lays out. */
+    page_rendering_t render();
 
     /* Updates the rendering if it's stale */
-    void update_rendering(page_rendering_t *rendering) const;
+    void update_rendering(page_rendering_t *rendering);
 
     /* Indicates if there are no completions, and therefore nothing to render */
     bool empty() const;
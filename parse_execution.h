@@ -32,8 +32,10 @@ enum parse_execution_result_t
 class parse_execution_context_t
 {
 private:
-    const parse_node_tree_t tree;
-    const wcstring src;
+    /* The parsed source we execute. We hold a reference so that the tree outlives us even if its owner (e.g. a function definition) goes away mid-execution */
+    const parsed_source_ref_t pstree;
+    const parse_node_tree_t &tree;
+    const wcstring &src;
     io_chain_t block_io;
     parser_t * const parser;
     //parse_error_list_t errors;
@@ -113,7 +115,7 @@ private:
     int line_offset_of_node_at_offset(node_offset_t idx);
 
 public:
-    parse_execution_context_t(const parse_node_tree_t &t, const wcstring &s, parser_t *p, int initial_eval_level);
+    parse_execution_context_t(const parsed_source_ref_t &ps, parser_t *p, int initial_eval_level);
 
     /* Returns the current eval level */
     int current_eval_level() const
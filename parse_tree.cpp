@@ -1206,6 +1206,16 @@ bool parse_tree_from_string(const wcstring &str, parse_tree_flags_t parse_flags,
     return ! parser.has_fatal_error();
 }
 
+parsed_source_ref_t parse_source(const wcstring &src, parse_tree_flags_t flags, parse_error_list_t *errors)
+{
+    parse_node_tree_t tree;
+    if (! parse_tree_from_string(src, flags, &tree, errors))
+    {
+        return parsed_source_ref_t();
+    }
+    return parsed_source_ref_t(new parsed_source_t(src, tree));
+}
+
 const parse_node_t *parse_node_tree_t::get_child(const parse_node_t &parent, node_offset_t which, parse_token_type_t expected_type) const
 {
     const parse_node_t *result = NULL;
@@ -193,6 +193,21 @@ public:
 /* The big entry point. Parse a string, attempting to produce a tree for the given goal type */
 bool parse_tree_from_string(const wcstring &str, parse_tree_flags_t flags, parse_node_tree_t *output, parse_error_list_t *errors, parse_token_type_t goal = symbol_job_list);
 
+/* A parse tree together with the source it was parsed from. This is immutable once constructed, so it may be shared between (for example) a function definition and every invocation of that function. */
+struct parsed_source_t
+{
+    const wcstring src;
+    const parse_node_tree_t tree;
+
+    parsed_source_t(const wcstring &s, const parse_node_tree_t &t) : src(s), tree(t)
+    {
+    }
+};
+typedef shared_ptr<const parsed_source_t> parsed_source_ref_t;
+
+/* Parse a string into a shared parsed_source_t. Returns an empty reference if the string could not be parsed. */
+parsed_source_ref_t parse_source(const wcstring &src, parse_tree_flags_t flags, parse_error_list_t *errors);
+
 /* Fish grammar:
 
 # A job_list is a list of jobs, separated by semicolons or newlines
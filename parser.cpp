@@ -837,8 +837,20 @@ profile_item_t *parser_t::create_profile_item()
 
 
 int parser_t::eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t block_type)
+{
+    /* Parse the source into a tree, if we can */
+    parsed_source_ref_t ps = parse_source(cmd, parse_flag_none, NULL);
+    if (ps.get() == NULL)
+    {
+        return 1;
+    }
+    return this->eval(ps, io, block_type);
+}
+
+int parser_t::eval(const parsed_source_ref_t &ps, const io_chain_t &io, enum block_type_t block_type)
 {
     CHECK_BLOCK(1);
+    assert(ps.get() != NULL);
 
     if (block_type != TOP && block_type != SUBST)
     {
@@ -847,13 +859,6 @@ int parser_t::eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t
         return 1;
     }
 
-    /* Parse the source into a tree, if we can */
-    parse_node_tree_t tree;
-    if (! parse_tree_from_string(cmd, parse_flag_none, &tree, NULL))
-    {
-        return 1;
-    }
-
     //print_stderr(block_stack_description());
 
 
@@ -861,11 +866,11 @@ int parser_t::eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t
     int exec_eval_level = (execution_contexts.empty() ? -1 : execution_contexts.back()->current_eval_level());
 
     /* Append to the execution context stack */
-    parse_execution_context_t *ctx = new parse_execution_context_t(tree, cmd, this, exec_eval_level);
+    parse_execution_context_t *ctx = new parse_execution_context_t(ps, this, exec_eval_level);
     execution_contexts.push_back(ctx);
 
     /* Execute the first node */
-    if (! tree.empty())
+    if (! ps->tree.empty())
     {
         this->eval_block_node(0, io, block_type);
     }
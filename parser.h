@@ -307,6 +307,9 @@ public:
     */
     int eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t block_type);
 
+    /** Evaluate the already-parsed source ps. This avoids reparsing source that is executed repeatedly, such as function bodies. Same return value as above. */
+    int eval(const parsed_source_ref_t &ps, const io_chain_t &io, enum block_type_t block_type);
+
     /** Evaluates a block node at the given node offset in the topmost execution context */
     int eval_block_node(node_offset_t node_idx, const io_chain_t &io, enum block_type_t block_type);
 
@@ -8,6 +8,12 @@
 #include <unistd.h>
 #include <errno.h>
 #include <libgen.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <set>
+#include <map>
+#include <algorithm>
 
 #include "fallback.h"
 #include "util.h"
@@ -17,12 +23,250 @@
 #include "wutil.h"
 #include "path.h"
 #include "expand.h"
+#include "lru.h"
 
 /**
    Unexpected error in path_get_path()
 */
 #define MISSING_COMMAND_ERR_MSG _( L"Error while searching for command '%ls'" )
 
+/**
+   How often, in seconds, background threads check a cached directory listing against the directory
+*/
+#define DIR_CACHE_RECHECK_INTERVAL 0.25
+
+/**
+   How many directory listings are cached
+*/
+#define DIR_CACHE_SIZE 256
+
+/** A cached directory listing, keyed by the path it was listed under */
+class dir_cache_node_t : public lru_node_t
+{
+public:
+    dir_listing_ref_t listing;
+
+    /** Whether the directory changed in the second it was listed, in which case a later change in that same second might not move its change time, and the listing can't be trusted */
+    bool racy;
+
+    /** When the listing was last checked against the directory */
+    double checked;
+
+    dir_cache_node_t(const wcstring &dir) : lru_node_t(dir), racy(false), checked(0)
+    {
+    }
+};
+
+class dir_cache_t : public lru_cache_t<dir_cache_node_t>
+{
+protected:
+
+    /* Override to delete evicted nodes */
+    virtual void node_was_evicted(dir_cache_node_t *node)
+    {
+        delete node;
+    }
+
+public:
+    dir_cache_t(size_t max) : lru_cache_t<dir_cache_node_t>(max) { }
+};
+
+/**
+   The directory listing cache, and how often it has been useful
+*/
+static pthread_mutex_t s_dir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static dir_cache_t s_dir_cache(DIR_CACHE_SIZE);
+static unsigned long s_dir_cache_hits = 0, s_dir_cache_misses = 0;
+
+/**
+   The commands that have been looked up on the main thread, keyed by name
+*/
+static pthread_mutex_t s_command_hash_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<wcstring, path_hashed_command_t> s_hashed_commands;
+
+/** Orders directory entries by name */
+struct dir_entry_less_t
+{
+    bool operator()(const dir_entry_t &a, const dir_entry_t &b) const
+    {
+        return a.name < b.name;
+    }
+};
+
+const dir_entry_t *dir_listing_t::find(const wcstring &name) const
+{
+    const dir_entry_t key(name, DT_UNKNOWN);
+    std::vector<dir_entry_t>::const_iterator iter = std::lower_bound(entries.begin(), entries.end(), key, dir_entry_less_t());
+    return (iter != entries.end() && iter->name == name) ? &*iter : NULL;
+}
+
+bool dir_listing_t::may_contain(const wcstring &name) const
+{
+    if (this->find(name) != NULL)
+        return true;
+    if (case_sensitive)
+        return false;
+
+    for (size_t i=0; i < entries.size(); i++)
+    {
+        if (wcscasecmp(entries.at(i).name.c_str(), name.c_str()) == 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+   Returns whether a directory tells names apart by case. This is found out by looking up an entry under a name with the case of its letters swapped. If no entry can be tried, the directory is taken to be case insensitive, which is always safe.
+*/
+static bool dir_cache_is_case_sensitive(const wcstring &dir, const dir_listing_t &listing)
+{
+    for (size_t i=0; i < listing.entries.size(); i++)
+    {
+        const wcstring &name = listing.entries.at(i).name;
+        wcstring swapped = name;
+        for (size_t j=0; j < swapped.size(); j++)
+        {
+            wchar_t c = swapped.at(j);
+            swapped.at(j) = iswlower(c) ? towupper(c) : towlower(c);
+        }
+        if (swapped == name || listing.find(swapped) != NULL)
+            continue;
+
+        wcstring path = dir, swapped_path = dir;
+        append_path_component(path, name);
+        append_path_component(swapped_path, swapped);
+        struct stat buf, swapped_buf;
+        if (lwstat(swapped_path, &swapped_buf) != 0)
+            return true;
+        return lwstat(path, &buf) != 0 || file_id_t::file_id_from_stat(&buf) != file_id_t::file_id_from_stat(&swapped_buf);
+    }
+    return false;
+}
+
+/** Reads the entries of a directory into a listing, returning false if it can't be opened */
+static bool dir_cache_read(const wcstring &dir, dir_listing_t *listing)
+{
+    const std::string narrow_dir = wcs2string(dir);
+    DIR *d = opendir(narrow_dir.c_str());
+    if (d == NULL)
+    {
+        return false;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        listing->entries.push_back(dir_entry_t(str2wcstring(ent->d_name), ent->d_type));
+    }
+    closedir(d);
+
+    std::sort(listing->entries.begin(), listing->entries.end(), dir_entry_less_t());
+    listing->case_sensitive = dir_cache_is_case_sensitive(dir, *listing);
+    return true;
+}
+
+dir_listing_ref_t dir_cache_get_listing(const wcstring &dir)
+{
+    const double now = timef();
+
+    /* Background threads may skip checking a recently checked listing. Relative paths are always checked, because they depend on the working directory. */
+    if (! is_main_thread() && string_prefixes_string(L"/", dir))
+    {
+        scoped_lock locker(s_dir_cache_lock);
+        const dir_cache_node_t *node = s_dir_cache.get_node(dir);
+        if (node != NULL && ! node->racy && now - node->checked < DIR_CACHE_RECHECK_INTERVAL)
+        {
+            s_dir_cache_hits++;
+            return node->listing;
+        }
+    }
+
+    /* Stat the directory before reading it, so that a change made while we read it is noticed next time */
+    struct stat buf;
+    if (wstat(dir, &buf) != 0 || ! S_ISDIR(buf.st_mode))
+    {
+        scoped_lock locker(s_dir_cache_lock);
+        s_dir_cache.evict_node(dir);
+        s_dir_cache_misses++;
+        return dir_listing_ref_t();
+    }
+    const file_id_t dir_id = file_id_t::file_id_from_stat(&buf);
+
+    {
+        scoped_lock locker(s_dir_cache_lock);
+        dir_cache_node_t *node = s_dir_cache.get_node(dir);
+        if (node != NULL && ! node->racy && node->listing->dir_id == dir_id)
+        {
+            node->checked = now;
+            s_dir_cache_hits++;
+            return node->listing;
+        }
+    }
+
+    /* Read the directory without holding the lock, since it may be large */
+    shared_ptr<dir_listing_t> listing(new dir_listing_t());
+    listing->dir_id = dir_id;
+    const bool readable = dir_cache_read(dir, listing.get());
+
+    scoped_lock locker(s_dir_cache_lock);
+    s_dir_cache_misses++;
+    if (! readable)
+    {
+        s_dir_cache.evict_node(dir);
+        return dir_listing_ref_t();
+    }
+
+    dir_cache_node_t *node = s_dir_cache.get_node(dir);
+    if (node == NULL)
+    {
+        node = new dir_cache_node_t(dir);
+        s_dir_cache.add_node(node);
+    }
+    node->listing = listing;
+    node->racy = (buf.st_ctime >= time(NULL));
+    node->checked = now;
+    return node->listing;
+}
+
+bool dir_entry_is_dir(const wcstring &dir, const dir_entry_t &entry)
+{
+    if (entry.known_dir())
+        return true;
+    if (entry.known_not_dir())
+        return false;
+
+    /* We want to treat symlinks to directories as directories. Use stat to resolve it. */
+    wcstring path = dir;
+    append_path_component(path, entry.name);
+    struct stat buf;
+    return wstat(path, &buf) == 0 && S_ISDIR(buf.st_mode);
+}
+
+dir_cache_stats_t dir_cache_get_stats()
+{
+    scoped_lock locker(s_dir_cache_lock);
+    dir_cache_stats_t result;
+    result.directories = s_dir_cache.size();
+    result.hits = s_dir_cache_hits;
+    result.misses = s_dir_cache_misses;
+    return result;
+}
+
+void dir_cache_reset()
+{
+    scoped_lock locker(s_dir_cache_lock);
+    s_dir_cache.evict_all_nodes();
+}
+
+/**
+   Returns whether the command may be in the directory, according to its listing. If it can't be listed, the command is looked for on disk as usual.
+*/
+static bool path_dir_may_contain(const wcstring &dir, const wcstring &cmd)
+{
+    const dir_listing_ref_t listing = dir_cache_get_listing(dir);
+    return ! listing || listing->may_contain(cmd);
+}
+
 static bool path_get_path_core(const wcstring &cmd, wcstring *out_path, const env_var_t &bin_path_var)
 {
     int err = ENOENT;
@@ -85,6 +329,8 @@ static bool path_get_path_core(const wcstring &cmd, wcstring *out_path, const en
         {
             if (nxt_path.empty())
                 continue;
+            if (! path_dir_may_contain(nxt_path, cmd))
+                continue;
             append_path_component(nxt_path, cmd);
             if (waccess(nxt_path, X_OK)==0)
             {
@@ -131,14 +377,67 @@ static bool path_get_path_core(const wcstring &cmd, wcstring *out_path, const en
     return false;
 }
 
+/**
+   Looks up a command, counting it in the command hash. The hash is only a record for the hash builtin; the command is always looked up in $PATH, using the directory listings. Lookups on the main thread are usually about to run the command or report on it, so they always check the directories' modification times, rather than trusting listings that may be a fraction of a second old; that still saves checking for the command in every directory. Successful lookups on the main thread are counted, whatever they were for.
+*/
+static bool path_get_path_hashed(const wcstring &cmd, wcstring *out_path, const env_var_t &bin_path_var)
+{
+    const bool main_thread = is_main_thread();
+    wcstring path;
+    bool found = path_get_path_core(cmd, &path, bin_path_var);
+
+    if (found && main_thread && cmd.find(L'/') == wcstring::npos)
+    {
+        scoped_lock locker(s_command_hash_lock);
+        path_hashed_command_t &hashed = s_hashed_commands[cmd];
+        if (hashed.path != path)
+        {
+            hashed.name = cmd;
+            hashed.path = path;
+            hashed.hits = 0;
+        }
+        hashed.hits++;
+    }
+
+    if (found && out_path)
+    {
+        out_path->swap(path);
+    }
+    return found;
+}
+
 bool path_get_path(const wcstring &cmd, wcstring *out_path, const env_vars_snapshot_t &vars)
 {
-    return path_get_path_core(cmd, out_path, vars.get(L"PATH"));
+    return path_get_path_hashed(cmd, out_path, vars.get(L"PATH"));
 }
 
 bool path_get_path(const wcstring &cmd, wcstring *out_path)
 {
-    return path_get_path_core(cmd, out_path, env_get_string(L"PATH"));
+    return path_get_path_hashed(cmd, out_path, env_get_string(L"PATH"));
+}
+
+std::vector<path_hashed_command_t> path_get_hashed_commands()
+{
+    scoped_lock locker(s_command_hash_lock);
+    std::vector<path_hashed_command_t> result;
+    for (std::map<wcstring, path_hashed_command_t>::const_iterator iter = s_hashed_commands.begin(); iter != s_hashed_commands.end(); ++iter)
+    {
+        result.push_back(iter->second);
+    }
+    return result;
+}
+
+bool path_forget_hashed_command(const wcstring &cmd)
+{
+    scoped_lock locker(s_command_hash_lock);
+    return s_hashed_commands.erase(cmd) > 0;
+}
+
+void path_reset_command_hash()
+{
+    dir_cache_reset();
+    scoped_lock locker(s_command_hash_lock);
+    s_hashed_commands.clear();
 }
 
 bool path_get_cdpath_string(const wcstring &dir_str, wcstring &result, const env_var_t &cdpath)
@@ -9,7 +9,9 @@
 #ifndef FISH_PATH_H
 #define FISH_PATH_H
 
+#include <vector>
 #include "env.h"
+#include "wutil.h"
 
 /**
    Return value for path_cdpath_get when locatied a rotten symlink
@@ -28,6 +30,11 @@ bool path_get_config(wcstring &path);
 /**
    Finds the full path of an executable. Returns YES if successful.
 
+   Directories in $PATH are searched using their cached listings (see
+   dir_cache_get_listing). Lookups on the main thread are counted in the
+   command hash, which the hash builtin shows; the hash is not used to
+   find commands.
+
    \param cmd The name of the executable.
    \param output_or_NULL If non-NULL, store the full path.
    \param vars The environment variables snapshot to use
@@ -37,6 +44,129 @@ bool path_get_path(const wcstring &cmd,
                    wcstring *output_or_NULL,
                    const env_vars_snapshot_t &vars = env_vars_snapshot_t::current());
 
+/**
+   A command remembered by the command hash, because path_get_path found it on the main thread. This is a count of lookups, not a cache of locations.
+*/
+struct path_hashed_command_t
+{
+    /** The name of the command */
+    wcstring name;
+
+    /** The full path it was found at */
+    wcstring path;
+
+    /** How many times it was looked up there, for any reason: to run it, for type or command -s, for highlighting, and so on */
+    unsigned long hits;
+
+    path_hashed_command_t() : hits(0)
+    {
+    }
+};
+
+/**
+   Returns the commands remembered by the command hash, sorted by name.
+*/
+std::vector<path_hashed_command_t> path_get_hashed_commands();
+
+/**
+   Forgets a remembered command. Returns whether it was remembered.
+*/
+bool path_forget_hashed_command(const wcstring &cmd);
+
+/**
+   Forgets all remembered commands and all cached directory listings. Called when $PATH changes.
+*/
+void path_reset_command_hash();
+
+/**
+   An entry in a cached directory listing
+*/
+struct dir_entry_t
+{
+    /** The name of the entry */
+    wcstring name;
+
+    /** The type of the entry as reported by readdir, one of the DT_ constants. This is DT_UNKNOWN if the filesystem doesn't say, and DT_LNK for symlinks, whose target may be of any type. */
+    unsigned char type;
+
+    dir_entry_t(const wcstring &n, unsigned char t) : name(n), type(t)
+    {
+    }
+
+    /** Returns whether the entry is known to be a directory, or known not to be one, without stat'ing it */
+    bool known_dir() const
+    {
+        return type == DT_DIR;
+    }
+    bool known_not_dir() const
+    {
+        return type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN;
+    }
+};
+
+/**
+   A listing of the entries in a directory. Listings are shared between threads, and never change once made.
+*/
+struct dir_listing_t
+{
+    /** The identity of the directory when it was listed. Its change time moves whenever an entry is added, removed or renamed. */
+    file_id_t dir_id;
+
+    /** The entries, including . and .., sorted by name */
+    std::vector<dir_entry_t> entries;
+
+    /** Whether the directory tells names apart by case. If not, as on the default filesystems of OS X, a name may refer to an entry whose case differs. */
+    bool case_sensitive;
+
+    dir_listing_t() : case_sensitive(true)
+    {
+    }
+
+    /** Returns the entry with the given name, or NULL */
+    const dir_entry_t *find(const wcstring &name) const;
+
+    /** Returns whether the name refers to an entry, taking into account whether the directory tells names apart by case */
+    bool may_contain(const wcstring &name) const;
+};
+
+typedef shared_ptr<const dir_listing_t> dir_listing_ref_t;
+
+/**
+   Returns the listing of a directory, or an empty reference if it can't be listed.
+
+   Listings are cached and shared by command lookup, wildcard expansion, completion and highlighting. A cached listing is reused as long as the directory's identity is unchanged. On the main thread that is checked on every call; background threads check absolute paths at most every quarter second.
+
+   The entries only carry what readdir reports for free. Anything else, like sizes and permissions, changes without the directory changing, and has to be looked up on disk.
+*/
+dir_listing_ref_t dir_cache_get_listing(const wcstring &dir);
+
+/**
+   Returns whether the entry is a directory or a symlink to one, stat'ing it only if readdir didn't say. dir is the directory of the listing the entry came from.
+*/
+bool dir_entry_is_dir(const wcstring &dir, const dir_entry_t &entry);
+
+/**
+   Statistics about the directory listing cache
+*/
+struct dir_cache_stats_t
+{
+    /** The number of directories whose listings are cached */
+    size_t directories;
+
+    /** The number of lookups that reused a cached listing */
+    unsigned long hits;
+
+    /** The number of lookups that had to read the directory */
+    unsigned long misses;
+};
+
+dir_cache_stats_t dir_cache_get_stats();
+
+/**
+   Forgets all cached directory listings
+*/
+void dir_cache_reset();
+
 /**
    Returns the full path of the specified directory, using the CDPATH
    variable as a list of base directories for relative paths. The
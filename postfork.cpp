@@ -507,16 +507,17 @@ bool fork_actions_make_spawn_properties(posix_spawnattr_t *attr, posix_spawn_fil
                     err = posix_spawn_file_actions_adddup2(actions, from_fd, to_fd);
 
 
+                /* Either end may already be closed, e.g. the read end of a streamed process's output pipe, which belongs to the next process */
                 if (write_pipe_idx > 0)
                 {
-                    if (! err)
+                    if (! err && io_pipe->pipe_fd[0] >= 0)
                         err = posix_spawn_file_actions_addclose(actions, io_pipe->pipe_fd[0]);
-                    if (! err)
+                    if (! err && io_pipe->pipe_fd[1] >= 0)
                         err = posix_spawn_file_actions_addclose(actions, io_pipe->pipe_fd[1]);
                 }
                 else
                 {
-                    if (! err)
+                    if (! err && io_pipe->pipe_fd[0] >= 0)
                         err = posix_spawn_file_actions_addclose(actions, io_pipe->pipe_fd[0]);
 
                 }
@@ -28,6 +28,7 @@ Some of the code in this file is based on code from the Glibc manual.
 
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <sys/time.h>
 
@@ -71,11 +72,6 @@ Some of the code in this file is based on code from the Glibc manual.
 */
 #define MESS_SIZE 256
 
-/**
-   Size of buffer for reading buffered output
-*/
-#define BUFFER_SIZE 4096
-
 /**
 	Status of last process to exit
 */
@@ -86,6 +82,13 @@ static int last_status=0;
 */
 static sig_atomic_t got_signal=0;
 
+/**
+   A pipe that the SIGCHLD handler writes a byte to, so that waiting for
+   buffered output can also wait for a child to change state. Both ends
+   are nonblocking.
+*/
+static int s_sigchld_pipe[2] = {-1, -1};
+
 bool job_list_is_empty(void)
 {
     ASSERT_IS_MAIN_THREAD();
@@ -166,6 +169,20 @@ static std::vector<int> interactive_stack;
 void proc_init()
 {
     proc_push_interactive(0);
+
+    if (pipe(s_sigchld_pipe) == 0)
+    {
+        for (size_t i=0; i < 2; i++)
+        {
+            fcntl(s_sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+            make_fd_nonblocking(s_sigchld_pipe[i]);
+        }
+    }
+    else
+    {
+        wperror(L"pipe");
+        s_sigchld_pipe[0] = s_sigchld_pipe[1] = -1;
+    }
 }
 
 
@@ -579,6 +596,16 @@ void job_handle_signal(int signal, siginfo_t *info, void *con)
 
     got_signal = 1;
 
+    /* Wake up select_try. If the pipe is full, it's awake already. */
+    if (s_sigchld_pipe[1] >= 0)
+    {
+        const char wakeup_byte = 0;
+        if (write(s_sigchld_pipe[1], &wakeup_byte, 1) < 0)
+        {
+            /* Nothing to do */
+        }
+    }
+
 //	write( 2, "got signal\n", 11 );
 
     while (1)
@@ -612,7 +639,10 @@ static void format_job_info(const job_t *j, const wchar_t *status)
     fwprintf(stdout, L"\r");
     fwprintf(stdout, _(L"Job %d, \'%ls\' has %ls"), j->job_id, j->command_wcstr(), status);
     fflush(stdout);
-    tputs(clr_eol,1,&writeb);
+    {
+        output_frame_t frame;
+        tputs(clr_eol,1,&writeb);
+    }
     fwprintf(stdout, L"\n");
 }
 
@@ -710,7 +740,11 @@ int job_reap(bool interactive)
                                      j->command_wcstr(),
                                      sig2wcs(WTERMSIG(p->status)),
                                      signal_get_desc(WTERMSIG(p->status)));
-                        tputs(clr_eol,1,&writeb);
+                        fflush(stdout);
+                        {
+                            output_frame_t frame;
+                            tputs(clr_eol,1,&writeb);
+                        }
                         fwprintf(stdout, L"\n");
                         found=1;
                     }
@@ -880,102 +914,92 @@ void proc_update_jiffies()
 #endif
 
 /**
-   Check if there are buffers associated with the job, and select on
-   them for a while if available.
-
-   \param j the job to test
-
-   \return 1 if buffers were available, zero otherwise
+   Returns the buffer that output of the job is being captured into,
+   which is the last one in its redirections, or NULL if there is none.
 */
-static int select_try(job_t *j)
+static io_buffer_t *job_output_buffer(const job_t *j)
 {
-    fd_set fds;
-    int maxfd=-1;
-
-    FD_ZERO(&fds);
-
+    io_buffer_t *buff = NULL;
     const io_chain_t chain = j->all_io_redirections();
     for (size_t idx = 0; idx < chain.size(); idx++)
     {
-        const io_data_t *io = chain.at(idx).get();
-        if (io->io_mode == IO_BUFFER)
+        io_data_t *d = chain.at(idx).get();
+        if (d->io_mode == IO_BUFFER)
         {
-            CAST_INIT(const io_pipe_t *, io_pipe, io);
-            int fd = io_pipe->pipe_fd[0];
-//			fwprintf( stderr, L"fd %d on job %ls\n", fd, j->command );
-            FD_SET(fd, &fds);
-            maxfd = maxi(maxfd, fd);
-            debug(3, L"select_try on %d\n", fd);
+            buff = static_cast<io_buffer_t *>(d);
         }
     }
+    return buff;
+}
+
+/**
+   Wait until the output buffer of the job can be read, or a child
+   changes state. Unlike polling, this returns as soon as either happens,
+   and does not wake up otherwise, except to poll the buffer's listener.
+
+   \param buff the job's output buffer
+   \param buff_at_eof whether the buffer's pipe has already reached end of file, in which case only child state changes are waited for
 
-    if (maxfd >= 0)
+   \return 1 if the buffer can be read, 0 otherwise
+*/
+static int select_try(const io_buffer_t *buff, bool buff_at_eof)
+{
+    const int buff_fd = buff_at_eof ? -1 : buff->pipe_fd[0];
+    const int chld_fd = s_sigchld_pipe[0];
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    int maxfd = -1;
+    if (buff_fd >= 0)
+    {
+        FD_SET(buff_fd, &fds);
+        maxfd = maxi(maxfd, buff_fd);
+        debug(3, L"select_try on %d\n", buff_fd);
+    }
+    if (chld_fd >= 0)
     {
-        int retval;
-        struct timeval tv;
+        FD_SET(chld_fd, &fds);
+        maxfd = maxi(maxfd, chld_fd);
+    }
 
-        tv.tv_sec=0;
-        tv.tv_usec=10000;
+    /* Without the SIGCHLD pipe we can't tell when a child exits, so fall back to polling. A listener is polled less often. */
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = (chld_fd >= 0 ? IO_BUFFER_LISTENER_POLL_USEC : 10000);
 
-        retval =select(maxfd+1, &fds, 0, 0, &tv);
-        return retval > 0;
+    int retval = select(maxfd + 1, &fds, 0, 0, chld_fd >= 0 && ! buff->has_listener() ? NULL : &tv);
+    if (retval <= 0)
+    {
+        return 0;
     }
 
-    return -1;
+    if (chld_fd >= 0 && FD_ISSET(chld_fd, &fds))
+    {
+        /* Drain the wakeup bytes. The handler has already reaped the children. */
+        char buff[64];
+        while (read(chld_fd, buff, sizeof buff) > 0)
+        {
+        }
+    }
+    return buff_fd >= 0 && FD_ISSET(buff_fd, &fds);
 }
 
 /**
    Read from descriptors until they are empty.
 
    \param j the job to test
+
+   \return true if the buffer reached end of file
 */
-static void read_try(job_t *j)
+static bool read_try(job_t *j)
 {
-    io_buffer_t *buff = NULL;
-
-    /*
-      Find the last buffer, which is the one we want to read from
-    */
-    const io_chain_t chain = j->all_io_redirections();
-    for (size_t idx = 0; idx < chain.size(); idx++)
-    {
-        io_data_t *d = chain.at(idx).get();
-        if (d->io_mode == IO_BUFFER)
-        {
-            buff = static_cast<io_buffer_t *>(d);
-        }
-    }
-
+    io_buffer_t *buff = job_output_buffer(j);
     if (buff)
     {
         debug(3, L"proc::read_try('%ls')\n", j->command_wcstr());
-        while (1)
-        {
-            char b[BUFFER_SIZE];
-            long l;
-
-            l=read_blocked(buff->pipe_fd[0],
-                           b, BUFFER_SIZE);
-            if (l==0)
-            {
-                break;
-            }
-            else if (l<0)
-            {
-                if (errno != EAGAIN)
-                {
-                    debug(1,
-                          _(L"An error occured while reading output from code block"));
-                    wperror(L"read_try");
-                }
-                break;
-            }
-            else
-            {
-                buff->out_buffer_append(b, l);
-            }
-        }
+        return buff->read_available();
     }
+    return true;
 }
 
 
@@ -1135,6 +1159,8 @@ void job_continue(job_t *j, bool cont)
                handle the possibility that a signal is dispatched while
                running job_is_stopped().
             */
+            io_buffer_t *buff = job_output_buffer(j);
+            bool buff_at_eof = false, writers_stopped = false;
             while (!quit)
             {
                 do
@@ -1146,50 +1172,61 @@ void job_continue(job_t *j, bool cont)
 
                 if (!quit)
                 {
-
-//					debug( 1, L"select_try()" );
-                    switch (select_try(j))
+                    if (buff != NULL)
                     {
-                        case 1:
+                        if (select_try(buff, buff_at_eof))
                         {
-                            read_try(j);
-                            break;
+                            buff_at_eof = read_try(j);
+                        }
+                        else if (buff->has_listener())
+                        {
+                            buff->notify_listener();
                         }
 
-                        case -1:
+                        /* If the buffer's listener wants no more output, stop the processes writing it. They get SIGPIPE, as if the reader of a pipe had exited, which is not reported. */
+                        if (buff->output_is_discarded() && ! writers_stopped)
                         {
-                            /*
-                              If there is no funky IO magic, we can use
-                              waitpid instead of handling child deaths
-                              through signals. This gives a rather large
-                              speed boost (A factor 3 startup time
-                              improvement on my 300 MHz machine) on
-                              short-lived jobs.
-                            */
-                            int status;
-                            pid_t pid = waitpid(-1, &status, WUNTRACED);
-                            if (pid > 0)
+                            for (process_t *p = j->first_process; p; p = p->next)
                             {
-                                handle_child_status(pid, status);
-                            }
-                            else
-                            {
-                                /*
-                                  This probably means we got a
-                                  signal. A signal might mean that the
-                                  terminal emulator sent us a hup
-                                  signal to tell is to close. If so,
-                                  we should exit.
-                                */
-                                if (reader_exit_forced())
+                                if (p->pid > 0 && ! p->completed)
                                 {
-                                    quit = 1;
+                                    kill(p->pid, SIGPIPE);
                                 }
-
                             }
-                            break;
+                            writers_stopped = true;
                         }
+                    }
+                    else
+                    {
+                        /*
+                          If there is no funky IO magic, we can use
+                          waitpid instead of handling child deaths
+                          through signals. This gives a rather large
+                          speed boost (A factor 3 startup time
+                          improvement on my 300 MHz machine) on
+                          short-lived jobs.
+                        */
+                        int status;
+                        pid_t pid = waitpid(-1, &status, WUNTRACED);
+                        if (pid > 0)
+                        {
+                            handle_child_status(pid, status);
+                        }
+                        else
+                        {
+                            /*
+                              This probably means we got a
+                              signal. A signal might mean that the
+                              terminal emulator sent us a hup
+                              signal to tell is to close. If so,
+                              we should exit.
+                            */
+                            if (reader_exit_forced())
+                            {
+                                quit = 1;
+                            }
 
+                        }
                     }
                 }
             }
@@ -175,11 +175,8 @@ commence.
  */
 #define SEARCH_FORWARD 1
 
-/* Any time the contents of a buffer changes, we update the generation count. This allows for our background highlighting thread to notice it and skip doing work that it would otherwise have to do. This variable should really be of some kind of interlocked or atomic type that guarantees we're not reading stale cache values. With C++11 we should use atomics, but until then volatile should work as well, at least on x86.*/
-static volatile unsigned int s_generation_count;
-
-/* This pthreads generation count is set when an autosuggestion background thread starts up, so it can easily check if the work it is doing is no longer useful. */
-static pthread_key_t generation_count_key;
+/* Any time the contents of the command line change, we cancel this token. This allows our background highlighting and autosuggestion tasks to notice it and skip doing work that it would otherwise have to do. */
+static iothread_cancellation_token_t s_command_line_changed;
 
 static void set_command_line_and_position(editable_line_t *el, const wcstring &new_str, size_t pos);
 
@@ -730,8 +727,8 @@ void reader_data_t::command_line_changed(const editable_line_t *el)
 
         indents.resize(len);
 
-        /* Update the gen count */
-        s_generation_count++;
+        /* Cancel any background work for the old contents */
+        s_command_line_changed.cancel();
     }
     else if (el == &this->pager.search_field_line)
     {
@@ -902,7 +899,7 @@ int reader_reading_interrupted()
 bool reader_thread_job_is_stale()
 {
     ASSERT_IS_BACKGROUND_THREAD();
-    return (void*)(uintptr_t) s_generation_count != pthread_getspecific(generation_count_key);
+    return iothread_current_task_is_cancelled();
 }
 
 void reader_write_title(const wcstring &cmd)
@@ -963,6 +960,7 @@ void reader_write_title(const wcstring &cmd)
     {
         if (! lst.empty())
         {
+            output_frame_t frame;
             writestr(L"\x1b]0;");
             for (size_t i=0; i<lst.size(); i++)
             {
@@ -1025,8 +1023,6 @@ static void exec_prompt()
 
 void reader_init()
 {
-    VOMIT_ON_FAILURE(pthread_key_create(&generation_count_key, NULL));
-
     /* Save the initial terminal mode */
     tcgetattr(STDIN_FILENO, &terminal_mode_on_startup);
 
@@ -1057,7 +1053,6 @@ void reader_init()
 
 void reader_destroy()
 {
-    pthread_key_delete(generation_count_key);
 }
 
 void restore_term_mode()
@@ -1417,7 +1412,9 @@ static void completion_insert(const wchar_t *val, complete_flags_t flags)
     data->suppress_autosuggestion = true;
 }
 
-struct autosuggestion_context_t
+static bool can_autosuggest(void);
+
+struct autosuggestion_context_t : public iothread_task_t
 {
     wcstring search_string;
     wcstring autosuggestion;
@@ -1426,7 +1423,6 @@ struct autosuggestion_context_t
     file_detection_context_t detector;
     const wcstring working_directory;
     const env_vars_snapshot_t vars;
-    const unsigned int generation_count;
 
     autosuggestion_context_t(history_t *history, const wcstring &term, size_t pos) :
         search_string(term),
@@ -1434,24 +1430,15 @@ struct autosuggestion_context_t
         searcher(*history, term, HISTORY_SEARCH_TYPE_PREFIX),
         detector(history),
         working_directory(env_get_pwd_slash()),
-        vars(env_vars_snapshot_t::highlighting_keys),
-        generation_count(s_generation_count)
+        vars(env_vars_snapshot_t::highlighting_keys)
     {
     }
 
-    /* The function run in the background thread to determine an autosuggestion */
-    int threaded_autosuggest(void)
+    /* The function run in the background thread to determine an autosuggestion. It is never started if the command line has changed since the request was made. */
+    int perform(void)
     {
         ASSERT_IS_BACKGROUND_THREAD();
 
-        /* If the main thread has moved on, skip all the work */
-        if (generation_count != s_generation_count)
-        {
-            return 0;
-        }
-
-        VOMIT_ON_FAILURE(pthread_setspecific(generation_count_key, (void*)(uintptr_t) generation_count));
-
         /* Let's make sure we aren't using the empty string */
         if (search_string.empty())
         {
@@ -1516,12 +1503,9 @@ struct autosuggestion_context_t
 
         return 0;
     }
-};
 
-static int threaded_autosuggest(autosuggestion_context_t *ctx)
-{
-    return ctx->threaded_autosuggest();
-}
+    void completed(int result);
+};
 
 static bool can_autosuggest(void)
 {
@@ -1534,19 +1518,18 @@ static bool can_autosuggest(void)
            el->text.find_first_not_of(whitespace) != wcstring::npos;
 }
 
-static void autosuggest_completed(autosuggestion_context_t *ctx, int result)
+void autosuggestion_context_t::completed(int result)
 {
     if (result &&
             can_autosuggest() &&
-            ctx->search_string == data->command_line.text &&
-            string_prefixes_string_case_insensitive(ctx->search_string, ctx->autosuggestion))
+            this->search_string == data->command_line.text &&
+            string_prefixes_string_case_insensitive(this->search_string, this->autosuggestion))
     {
         /* Autosuggestion is active and the search term has not changed, so we're good to go */
-        data->autosuggestion = ctx->autosuggestion;
+        data->autosuggestion = this->autosuggestion;
         sanity_check();
         reader_repaint();
     }
-    delete ctx;
 }
 
 
@@ -1558,7 +1541,7 @@ static void update_autosuggestion(void)
     {
         const editable_line_t *el = data->active_edit_line();
         autosuggestion_context_t *ctx = new autosuggestion_context_t(data->history, el->text, el->position);
-        iothread_perform(threaded_autosuggest, autosuggest_completed, ctx);
+        iothread_perform_task(ctx, IOTHREAD_PRIORITY_AUTOSUGGEST, &s_command_line_changed);
     }
 }
 
@@ -1736,6 +1719,151 @@ static void prioritize_completions(std::vector<completion_t> &comp)
     sort(comp.begin(), comp.end(), compare_completions_by_match_type);
 }
 
+/**
+   Determine which completions are worth offering: those of the best match
+   type, that agree on whether to replace the token, and that we know how to
+   insert.
+
+   \param comp the list of completions, already prioritized
+   \param tok the token being completed
+   \param out_surviving the list into which surviving completions are appended
+
+   Returns whether the surviving completions replace the token.
+*/
+static bool select_surviving_completions(const std::vector<completion_t> &comp, const wcstring &tok, std::vector<completion_t> *out_surviving)
+{
+    fuzzy_match_type_t best_match_type = get_best_match_type(comp);
+
+    /* Determine whether we are going to replace the token or not. If any commands of the best type do not require replacement, then ignore all those that want to use replacement */
+    bool will_replace_token = true;
+    for (size_t i=0; i< comp.size(); i++)
+    {
+        const completion_t &el = comp.at(i);
+        if (el.match.type <= best_match_type && !(el.flags & COMPLETE_REPLACES_TOKEN))
+        {
+            will_replace_token = false;
+            break;
+        }
+    }
+
+    for (size_t i=0; i < comp.size(); i++)
+    {
+        const completion_t &el = comp.at(i);
+        /* Ignore completions with a less suitable match type than the best. */
+        if (el.match.type > best_match_type)
+            continue;
+
+        /* Only use completions that match replace_token */
+        bool completion_replace_token = !!(el.flags & COMPLETE_REPLACES_TOKEN);
+        if (completion_replace_token != will_replace_token)
+            continue;
+
+        /* Don't use completions that want to replace, if we cannot replace them */
+        if (completion_replace_token && ! reader_can_replace(tok, el.flags))
+            continue;
+
+        /* This completion survived */
+        out_surviving->push_back(el);
+    }
+    return will_replace_token;
+}
+
+/**
+   Show a list of completions in the pager, using the text of the token
+   before the cursor as the pager prefix.
+
+   \param comp the completions to show
+   \param best_match_type the best match type among them
+*/
+static void show_completions_in_pager(const std::vector<completion_t> &comp, fuzzy_match_type_t best_match_type)
+{
+    const editable_line_t *el = &data->command_line;
+    size_t len, prefix_start = 0;
+    wcstring prefix;
+    parse_util_get_parameter_info(el->text, el->position, NULL, &prefix_start, NULL);
+
+    assert(el->position >= prefix_start);
+    len = el->position - prefix_start;
+
+    if (match_type_requires_full_replacement(best_match_type))
+    {
+        // No prefix
+        prefix.clear();
+    }
+    else if (len <= PREFIX_MAX_LEN)
+    {
+        prefix.append(el->text, prefix_start, len);
+    }
+    else
+    {
+        // append just the end of the string
+        prefix = wcstring(&ellipsis_char, 1);
+        prefix.append(el->text, prefix_start + len - PREFIX_MAX_LEN, PREFIX_MAX_LEN);
+    }
+
+    /* Update the pager data */
+    data->pager.set_prefix(prefix);
+    data->pager.set_completions(comp);
+
+    /* Invalidate our rendering */
+    data->current_page_rendering = page_rendering_t();
+
+    /* Modify the command line to reflect the new pager */
+    data->pager_selection_changed();
+
+    reader_repaint_needed();
+}
+
+/** Returns the part of the token under the cursor that lies before the cursor */
+static wcstring token_before_cursor()
+{
+    const editable_line_t *el = &data->command_line;
+    const wchar_t *begin, *buff = el->text.c_str();
+    parse_util_token_extent(buff, el->position, &begin, 0, 0, 0);
+    return wcstring(begin, buff + el->position - begin);
+}
+
+/**
+   Shows the completions found so far in the pager while a completion
+   generator is still running. If a key is pressed, the completion is
+   cancelled so that the key can be handled right away.
+*/
+class reader_completion_progress_t : public completion_progress_t
+{
+public:
+    bool cancelled;
+
+    /** Whether the pager shows partial results, which the final ones must replace */
+    bool shown;
+
+    reader_completion_progress_t() : cancelled(false), shown(false)
+    {
+    }
+
+    bool completions_found(const std::vector<completion_t> &completions)
+    {
+        if (input_common_has_pending_input())
+        {
+            cancelled = true;
+            return false;
+        }
+
+        std::vector<completion_t> comp = completions;
+        sort_and_make_unique(comp);
+        prioritize_completions(comp);
+
+        std::vector<completion_t> surviving_completions;
+        select_surviving_completions(comp, token_before_cursor(), &surviving_completions);
+        if (surviving_completions.size() > 1)
+        {
+            show_completions_in_pager(surviving_completions, get_best_match_type(comp));
+            reader_repaint();
+            shown = true;
+        }
+        return true;
+    }
+};
+
 /**
    Handle the list of completions. This means the following:
 
@@ -1761,13 +1889,7 @@ static bool handle_completions(const std::vector<completion_t> &comp, bool conti
 {
     bool done = false;
     bool success = false;
-    const editable_line_t *el = &data->command_line;
-    const wchar_t *begin, *end, *buff = el->text.c_str();
-
-    parse_util_token_extent(buff, el->position, &begin, 0, 0, 0);
-    end = buff+el->position;
-
-    const wcstring tok(begin, end - begin);
+    const wcstring tok = token_before_cursor();
 
     /*
       Check trivial cases
@@ -1810,40 +1932,9 @@ static bool handle_completions(const std::vector<completion_t> &comp, bool conti
     {
         fuzzy_match_type_t best_match_type = get_best_match_type(comp);
 
-        /* Determine whether we are going to replace the token or not. If any commands of the best type do not require replacement, then ignore all those that want to use replacement */
-        bool will_replace_token = true;
-        for (size_t i=0; i< comp.size(); i++)
-        {
-            const completion_t &el = comp.at(i);
-            if (el.match.type <= best_match_type && !(el.flags & COMPLETE_REPLACES_TOKEN))
-            {
-                will_replace_token = false;
-                break;
-            }
-        }
-
         /* Decide which completions survived. There may be a lot of them; it would be nice if we could figure out how to avoid copying them here */
         std::vector<completion_t> surviving_completions;
-        for (size_t i=0; i < comp.size(); i++)
-        {
-            const completion_t &el = comp.at(i);
-            /* Ignore completions with a less suitable match type than the best. */
-            if (el.match.type > best_match_type)
-                continue;
-
-            /* Only use completions that match replace_token */
-            bool completion_replace_token = !!(el.flags & COMPLETE_REPLACES_TOKEN);
-            if (completion_replace_token != will_replace_token)
-                continue;
-
-            /* Don't use completions that want to replace, if we cannot replace them */
-            if (completion_replace_token && ! reader_can_replace(tok, el.flags))
-                continue;
-
-            /* This completion survived */
-            surviving_completions.push_back(el);
-        }
-
+        bool will_replace_token = select_surviving_completions(comp, tok, &surviving_completions);
 
         /* Try to find a common prefix to insert among the surviving completions */
         wcstring common_prefix;
@@ -1898,43 +1989,7 @@ static bool handle_completions(const std::vector<completion_t> &comp, bool conti
         if (continue_after_prefix_insertion || common_prefix.empty())
         {
             /* We didn't get a common prefix, or we want to print the list anyways. */
-            size_t len, prefix_start = 0;
-            wcstring prefix;
-            parse_util_get_parameter_info(el->text, el->position, NULL, &prefix_start, NULL);
-
-            assert(el->position >= prefix_start);
-            len = el->position - prefix_start;
-
-            if (match_type_requires_full_replacement(best_match_type))
-            {
-                // No prefix
-                prefix.clear();
-            }
-            else if (len <= PREFIX_MAX_LEN)
-            {
-                prefix.append(el->text, prefix_start, len);
-            }
-            else
-            {
-                // append just the end of the string
-                prefix = wcstring(&ellipsis_char, 1);
-                prefix.append(el->text, prefix_start + len - PREFIX_MAX_LEN, PREFIX_MAX_LEN);
-            }
-
-            wchar_t quote;
-            parse_util_get_parameter_info(el->text, el->position, &quote, NULL, NULL);
-
-            /* Update the pager data */
-            data->pager.set_prefix(prefix);
-            data->pager.set_completions(surviving_completions);
-
-            /* Invalidate our rendering */
-            data->current_page_rendering = page_rendering_t();
-
-            /* Modify the command line to reflect the new pager */
-            data->pager_selection_changed();
-
-            reader_repaint_needed();
+            show_completions_in_pager(surviving_completions, best_match_type);
 
             success = false;
         }
@@ -2526,6 +2581,9 @@ void reader_run_command(parser_t &parser, const wcstring &cmd)
     parser.eval(cmd, io_chain_t(), TOP);
     job_reap(1);
 
+    /* The command may have created or removed files and functions */
+    highlight_forget_validity();
+
     gettimeofday(&time_after, NULL);
     set_env_cmd_duration(&time_after, &time_before);
 
@@ -2687,8 +2745,8 @@ void reader_import_history_if_necessary(void)
     }
 }
 
-/** A class as the context pointer for a background (threaded) highlight operation. */
-class background_highlight_context_t
+/** A task for a background (threaded) highlight operation. */
+class background_highlight_context_t : public iothread_task_t
 {
 public:
     /** The string to highlight */
@@ -2709,33 +2767,27 @@ public:
     /** When the request was made */
     const double when;
 
-    /** Gen count at the time the request was made */
-    const unsigned int generation_count;
-
     background_highlight_context_t(const wcstring &pbuff, size_t phighlight_pos, highlight_function_t phighlight_func) :
         string_to_highlight(pbuff),
         colors(pbuff.size(), 0),
         match_highlight_pos(phighlight_pos),
         highlight_function(phighlight_func),
         vars(env_vars_snapshot_t::highlighting_keys),
-        when(timef()),
-        generation_count(s_generation_count)
+        when(timef())
     {
     }
 
-    int perform_highlight()
+    /* Background tasks are never started if the command line has changed since the request was made */
+    int perform()
     {
-        if (generation_count != s_generation_count)
-        {
-            // The gen count has changed, so don't do anything
-            return 0;
-        }
         if (! string_to_highlight.empty())
         {
             highlight_function(string_to_highlight, colors, match_highlight_pos, NULL /* error */, vars);
         }
         return 0;
     }
+
+    void completed(int result);
 };
 
 /* Called to set the highlight flag for search results */
@@ -2757,29 +2809,21 @@ static void highlight_search(void)
     }
 }
 
-static void highlight_complete(background_highlight_context_t *ctx, int result)
+void background_highlight_context_t::completed(int result)
 {
     ASSERT_IS_MAIN_THREAD();
-    if (ctx->string_to_highlight == data->command_line.text)
+    if (this->string_to_highlight == data->command_line.text)
     {
         /* The data hasn't changed, so swap in our colors. The colors may not have changed, so do nothing if they have not. */
-        assert(ctx->colors.size() == data->command_line.size());
-        if (data->colors != ctx->colors)
+        assert(this->colors.size() == data->command_line.size());
+        if (data->colors != this->colors)
         {
-            data->colors.swap(ctx->colors);
+            data->colors.swap(this->colors);
             sanity_check();
             highlight_search();
             reader_repaint();
         }
     }
-
-    /* Free our context */
-    delete ctx;
-}
-
-static int threaded_highlight(background_highlight_context_t *ctx)
-{
-    return ctx->perform_highlight();
 }
 
 
@@ -2806,14 +2850,13 @@ static void reader_super_highlight_me_plenty(int match_highlight_pos_adjust, boo
     if (no_io)
     {
         // Highlighting without IO, we just do it
-        // Note that highlight_complete deletes ctx.
-        int result = ctx->perform_highlight();
-        highlight_complete(ctx, result);
+        ctx->completed(ctx->perform());
+        delete ctx;
     }
     else
     {
-        // Highlighting including I/O proceeds in the background
-        iothread_perform(threaded_highlight, highlight_complete, ctx);
+        // Highlighting including I/O proceeds in the background, ahead of any other background work
+        iothread_perform_task(ctx, IOTHREAD_PRIORITY_HIGHLIGHT, &s_command_line_changed);
     }
     highlight_search();
 
@@ -3310,17 +3353,32 @@ const wchar_t *reader_readline(void)
                     /* Construct a copy of the string from the beginning of the command substitution up to the end of the token we're completing */
                     const wcstring buffcpy = wcstring(cmdsub_begin, token_end);
 
+                    /* Record our cycle_command_line. The pager may show partial results while completing, and they are shown against it. */
+                    data->cycle_command_line = el->text;
+                    data->cycle_cursor_pos = el->position;
+
                     //fprintf(stderr, "Complete (%ls)\n", buffcpy.c_str());
-                    data->complete_func(buffcpy, comp, COMPLETION_REQUEST_DEFAULT | COMPLETION_REQUEST_DESCRIPTIONS | COMPLETION_REQUEST_FUZZY_MATCH);
+                    reader_completion_progress_t progress;
+                    data->complete_func(buffcpy, comp, COMPLETION_REQUEST_DEFAULT | COMPLETION_REQUEST_DESCRIPTIONS | COMPLETION_REQUEST_FUZZY_MATCH, &progress);
+
+                    /* A key was pressed while a completion generator was running. Drop whatever it found, and handle the key. */
+                    if (progress.cancelled)
+                    {
+                        clear_pager();
+                        reader_repaint();
+                        break;
+                    }
+
+                    /* Drop the partial results. If the final ones are shown at all, they are shown afresh; if a common prefix is inserted instead, the pager must not linger. */
+                    if (progress.shown)
+                    {
+                        clear_pager();
+                    }
 
                     /* Munge our completions */
                     sort_and_make_unique(comp);
                     prioritize_completions(comp);
 
-                    /* Record our cycle_command_line */
-                    data->cycle_command_line = el->text;
-                    data->cycle_cursor_pos = el->position;
-
                     bool continue_after_prefix_insertion = (c == R_COMPLETE_AND_SEARCH);
                     comp_empty = handle_completions(comp, continue_after_prefix_insertion);
 
@@ -192,10 +192,10 @@ void reader_reset_interrupted();
 int reader_reading_interrupted();
 
 /**
-   Returns true if the current reader generation count does not equal the
-   generation count the current thread was started with.
-   Note 1: currently only valid for autocompletion threads! Other threads don't
-   set the threadlocal generation count when they start up.
+   Returns true if the command line has changed since the background task
+   running on the current thread was started. Only highlighting and
+   autosuggestion tasks are cancelled this way; for any other thread this
+   returns false.
 */
 bool reader_thread_job_is_stale();
 
@@ -221,8 +221,10 @@ void reader_pop();
 
    - The command to be completed as a null terminated array of wchar_t
    - An array_list_t in which completions will be inserted.
+   - The completion request flags.
+   - An optional receiver of partial results from slow completion generators.
 */
-typedef void (*complete_function_t)(const wcstring &, std::vector<completion_t> &, completion_request_flags_t);
+typedef void (*complete_function_t)(const wcstring &, std::vector<completion_t> &, completion_request_flags_t, completion_progress_t *);
 void reader_set_complete_function(complete_function_t);
 
 /**
@@ -487,7 +487,7 @@ static void s_check_status(screen_t *s)
         */
 
         int prev_line = s->actual.cursor.y;
-        write_loop(STDOUT_FILENO, "\r", 1);
+        output_write_bytes("\r", 1);
         s_reset(s, screen_reset_current_line_and_prompt);
         s->actual.cursor.y = prev_line;
     }
@@ -1055,7 +1055,7 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
 
     if (! output.empty())
     {
-        write_loop(STDOUT_FILENO, &output.at(0), output.size());
+        output_write_bytes(&output.at(0), output.size());
     }
 
     /* We have now synced our actual screen against our desired screen. Note that this is a big assignment! */
@@ -1274,6 +1274,9 @@ void s_write(screen_t *s,
     CHECK(s,);
     CHECK(indent,);
 
+    /* Everything we draw goes out in a single write */
+    output_frame_t frame;
+
     /* Turn the command line into the explicit portion and the autosuggestion */
     const wcstring explicit_command_line = commandline.substr(0, explicit_len);
     const wcstring autosuggestion = commandline.substr(explicit_len);
@@ -1287,9 +1290,9 @@ void s_write(screen_t *s,
         const std::string prompt_narrow = wcs2string(left_prompt);
         const std::string command_line_narrow = wcs2string(explicit_command_line);
 
-        write_loop(STDOUT_FILENO, "\r", 1);
-        write_loop(STDOUT_FILENO, prompt_narrow.c_str(), prompt_narrow.size());
-        write_loop(STDOUT_FILENO, command_line_narrow.c_str(), command_line_narrow.size());
+        output_write_bytes("\r", 1);
+        output_write_bytes(prompt_narrow.c_str(), prompt_narrow.size());
+        output_write_bytes(command_line_narrow.c_str(), command_line_narrow.size());
 
         return;
     }
@@ -1367,6 +1370,7 @@ void s_write(screen_t *s,
 void s_reset(screen_t *s, screen_reset_mode_t mode)
 {
     CHECK(s,);
+    output_frame_t frame;
 
     bool abandon_line = false, repaint_prompt = false, clear_to_eos = false;
     switch (mode)
@@ -1450,14 +1454,14 @@ void s_reset(screen_t *s, screen_reset_mode_t mode)
         abandon_line_string.push_back(L'\r');
 
         const std::string narrow_abandon_line_string = wcs2string(abandon_line_string);
-        write_loop(STDOUT_FILENO, narrow_abandon_line_string.c_str(), narrow_abandon_line_string.size());
+        output_write_bytes(narrow_abandon_line_string.c_str(), narrow_abandon_line_string.size());
         s->actual.cursor.x = 0;
     }
 
     if (! abandon_line)
     {
         /* This should prevent resetting the cursor position during the next repaint. */
-        write_loop(STDOUT_FILENO, "\r", 1);
+        output_write_bytes("\r", 1);
         s->actual.cursor.x = 0;
     }
 
@@ -1474,7 +1478,7 @@ bool screen_force_clear_to_end()
         s_write_mbs(&output, clr_eos);
         if (! output.empty())
         {
-            write_loop(STDOUT_FILENO, &output.at(0), output.size());
+            output_write_bytes(&output.at(0), output.size());
             result = true;
         }
     }
@@ -0,0 +1,5 @@
+complete -c hash -s h -l help --description 'Display help and exit'
+complete -c hash -s t -l print --description 'Print the full path of each command'
+complete -c hash -s d -l delete --description 'Forget the given remembered commands'
+complete -c hash -s r -l reset --description 'Forget all remembered commands'
+complete -c hash -x -a "(__fish_complete_command)" --description "Command"
@@ -9,3 +9,4 @@ complete -c status -l is-interactive-job-control --description "Test if only int
 complete -c status -l is-no-job-control --description "Test if new jobs are never put under job control"
 complete -c status -s j -l job-control -xa "full interactive none" --description "Set which jobs are out under job control"
 complete -c status -s t -l print-stack-trace --description "Print a list of all function calls leading up to running the current command"
+complete -c status -l print-dir-cache-stats --description "Print statistics about the cache of directory listings"
@@ -0,0 +1,22 @@
+complete -c string -f -n "test (count (commandline -opc)) -ge 2" -s q -l quiet --description "Do not print output"
+complete -f -c string -n "test (count (commandline -opc)) -lt 2" -a "length" --description "Print the length of strings"
+complete -f -c string -n "test (count (commandline -opc)) -lt 2" -a "sub" --description "Print substrings"
+complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] sub" -s s -l start -x --description "Specify start index"
+complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] sub" -s l -l length -x --description "Specify substring length"
+complete -f -c string -n "test (count (commandline -opc)) -lt 2" -a "split" --description "Split strings at a separator"
+complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] split" -s m -l max -x --description "Specify maximum number of splits"
+complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] split" -s n -l no-empty --description "Don't print empty pieces"
+complete -f -c string -n "test (count (commandline -opc)) -lt 2" -a "join" --description "Join strings with a separator"
+complete -f -c string -n "test (count (commandline -opc)) -lt 2" -a "trim" --description "Remove whitespace from strings"
+complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] trim" -s l -l left --description "Trim only leading characters"
+complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] split trim" -s r -l right --description "Trim or split from the right"
+complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] trim" -s c -l chars -x --description "Specify the characters to trim"
+complete -f -c string -n "test (count (commandline -opc)) -lt 2" -a "escape" --description "Escape strings for use as fish arguments"
+complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] escape" -s n -l no-quoted --description "Escape with backslashes instead of quotes"
+complete -f -c string -n "test (count (commandline -opc)) -lt 2" -a "match" --description "Print strings matching a pattern"
+complete -f -c string -n "test (count (commandline -opc)) -lt 2" -a "replace" --description "Replace text matching a pattern"
+complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] match replace" -s a -l all --description "Report or replace all matches"
+complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] match replace" -s i -l ignore-case --description "Ignore case when matching"
+complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] match replace" -s r -l regex --description "Use a regular expression as the pattern"
+complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] match" -s n -l index --description "Print the index and length of matches"
+complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] match" -s v -l invert --description "Print strings that do not match"
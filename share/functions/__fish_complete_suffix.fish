@@ -35,7 +35,7 @@ function __fish_complete_suffix -d "Complete using files"
 
 	# Perform the completion
 
-	set base (echo $comp |sed -e 's/\.[a-zA-Z0-9]*$//')
+	set base (string replace -r '\.[a-zA-Z0-9]*$' '' $comp)
 	eval "set files $base*$suff"
 
 	if test $files[1]
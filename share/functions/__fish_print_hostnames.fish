@@ -3,7 +3,7 @@ function __fish_print_hostnames -d "Print a list of known hostnames"
 
 	# Print all hosts from /etc/hosts
 	if test -x /usr/bin/getent
-		getent hosts | tr -s ' ' ' ' | cut -d ' ' -f 2- | tr ' ' '\n'
+		getent hosts | string replace -r '^[^[:space:]]+[[:space:]]+' '' | string split -n ' '
 		else if test -r /etc/hosts
 		tr -s ' \t' '  ' < /etc/hosts | sed 's/ *#.*//' | cut -s -d ' ' -f 2- | sgrep -o '[^ ]*'
 	end
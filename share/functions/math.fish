@@ -1,22 +0,0 @@
-
-function math --description "Perform math calculations in bc"
-	if count $argv >/dev/null
-		switch $argv[1]
-			case -h --h --he --hel --help
-				__fish_print_help math
-				return 0
-		end
-
-		set -l out (echo $argv|env BC_LINE_LENGTH=0 bc)
-                test -z "$out"; and return 1
-		echo $out
-		switch $out
-			case 0
-				return 1
-		end
-		return 0
-	end
-	return 2
-
-end
-
@@ -28,6 +28,7 @@ wildcards using **.
 #include "complete.h"
 #include "common.h"
 #include "wildcard.h"
+#include "path.h"
 #include "complete.h"
 #include "reader.h"
 #include "expand.h"
@@ -596,8 +597,9 @@ static wcstring file_get_desc(const wcstring &filename,
         }
     }
 
+    /* Looking up a suffix runs a command, which only the main thread can do */
     suffix = wcsrchr(filename.c_str(), L'.');
-    if (suffix != 0 && !wcsrchr(suffix, L'/'))
+    if (suffix != 0 && !wcsrchr(suffix, L'/') && is_main_thread())
     {
         return complete_get_desc_suffix(suffix);
     }
@@ -709,12 +711,19 @@ static void wildcard_completion_allocate(std::vector<completion_t> &list,
 /**
   Test if the file specified by the given filename matches the
   expansion flags specified. flags can be a combination of
-  EXECUTABLES_ONLY and DIRECTORIES_ONLY.
+  EXECUTABLES_ONLY and DIRECTORIES_ONLY. entry is the file's entry in
+  its directory listing, which saves a stat when it is known not to be
+  a directory.
 */
-static bool test_flags(const wchar_t *filename, expand_flags_t flags)
+static bool test_flags(const wchar_t *filename, const dir_entry_t &entry, expand_flags_t flags)
 {
     if (flags & DIRECTORIES_ONLY)
     {
+        if (entry.known_not_dir())
+        {
+            return false;
+        }
+
         struct stat buf;
         if (wstat(filename, &buf) == -1)
         {
@@ -764,9 +773,6 @@ static int wildcard_expand_internal(const wchar_t *wc,
                                     std::set<file_id_t> &visited_files)
 {
 
-    /* Variables for traversing a directory */
-    DIR *dir;
-
     /* The result returned */
     int res = 0;
 
@@ -812,10 +818,13 @@ static int wildcard_expand_internal(const wchar_t *wc,
 
     dir_string = (base_dir[0] == L'\0') ? L"." : base_dir;
 
-    if (!(dir = wopendir(dir_string)))
+    /* The directory's entries come from the shared listing cache, rather than from reading the directory every time */
+    const dir_listing_ref_t listing = dir_cache_get_listing(dir_string);
+    if (! listing)
     {
         return 0;
     }
+    const std::vector<dir_entry_t> &entries = listing->entries;
 
     /* Points to the end of the current wildcard segment */
     const wchar_t * const wc_end = wcschr(wc,L'/');
@@ -844,14 +853,15 @@ static int wildcard_expand_internal(const wchar_t *wc,
             */
             if (flags & ACCEPT_INCOMPLETE)
             {
-                wcstring next;
-                while (wreaddir(dir, next))
+                for (size_t i=0; i < entries.size(); i++)
                 {
+                    const dir_entry_t &entry = entries.at(i);
+                    const wcstring &next = entry.name;
                     if (next[0] != L'.')
                     {
                         wcstring long_name = make_path(base_dir, next);
 
-                        if (test_flags(long_name.c_str(), flags))
+                        if (test_flags(long_name.c_str(), entry, flags))
                         {
                             wildcard_completion_allocate(out, long_name, next, L"", flags);
                         }
@@ -867,9 +877,10 @@ static int wildcard_expand_internal(const wchar_t *wc,
         else
         {
             /* This is the last wildcard segment, and it is not empty. Match files/directories. */
-            wcstring name_str;
-            while (wreaddir(dir, name_str))
+            for (size_t i=0; i < entries.size(); i++)
             {
+                const dir_entry_t &entry = entries.at(i);
+                const wcstring &name_str = entry.name;
                 if (flags & ACCEPT_INCOMPLETE)
                 {
 
@@ -879,7 +890,7 @@ static int wildcard_expand_internal(const wchar_t *wc,
                     std::vector<completion_t> test;
                     if (wildcard_complete(name_str, wc, L"", NULL, test, flags & EXPAND_FUZZY_MATCH, 0))
                     {
-                        if (test_flags(long_name.c_str(), flags))
+                        if (test_flags(long_name.c_str(), entry, flags))
                         {
                             wildcard_completion_allocate(out, long_name, name_str, wc, flags);
 
@@ -900,10 +911,17 @@ static int wildcard_expand_internal(const wchar_t *wc,
                               interested in adding files -directories
                               will be added in the next pass.
                             */
-                            struct stat buf;
-                            if (!wstat(long_name, &buf))
+                            if (entry.known_dir())
+                            {
+                                skip = 1;
+                            }
+                            else if (! entry.known_not_dir())
                             {
-                                skip = S_ISDIR(buf.st_mode);
+                                struct stat buf;
+                                if (!wstat(long_name, &buf))
+                                {
+                                    skip = S_ISDIR(buf.st_mode);
+                                }
                             }
                         }
                         if (! skip)
@@ -925,10 +943,8 @@ static int wildcard_expand_internal(const wchar_t *wc,
         */
 
         /*
-          In recursive mode, we look through the directory twice. If
-          so, this rewind is needed.
+          In recursive mode, we look through the directory twice.
         */
-        rewinddir(dir);
 
         /*
           wc_str is the part of the wildcarded string from the
@@ -939,9 +955,17 @@ static int wildcard_expand_internal(const wchar_t *wc,
         /* new_dir is a scratch area containing the full path to a file/directory we are iterating over */
         wcstring new_dir = base_dir;
 
-        wcstring name_str;
-        while (wreaddir(dir, name_str))
+        for (size_t i=0; i < entries.size(); i++)
         {
+            const dir_entry_t &entry = entries.at(i);
+            const wcstring &name_str = entry.name;
+
+            /* Only directories can be descended into */
+            if (entry.known_not_dir())
+            {
+                continue;
+            }
+
             /*
               Test if the file/directory name matches the whole
               wildcard element, i.e. regular matching.
@@ -1044,8 +1068,6 @@ static int wildcard_expand_internal(const wchar_t *wc,
             }
         }
     }
-    closedir(dir);
-
     return res;
 }
 